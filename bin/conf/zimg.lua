@@ -69,6 +69,34 @@ disable_args    = 0
 disable_type    = 0
 --禁用图片放大
 disable_zoom_up = 0
+--缩略图按目标尺寸解码原图：JPEG按1/2、1/4、1/8在DCT域缩小，WebP由解码器缩放，再精确缩放到目标尺寸
+--裁剪请求只解码裁剪区域：JPEG跳过上方的行并只解码所在的MCU列，WebP由解码器裁剪；PNG和GIF仍整图解码
+shrink_on_load  = 1
+--JPEG原图缩放为JPEG或WebP时直接用libjpeg-turbo和libwebp处理，不经过MagickWand；裁剪、旋转、脚本等其他请求仍由MagickWand处理
+--同时8位RGB和灰度图的缩放改用内置的SIMD Lanczos实现
+native          = 1
+--lossless rotate, crop and gray of JPEG originals on the DCT coefficients like jpegtran, when the
+--edges fall on MCU boundaries and nothing is scaled; 1 only when the quality is not lowered, 2 also
+--keeps the original quality when the request asks for a lower one, 0 to disable
+--JPEG原图不缩放的90度旋转、裁剪和灰度化直接在DCT系数上无损完成，边缘需按MCU对齐；1为不降低质量时启用，2为总是保留原图质量，0为关闭
+lossless        = 1
+--resize tier: 'best' for lanczos at any scale, 'balanced' for a box pre-shrink to 2x target before lanczos on reductions of 3x or more, 'fast' for box on reductions of 2x or more and triangle otherwise; lua scripts may override it per type by zimg.set_tier()
+--缩放质量档位：'best'任何比例都用Lanczos；'balanced'缩小3倍以上时先用box缩到目标的2倍再用Lanczos；'fast'缩小2倍以上直接用box，其余用triangle；lua脚本可用zimg.set_tier()按类型覆盖
+resize_tier     = 'balanced'
+--derive: make a plain scaling from the smallest stored derivative of the same image that is
+--large enough and has the same gray and format, instead of the original; results made this way
+--are cached but not stored, so a derivative is never made from another derived one
+--缩放请求优先从同一图片已存储的、足够大且灰度和格式相同的缩略图生成，不再解码原图；这样生成的结果只缓存不存储，最多经过一次中间缩略图
+derive          = 1
+--作为来源的缩略图质量不能低于该值，也不能低于目标质量
+derive_quality  = 75
+--memory and memory-mapped MB of the MagickWand pixel caches of all threads; images beyond them
+--are cached on disk instead of growing the heap, 0 keeps the defaults of ImageMagick. JPEG to
+--JPEG scaling by native streams rows and needs no pixel cache
+--MagickWand像素缓存可用的内存和内存映射大小（MB，所有线程共享），超出的大图缓存到磁盘而不再占用内存，0为ImageMagick默认值；
+--native处理的JPEG缩放按行流式解码、缩放和编码，不需要整图像素缓存
+magick_memory   = 0
+magick_map      = 0
 --lua process script
 --lua脚本文件路径
 script_name     = pwd .. '/script/process.lua'
@@ -97,6 +125,33 @@ allowed_type    = {'jpeg', 'jpg', 'png', 'gif', 'webp'}
 --mode[1]: local disk mode
 --本地存储时的存储路径
 img_path        = pwd .. '/img'
+--JBOD: multiple storage roots, one per disk, images are placed by md5; overrides img_path when not empty
+--do not change the list after images are stored, use zimg-export/zimg-import to move them
+--多块磁盘各自的存储路径，图片按md5分布到各盘，非空时替代img_path；存入图片后不要修改该列表
+img_paths       = {}
+--每块磁盘的I/O线程数
+disk_threads    = 2
+--每块磁盘的I/O队列长度上限，队列满时请求直接失败
+disk_queue      = 64
+--等待单次磁盘I/O的超时(毫秒)
+disk_timeout    = 3000
+--连续出错多少次后将磁盘标记为不可用
+disk_max_errors = 5
+--不可用磁盘每隔多少秒重试一次
+disk_retry      = 30
+--tiered storage: img_path is the hot tier(NVMe) and tier_path is the cold tier(HDD)
+--是否启用冷热分层存储，img_path为热层(如NVMe)，tier_path为冷层(如HDD阵列)
+tier            = 0
+--冷层存储路径
+tier_path       = pwd .. '/img_cold'
+--冷层图片被访问多少次后提升到热层
+tier_promote_hits = 3
+--热层图片多少秒未被访问后下沉到冷层，默认7天
+tier_demote_age = 7*24*3600
+--后台迁移扫描间隔(秒)
+tier_interval   = 600
+--热层剩余空间低于该百分比时不再提升
+tier_min_free   = 10
 
 --mode[2]: beansdb mode
 --beansdb服务器IP
@@ -110,6 +165,95 @@ ssdb_ip         = '127.0.0.1'
 --SSDB服务器端口
 ssdb_port       = 8888
 
+--ssdb cluster: keys are sharded by consistent hashing of the md5 and stored on
+--ssdb_replicas nodes, ssdb_ip/ssdb_port above are used when the list is empty
+--SSDB集群节点列表，按md5一致性哈希分片，列表为空时使用上面的ssdb_ip和ssdb_port
+ssdb_servers    = {}
+--每个key保存的副本数，读取时优先访问健康且延迟最低的副本
+ssdb_replicas   = 2
+--写入成功所需的副本确认数，0为多数派(ssdb_replicas/2+1)
+ssdb_quorum     = 0
+--hedged reads: when a replica has not answered within hedge_percentile of its
+--recent read latency, the same read is sent to the next replica and the first answer wins
+--对冲读取：副本超过其近期读延迟的hedge_percentile分位仍未返回时，向下一个副本重发，取先返回者
+hedge           = 0
+--触发对冲的延迟分位数(1-99)
+hedge_percentile = 95
+--触发对冲的最小延迟(毫秒)，分位数样本不足时也使用该值
+hedge_delay_min = 5
+--对冲请求占读取请求的比例上限(%)
+hedge_budget    = 2
+
+--beansdb和ssdb中大于该值(KB)的图片拆分为多个分块存储，0为不拆分
+chunk_size      = 512
+--beansdb和ssdb中缩略图的过期时间(秒)，过期后按需重新生成，原图永久保存，0为不过期
+--ssdb使用SETEX写入；beansdb本身不支持过期，该值仅对兼容memcached过期协议的后端生效
+derivative_ttl  = 0
+
+--backend connection config, used by beansdb and ssdb
+--连接存储后端的超时时间(毫秒)
+connect_timeout = 500
+--存储后端读写超时时间(毫秒)，0为不超时
+read_timeout    = 2000
+--ssdb断线后立即重连一次，之后按指数退避重试，此为最大重试间隔(毫秒)
+reconnect_max   = 30000
+--连接空闲超过该时间(秒)后使用前先PING检查，0为不检查
+ping_interval   = 30
+
+--replica backends: new originals are copied to them in background and reads
+--fall back to them in order when the primary(mode) misses, e.g. {3} for disk + SSDB
+--副本存储后端列表，上传的原图异步写入副本，主存储(mode)缺失时按顺序从副本读取并修复主存储
+replica         = {}
+--memory MB of the images waiting for the replicas; beyond it only the md5 waits and the
+--original is read back from the primary. Failed copies are retried with backoff
+--副本异步写入队列的内存上限(MB)，超出时只保留md5，写入时从主存储重新读取原图；写入失败的副本按指数退避重试
+replica_queue   = 256
+--md5s waiting for the replicas are appended here and queued again on restart, empty to disable
+--等待写入副本的md5记录文件，重启时重新排队，为空则不记录
+replica_log     = pwd .. '/replica.log'
+
+--scrubber config: re-check originals by md5 and derivatives by decoding
+--后台巡检，重新校验原图md5并检查缩略图能否解码，损坏的缩略图会被删除重新生成
+scrub           = 0
+--巡检读取速度上限(KB/s)，0为不限速
+scrub_rate      = 10*1024
+--两轮巡检之间的间隔(秒)
+scrub_interval  = 24*3600
+--损坏原图的隔离目录(仅本地存储)，为空则只记录日志
+scrub_quarantine = pwd .. '/img_quarantine'
+
+--write-back journal for beansdb and ssdb mode: uploads are acknowledged once
+--appended to a local log and written to the backend by a background thread
+--写回日志(仅beansdb和ssdb模式)，上传写入本地日志即返回，由后台线程批量写入存储后端
+journal         = 0
+--日志目录，重启时未写入后端的记录会重新排队
+journal_path    = pwd .. '/journal'
+--日志中未写入后端数据的上限(MB)，超出时直接同步写入后端
+journal_max     = 1024
+--后台线程每批写入的记录数
+journal_batch   = 64
+--每条记录落盘后再返回，0为交给系统刷盘(掉电可能丢失最近的上传)
+journal_sync    = 1
+
+--local disk cache for beansdb and ssdb mode: originals and derivatives missed
+--by memcached are kept on local disk in the layout of disk mode, evicted by CLOCK
+--本地磁盘缓存(仅beansdb和ssdb模式)，memcached未命中的原图和缩略图缓存在本地磁盘，按CLOCK淘汰
+dcache          = 0
+--缓存目录，重启后后台扫描重建索引
+dcache_path     = pwd .. '/dcache'
+--缓存大小上限(MB)，单个文件超过其1/16不缓存
+dcache_size     = 10240
+
+--eager derivatives: made in background right after an upload is stored, so the
+--first viewers do not wait for them. A string is a lua type of the script, a table
+--is a parameter set like a GET request, e.g. {'thumbnail', {w=300, h=300}, {w=800, f='webp'}}
+--上传成功后在后台预先生成的缩略图列表，字符串为lua处理类型，表为请求参数(w/h/p/g/x/y/r/q/f)
+pregen          = {}
+--预生成线程数，线程以低优先级运行
+pregen_threads  = 1
+--等待预生成的图片数上限，超出时跳过并记录日志，之后按需生成
+pregen_queue    = 1024
+
 --lua conf functions
 --部分与配置有关的函数在lua中实现，对性能影响不大
 function is_img(type_name)
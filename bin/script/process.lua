@@ -50,6 +50,7 @@ local type_list = {
 		type				= CT_MAX_SIZE,
 		size				= 120,
 		quality			    = THUMB_QUALITY,
+		tier				= 'fast',
 	},
 	small = {
 		type				= CT_MAX_SIZE,
@@ -316,6 +317,10 @@ function f()
             [CT_CROP]           = function()    ret = crop(arg)            end,
             [CT_NONE]           = function()    ret = WI_OK                end,
         }
+        if arg.tier then
+            zimg.set_tier(arg.tier)
+            log.print(LOG_DEBUG, "zimg.set_tier(" .. arg.tier .. ")")
+        end
         log.print(LOG_DEBUG, "start scale image...")
         local action = switch[arg.type]
         if action then
@@ -0,0 +1,24 @@
+# - Find TurboJPEG library
+# Find the TurboJPEG headers and libraries of libjpeg-turbo.
+#
+#  TURBOJPEG_INCLUDE_DIRS - where to find turbojpeg.h.
+#  TURBOJPEG_LIBRARIES    - List of libraries when using turbojpeg.
+#  TURBOJPEG_FOUND        - True if turbojpeg is found.
+
+# Look for the header file, libjpeg-turbo is keg-only in homebrew.
+FIND_PATH(TURBOJPEG_INCLUDE_DIR NAMES turbojpeg.h
+    HINTS /usr/local/opt/jpeg-turbo/include /opt/homebrew/opt/jpeg-turbo/include)
+MARK_AS_ADVANCED(TURBOJPEG_INCLUDE_DIR)
+
+# Look for the library.
+FIND_LIBRARY(TURBOJPEG_LIBRARY NAMES turbojpeg
+    HINTS /usr/local/opt/jpeg-turbo/lib /opt/homebrew/opt/jpeg-turbo/lib)
+MARK_AS_ADVANCED(TURBOJPEG_LIBRARY)
+
+# handle the QUIETLY and REQUIRED arguments and set TURBOJPEG_FOUND to TRUE if
+# all listed variables are TRUE
+INCLUDE(${CMAKE_ROOT}/Modules/FindPackageHandleStandardArgs.cmake)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(TurboJPEG DEFAULT_MSG TURBOJPEG_LIBRARY TURBOJPEG_INCLUDE_DIR)
+
+SET(TURBOJPEG_LIBRARIES ${TURBOJPEG_LIBRARY})
+SET(TURBOJPEG_INCLUDE_DIRS ${TURBOJPEG_INCLUDE_DIR})
@@ -37,6 +37,7 @@
 #include <lauxlib.h>
 #include "libevhtp/evhtp.h"
 #include "zcommon.h"
+#include "zconf.h"
 #include "zhttpd.h"
 #include "zimg.h"
 #include "zdb.h"
@@ -44,19 +45,23 @@
 #include "zlog.h"
 #include "zcache.h"
 #include "zlscale.h"
+#include "ztier.h"
+#include "zscrub.h"
+#include "zrepl.h"
+#include "zdisk.h"
+#include "zpool.h"
+#include "zjournal.h"
+#include "zdcache.h"
+#include "zpregen.h"
+#include "zdecode.h"
 
 #if __APPLE__
 #undef daemon
 extern int daemon(int, int);
 #endif
 
-#define _STR(s) #s
-#define STR(s) _STR(s)
-
 
 void usage(int argc, char **argv);
-static void settings_init(void);
-static int load_conf(const char *conf);
 static void sighandler(int signal, siginfo_t *siginfo, void *arg);
 void init_thread(evhtp_t *htp, evthr_t *thread, void *arg);
 int main(int argc, char **argv);
@@ -67,7 +72,6 @@ extern const struct luaL_reg zimg_lib[];
 extern const struct luaL_Reg loglib[];
 
 const char *conf_file = NULL;
-pthread_key_t gLuaStateKey = 0;
 
 /**
  * @brief close lua_State in thread local storage.
@@ -91,269 +95,6 @@ void usage(int argc, char **argv) {
     printf("    -d    run as daemon\n");
 }
 
-/**
- * @brief settings_init Init the setting with default values.
- */
-static void settings_init(void) {
-    settings.L = NULL;
-    settings.is_daemon = 0;
-    str_lcpy(settings.ip, "0.0.0.0", sizeof(settings.ip));
-    settings.port = 4869;
-    settings.num_threads = get_cpu_cores();         /* N workers */
-    settings.backlog = 1024;
-    settings.max_keepalives = 1;
-    settings.retry = 3;
-    str_lcpy(settings.version, STR(PROJECT_VERSION), sizeof(settings.version));
-    snprintf(settings.server_name, 128, "zimg/%s", settings.version);
-    settings.headers = NULL;
-    settings.etag = 0;
-    settings.up_access = NULL;
-    settings.down_access = NULL;
-    settings.admin_access = NULL;
-    settings.cache_on = 0;
-    str_lcpy(settings.cache_ip, "127.0.0.1", sizeof(settings.cache_ip));
-    settings.cache_port = 11211;
-    settings.log_level = 6;
-    str_lcpy(settings.log_name, "./log/zimg.log", sizeof(settings.log_name));
-    str_lcpy(settings.root_path, "./www/index.html", sizeof(settings.root_path));
-    str_lcpy(settings.admin_path, "./www/admin.html", sizeof(settings.admin_path));
-    settings.disable_args = 0;
-    settings.disable_type = 0;
-    settings.disable_zoom_up = 0;
-    settings.script_on = 0;
-    settings.script_name[0] = '\0';
-    str_lcpy(settings.format, "none", sizeof(settings.format));
-    settings.quality = 75;
-    settings.mode = 1;
-    settings.save_new = 1;
-    settings.max_size = 10485760;
-    str_lcpy(settings.img_path, "./img", sizeof(settings.img_path));
-    str_lcpy(settings.beansdb_ip, "127.0.0.1", sizeof(settings.beansdb_ip));
-    settings.beansdb_port = 7905;
-    str_lcpy(settings.ssdb_ip, "127.0.0.1", sizeof(settings.ssdb_ip));
-    settings.ssdb_port = 6379;
-    multipart_parser_settings *callbacks = (multipart_parser_settings *)malloc(sizeof(multipart_parser_settings));
-    memset(callbacks, 0, sizeof(multipart_parser_settings));
-    //callbacks->on_header_field = on_header_field;
-    callbacks->on_header_value = on_header_value;
-    callbacks->on_chunk_data = on_chunk_data;
-    settings.mp_set = callbacks;
-    settings.get_img = NULL;
-    settings.info_img = NULL;
-    settings.admin_img = NULL;
-}
-
-static void set_callback(int mode) {
-    if (mode == 1) {
-        settings.get_img = get_img;
-        settings.info_img = info_img;
-        settings.admin_img = admin_img;
-    } else {
-        settings.get_img = get_img_mode_db;
-        settings.info_img = info_img_mode_db;
-        settings.admin_img = admin_img_mode_db;
-    }
-}
-
-/**
- * @brief load_conf load the conf of zimg
- *
- * @param conf conf name
- *
- * @return 1 for OK and -1 for fail
- */
-static int load_conf(const char *conf) {
-    lua_State *L = luaL_newstate();
-    luaL_openlibs(L);
-    if (luaL_loadfile(L, conf) || lua_pcall(L, 0, 0, 0)) {
-        lua_close(L);
-        return -1;
-    }
-
-    lua_getglobal(L, "is_daemon"); //stack index: -12
-    if (lua_isnumber(L, -1))
-        settings.is_daemon = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "ip");
-    if (lua_isstring(L, -1))
-        str_lcpy(settings.ip, lua_tostring(L, -1), sizeof(settings.ip));
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "port");
-    if (lua_isnumber(L, -1))
-        settings.port = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "thread_num");
-    if (lua_isnumber(L, -1))
-        settings.num_threads = (int)lua_tonumber(L, -1);         /* N workers */
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "backlog_num");
-    if (lua_isnumber(L, -1))
-        settings.backlog = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "max_keepalives");
-    if (lua_isnumber(L, -1))
-        settings.max_keepalives = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "retry");
-    if (lua_isnumber(L, -1))
-        settings.retry = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "system");
-    if (lua_isstring(L, -1)) {
-        char tmp[128];
-        snprintf(tmp, 128, "%s %s", settings.server_name, lua_tostring(L, -1));
-        snprintf(settings.server_name, 128, "%s", tmp);
-    }
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "headers");
-    if (lua_isstring(L, -1)) {
-        settings.headers = conf_get_headers(lua_tostring(L, -1));
-    }
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "etag");
-    if (lua_isnumber(L, -1))
-        settings.etag = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "upload_rule");
-    if (lua_isstring(L, -1)) {
-        settings.up_access = conf_get_rules(lua_tostring(L, -1));
-    }
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "download_rule");
-    if (lua_isstring(L, -1)) {
-        settings.down_access = conf_get_rules(lua_tostring(L, -1));
-    }
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "admin_rule");
-    if (lua_isstring(L, -1)) {
-        settings.admin_access = conf_get_rules(lua_tostring(L, -1));
-    }
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "cache");
-    if (lua_isnumber(L, -1))
-        settings.cache_on = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "mc_ip");
-    if (lua_isstring(L, -1))
-        str_lcpy(settings.cache_ip, lua_tostring(L, -1), sizeof(settings.cache_ip));
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "mc_port");
-    if (lua_isnumber(L, -1))
-        settings.cache_port = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "log_level");
-    if (lua_isnumber(L, -1))
-        settings.log_level = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "log_name"); //stack index: -1
-    if (lua_isstring(L, -1))
-        str_lcpy(settings.log_name, lua_tostring(L, -1), sizeof(settings.log_name));
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "root_path");
-    if (lua_isstring(L, -1))
-        str_lcpy(settings.root_path, lua_tostring(L, -1), sizeof(settings.root_path));
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "admin_path");
-    if (lua_isstring(L, -1))
-        str_lcpy(settings.admin_path, lua_tostring(L, -1), sizeof(settings.admin_path));
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "disable_args");
-    if (lua_isnumber(L, -1))
-        settings.disable_args = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "disable_type");
-    if (lua_isnumber(L, -1))
-        settings.disable_type = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "disable_zoom_up");
-    if (lua_isnumber(L, -1))
-        settings.disable_zoom_up = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "script_name"); //stack index: -1
-    if (lua_isstring(L, -1))
-        str_lcpy(settings.script_name, lua_tostring(L, -1), sizeof(settings.script_name));
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "format");
-    if (lua_isstring(L, -1))
-        str_lcpy(settings.format, lua_tostring(L, -1), sizeof(settings.format));
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "quality");
-    if (lua_isnumber(L, -1))
-        settings.quality = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "mode");
-    if (lua_isnumber(L, -1))
-        settings.mode = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    set_callback(settings.mode);
-
-    lua_getglobal(L, "save_new");
-    if (lua_isnumber(L, -1))
-        settings.save_new = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "max_size");
-    if (lua_isnumber(L, -1))
-        settings.max_size = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "img_path");
-    if (lua_isstring(L, -1))
-        str_lcpy(settings.img_path, lua_tostring(L, -1), sizeof(settings.img_path));
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "beansdb_ip");
-    if (lua_isstring(L, -1))
-        str_lcpy(settings.beansdb_ip, lua_tostring(L, -1), sizeof(settings.beansdb_ip));
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "beansdb_port");
-    if (lua_isnumber(L, -1))
-        settings.beansdb_port = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "ssdb_ip");
-    if (lua_isstring(L, -1))
-        str_lcpy(settings.ssdb_ip, lua_tostring(L, -1), sizeof(settings.ssdb_ip));
-    lua_pop(L, 1);
-
-    lua_getglobal(L, "ssdb_port");
-    if (lua_isnumber(L, -1))
-        settings.ssdb_port = (int)lua_tonumber(L, -1);
-    lua_pop(L, 1);
-
-    //settings.L = L;
-    lua_close(L);
-
-    return 1;
-}
 /**
  * @brief sighandler the signal handler of zimg
  *
@@ -387,47 +128,7 @@ void init_thread(evhtp_t *htp, evthr_t *thread, void *arg) {
     LOG_PRINT(LOG_DEBUG, "thr_args alloc");
     thr_args->thread = thread;
 
-    char mserver[32];
-
-    if (settings.cache_on == true) {
-        memcached_st *memc = memcached_create(NULL);
-        snprintf(mserver, 32, "%s:%d", settings.cache_ip, settings.cache_port);
-        memcached_server_st *servers = memcached_servers_parse(mserver);
-        memcached_server_push(memc, servers);
-        memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
-        memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_NO_BLOCK, 1);
-        memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_NOREPLY, 1);
-        memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_TCP_KEEPALIVE, 1);
-        thr_args->cache_conn = memc;
-        LOG_PRINT(LOG_DEBUG, "Memcached Connection Init Finished.");
-        memcached_server_list_free(servers);
-    } else
-        thr_args->cache_conn = NULL;
-
-    if (settings.mode == 2) {
-        thr_args->ssdb_conn = NULL;
-        memcached_st *beans = memcached_create(NULL);
-        snprintf(mserver, 32, "%s:%d", settings.beansdb_ip, settings.beansdb_port);
-        memcached_server_st *servers = memcached_servers_parse(mserver);
-        servers = memcached_servers_parse(mserver);
-        memcached_server_push(beans, servers);
-        memcached_behavior_set(beans, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 0);
-        memcached_behavior_set(beans, MEMCACHED_BEHAVIOR_NO_BLOCK, 1);
-        memcached_behavior_set(beans, MEMCACHED_BEHAVIOR_TCP_KEEPALIVE, 1);
-        thr_args->beansdb_conn = beans;
-        LOG_PRINT(LOG_DEBUG, "beansdb Connection Init Finished.");
-        memcached_server_list_free(servers);
-    } else if (settings.mode == 3) {
-        thr_args->beansdb_conn = NULL;
-        redisContext* c = redisConnect(settings.ssdb_ip, settings.ssdb_port);
-        if (c->err) {
-            redisFree(c);
-            LOG_PRINT(LOG_DEBUG, "Connect to ssdb server faile");
-        } else {
-            thr_args->ssdb_conn = c;
-            LOG_PRINT(LOG_DEBUG, "Connect to ssdb server Success");
-        }
-    }
+    init_conns(thr_args);
 
     thr_args->L = luaL_newstate();
     LOG_PRINT(LOG_DEBUG, "luaL_newstate alloc");
@@ -540,20 +241,26 @@ int main(int argc, char **argv) {
             return -1;
         }
     }
+    if (backend_on(1) && settings.img_path_num > 0) {
+        if (disk_init() != 1) {
+            fprintf(stderr, "Disks Init Failed!\n");
+            return -1;
+        }
+    }
+    if (settings.mode == 1 && settings.tier == 1) {
+        if (tier_init() != 1) {
+            LOG_PRINT(LOG_DEBUG, "tier_path[%s] Init Failed!", settings.tier_path);
+            fprintf(stderr, "%s Tiered Storage Init Failed!\n", settings.tier_path);
+            return -1;
+        }
+    }
     LOG_PRINT(LOG_DEBUG, "Paths Init Finished.");
 
     if (settings.mode == 2) {
         LOG_PRINT(LOG_DEBUG, "Begin to Test Memcached Connection...");
-        memcached_st *beans = memcached_create(NULL);
+        memcached_st *beans = beansdb_connect(settings.beansdb_ip, settings.beansdb_port);
         char mserver[32];
         snprintf(mserver, 32, "%s:%d", settings.beansdb_ip, settings.beansdb_port);
-        memcached_server_st *servers = memcached_servers_parse(mserver);
-        servers = memcached_servers_parse(mserver);
-        memcached_server_push(beans, servers);
-        memcached_server_list_free(servers);
-        memcached_behavior_set(beans, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 0);
-        memcached_behavior_set(beans, MEMCACHED_BEHAVIOR_NO_BLOCK, 1);
-        memcached_behavior_set(beans, MEMCACHED_BEHAVIOR_TCP_KEEPALIVE, 1);
         LOG_PRINT(LOG_DEBUG, "beansdb Connection Init Finished.");
         if (set_cache(beans, "zimg", "1") == -1) {
             LOG_PRINT(LOG_DEBUG, "Beansdb[%s] Connect Failed!", mserver);
@@ -565,19 +272,28 @@ int main(int argc, char **argv) {
         }
         memcached_free(beans);
     } else if (settings.mode == 3) {
-        redisContext* c = redisConnect(settings.ssdb_ip, settings.ssdb_port);
-        if (c->err) {
-            redisFree(c);
-            LOG_PRINT(LOG_DEBUG, "Connect to ssdb server faile");
-            fprintf(stderr, "SSDB[%s:%d] Connect Failed!\n", settings.ssdb_ip, settings.ssdb_port);
+        int i, up = 0;
+        for (i = 0; i < settings.ssdb_node_num; i++) {
+            redisContext* c = ssdb_connect(settings.ssdb_node_ip[i], settings.ssdb_node_port[i]);
+            if (c == NULL) {
+                LOG_PRINT(LOG_DEBUG, "Connect to ssdb server faile");
+                fprintf(stderr, "SSDB[%s:%d] Connect Failed!\n", settings.ssdb_node_ip[i], settings.ssdb_node_port[i]);
+            } else {
+                LOG_PRINT(LOG_DEBUG, "Connect to ssdb server Success");
+                redisFree(c);
+                up++;
+            }
+        }
+        /* writes need the quorum, start only if it can be reached */
+        if (up < settings.ssdb_quorum) {
+            fprintf(stderr, "SSDB: %d of %d nodes connected, quorum is %d!\n", up, settings.ssdb_node_num, settings.ssdb_quorum);
             return -1;
-        } else {
-            LOG_PRINT(LOG_DEBUG, "Connect to ssdb server Success");
         }
     }
 
     //init magickwand
     MagickCoreGenesis((char *) NULL, MagickFalse);
+    decode_limits();
     /*
     ExceptionInfo *exception=AcquireExceptionInfo();
     MagickInfo *jpeg_info = (MagickInfo *)GetMagickInfo("JPEG", exception);
@@ -590,6 +306,41 @@ int main(int argc, char **argv) {
     jpg_info->thread_support = MagickTrue;
     */
 
+    if (settings.replica_num > 0) {
+        if (repl_init() != 1) {
+            fprintf(stderr, "Replication Init Failed!\n");
+            return -1;
+        }
+    }
+
+    if (settings.journal == 1) {
+        if (journal_init() != 1) {
+            fprintf(stderr, "%s Journal Init Failed!\n", settings.journal_path);
+            return -1;
+        }
+    }
+
+    if (settings.dcache == 1) {
+        if (dcache_init() != 1) {
+            fprintf(stderr, "%s Disk Cache Init Failed!\n", settings.dcache_path);
+            return -1;
+        }
+    }
+
+    if (settings.scrub == 1) {
+        if (scrub_init() != 1) {
+            fprintf(stderr, "Scrubber Init Failed!\n");
+            return -1;
+        }
+    }
+
+    if (settings.pregen_num > 0) {
+        if (pregen_init() != 1) {
+            fprintf(stderr, "Pregen Init Failed!\n");
+            return -1;
+        }
+    }
+
     int result = pthread_key_create(&gLuaStateKey, thread_lua_dtor);
     if (result != 0) {
         LOG_PRINT(LOG_ERROR, "Could not allocate TLS key for lua_State.");
@@ -606,6 +357,8 @@ int main(int argc, char **argv) {
     evhtp_set_cb(htp, "/admin", admin_request_cb, NULL);
     evhtp_set_cb(htp, "/info", info_request_cb, NULL);
     evhtp_set_cb(htp, "/echo", echo_cb, NULL);
+    evhtp_set_cb(htp, "/status", status_request_cb, NULL);
+    evhtp_set_cb(htp, "/batch", batch_request_cb, NULL);
     evhtp_set_gencb(htp, get_request_cb, NULL);
 #ifndef EVHTP_DISABLE_EVTHR
     evhtp_use_threads(htp, init_thread, settings.num_threads, NULL);
@@ -0,0 +1,422 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zimg_export.c
+ * @brief export the original images of a zimg store as a tar stream.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * Every original is written as a regular file named by its md5 and the
+ * suffix of its format sniffed from the content, and every name is checked
+ * against allowed_type as zimg-import does, so the output can be fed
+ * straight back into zimg-import. Disk mode walks the
+ * storage tree(s); beansdb and ssdb modes read a list of md5 from a file
+ * or stdin because neither backend can be listed cheaply.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#include "zcommon.h"
+#include "zconf.h"
+#include "zdb.h"
+#include "zdisk.h"
+#include "zutil.h"
+#include "zlog.h"
+
+#define TAR_BLOCK_SIZE      512
+
+static long succ_count = 0;
+static long fail_count = 0;
+
+static void usage(char **argv);
+static int write_full(int fd, const char *buff, size_t len);
+static int tar_write(int fd, const char *name, const char *buff, size_t len, time_t mtime);
+static int tar_finish(int fd);
+static const char * img_suffix(const char *buff, size_t len);
+static int tar_img(int fd, const char *md5, const char *buff, size_t len, time_t mtime);
+static void export_file(int fd, const char *md5, const char *path);
+static void export_dir(int fd, const char *root);
+static void export_db(int fd, thr_arg_t *thr_arg, FILE *list);
+int main(int argc, char **argv);
+
+/**
+ * @brief usage usage display of zimg-export
+ *
+ * @param argv the args
+ */
+static void usage(char **argv) {
+    printf("Usage:\n");
+    printf("    %s [-l md5_list] /path/to/zimg.lua > images.tar\n", argv[0]);
+    printf("Options:\n");
+    printf("    -l    file of md5 to export, one per line, '-' for stdin\n");
+    printf("          required in beansdb and ssdb mode\n");
+}
+
+/**
+ * @brief write_full write exactly len bytes
+ *
+ * @param fd the fd
+ * @param buff the buffer
+ * @param len the length to write
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int write_full(int fd, const char *buff, size_t len) {
+    size_t off = 0;
+    ssize_t wlen;
+    while (off < len) {
+        wlen = write(fd, buff + off, len - off);
+        if (wlen <= 0)
+            return -1;
+        off += wlen;
+    }
+    return 1;
+}
+
+/**
+ * @brief tar_write write one regular file in ustar format
+ *
+ * @param fd the output fd
+ * @param name the entry name, shorter than 100 bytes
+ * @param buff the content
+ * @param len the length of buff
+ * @param mtime the modify time of the entry
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int tar_write(int fd, const char *name, const char *buff, size_t len, time_t mtime) {
+    char header[TAR_BLOCK_SIZE];
+    char pad[TAR_BLOCK_SIZE];
+    unsigned int sum = 0;
+    int i;
+
+    memset(header, 0, sizeof(header));
+    snprintf(header, 100, "%s", name);
+    snprintf(header + 100, 8, "%07o", 0644);
+    snprintf(header + 108, 8, "%07o", 0);
+    snprintf(header + 116, 8, "%07o", 0);
+    snprintf(header + 124, 12, "%011llo", (unsigned long long)len);
+    snprintf(header + 136, 12, "%011llo", (unsigned long long)mtime);
+    header[156] = '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    memset(header + 148, ' ', 8);
+    for (i = 0; i < TAR_BLOCK_SIZE; i++)
+        sum += (unsigned char)header[i];
+    snprintf(header + 148, 8, "%06o", sum);
+    header[155] = ' ';
+
+    if (write_full(fd, header, TAR_BLOCK_SIZE) == -1 || write_full(fd, buff, len) == -1)
+        return -1;
+    if (len % TAR_BLOCK_SIZE != 0) {
+        memset(pad, 0, sizeof(pad));
+        if (write_full(fd, pad, TAR_BLOCK_SIZE - len % TAR_BLOCK_SIZE) == -1)
+            return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief tar_finish write the two zero blocks ending a tar stream
+ *
+ * @param fd the output fd
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int tar_finish(int fd) {
+    char pad[TAR_BLOCK_SIZE * 2];
+    memset(pad, 0, sizeof(pad));
+    return write_full(fd, pad, sizeof(pad));
+}
+
+/**
+ * @brief img_suffix the file suffix of an image by its magic bytes
+ *
+ * @param buff the image
+ * @param len length of the image
+ *
+ * @return the suffix or NULL for an unknown format
+ */
+static const char * img_suffix(const char *buff, size_t len) {
+    const unsigned char *p = (const unsigned char *)buff;
+
+    if (len >= 3 && p[0] == 0xFF && p[1] == 0xD8 && p[2] == 0xFF)
+        return "jpg";
+    if (len >= 8 && memcmp(p, "\x89PNG\r\n\x1a\n", 8) == 0)
+        return "png";
+    if (len >= 6 && (memcmp(p, "GIF87a", 6) == 0 || memcmp(p, "GIF89a", 6) == 0))
+        return "gif";
+    if (len >= 12 && memcmp(p, "RIFF", 4) == 0 && memcmp(p + 8, "WEBP", 4) == 0)
+        return "webp";
+    return NULL;
+}
+
+/**
+ * @brief tar_img write an original named <md5>.<suffix>, only if zimg-import will take it back
+ *
+ * @param fd the output fd
+ * @param md5 the md5 of the image
+ * @param buff the image
+ * @param len length of the image
+ * @param mtime the modify time
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int tar_img(int fd, const char *md5, const char *buff, size_t len, time_t mtime) {
+    const char *suffix = img_suffix(buff, len);
+    char name[64];
+    char type[32];
+
+    if (suffix == NULL) {
+        fprintf(stderr, "%s is not jpg, png, gif or webp\n", md5);
+        return -1;
+    }
+    snprintf(name, sizeof(name), "%s.%s", md5, suffix);
+    /* the same rules as accept_file() of zimg-import */
+    if (len == 0 || len > settings.max_size || get_type(name, type) == -1 || is_img(type) != 1) {
+        fprintf(stderr, "%s would be skipped by zimg-import, check max_size and allowed_type\n", name);
+        return -1;
+    }
+    return tar_write(fd, name, buff, len, mtime);
+}
+
+/**
+ * @brief export_file export the original image of a storage dir
+ *
+ * @param fd the output fd
+ * @param md5 the md5 of the image
+ * @param path the storage dir of the image
+ */
+static void export_file(int fd, const char *md5, const char *path) {
+    char file_path[PATH_MAX_SIZE];
+    struct stat st;
+    char *buff = NULL;
+    int in = -1;
+    size_t off = 0;
+    ssize_t rlen;
+
+    snprintf(file_path, PATH_MAX_SIZE, "%s/0*0", path);
+    if ((in = open(file_path, O_RDONLY)) == -1 || fstat(in, &st) == -1)
+        goto err;
+    if ((buff = (char *)malloc(st.st_size > 0 ? st.st_size : 1)) == NULL)
+        goto err;
+    while (off < (size_t)st.st_size) {
+        rlen = read(in, buff + off, st.st_size - off);
+        if (rlen <= 0)
+            goto err;
+        off += rlen;
+    }
+    if (tar_img(fd, md5, buff, off, st.st_mtime) == -1)
+        goto err;
+    succ_count++;
+    close(in);
+    free(buff);
+    return;
+
+err:
+    fprintf(stderr, "export %s failed\n", md5);
+    fail_count++;
+    if (in != -1)
+        close(in);
+    free(buff);
+}
+
+/**
+ * @brief export_dir walk a storage root of disk mode, img_path/<h1>/<h2>/<md5>
+ *
+ * @param fd the output fd
+ * @param root the storage root
+ */
+static void export_dir(int fd, const char *root) {
+    DIR *d1, *d2, *d3;
+    struct dirent *e1, *e2, *e3;
+    char p1[PATH_MAX_SIZE], p2[PATH_MAX_SIZE], p3[PATH_MAX_SIZE];
+
+    if ((d1 = opendir(root)) == NULL)
+        return;
+    while ((e1 = readdir(d1)) != NULL) {
+        if (e1->d_name[0] == '.')
+            continue;
+        get_file_path(root, e1->d_name, p1);
+        if ((d2 = opendir(p1)) == NULL)
+            continue;
+        while ((e2 = readdir(d2)) != NULL) {
+            if (e2->d_name[0] == '.')
+                continue;
+            get_file_path(p1, e2->d_name, p2);
+            if ((d3 = opendir(p2)) == NULL)
+                continue;
+            while ((e3 = readdir(d3)) != NULL) {
+                if (is_md5(e3->d_name) != 1)
+                    continue;
+                get_file_path(p2, e3->d_name, p3);
+                export_file(fd, e3->d_name, p3);
+            }
+            closedir(d3);
+        }
+        closedir(d2);
+    }
+    closedir(d1);
+}
+
+/**
+ * @brief export_db export the originals of a list of md5 from beansdb or ssdb
+ *
+ * @param fd the output fd
+ * @param thr_arg the connections
+ * @param list the md5 list
+ */
+static void export_db(int fd, thr_arg_t *thr_arg, FILE *list) {
+    char line[128];
+    char key[128];
+    char *buff = NULL;
+    size_t len = 0;
+
+    while (fgets(line, sizeof(line), list) != NULL) {
+        line[strcspn(line, "\r\n \t")] = '\0';
+        if (is_md5(line) != 1)
+            continue;
+        gen_key(key, line, 0);
+        if (get_img_db(thr_arg, key, &buff, &len) == -1) {
+            fprintf(stderr, "export %s failed\n", line);
+            fail_count++;
+            continue;
+        }
+        if (tar_img(fd, line, buff, len, time(NULL)) == -1) {
+            fprintf(stderr, "export %s failed\n", line);
+            fail_count++;
+        } else {
+            succ_count++;
+        }
+        free(buff);
+        buff = NULL;
+    }
+}
+
+/**
+ * @brief main the entrance of zimg-export
+ *
+ * @param argc count of args
+ * @param argv arg list
+ *
+ * @return 0 for OK and 1 for any failure
+ */
+int main(int argc, char **argv) {
+    const char *conf_file = NULL;
+    const char *list_file = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:h")) != -1) {
+        switch (opt) {
+        case 'l':
+            list_file = optarg;
+            break;
+        default:
+            usage(argv);
+            return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv);
+        return 1;
+    }
+    conf_file = argv[optind];
+
+    settings_init();
+    if (load_conf(conf_file) == -1) {
+        fprintf(stderr, "'%s' load failed!\n", conf_file);
+        return 1;
+    }
+    if (mk_dirf(settings.log_name) != 1) {
+        fprintf(stderr, "%s log path create failed!\n", settings.log_name);
+        return 1;
+    }
+    log_init();
+    if (isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "refuse to write a tar stream to a terminal\n");
+        return 1;
+    }
+
+    /* is_img() asks the conf lua state */
+    lua_State *L = luaL_newstate();
+    if (L == NULL)
+        return 1;
+    luaL_openlibs(L);
+    if (luaL_loadfile(L, conf_file) || lua_pcall(L, 0, 0, 0)) {
+        lua_close(L);
+        return 1;
+    }
+    pthread_key_create(&gLuaStateKey, NULL);
+    pthread_setspecific(gLuaStateKey, (void *)L);
+
+    if (settings.mode == 1 && list_file == NULL) {
+        int i;
+        for (i = 0; i < disk_count(); i++)
+            export_dir(STDOUT_FILENO, disk_path(i));
+        if (settings.tier == 1)
+            export_dir(STDOUT_FILENO, settings.tier_path);
+    } else {
+        FILE *list = stdin;
+        if (list_file == NULL) {
+            usage(argv);
+            return 1;
+        }
+        if (strcmp(list_file, "-") != 0 && (list = fopen(list_file, "r")) == NULL) {
+            fprintf(stderr, "open %s failed\n", list_file);
+            return 1;
+        }
+        thr_arg_t *thr_arg = (thr_arg_t *)calloc(1, sizeof(thr_arg_t));
+        if (thr_arg == NULL)
+            return 1;
+        if (settings.mode == 1) {
+            char path[PATH_MAX_SIZE];
+            char line[128];
+            while (fgets(line, sizeof(line), list) != NULL) {
+                line[strcspn(line, "\r\n \t")] = '\0';
+                if (is_md5(line) != 1)
+                    continue;
+                get_img_path(disk_root(line), line, path);
+                if (settings.tier == 1 && is_dir(path) != 1)
+                    get_img_path(settings.tier_path, line, path);
+                export_file(STDOUT_FILENO, line, path);
+            }
+        } else {
+            init_conns(thr_arg);
+            export_db(STDOUT_FILENO, thr_arg, list);
+            free_conns(thr_arg);
+        }
+        free(thr_arg);
+        if (list != stdin)
+            fclose(list);
+    }
+
+    lua_close(L);
+    if (tar_finish(STDOUT_FILENO) == -1) {
+        fprintf(stderr, "write tar stream failed!\n");
+        return 1;
+    }
+    fprintf(stderr, "exported: %ld failed: %ld\n", succ_count, fail_count);
+    return fail_count > 0 ? 1 : 0;
+}
@@ -0,0 +1,523 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zimg_import.c
+ * @brief bulk import images into a zimg store from a directory tree or a tar stream.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * Images are hashed and stored by the same save_img() used by the upload
+ * handler, so the result is identical to POSTing every file. One reader
+ * thread feeds N storage threads through a queue bounded by bytes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#include "zcommon.h"
+#include "zconf.h"
+#include "zimg.h"
+#include "zrepl.h"
+#include "zdisk.h"
+#include "zdecode.h"
+#include "zutil.h"
+#include "zlog.h"
+
+#define TAR_BLOCK_SIZE      512
+
+typedef struct import_item_s import_item_t;
+
+struct import_item_s {
+    char *name;
+    char *buff;
+    size_t len;
+    import_item_t *next;
+};
+
+static import_item_t *queue_head = NULL;
+static import_item_t *queue_tail = NULL;
+static size_t queue_bytes = 0;
+static size_t queue_max_bytes = 256 * 1024 * 1024;
+static int queue_closed = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static long succ_count = 0;
+static long fail_count = 0;
+static long skip_count = 0;
+
+static void usage(char **argv);
+static void queue_push(char *name, char *buff, size_t len);
+static import_item_t * queue_pop(void);
+static int accept_file(const char *name, size_t len);
+static void import_buff(const char *name, char *buff, size_t len);
+static void import_file(const char *path);
+static void import_dir(const char *path);
+static int tar_octal(const char *p, size_t n, size_t *value);
+static int read_full(int fd, char *buff, size_t len);
+static int skip_full(int fd, size_t len);
+static int import_tar(int fd);
+static void * import_worker(void *arg);
+int main(int argc, char **argv);
+
+/**
+ * @brief usage usage display of zimg-import
+ *
+ * @param argv the args
+ */
+static void usage(char **argv) {
+    printf("Usage:\n");
+    printf("    %s [-t threads] [-m max_mb] /path/to/zimg.lua <dir|->\n", argv[0]);
+    printf("Options:\n");
+    printf("    -t    storage threads, default is thread_num in conf\n");
+    printf("    -m    max MB of images buffered in memory, default 256\n");
+    printf("    -     read a tar stream from stdin instead of a directory\n");
+}
+
+/**
+ * @brief queue_push add an image to the queue, block while the queue is full
+ *
+ * @param name the name of the image
+ * @param buff the image buffer, owned by the queue after push
+ * @param len the length of buff
+ */
+static void queue_push(char *name, char *buff, size_t len) {
+    import_item_t *item = (import_item_t *)malloc(sizeof(import_item_t));
+    if (item == NULL) {
+        free(name);
+        free(buff);
+        return;
+    }
+    item->name = name;
+    item->buff = buff;
+    item->len = len;
+    item->next = NULL;
+
+    pthread_mutex_lock(&queue_lock);
+    /* one image larger than the limit is still allowed into an empty queue */
+    while (queue_bytes > 0 && queue_bytes + len > queue_max_bytes)
+        pthread_cond_wait(&queue_not_full, &queue_lock);
+    if (queue_tail == NULL)
+        queue_head = item;
+    else
+        queue_tail->next = item;
+    queue_tail = item;
+    queue_bytes += len;
+    pthread_cond_signal(&queue_not_empty);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * @brief queue_pop take an image from the queue
+ *
+ * @return the image or NULL when the queue is closed and empty
+ */
+static import_item_t * queue_pop(void) {
+    import_item_t *item = NULL;
+
+    pthread_mutex_lock(&queue_lock);
+    while (queue_head == NULL && queue_closed == 0)
+        pthread_cond_wait(&queue_not_empty, &queue_lock);
+    if (queue_head != NULL) {
+        item = queue_head;
+        queue_head = item->next;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+        queue_bytes -= item->len;
+        pthread_cond_signal(&queue_not_full);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return item;
+}
+
+/**
+ * @brief accept_file check a file by the same rules as the upload interface
+ *
+ * @param name the file name
+ * @param len the file size
+ *
+ * @return 1 for yes and -1 for no
+ */
+static int accept_file(const char *name, size_t len) {
+    char type[32];
+    if (len == 0 || len > settings.max_size)
+        return -1;
+    if (get_type(name, type) == -1)
+        return -1;
+    return is_img(type);
+}
+
+/**
+ * @brief import_buff queue an image buffer or drop it
+ *
+ * @param name the file name
+ * @param buff the image buffer
+ * @param len the length of buff
+ */
+static void import_buff(const char *name, char *buff, size_t len) {
+    char *dup = strdup(name);
+    if (dup == NULL) {
+        free(buff);
+        return;
+    }
+    queue_push(dup, buff, len);
+}
+
+/**
+ * @brief import_file read a file and queue it
+ *
+ * @param path the path of the file
+ */
+static void import_file(const char *path) {
+    int fd = -1;
+    struct stat st;
+    char *buff = NULL;
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "open %s failed\n", path);
+        __sync_fetch_and_add(&fail_count, 1);
+        goto done;
+    }
+    if (accept_file(path, st.st_size) != 1) {
+        __sync_fetch_and_add(&skip_count, 1);
+        goto done;
+    }
+    if ((buff = (char *)malloc(st.st_size)) == NULL || read_full(fd, buff, st.st_size) == -1) {
+        fprintf(stderr, "read %s failed\n", path);
+        __sync_fetch_and_add(&fail_count, 1);
+        free(buff);
+        goto done;
+    }
+    import_buff(path, buff, st.st_size);
+
+done:
+    if (fd != -1)
+        close(fd);
+}
+
+/**
+ * @brief import_dir walk a directory tree and queue all images in it
+ *
+ * @param path the directory
+ */
+static void import_dir(const char *path) {
+    DIR *dir;
+    struct dirent *dir_info;
+    char file_path[PATH_MAX_SIZE];
+
+    if ((dir = opendir(path)) == NULL) {
+        fprintf(stderr, "opendir %s failed\n", path);
+        return;
+    }
+    while ((dir_info = readdir(dir)) != NULL) {
+        if (dir_info->d_name[0] == '.')
+            continue;
+        get_file_path(path, dir_info->d_name, file_path);
+        if (is_dir(file_path) == 1)
+            import_dir(file_path);
+        else if (is_file(file_path) == 1)
+            import_file(file_path);
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief tar_octal parse an octal field of a tar header
+ *
+ * @param p the field
+ * @param n the size of the field
+ * @param value the parsed value
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int tar_octal(const char *p, size_t n, size_t *value) {
+    size_t i = 0;
+    *value = 0;
+    while (i < n && (p[i] == ' ' || p[i] == '\0'))
+        i++;
+    for (; i < n && p[i] >= '0' && p[i] <= '7'; i++)
+        *value = (*value << 3) + (p[i] - '0');
+    return 1;
+}
+
+/**
+ * @brief read_full read exactly len bytes
+ *
+ * @param fd the fd
+ * @param buff the buffer
+ * @param len the length to read
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int read_full(int fd, char *buff, size_t len) {
+    size_t off = 0;
+    ssize_t rlen;
+    while (off < len) {
+        rlen = read(fd, buff + off, len - off);
+        if (rlen <= 0)
+            return -1;
+        off += rlen;
+    }
+    return 1;
+}
+
+/**
+ * @brief skip_full skip len bytes of a stream
+ *
+ * @param fd the fd
+ * @param len the length to skip
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int skip_full(int fd, size_t len) {
+    char buff[TAR_BLOCK_SIZE * 16];
+    size_t n;
+    while (len > 0) {
+        n = len < sizeof(buff) ? len : sizeof(buff);
+        if (read_full(fd, buff, n) == -1)
+            return -1;
+        len -= n;
+    }
+    return 1;
+}
+
+/**
+ * @brief import_tar read a ustar/gnu tar stream and queue all images in it
+ *
+ * @param fd the fd of the stream
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int import_tar(int fd) {
+    char header[TAR_BLOCK_SIZE];
+    char name[PATH_MAX_SIZE];
+    char long_name[PATH_MAX_SIZE];
+    size_t size, padded;
+    char *buff;
+
+    long_name[0] = '\0';
+    for (;;) {
+        if (read_full(fd, header, TAR_BLOCK_SIZE) == -1)
+            return -1;
+        if (header[0] == '\0')
+            return 1;
+
+        tar_octal(header + 124, 12, &size);
+        padded = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+        char typeflag = header[156];
+
+        if (typeflag == 'L') {
+            /* gnu long name of the next entry */
+            size_t n = size < sizeof(long_name) ? size : sizeof(long_name) - 1;
+            if (read_full(fd, long_name, n) == -1 || skip_full(fd, padded - n) == -1)
+                return -1;
+            long_name[n] = '\0';
+            continue;
+        }
+        if (typeflag != '0' && typeflag != '\0') {
+            if (skip_full(fd, padded) == -1)
+                return -1;
+            long_name[0] = '\0';
+            continue;
+        }
+
+        if (long_name[0] != '\0') {
+            str_lcpy(name, long_name, sizeof(name));
+            long_name[0] = '\0';
+        } else if (memcmp(header + 257, "ustar", 5) == 0 && header[345] != '\0') {
+            snprintf(name, sizeof(name), "%.155s/%.100s", header + 345, header);
+        } else {
+            snprintf(name, sizeof(name), "%.100s", header);
+        }
+
+        if (accept_file(name, size) != 1) {
+            __sync_fetch_and_add(&skip_count, 1);
+            if (skip_full(fd, padded) == -1)
+                return -1;
+            continue;
+        }
+        if ((buff = (char *)malloc(padded)) == NULL)
+            return -1;
+        if (read_full(fd, buff, padded) == -1) {
+            free(buff);
+            return -1;
+        }
+        import_buff(name, buff, size);
+    }
+}
+
+/**
+ * @brief import_worker the storage thread
+ *
+ * @param arg not used
+ *
+ * @return not used
+ */
+static void * import_worker(void *arg) {
+    thr_arg_t *thr_arg = (thr_arg_t *)calloc(1, sizeof(thr_arg_t));
+    import_item_t *item;
+    char md5sum[33];
+
+    if (thr_arg == NULL)
+        return NULL;
+    init_conns(thr_arg);
+
+    while ((item = queue_pop()) != NULL) {
+        if (save_img(thr_arg, item->buff, item->len, md5sum) == -1) {
+            __sync_fetch_and_add(&fail_count, 1);
+            LOG_PRINT(LOG_ERROR, "import fail %s", item->name);
+            pthread_mutex_lock(&out_lock);
+            fprintf(stderr, "save %s failed\n", item->name);
+            pthread_mutex_unlock(&out_lock);
+        } else {
+            __sync_fetch_and_add(&succ_count, 1);
+            LOG_PRINT(LOG_INFO, "import succ pic:%s size:%d %s", md5sum, item->len, item->name);
+            pthread_mutex_lock(&out_lock);
+            fprintf(stdout, "%s\t%s\n", md5sum, item->name);
+            pthread_mutex_unlock(&out_lock);
+        }
+        free(item->name);
+        free(item->buff);
+        free(item);
+    }
+
+    free_conns(thr_arg);
+    free(thr_arg);
+    return NULL;
+}
+
+/**
+ * @brief main the entrance of zimg-import
+ *
+ * @param argc count of args
+ * @param argv arg list
+ *
+ * @return 0 for OK and 1 for any failure
+ */
+int main(int argc, char **argv) {
+    int num_threads = 0;
+    const char *conf_file = NULL;
+    const char *source = NULL;
+    int i, opt;
+
+    while ((opt = getopt(argc, argv, "t:m:h")) != -1) {
+        switch (opt) {
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 'm':
+            queue_max_bytes = (size_t)atoi(optarg) * 1024 * 1024;
+            break;
+        default:
+            usage(argv);
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv);
+        return 1;
+    }
+    conf_file = argv[optind];
+    source = argv[optind + 1];
+
+    settings_init();
+    if (load_conf(conf_file) == -1) {
+        fprintf(stderr, "'%s' load failed!\n", conf_file);
+        return 1;
+    }
+    if (mk_dirf(settings.log_name) != 1) {
+        fprintf(stderr, "%s log path create failed!\n", settings.log_name);
+        return 1;
+    }
+    log_init();
+    for (i = 0; settings.mode == 1 && i < disk_count(); i++) {
+        if (is_dir(disk_path(i)) != 1 && mk_dirs(disk_path(i)) != 1) {
+            fprintf(stderr, "%s Create Failed!\n", disk_path(i));
+            return 1;
+        }
+    }
+    if (num_threads <= 0)
+        num_threads = settings.num_threads;
+
+    /* is_img() in the reader thread asks the conf lua state */
+    lua_State *L = luaL_newstate();
+    if (L == NULL)
+        return 1;
+    luaL_openlibs(L);
+    if (luaL_loadfile(L, conf_file) || lua_pcall(L, 0, 0, 0)) {
+        lua_close(L);
+        return 1;
+    }
+    pthread_key_create(&gLuaStateKey, NULL);
+    pthread_setspecific(gLuaStateKey, (void *)L);
+
+    if (settings.replica_num > 0 && repl_init() != 1) {
+        fprintf(stderr, "Replication Init Failed!\n");
+        return 1;
+    }
+
+    /* save_img() pings every image with MagickWand on the worker threads */
+    MagickWandGenesis();
+    decode_limits();
+
+    pthread_t *workers = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+    if (workers == NULL)
+        return 1;
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&workers[i], NULL, import_worker, NULL) != 0) {
+            fprintf(stderr, "create thread failed!\n");
+            return 1;
+        }
+    }
+
+    int ret = 1;
+    if (strcmp(source, "-") == 0)
+        ret = import_tar(STDIN_FILENO);
+    else if (is_dir(source) == 1)
+        import_dir(source);
+    else {
+        fprintf(stderr, "%s is not a directory!\n", source);
+        ret = -1;
+    }
+    if (ret == -1 && strcmp(source, "-") == 0)
+        fprintf(stderr, "tar stream broken!\n");
+
+    pthread_mutex_lock(&queue_lock);
+    queue_closed = 1;
+    pthread_cond_broadcast(&queue_not_empty);
+    pthread_mutex_unlock(&queue_lock);
+    for (i = 0; i < num_threads; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    repl_drain();
+    lua_close(L);
+    MagickWandTerminus();
+
+    fprintf(stderr, "imported: %ld failed: %ld skipped: %ld\n", succ_count, fail_count, skip_count);
+    /* a migration which copies nothing is a failure, not a quiet success */
+    if (succ_count == 0 && skip_count > 0) {
+        fprintf(stderr, "nothing imported, check the file suffixes against allowed_type!\n");
+        ret = -1;
+    }
+    return (fail_count > 0 || ret == -1) ? 1 : 0;
+}
@@ -0,0 +1,1400 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zimg_stub.c
+ * @brief in-memory stand-in for memcached, beansdb and ssdb.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * Speaks the memcached text and binary protocols (cache and beansdb mode)
+ * and the redis protocol (ssdb mode), covering the commands zcache.c and
+ * zdb.c send. Every listener has its own store. Replies can be delayed by
+ * a fixed latency with jitter, answered with an error, or the connection
+ * dropped, all driven by a seeded generator so runs can be repeated.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include <event2/util.h>
+
+#define STUB_MAX_LISTENERS  8
+#define STUB_MAX_LINE       4096
+#define STUB_MAX_ARGS       64
+#define STUB_MAX_VALUE      (64 * 1024 * 1024)
+#define STUB_REL_TIME_MAX   (60 * 60 * 24 * 30)
+
+#define PROTO_MEMCACHED     1
+#define PROTO_REDIS         2
+
+#define BIN_REQ_MAGIC       0x80
+#define BIN_RES_MAGIC       0x81
+#define BIN_HEADER_LEN      24
+
+#define BIN_CMD_GET         0x00
+#define BIN_CMD_SET         0x01
+#define BIN_CMD_ADD         0x02
+#define BIN_CMD_REPLACE     0x03
+#define BIN_CMD_DELETE      0x04
+#define BIN_CMD_QUIT        0x07
+#define BIN_CMD_FLUSH       0x08
+#define BIN_CMD_GETQ        0x09
+#define BIN_CMD_NOOP        0x0a
+#define BIN_CMD_VERSION     0x0b
+#define BIN_CMD_GETK        0x0c
+#define BIN_CMD_GETKQ       0x0d
+#define BIN_CMD_SETQ        0x11
+#define BIN_CMD_ADDQ        0x12
+#define BIN_CMD_REPLACEQ    0x13
+#define BIN_CMD_DELETEQ     0x14
+#define BIN_CMD_QUITQ       0x17
+#define BIN_CMD_FLUSHQ      0x18
+
+#define BIN_OK              0x0000
+#define BIN_NOT_FOUND       0x0001
+#define BIN_EXISTS          0x0002
+#define BIN_TOO_LARGE       0x0003
+#define BIN_INVALID         0x0004
+#define BIN_NOT_STORED      0x0005
+#define BIN_UNKNOWN         0x0081
+#define BIN_TMP_FAIL        0x0086
+
+typedef struct item_s {
+    struct item_s *next;
+    char *key;
+    size_t nkey;
+    char *val;
+    size_t nval;
+    uint32_t flags;
+    time_t exptime;
+} item_t;
+
+typedef struct store_s {
+    item_t **buckets;
+    size_t nbuckets;
+    size_t count;
+    size_t bytes;
+} store_t;
+
+typedef struct listener_s {
+    int proto;
+    int port;
+    store_t store;
+    struct evconnlistener *lev;
+} listener_t;
+
+typedef struct pending_s {
+    struct pending_s *next;
+    struct evbuffer *buf;
+    uint64_t at;
+    int close;
+} pending_t;
+
+typedef struct conn_s {
+    listener_t *l;
+    struct bufferevent *bev;
+    struct event *timer;
+    pending_t *head;
+    pending_t *tail;
+    int closing;
+} conn_t;
+
+static struct {
+    const char *bind;
+    double latency;
+    double jitter;
+    double fail_rate;
+    double close_rate;
+    uint64_t seed;
+    int verbose;
+} opts;
+
+static struct {
+    uint64_t conns;
+    uint64_t requests;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t failed;
+    uint64_t dropped;
+} stats;
+
+static struct event_base *base = NULL;
+static listener_t listeners[STUB_MAX_LISTENERS];
+static int listener_num = 0;
+static uint64_t rng_state = 0;
+
+static void usage(char **argv);
+static uint64_t now_us(void);
+static uint64_t rng_next(void);
+static int chance(double rate);
+static int ieq(const char *a, const char *b);
+static uint32_t hash_key(const char *key, size_t nkey);
+static int store_init(store_t *s);
+static void item_free(item_t *it);
+static int item_expired(const item_t *it);
+static item_t * store_find(store_t *s, const char *key, size_t nkey);
+static int store_set(store_t *s, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags, time_t exptime);
+static int store_del(store_t *s, const char *key, size_t nkey);
+static void store_flush(store_t *s);
+static int key_order(const char *a, size_t na, const char *b, size_t nb);
+static int key_cmp(const void *a, const void *b);
+static int keys_collect(store_t *s, struct evbuffer *out, char **argv, size_t *argl, int argc);
+static time_t mc_exptime(long exptime);
+static void conn_free(conn_t *c);
+static void conn_deliver(conn_t *c, struct evbuffer *out, int close);
+static void conn_timer_cb(evutil_socket_t fd, short what, void *arg);
+static int mc_text(conn_t *c, struct evbuffer *in, struct evbuffer *out, int *close);
+static void bin_reply(struct evbuffer *out, const unsigned char *req, uint16_t status, const char *key, size_t nkey, const item_t *it, const char *msg);
+static int mc_binary(conn_t *c, struct evbuffer *in, struct evbuffer *out, int *close);
+static int redis_parse(struct evbuffer *in, char **argv, size_t *argl, int *argc, char **raw);
+static int redis_cmd(conn_t *c, struct evbuffer *in, struct evbuffer *out, int *close);
+static void read_cb(struct bufferevent *bev, void *arg);
+static void event_cb(struct bufferevent *bev, short what, void *arg);
+static void write_cb(struct bufferevent *bev, void *arg);
+static void accept_cb(struct evconnlistener *lev, evutil_socket_t fd, struct sockaddr *sa, int socklen, void *arg);
+static void signal_cb(evutil_socket_t sig, short what, void *arg);
+static int add_listener(int proto, const char *port);
+int main(int argc, char **argv);
+
+/**
+ * @brief usage usage display of zimg-stub
+ *
+ * @param argv the args
+ */
+static void usage(char **argv) {
+    printf("Usage:\n");
+    printf("    %s [options]\n", argv[0]);
+    printf("Options:\n");
+    printf("    -m port    serve memcached text/binary protocol, for cache and beansdb\n");
+    printf("    -r port    serve redis protocol, for ssdb\n");
+    printf("               both may be repeated, %d listeners at most\n", STUB_MAX_LISTENERS);
+    printf("    -b ip      address to bind, default 127.0.0.1\n");
+    printf("    -l ms      latency added to every reply, default 0\n");
+    printf("    -j ms      uniform jitter around the latency, default 0\n");
+    printf("    -f rate    share of requests answered with an error, 0.0-1.0\n");
+    printf("    -c rate    share of reads after which the connection is dropped, 0.0-1.0\n");
+    printf("    -s seed    seed of the fault generator, default 1\n");
+    printf("    -v         print every connection\n");
+    printf("Example:\n");
+    printf("    %s -m 11211 -m 7900 -r 8888 -l 0.5 -j 0.2 -f 0.01\n", argv[0]);
+}
+
+/**
+ * @brief now_us wall clock in microseconds
+ *
+ * @return the time
+ */
+static uint64_t now_us(void) {
+    struct timeval tv;
+    evutil_gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * @brief rng_next xorshift64* generator, reproducible for a seed
+ *
+ * @return the next number
+ */
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+/**
+ * @brief chance draw an event of the given probability
+ *
+ * @param rate the probability
+ *
+ * @return 1 when the event happens and 0 when not
+ */
+static int chance(double rate) {
+    if (rate <= 0)
+        return 0;
+    return (double)(rng_next() >> 11) / 9007199254740992.0 < rate;
+}
+
+/**
+ * @brief ieq case insensitive compare of a command name
+ *
+ * @param a the received word
+ * @param b the lower case command
+ *
+ * @return 1 for equal and 0 for not
+ */
+static int ieq(const char *a, const char *b) {
+    while (*a && *b) {
+        char ch = *a;
+        if (ch >= 'A' && ch <= 'Z')
+            ch += 'a' - 'A';
+        if (ch != *b)
+            return 0;
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+/**
+ * @brief hash_key FNV-1a of a key
+ *
+ * @param key the key
+ * @param nkey the length of key
+ *
+ * @return the hash
+ */
+static uint32_t hash_key(const char *key, size_t nkey) {
+    uint32_t h = 2166136261U;
+    size_t i;
+    for (i = 0; i < nkey; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/**
+ * @brief store_init init an empty store
+ *
+ * @param s the store
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int store_init(store_t *s) {
+    s->nbuckets = 1024;
+    s->count = 0;
+    s->bytes = 0;
+    s->buckets = (item_t **)calloc(s->nbuckets, sizeof(item_t *));
+    return s->buckets == NULL ? -1 : 1;
+}
+
+/**
+ * @brief item_free free an item
+ *
+ * @param it the item
+ */
+static void item_free(item_t *it) {
+    free(it->key);
+    free(it->val);
+    free(it);
+}
+
+/**
+ * @brief item_expired check the expire time of an item
+ *
+ * @param it the item
+ *
+ * @return 1 for expired and 0 for not
+ */
+static int item_expired(const item_t *it) {
+    return it->exptime != 0 && it->exptime <= time(NULL);
+}
+
+/**
+ * @brief store_find find a live item, reaping it if expired
+ *
+ * @param s the store
+ * @param key the key
+ * @param nkey the length of key
+ *
+ * @return the item or NULL
+ */
+static item_t * store_find(store_t *s, const char *key, size_t nkey) {
+    item_t **pp = &s->buckets[hash_key(key, nkey) & (s->nbuckets - 1)];
+    item_t *it;
+    while ((it = *pp) != NULL) {
+        if (it->nkey == nkey && memcmp(it->key, key, nkey) == 0) {
+            if (item_expired(it)) {
+                *pp = it->next;
+                s->count--;
+                s->bytes -= it->nval;
+                item_free(it);
+                return NULL;
+            }
+            return it;
+        }
+        pp = &it->next;
+    }
+    return NULL;
+}
+
+/**
+ * @brief store_set insert or replace an item, growing the table as needed
+ *
+ * @param s the store
+ * @param key the key
+ * @param nkey the length of key
+ * @param val the value
+ * @param nval the length of value
+ * @param flags the client flags
+ * @param exptime the absolute expire time, 0 for never
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int store_set(store_t *s, const char *key, size_t nkey, const char *val, size_t nval, uint32_t flags, time_t exptime) {
+    item_t *it;
+    char *copy;
+    size_t i;
+
+    if ((copy = (char *)malloc(nval > 0 ? nval : 1)) == NULL)
+        return -1;
+    memcpy(copy, val, nval);
+    if ((it = store_find(s, key, nkey)) != NULL) {
+        s->bytes -= it->nval;
+        free(it->val);
+        it->val = copy;
+        it->nval = nval;
+        it->flags = flags;
+        it->exptime = exptime;
+        s->bytes += nval;
+        return 1;
+    }
+
+    if (s->count >= s->nbuckets) {
+        size_t n = s->nbuckets * 2;
+        item_t **b = (item_t **)calloc(n, sizeof(item_t *));
+        if (b != NULL) {
+            for (i = 0; i < s->nbuckets; i++) {
+                while ((it = s->buckets[i]) != NULL) {
+                    s->buckets[i] = it->next;
+                    it->next = b[hash_key(it->key, it->nkey) & (n - 1)];
+                    b[hash_key(it->key, it->nkey) & (n - 1)] = it;
+                }
+            }
+            free(s->buckets);
+            s->buckets = b;
+            s->nbuckets = n;
+        }
+    }
+
+    if ((it = (item_t *)calloc(1, sizeof(item_t))) == NULL || (it->key = (char *)malloc(nkey + 1)) == NULL) {
+        free(it);
+        free(copy);
+        return -1;
+    }
+    memcpy(it->key, key, nkey);
+    it->key[nkey] = '\0';
+    it->nkey = nkey;
+    it->val = copy;
+    it->nval = nval;
+    it->flags = flags;
+    it->exptime = exptime;
+    i = hash_key(key, nkey) & (s->nbuckets - 1);
+    it->next = s->buckets[i];
+    s->buckets[i] = it;
+    s->count++;
+    s->bytes += nval;
+    return 1;
+}
+
+/**
+ * @brief store_del delete an item
+ *
+ * @param s the store
+ * @param key the key
+ * @param nkey the length of key
+ *
+ * @return 1 for deleted and -1 for not found
+ */
+static int store_del(store_t *s, const char *key, size_t nkey) {
+    item_t **pp = &s->buckets[hash_key(key, nkey) & (s->nbuckets - 1)];
+    item_t *it;
+    while ((it = *pp) != NULL) {
+        if (it->nkey == nkey && memcmp(it->key, key, nkey) == 0) {
+            int live = !item_expired(it);
+            *pp = it->next;
+            s->count--;
+            s->bytes -= it->nval;
+            item_free(it);
+            return live ? 1 : -1;
+        }
+        pp = &it->next;
+    }
+    return -1;
+}
+
+/**
+ * @brief store_flush drop every item of a store
+ *
+ * @param s the store
+ */
+static void store_flush(store_t *s) {
+    size_t i;
+    item_t *it;
+    for (i = 0; i < s->nbuckets; i++) {
+        while ((it = s->buckets[i]) != NULL) {
+            s->buckets[i] = it->next;
+            item_free(it);
+        }
+    }
+    s->count = 0;
+    s->bytes = 0;
+}
+
+/**
+ * @brief key_order byte order of two keys, as ssdb sorts them
+ *
+ * @param a the first key
+ * @param na the length of a
+ * @param b the second key
+ * @param nb the length of b
+ *
+ * @return <0, 0 or >0 like memcmp
+ */
+static int key_order(const char *a, size_t na, const char *b, size_t nb) {
+    int r = memcmp(a, b, na < nb ? na : nb);
+    if (r != 0)
+        return r;
+    return na < nb ? -1 : (na > nb);
+}
+
+/**
+ * @brief key_cmp qsort compare of item keys
+ */
+static int key_cmp(const void *a, const void *b) {
+    const item_t *x = *(const item_t * const *)a;
+    const item_t *y = *(const item_t * const *)b;
+    return key_order(x->key, x->nkey, y->key, y->nkey);
+}
+
+/**
+ * @brief keys_collect answer KEYS, both the ssdb range form
+ * "KEYS start end limit" and the redis form "KEYS prefix*"
+ *
+ * @param s the store
+ * @param out the reply buffer
+ * @param argv the args, argv[0] is the command
+ * @param argl the length of args
+ * @param argc count of args
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int keys_collect(store_t *s, struct evbuffer *out, char **argv, size_t *argl, int argc) {
+    item_t **list;
+    item_t *it;
+    size_t i, n = 0, end, limit = (size_t)-1;
+    int range = (argc == 4);
+    size_t plen = 0;
+
+    if (argc != 2 && argc != 4) {
+        evbuffer_add_printf(out, "-ERR wrong number of arguments for 'keys'\r\n");
+        return 1;
+    }
+    if (range) {
+        limit = (size_t)strtol(argv[3], NULL, 10);
+    } else {
+        plen = argl[1];
+        if (plen > 0 && argv[1][plen - 1] == '*')
+            plen--;
+    }
+
+    if ((list = (item_t **)malloc((s->count + 1) * sizeof(item_t *))) == NULL)
+        return -1;
+    for (i = 0; i < s->nbuckets; i++) {
+        for (it = s->buckets[i]; it != NULL; it = it->next) {
+            if (item_expired(it))
+                continue;
+            if (range) {
+                if (argl[1] > 0 && key_order(it->key, it->nkey, argv[1], argl[1]) <= 0)
+                    continue;
+                if (argl[2] > 0 && key_order(it->key, it->nkey, argv[2], argl[2]) > 0)
+                    continue;
+            } else if (it->nkey < plen || memcmp(it->key, argv[1], plen) != 0) {
+                continue;
+            }
+            list[n++] = it;
+        }
+    }
+    qsort(list, n, sizeof(item_t *), key_cmp);
+    end = n < limit ? n : limit;
+    evbuffer_add_printf(out, "*%zu\r\n", end);
+    for (i = 0; i < end; i++) {
+        evbuffer_add_printf(out, "$%zu\r\n", list[i]->nkey);
+        evbuffer_add(out, list[i]->key, list[i]->nkey);
+        evbuffer_add(out, "\r\n", 2);
+    }
+    free(list);
+    return 1;
+}
+
+/**
+ * @brief mc_exptime convert a memcached exptime, relative up to 30 days
+ * and absolute beyond, the way libmemcached's exist check relies on
+ *
+ * @param exptime the exptime of the request
+ *
+ * @return the absolute expire time, 0 for never and -1 for already expired
+ */
+static time_t mc_exptime(long exptime) {
+    if (exptime == 0)
+        return 0;
+    if (exptime < 0)
+        return -1;
+    if (exptime <= STUB_REL_TIME_MAX)
+        return time(NULL) + exptime;
+    return exptime <= time(NULL) ? -1 : (time_t)exptime;
+}
+
+/**
+ * @brief conn_free close a connection and drop its queued replies
+ *
+ * @param c the connection
+ */
+static void conn_free(conn_t *c) {
+    pending_t *p;
+    while ((p = c->head) != NULL) {
+        c->head = p->next;
+        evbuffer_free(p->buf);
+        free(p);
+    }
+    if (c->timer != NULL)
+        event_free(c->timer);
+    bufferevent_free(c->bev);
+    free(c);
+}
+
+/**
+ * @brief conn_deliver hand the replies of one read to the socket, after
+ * the injected latency; replies never overtake earlier ones
+ *
+ * @param c the connection
+ * @param out the replies, owned by this function
+ * @param close close the connection once delivered
+ */
+static void conn_deliver(conn_t *c, struct evbuffer *out, int close) {
+    double ms = opts.latency;
+    uint64_t at;
+    pending_t *p;
+
+    if (opts.jitter > 0)
+        ms += opts.jitter * (2.0 * (double)(rng_next() >> 11) / 9007199254740992.0 - 1.0);
+    if (ms <= 0 && c->head == NULL) {
+        bufferevent_write_buffer(c->bev, out);
+        evbuffer_free(out);
+        if (close)
+            c->closing = 1;
+        return;
+    }
+
+    at = now_us() + (ms > 0 ? (uint64_t)(ms * 1000) : 0);
+    if (c->tail != NULL && at < c->tail->at)
+        at = c->tail->at;
+    if ((p = (pending_t *)calloc(1, sizeof(pending_t))) == NULL) {
+        evbuffer_free(out);
+        c->closing = 1;
+        return;
+    }
+    p->buf = out;
+    p->at = at;
+    p->close = close;
+    if (c->tail != NULL)
+        c->tail->next = p;
+    else
+        c->head = p;
+    c->tail = p;
+    if (c->head == p) {
+        struct timeval tv;
+        uint64_t now = now_us();
+        at = at > now ? at - now : 0;
+        tv.tv_sec = at / 1000000;
+        tv.tv_usec = at % 1000000;
+        evtimer_add(c->timer, &tv);
+    }
+}
+
+/**
+ * @brief conn_timer_cb release the replies whose time has come
+ *
+ * @param fd unused
+ * @param what unused
+ * @param arg the connection
+ */
+static void conn_timer_cb(evutil_socket_t fd, short what, void *arg) {
+    conn_t *c = (conn_t *)arg;
+    uint64_t now = now_us();
+    pending_t *p;
+    struct timeval tv;
+
+    while ((p = c->head) != NULL && p->at <= now) {
+        c->head = p->next;
+        if (c->head == NULL)
+            c->tail = NULL;
+        bufferevent_write_buffer(c->bev, p->buf);
+        if (p->close)
+            c->closing = 1;
+        evbuffer_free(p->buf);
+        free(p);
+    }
+    if (c->closing && evbuffer_get_length(bufferevent_get_output(c->bev)) == 0) {
+        conn_free(c);
+        return;
+    }
+    if (c->head != NULL) {
+        tv.tv_sec = (c->head->at - now) / 1000000;
+        tv.tv_usec = (c->head->at - now) % 1000000;
+        evtimer_add(c->timer, &tv);
+    }
+}
+
+/**
+ * @brief mc_text handle one memcached text command
+ *
+ * @param c the connection
+ * @param in the input buffer
+ * @param out the reply buffer
+ * @param close set when the connection should be closed
+ *
+ * @return 1 for handled, 0 for incomplete and -1 for protocol error
+ */
+static int mc_text(conn_t *c, struct evbuffer *in, struct evbuffer *out, int *close) {
+    store_t *s = &c->l->store;
+    char line[STUB_MAX_LINE];
+    char *argv[STUB_MAX_ARGS];
+    char *save = NULL, *tok;
+    size_t eol_len = 0, llen;
+    struct evbuffer_ptr eol;
+    int argc = 0, i, fail;
+
+    eol = evbuffer_search_eol(in, NULL, &eol_len, EVBUFFER_EOL_CRLF);
+    if (eol.pos < 0)
+        return evbuffer_get_length(in) > STUB_MAX_LINE ? -1 : 0;
+    if ((size_t)eol.pos >= sizeof(line))
+        return -1;
+    llen = eol.pos;
+    evbuffer_copyout(in, line, llen);
+    line[llen] = '\0';
+    for (tok = strtok_r(line, " ", &save); tok != NULL && argc < STUB_MAX_ARGS; tok = strtok_r(NULL, " ", &save))
+        argv[argc++] = tok;
+    if (argc == 0) {
+        evbuffer_drain(in, llen + eol_len);
+        evbuffer_add_printf(out, "ERROR\r\n");
+        return 1;
+    }
+
+    if (ieq(argv[0], "set") || ieq(argv[0], "add") || ieq(argv[0], "replace")) {
+        long bytes;
+        char *val;
+        item_t *it;
+        time_t exptime;
+        int noreply = (argc == 6 && ieq(argv[5], "noreply"));
+
+        if (argc < 5 || (bytes = strtol(argv[4], NULL, 10)) < 0 || bytes > STUB_MAX_VALUE) {
+            evbuffer_drain(in, llen + eol_len);
+            evbuffer_add_printf(out, "CLIENT_ERROR bad command line format\r\n");
+            return 1;
+        }
+        if (evbuffer_get_length(in) < llen + eol_len + bytes + 2)
+            return 0;
+        stats.requests++;
+        evbuffer_drain(in, llen + eol_len);
+        val = (char *)evbuffer_pullup(in, bytes + 2);
+        fail = chance(opts.fail_rate);
+        exptime = mc_exptime(strtol(argv[3], NULL, 10));
+        it = store_find(s, argv[1], strlen(argv[1]));
+        if (fail) {
+            stats.failed++;
+            evbuffer_add_printf(out, "SERVER_ERROR injected failure\r\n");
+        } else if ((ieq(argv[0], "add") && it != NULL) || (ieq(argv[0], "replace") && it == NULL)) {
+            if (!noreply)
+                evbuffer_add_printf(out, "NOT_STORED\r\n");
+        } else {
+            if (exptime == -1)
+                store_del(s, argv[1], strlen(argv[1]));
+            else if (store_set(s, argv[1], strlen(argv[1]), val, bytes, (uint32_t)strtoul(argv[2], NULL, 10), exptime) == -1)
+                fail = 1;
+            if (fail)
+                evbuffer_add_printf(out, "SERVER_ERROR out of memory storing object\r\n");
+            else if (!noreply)
+                evbuffer_add_printf(out, "STORED\r\n");
+        }
+        evbuffer_drain(in, bytes + 2);
+        return 1;
+    }
+
+    evbuffer_drain(in, llen + eol_len);
+    stats.requests++;
+    if (ieq(argv[0], "quit")) {
+        *close = 1;
+        return 1;
+    }
+    if ((fail = chance(opts.fail_rate)) == 1 && !ieq(argv[0], "version")) {
+        stats.failed++;
+        evbuffer_add_printf(out, "SERVER_ERROR injected failure\r\n");
+        return 1;
+    }
+
+    if ((ieq(argv[0], "get") || ieq(argv[0], "gets")) && argc > 1) {
+        for (i = 1; i < argc; i++) {
+            item_t *it = store_find(s, argv[i], strlen(argv[i]));
+            if (it == NULL) {
+                stats.misses++;
+                continue;
+            }
+            stats.hits++;
+            if (ieq(argv[0], "gets"))
+                evbuffer_add_printf(out, "VALUE %s %u %zu 1\r\n", argv[i], it->flags, it->nval);
+            else
+                evbuffer_add_printf(out, "VALUE %s %u %zu\r\n", argv[i], it->flags, it->nval);
+            evbuffer_add(out, it->val, it->nval);
+            evbuffer_add(out, "\r\n", 2);
+        }
+        evbuffer_add_printf(out, "END\r\n");
+    } else if (ieq(argv[0], "delete") && argc > 1) {
+        int found = store_del(s, argv[1], strlen(argv[1]));
+        if (!(argc > 2 && ieq(argv[argc - 1], "noreply")))
+            evbuffer_add_printf(out, found == 1 ? "DELETED\r\n" : "NOT_FOUND\r\n");
+    } else if (ieq(argv[0], "version")) {
+        evbuffer_add_printf(out, "VERSION 1.4.0-zimg-stub\r\n");
+    } else if (ieq(argv[0], "flush_all")) {
+        store_flush(s);
+        if (!(argc > 1 && ieq(argv[argc - 1], "noreply")))
+            evbuffer_add_printf(out, "OK\r\n");
+    } else if (ieq(argv[0], "stats")) {
+        evbuffer_add_printf(out, "STAT curr_items %zu\r\nSTAT bytes %zu\r\n", s->count, s->bytes);
+        evbuffer_add_printf(out, "STAT get_hits %llu\r\nSTAT get_misses %llu\r\n",
+                            (unsigned long long)stats.hits, (unsigned long long)stats.misses);
+        evbuffer_add_printf(out, "STAT injected_failures %llu\r\nEND\r\n", (unsigned long long)stats.failed);
+    } else {
+        evbuffer_add_printf(out, "ERROR\r\n");
+    }
+    return 1;
+}
+
+/**
+ * @brief bin_reply append a memcached binary response
+ *
+ * @param out the reply buffer
+ * @param req the request header
+ * @param status the status
+ * @param key the key to echo, or NULL
+ * @param nkey the length of key
+ * @param it the item to return, or NULL
+ * @param msg the body, NULL for the default message of status
+ */
+static void bin_reply(struct evbuffer *out, const unsigned char *req, uint16_t status, const char *key, size_t nkey, const item_t *it, const char *msg) {
+    unsigned char h[BIN_HEADER_LEN];
+    uint32_t extlen = 0, body, flags;
+
+    if (msg == NULL && status != BIN_OK) {
+        if (status == BIN_NOT_FOUND)
+            msg = "Not found";
+        else if (status == BIN_EXISTS)
+            msg = "Data exists for key.";
+        else if (status == BIN_NOT_STORED)
+            msg = "Not stored.";
+        else if (status == BIN_UNKNOWN)
+            msg = "Unknown command";
+        else if (status == BIN_TMP_FAIL)
+            msg = "Injected failure";
+        else
+            msg = "Invalid arguments";
+    }
+    if (it != NULL)
+        extlen = 4;
+    body = extlen + (uint32_t)nkey + (it != NULL ? (uint32_t)it->nval : 0) + (msg != NULL ? (uint32_t)strlen(msg) : 0);
+
+    memset(h, 0, sizeof(h));
+    h[0] = BIN_RES_MAGIC;
+    h[1] = req[1];
+    h[2] = (unsigned char)(nkey >> 8);
+    h[3] = (unsigned char)nkey;
+    h[4] = (unsigned char)extlen;
+    h[6] = (unsigned char)(status >> 8);
+    h[7] = (unsigned char)status;
+    h[8] = (unsigned char)(body >> 24);
+    h[9] = (unsigned char)(body >> 16);
+    h[10] = (unsigned char)(body >> 8);
+    h[11] = (unsigned char)body;
+    memcpy(h + 12, req + 12, 4);
+    if (status == BIN_OK && req[1] != BIN_CMD_DELETE && req[1] != BIN_CMD_DELETEQ)
+        h[23] = 1;
+    evbuffer_add(out, h, sizeof(h));
+    if (it != NULL) {
+        flags = htonl(it->flags);
+        evbuffer_add(out, &flags, 4);
+    }
+    if (nkey > 0)
+        evbuffer_add(out, key, nkey);
+    if (it != NULL)
+        evbuffer_add(out, it->val, it->nval);
+    if (msg != NULL)
+        evbuffer_add(out, msg, strlen(msg));
+}
+
+/**
+ * @brief mc_binary handle one memcached binary command
+ *
+ * @param c the connection
+ * @param in the input buffer
+ * @param out the reply buffer
+ * @param close set when the connection should be closed
+ *
+ * @return 1 for handled, 0 for incomplete and -1 for protocol error
+ */
+static int mc_binary(conn_t *c, struct evbuffer *in, struct evbuffer *out, int *close) {
+    store_t *s = &c->l->store;
+    unsigned char h[BIN_HEADER_LEN];
+    unsigned char *req;
+    const char *key, *val;
+    size_t nkey, extlen, body, nval;
+    unsigned char op;
+    int quiet;
+    item_t *it;
+
+    if (evbuffer_get_length(in) < BIN_HEADER_LEN)
+        return 0;
+    evbuffer_copyout(in, h, BIN_HEADER_LEN);
+    nkey = ((size_t)h[2] << 8) | h[3];
+    extlen = h[4];
+    body = ((size_t)h[8] << 24) | ((size_t)h[9] << 16) | ((size_t)h[10] << 8) | h[11];
+    if (body > STUB_MAX_VALUE + 1024 || nkey + extlen > body)
+        return -1;
+    if (evbuffer_get_length(in) < BIN_HEADER_LEN + body)
+        return 0;
+
+    req = evbuffer_pullup(in, BIN_HEADER_LEN + body);
+    op = req[1];
+    key = (const char *)req + BIN_HEADER_LEN + extlen;
+    val = key + nkey;
+    nval = body - extlen - nkey;
+    quiet = (op == BIN_CMD_GETQ || op == BIN_CMD_GETKQ || op == BIN_CMD_SETQ || op == BIN_CMD_ADDQ ||
+             op == BIN_CMD_REPLACEQ || op == BIN_CMD_DELETEQ || op == BIN_CMD_QUITQ || op == BIN_CMD_FLUSHQ);
+    stats.requests++;
+
+    if (op != BIN_CMD_NOOP && op != BIN_CMD_VERSION && op != BIN_CMD_QUIT && op != BIN_CMD_QUITQ &&
+            chance(opts.fail_rate)) {
+        stats.failed++;
+        bin_reply(out, req, BIN_TMP_FAIL, NULL, 0, NULL, NULL);
+        evbuffer_drain(in, BIN_HEADER_LEN + body);
+        return 1;
+    }
+
+    switch (op) {
+    case BIN_CMD_GET:
+    case BIN_CMD_GETQ:
+    case BIN_CMD_GETK:
+    case BIN_CMD_GETKQ: {
+        int with_key = (op == BIN_CMD_GETK || op == BIN_CMD_GETKQ);
+        it = store_find(s, key, nkey);
+        if (it != NULL) {
+            stats.hits++;
+            bin_reply(out, req, BIN_OK, with_key ? key : NULL, with_key ? nkey : 0, it, NULL);
+        } else {
+            stats.misses++;
+            if (!quiet)
+                bin_reply(out, req, BIN_NOT_FOUND, with_key ? key : NULL, with_key ? nkey : 0, NULL, NULL);
+        }
+        break;
+    }
+    case BIN_CMD_SET:
+    case BIN_CMD_SETQ:
+    case BIN_CMD_ADD:
+    case BIN_CMD_ADDQ:
+    case BIN_CMD_REPLACE:
+    case BIN_CMD_REPLACEQ: {
+        uint32_t flags, exp;
+        time_t exptime;
+        uint16_t status = BIN_OK;
+        if (extlen != 8) {
+            bin_reply(out, req, BIN_INVALID, NULL, 0, NULL, NULL);
+            break;
+        }
+        memcpy(&flags, req + BIN_HEADER_LEN, 4);
+        memcpy(&exp, req + BIN_HEADER_LEN + 4, 4);
+        exptime = mc_exptime((long)ntohl(exp));
+        it = store_find(s, key, nkey);
+        if ((op == BIN_CMD_ADD || op == BIN_CMD_ADDQ) && it != NULL)
+            status = BIN_EXISTS;
+        else if ((op == BIN_CMD_REPLACE || op == BIN_CMD_REPLACEQ) && it == NULL)
+            status = BIN_NOT_FOUND;
+        else if (exptime == -1)
+            store_del(s, key, nkey);
+        else if (store_set(s, key, nkey, val, nval, ntohl(flags), exptime) == -1)
+            status = BIN_TOO_LARGE;
+        if (status != BIN_OK || !quiet)
+            bin_reply(out, req, status, NULL, 0, NULL, NULL);
+        break;
+    }
+    case BIN_CMD_DELETE:
+    case BIN_CMD_DELETEQ:
+        if (store_del(s, key, nkey) == 1) {
+            if (!quiet)
+                bin_reply(out, req, BIN_OK, NULL, 0, NULL, NULL);
+        } else {
+            bin_reply(out, req, BIN_NOT_FOUND, NULL, 0, NULL, NULL);
+        }
+        break;
+    case BIN_CMD_FLUSH:
+    case BIN_CMD_FLUSHQ:
+        store_flush(s);
+        if (!quiet)
+            bin_reply(out, req, BIN_OK, NULL, 0, NULL, NULL);
+        break;
+    case BIN_CMD_NOOP:
+        bin_reply(out, req, BIN_OK, NULL, 0, NULL, NULL);
+        break;
+    case BIN_CMD_VERSION:
+        bin_reply(out, req, BIN_OK, NULL, 0, NULL, "1.4.0");
+        break;
+    case BIN_CMD_QUIT:
+    case BIN_CMD_QUITQ:
+        if (!quiet)
+            bin_reply(out, req, BIN_OK, NULL, 0, NULL, NULL);
+        *close = 1;
+        break;
+    default:
+        bin_reply(out, req, BIN_UNKNOWN, NULL, 0, NULL, NULL);
+        break;
+    }
+    evbuffer_drain(in, BIN_HEADER_LEN + body);
+    return 1;
+}
+
+/**
+ * @brief redis_parse parse one multibulk or inline redis request
+ *
+ * The args point into a contiguous copy of the request made with
+ * evbuffer_pullup, so they stay valid until the request is drained.
+ *
+ * @param in the input buffer
+ * @param argv the args
+ * @param argl the length of args
+ * @param argc count of args
+ * @param raw set to the start of the request
+ *
+ * @return the length of the request, 0 for incomplete and -1 for protocol error
+ */
+static int redis_parse(struct evbuffer *in, char **argv, size_t *argl, int *argc, char **raw) {
+    struct evbuffer_ptr eol;
+    size_t eol_len = 0, total, len = evbuffer_get_length(in);
+    char line[64];
+    long n, i, alen;
+    char *p, *end;
+
+    eol = evbuffer_search_eol(in, NULL, &eol_len, EVBUFFER_EOL_CRLF);
+    if (eol.pos < 0)
+        return len > STUB_MAX_LINE ? -1 : 0;
+
+    if (evbuffer_pullup(in, 1)[0] != '*') {
+        char *save = NULL, *tok;
+        if ((size_t)eol.pos >= STUB_MAX_LINE)
+            return -1;
+        p = (char *)evbuffer_pullup(in, eol.pos + eol_len);
+        p[eol.pos] = '\0';
+        *raw = p;
+        *argc = 0;
+        for (tok = strtok_r(p, " ", &save); tok != NULL && *argc < STUB_MAX_ARGS; tok = strtok_r(NULL, " ", &save)) {
+            argl[*argc] = strlen(tok);
+            argv[(*argc)++] = tok;
+        }
+        return (int)(eol.pos + eol_len);
+    }
+
+    /* walk the headers first so nothing is pulled up before it is complete */
+    if ((size_t)eol.pos >= sizeof(line))
+        return -1;
+    evbuffer_copyout(in, line, eol.pos);
+    line[eol.pos] = '\0';
+    n = strtol(line + 1, NULL, 10);
+    if (n < 1 || n > STUB_MAX_ARGS)
+        return -1;
+    total = eol.pos + eol_len;
+    for (i = 0; i < n; i++) {
+        struct evbuffer_ptr pos;
+        char hdr[32];
+        if (evbuffer_ptr_set(in, &pos, total, EVBUFFER_PTR_SET) != 0)
+            return 0;
+        eol = evbuffer_search_eol(in, &pos, &eol_len, EVBUFFER_EOL_CRLF);
+        if (eol.pos < 0)
+            return 0;
+        if ((size_t)(eol.pos - total) >= sizeof(hdr))
+            return -1;
+        evbuffer_copyout_from(in, &pos, hdr, eol.pos - total);
+        hdr[eol.pos - total] = '\0';
+        if (hdr[0] != '$' || (alen = strtol(hdr + 1, NULL, 10)) < 0 || alen > STUB_MAX_VALUE)
+            return -1;
+        total = eol.pos + eol_len + alen + 2;
+        if (total > len)
+            return 0;
+    }
+    if (total > (size_t)STUB_MAX_VALUE * 2)
+        return -1;
+
+    p = (char *)evbuffer_pullup(in, total);
+    *raw = p;
+    end = p + total;
+    p = (char *)memchr(p, '\n', end - p) + 1;
+    for (i = 0; i < n; i++) {
+        alen = strtol(p + 1, NULL, 10);
+        p = (char *)memchr(p, '\n', end - p) + 1;
+        argv[i] = p;
+        argl[i] = alen;
+        p[alen] = '\0';
+        p += alen + 2;
+    }
+    *argc = (int)n;
+    return (int)total;
+}
+
+/**
+ * @brief redis_cmd handle one redis command
+ *
+ * @param c the connection
+ * @param in the input buffer
+ * @param out the reply buffer
+ * @param close set when the connection should be closed
+ *
+ * @return 1 for handled, 0 for incomplete and -1 for protocol error
+ */
+static int redis_cmd(conn_t *c, struct evbuffer *in, struct evbuffer *out, int *close) {
+    store_t *s = &c->l->store;
+    char *argv[STUB_MAX_ARGS];
+    size_t argl[STUB_MAX_ARGS];
+    char *raw = NULL;
+    int argc = 0, i, n, len;
+    item_t *it;
+
+    if ((len = redis_parse(in, argv, argl, &argc, &raw)) <= 0)
+        return len;
+    if (argc == 0) {
+        evbuffer_drain(in, len);
+        return 1;
+    }
+    stats.requests++;
+
+    if (ieq(argv[0], "quit")) {
+        evbuffer_add_printf(out, "+OK\r\n");
+        *close = 1;
+    } else if (ieq(argv[0], "ping")) {
+        evbuffer_add_printf(out, "+PONG\r\n");
+    } else if (chance(opts.fail_rate)) {
+        stats.failed++;
+        evbuffer_add_printf(out, "-ERR injected failure\r\n");
+    } else if (ieq(argv[0], "get") && argc == 2) {
+        if ((it = store_find(s, argv[1], argl[1])) == NULL) {
+            stats.misses++;
+            evbuffer_add_printf(out, "$-1\r\n");
+        } else {
+            stats.hits++;
+            evbuffer_add_printf(out, "$%zu\r\n", it->nval);
+            evbuffer_add(out, it->val, it->nval);
+            evbuffer_add(out, "\r\n", 2);
+        }
+    } else if (ieq(argv[0], "set") && (argc == 3 || (argc == 5 && ieq(argv[3], "ex")))) {
+        time_t exptime = argc == 5 ? time(NULL) + strtol(argv[4], NULL, 10) : 0;
+        if (store_set(s, argv[1], argl[1], argv[2], argl[2], 0, exptime) == -1)
+            evbuffer_add_printf(out, "-ERR out of memory\r\n");
+        else
+            evbuffer_add_printf(out, "+OK\r\n");
+    } else if (ieq(argv[0], "setex") && argc == 4) {
+        long ttl = strtol(argv[2], NULL, 10);
+        if (ttl <= 0)
+            evbuffer_add_printf(out, "-ERR invalid expire time in setex\r\n");
+        else if (store_set(s, argv[1], argl[1], argv[3], argl[3], 0, time(NULL) + ttl) == -1)
+            evbuffer_add_printf(out, "-ERR out of memory\r\n");
+        else
+            evbuffer_add_printf(out, "+OK\r\n");
+    } else if ((ieq(argv[0], "exists") || ieq(argv[0], "del")) && argc >= 2) {
+        int del = ieq(argv[0], "del");
+        for (i = 1, n = 0; i < argc; i++) {
+            if (del)
+                n += store_del(s, argv[i], argl[i]) == 1;
+            else
+                n += store_find(s, argv[i], argl[i]) != NULL;
+        }
+        evbuffer_add_printf(out, ":%d\r\n", n);
+    } else if (ieq(argv[0], "keys")) {
+        if (keys_collect(s, out, argv, argl, argc) == -1)
+            evbuffer_add_printf(out, "-ERR out of memory\r\n");
+    } else if (ieq(argv[0], "dbsize")) {
+        evbuffer_add_printf(out, ":%zu\r\n", s->count);
+    } else if (ieq(argv[0], "flushdb") || ieq(argv[0], "flushall")) {
+        store_flush(s);
+        evbuffer_add_printf(out, "+OK\r\n");
+    } else if (ieq(argv[0], "select") || ieq(argv[0], "auth")) {
+        evbuffer_add_printf(out, "+OK\r\n");
+    } else if (ieq(argv[0], "info")) {
+        char info[512];
+        int ilen = snprintf(info, sizeof(info),
+                            "# zimg-stub\r\nkeys:%zu\r\nbytes:%zu\r\nhits:%llu\r\nmisses:%llu\r\ninjected_failures:%llu\r\n",
+                            s->count, s->bytes, (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                            (unsigned long long)stats.failed);
+        evbuffer_add_printf(out, "$%d\r\n%s\r\n", ilen, info);
+    } else {
+        evbuffer_add_printf(out, "-ERR unknown command '%s'\r\n", argv[0]);
+    }
+    evbuffer_drain(in, len);
+    return 1;
+}
+
+/**
+ * @brief read_cb handle every complete request of a read, then decide
+ * the fate of the batch: delayed reply, or a dropped connection
+ *
+ * @param bev the bufferevent
+ * @param arg the connection
+ */
+static void read_cb(struct bufferevent *bev, void *arg) {
+    conn_t *c = (conn_t *)arg;
+    struct evbuffer *in = bufferevent_get_input(bev);
+    struct evbuffer *out;
+    int ret = 1, close = 0;
+
+    if (c->closing)
+        return;
+    if ((out = evbuffer_new()) == NULL)
+        return;
+    while (!close && evbuffer_get_length(in) > 0) {
+        if (c->l->proto == PROTO_REDIS)
+            ret = redis_cmd(c, in, out, &close);
+        else if (evbuffer_pullup(in, 1)[0] == BIN_REQ_MAGIC)
+            ret = mc_binary(c, in, out, &close);
+        else
+            ret = mc_text(c, in, out, &close);
+        if (ret != 1)
+            break;
+    }
+    if (ret == -1) {
+        evbuffer_add_printf(out, c->l->proto == PROTO_REDIS ? "-ERR protocol error\r\n" : "CLIENT_ERROR bad data chunk\r\n");
+        close = 1;
+    }
+
+    if (chance(opts.close_rate)) {
+        stats.dropped++;
+        evbuffer_free(out);
+        conn_free(c);
+        return;
+    }
+    conn_deliver(c, out, close);
+    if (c->closing && c->head == NULL && evbuffer_get_length(bufferevent_get_output(bev)) == 0)
+        conn_free(c);
+}
+
+/**
+ * @brief event_cb handle eof, errors and the end of a lingering close
+ *
+ * @param bev the bufferevent
+ * @param what the events
+ * @param arg the connection
+ */
+static void event_cb(struct bufferevent *bev, short what, void *arg) {
+    conn_t *c = (conn_t *)arg;
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        if (opts.verbose)
+            fprintf(stderr, "connection closed on port %d\n", c->l->port);
+        conn_free(c);
+    }
+}
+
+/**
+ * @brief write_cb finish a close once the last reply is flushed
+ *
+ * @param bev the bufferevent
+ * @param arg the connection
+ */
+static void write_cb(struct bufferevent *bev, void *arg) {
+    conn_t *c = (conn_t *)arg;
+    if (c->closing && c->head == NULL)
+        conn_free(c);
+}
+
+/**
+ * @brief accept_cb set up a new connection
+ *
+ * @param lev the listener
+ * @param fd the socket
+ * @param sa the peer address
+ * @param socklen the length of sa
+ * @param arg the listener_t
+ */
+static void accept_cb(struct evconnlistener *lev, evutil_socket_t fd, struct sockaddr *sa, int socklen, void *arg) {
+    listener_t *l = (listener_t *)arg;
+    conn_t *c = (conn_t *)calloc(1, sizeof(conn_t));
+    if (c == NULL) {
+        evutil_closesocket(fd);
+        return;
+    }
+    c->l = l;
+    c->bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+    c->timer = evtimer_new(base, conn_timer_cb, c);
+    if (c->bev == NULL || c->timer == NULL) {
+        if (c->bev != NULL)
+            bufferevent_free(c->bev);
+        else
+            evutil_closesocket(fd);
+        if (c->timer != NULL)
+            event_free(c->timer);
+        free(c);
+        return;
+    }
+    stats.conns++;
+    if (opts.verbose)
+        fprintf(stderr, "connection accepted on port %d\n", l->port);
+    bufferevent_setcb(c->bev, read_cb, write_cb, event_cb, c);
+    bufferevent_enable(c->bev, EV_READ | EV_WRITE);
+}
+
+/**
+ * @brief signal_cb print the counters and stop
+ *
+ * @param sig the signal
+ * @param what unused
+ * @param arg unused
+ */
+static void signal_cb(evutil_socket_t sig, short what, void *arg) {
+    fprintf(stderr, "connections: %llu requests: %llu hits: %llu misses: %llu failed: %llu dropped: %llu\n",
+            (unsigned long long)stats.conns, (unsigned long long)stats.requests,
+            (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+            (unsigned long long)stats.failed, (unsigned long long)stats.dropped);
+    event_base_loopexit(base, NULL);
+}
+
+/**
+ * @brief add_listener parse a port option into a listener
+ *
+ * @param proto the protocol
+ * @param port the port string
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int add_listener(int proto, const char *port) {
+    listener_t *l;
+    if (listener_num >= STUB_MAX_LISTENERS)
+        return -1;
+    l = &listeners[listener_num];
+    l->proto = proto;
+    l->port = atoi(port);
+    if (l->port <= 0 || l->port > 65535 || store_init(&l->store) == -1)
+        return -1;
+    listener_num++;
+    return 1;
+}
+
+/**
+ * @brief main the entrance of zimg-stub
+ *
+ * @param argc count of args
+ * @param argv arg list
+ *
+ * @return 0 for OK and 1 for fail
+ */
+int main(int argc, char **argv) {
+    struct event_config *cfg;
+    struct event *sig_int, *sig_term;
+    int opt, i;
+
+    opts.bind = "127.0.0.1";
+    opts.seed = 1;
+    while ((opt = getopt(argc, argv, "m:r:b:l:j:f:c:s:vh")) != -1) {
+        switch (opt) {
+        case 'm':
+        case 'r':
+            if (add_listener(opt == 'm' ? PROTO_MEMCACHED : PROTO_REDIS, optarg) == -1) {
+                fprintf(stderr, "bad port or too many listeners: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            opts.bind = optarg;
+            break;
+        case 'l':
+            opts.latency = atof(optarg);
+            break;
+        case 'j':
+            opts.jitter = atof(optarg);
+            break;
+        case 'f':
+            opts.fail_rate = atof(optarg);
+            break;
+        case 'c':
+            opts.close_rate = atof(optarg);
+            break;
+        case 's':
+            opts.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'v':
+            opts.verbose = 1;
+            break;
+        default:
+            usage(argv);
+            return 1;
+        }
+    }
+    if (listener_num == 0) {
+        usage(argv);
+        return 1;
+    }
+    rng_state = opts.seed != 0 ? opts.seed : 1;
+    signal(SIGPIPE, SIG_IGN);
+
+    /* the default coarse clock rounds injected latency up to a few ms */
+    if ((cfg = event_config_new()) == NULL)
+        return 1;
+    event_config_set_flag(cfg, EVENT_BASE_FLAG_PRECISE_TIMER);
+    base = event_base_new_with_config(cfg);
+    event_config_free(cfg);
+    if (base == NULL) {
+        fprintf(stderr, "event_base_new failed\n");
+        return 1;
+    }
+    for (i = 0; i < listener_num; i++) {
+        listener_t *l = &listeners[i];
+        struct sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(l->port);
+        if (inet_pton(AF_INET, opts.bind, &sin.sin_addr) != 1) {
+            fprintf(stderr, "bad bind address: %s\n", opts.bind);
+            return 1;
+        }
+        l->lev = evconnlistener_new_bind(base, accept_cb, l, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
+                                         (struct sockaddr *)&sin, sizeof(sin));
+        if (l->lev == NULL) {
+            fprintf(stderr, "listen on %s:%d failed\n", opts.bind, l->port);
+            return 1;
+        }
+        fprintf(stderr, "%s on %s:%d\n", l->proto == PROTO_REDIS ? "redis" : "memcached", opts.bind, l->port);
+    }
+    fprintf(stderr, "latency: %.3fms jitter: %.3fms fail rate: %.4f close rate: %.4f seed: %llu\n",
+            opts.latency, opts.jitter, opts.fail_rate, opts.close_rate, (unsigned long long)opts.seed);
+
+    sig_int = evsignal_new(base, SIGINT, signal_cb, NULL);
+    sig_term = evsignal_new(base, SIGTERM, signal_cb, NULL);
+    evsignal_add(sig_int, NULL);
+    evsignal_add(sig_term, NULL);
+    event_base_dispatch(base);
+
+    event_free(sig_int);
+    event_free(sig_term);
+    for (i = 0; i < listener_num; i++) {
+        evconnlistener_free(listeners[i].lev);
+        store_flush(&listeners[i].store);
+        free(listeners[i].store.buckets);
+    }
+    event_base_free(base);
+    return 0;
+}
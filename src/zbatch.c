@@ -0,0 +1,89 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zbatch.c
+ * @brief several derivatives from one decoding.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * The original is decoded once, no smaller than the largest request of
+ * the batch needs, and every derivative is made from a clone of that
+ * decoding by convert() or the lua script. Clones share the pixels until
+ * they are changed, so a batch costs one decoding plus the transforms.
+ * Looking up, loading and storing stay with the mode, in batch_img() and
+ * batch_img_mode_db().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <wand/magick_wand.h>
+#include "zbatch.h"
+#include "zdecode.h"
+#include "zscale.h"
+#include "zlscale.h"
+#include "zlog.h"
+
+int batch_convert(zimg_req_t *reqs, int n, const char *orig, size_t orig_len, char **outs, size_t *lens, int *saves);
+
+/**
+ * @brief batch_convert make the derivatives of several requests from one decoding
+ *
+ * @param reqs the zimg requests of one image
+ * @param n number of requests
+ * @param orig the original
+ * @param orig_len length of the original
+ * @param outs the derivatives, NULL for failed ones, free by caller
+ * @param lens lengths of the derivatives
+ * @param saves 1 if a derivative should be stored, 0 if the script asked not to
+ *
+ * @return number of derivatives made, -1 for fail to decode
+ */
+int batch_convert(zimg_req_t *reqs, int n, const char *orig, size_t orig_len, char **outs, size_t *lens, int *saves) {
+    MagickWand *base, *im;
+    int i, ret, done = 0;
+
+    for (i = 0; i < n; i++) {
+        outs[i] = NULL;
+        lens[i] = 0;
+        saves[i] = 0;
+    }
+    if (n <= 0)
+        return 0;
+    if ((base = NewMagickWand()) == NULL)
+        return -1;
+    if (read_img_batch(base, reqs, n, orig, orig_len) != MagickTrue) {
+        LOG_PRINT(LOG_DEBUG, "Batch Read Blob [%s] Failed!", reqs[0].md5);
+        DestroyMagickWand(base);
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        if ((im = CloneMagickWand(base)) == NULL)
+            continue;
+        if (settings.script_on == 1 && reqs[i].type != NULL)
+            ret = lua_convert(im, &reqs[i]);
+        else
+            ret = convert(im, &reqs[i]);
+        if (ret != -1) {
+            outs[i] = (char *)MagickGetImageBlob(im, &lens[i]);
+            saves[i] = ret == 0 ? 0 : 1;
+            if (outs[i] != NULL)
+                done++;
+        }
+        DestroyMagickWand(im);
+    }
+    DestroyMagickWand(base);
+    LOG_PRINT(LOG_DEBUG, "Batch of [%s] made %d of %d derivatives from one decoding.", reqs[0].md5, done, n);
+    return done;
+}
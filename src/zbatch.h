@@ -0,0 +1,30 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zbatch.h
+ * @brief several derivatives from one decoding header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZBATCH_H
+#define ZBATCH_H
+
+#include "zcommon.h"
+
+#define BATCH_MAX           16
+
+int batch_convert(zimg_req_t *reqs, int n, const char *orig, size_t orig_len, char **outs, size_t *lens, int *saves);
+
+#endif
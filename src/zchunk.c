@@ -0,0 +1,393 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zchunk.c
+ * @brief chunked storage of large values in kv backends.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * A value larger than chunk_size is split into chunks stored under
+ * key:chunk:<i>, and the key itself holds a short manifest
+ * "ZCHK <total> <count> <chunk size>". The manifest is written after all chunks, so a
+ * reader either finds the old value, nothing, or a complete set. Chunk
+ * keys keep the md5 prefix of their key, so in a ssdb cluster they land
+ * on the same nodes and are fetched over the connection that read the
+ * manifest, all requests pipelined in one write, straight into a buffer
+ * of the final size. Chunks of an expiring key live a little longer than
+ * its manifest, so an expired value is a miss and never a broken one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <hiredis/hiredis.h>
+#include "zchunk.h"
+#include "zdb.h"
+#include "zlog.h"
+
+#define CHUNK_MAGIC         "ZCHK "
+#define CHUNK_MAGIC_LEN     5
+#define CHUNK_MANIFEST_MAX  64
+#define CHUNK_TAG           ":chunk:"
+#define CHUNK_TTL_GRACE     60
+
+static void chunk_key(char *out, const char *key, int i);
+static size_t chunk_bytes(void);
+int chunk_need(size_t len);
+int is_chunk_key(const char *key);
+int chunk_manifest(const char *value, size_t len, size_t *total, int *count, size_t *step);
+int chunk_save_ssdb(redisContext *c, const char *key, const char *buff, size_t len);
+int chunk_get_ssdb(redisContext *c, const char *key, size_t total, int count, char **buff);
+int chunk_del_ssdb(redisContext *c, const char *key);
+int chunk_save_beansdb(memcached_st *memc, const char *key, const char *buff, size_t len);
+int chunk_get_beansdb(memcached_st *memc, const char *key, size_t total, int count, size_t step, char **buff);
+int chunk_del_beansdb(memcached_st *memc, const char *key);
+
+/**
+ * @brief chunk_key gen the key of a chunk
+ *
+ * @param out the key, CACHE_KEY_SIZE
+ * @param key the key of the whole value
+ * @param i the index of the chunk
+ */
+static void chunk_key(char *out, const char *key, int i) {
+    snprintf(out, CACHE_KEY_SIZE, "%s%s%d", key, CHUNK_TAG, i);
+}
+
+/**
+ * @brief chunk_bytes the size of a chunk in bytes
+ *
+ * @return the size
+ */
+static size_t chunk_bytes(void) {
+    return (size_t)settings.chunk_size * 1024;
+}
+
+/**
+ * @brief chunk_need check if a value should be split
+ *
+ * @param len the length of the value
+ *
+ * @return 1 for yes and 0 for no
+ */
+int chunk_need(size_t len) {
+    return (settings.chunk_size > 0 && len > chunk_bytes()) ? 1 : 0;
+}
+
+/**
+ * @brief is_chunk_key check if a key is a chunk of another key
+ *
+ * @param key the key
+ *
+ * @return 1 for yes and 0 for no
+ */
+int is_chunk_key(const char *key) {
+    return strstr(key, CHUNK_TAG) != NULL ? 1 : 0;
+}
+
+/**
+ * @brief chunk_manifest parse a value as a manifest
+ *
+ * @param value the value
+ * @param len the length of value
+ * @param total the total length of the chunked value
+ * @param count count of chunks
+ * @param step the size of every chunk but the last
+ *
+ * @return 1 for a manifest and 0 for a plain value
+ */
+int chunk_manifest(const char *value, size_t len, size_t *total, int *count, size_t *step) {
+    char tmp[CHUNK_MANIFEST_MAX];
+    unsigned long t, s;
+
+    if (len < CHUNK_MAGIC_LEN || len >= CHUNK_MANIFEST_MAX || memcmp(value, CHUNK_MAGIC, CHUNK_MAGIC_LEN) != 0)
+        return 0;
+    memcpy(tmp, value, len);
+    tmp[len] = '\0';
+    if (sscanf(tmp + CHUNK_MAGIC_LEN, "%lu %d %lu", &t, count, &s) != 3 || *count <= 0 || s == 0)
+        return 0;
+    *total = t;
+    *step = s;
+    return 1;
+}
+
+/**
+ * @brief chunk_save_ssdb save a large value as chunks and a manifest, pipelined
+ *
+ * @param c the connection to ssdb
+ * @param key the key
+ * @param buff the value
+ * @param len the length of value
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int chunk_save_ssdb(redisContext *c, const char *key, const char *buff, size_t len) {
+    char ckey[CACHE_KEY_SIZE];
+    char manifest[CHUNK_MANIFEST_MAX];
+    size_t step = chunk_bytes(), off;
+    redisReply *r;
+    int i, sent, count = (int)((len + step - 1) / step), ok = 0;
+    int ttl = key_ttl(key), ret;
+
+    if (c == NULL)
+        return -1;
+    for (sent = 0, off = 0; sent < count; sent++, off += step) {
+        chunk_key(ckey, key, sent);
+        if (ttl > 0)
+            ret = redisAppendCommand(c, "SETEX %s %d %b", ckey, ttl + CHUNK_TTL_GRACE,
+                                     buff + off, (len - off) < step ? (len - off) : step);
+        else
+            ret = redisAppendCommand(c, "SET %s %b", ckey, buff + off, (len - off) < step ? (len - off) : step);
+        if (ret != REDIS_OK)
+            break;
+    }
+    for (i = 0; i < sent; i++) {
+        if (redisGetReply(c, (void **)&r) != REDIS_OK || r == NULL)
+            return -1;
+        if (r->type == REDIS_REPLY_STATUS && strcasecmp(r->str, "OK") == 0)
+            ok++;
+        freeReplyObject(r);
+    }
+    if (ok != count) {
+        LOG_PRINT(LOG_DEBUG, "Failed to save chunks of [%s] to ssdb: %d of %d", key, ok, count);
+        return -1;
+    }
+
+    snprintf(manifest, sizeof(manifest), "%s%lu %d %lu", CHUNK_MAGIC, (unsigned long)len, count, (unsigned long)step);
+    if (ttl > 0)
+        r = (redisReply *)redisCommand(c, "SETEX %s %d %s", key, ttl, manifest);
+    else
+        r = (redisReply *)redisCommand(c, "SET %s %s", key, manifest);
+    if (r == NULL)
+        return -1;
+    ok = (r->type == REDIS_REPLY_STATUS && strcasecmp(r->str, "OK") == 0);
+    freeReplyObject(r);
+    LOG_PRINT(LOG_DEBUG, "Save [%s] to ssdb as %d chunks. length = [%d].", key, count, len);
+    return ok ? 1 : -1;
+}
+
+/**
+ * @brief chunk_get_ssdb fetch all chunks of a value, pipelined, into one buffer
+ *
+ * @param c the connection to ssdb
+ * @param key the key
+ * @param total the total length from the manifest
+ * @param count count of chunks from the manifest
+ * @param buff the value, alloced
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int chunk_get_ssdb(redisContext *c, const char *key, size_t total, int count, char **buff) {
+    char ckey[CACHE_KEY_SIZE];
+    redisReply *r;
+    size_t off = 0;
+    int i, sent, ret = 1;
+
+    if (c == NULL || (*buff = (char *)malloc(total > 0 ? total : 1)) == NULL)
+        return -1;
+    for (sent = 0; sent < count; sent++) {
+        chunk_key(ckey, key, sent);
+        if (redisAppendCommand(c, "GET %s", ckey) != REDIS_OK) {
+            ret = -1;
+            break;
+        }
+    }
+    /* every reply must be read even after a bad chunk to keep the pipeline in sync */
+    for (i = 0; i < sent; i++) {
+        if (redisGetReply(c, (void **)&r) != REDIS_OK || r == NULL) {
+            ret = -1;
+            break;
+        }
+        if (r->type == REDIS_REPLY_STRING && off + r->len <= total) {
+            memcpy(*buff + off, r->str, r->len);
+            off += r->len;
+        } else {
+            ret = -1;
+        }
+        freeReplyObject(r);
+    }
+    if (ret == -1 || off != total) {
+        LOG_PRINT(LOG_DEBUG, "Failed to get chunks of [%s] from ssdb.", key);
+        free(*buff);
+        *buff = NULL;
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief chunk_del_ssdb delete the chunks of a key if it is chunked
+ *
+ * @param c the connection to ssdb
+ * @param key the key
+ *
+ * @return count of chunks deleted, 0 for a plain value
+ */
+int chunk_del_ssdb(redisContext *c, const char *key) {
+    char ckey[CACHE_KEY_SIZE];
+    redisReply *r;
+    size_t total, step;
+    int i, sent, count = 0;
+
+    if (c == NULL)
+        return 0;
+    r = (redisReply *)redisCommand(c, "GET %s", key);
+    if (r == NULL)
+        return 0;
+    if (r->type != REDIS_REPLY_STRING || chunk_manifest(r->str, r->len, &total, &count, &step) != 1)
+        count = 0;
+    freeReplyObject(r);
+    for (sent = 0; sent < count; sent++) {
+        chunk_key(ckey, key, sent);
+        if (redisAppendCommand(c, "DEL %s", ckey) != REDIS_OK)
+            break;
+    }
+    for (i = 0; i < sent; i++) {
+        if (redisGetReply(c, (void **)&r) != REDIS_OK || r == NULL)
+            break;
+        freeReplyObject(r);
+    }
+    return count;
+}
+
+/**
+ * @brief chunk_save_beansdb save a large value as chunks and a manifest
+ *
+ * @param memc the connection to beansdb
+ * @param key the key
+ * @param buff the value
+ * @param len the length of value
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int chunk_save_beansdb(memcached_st *memc, const char *key, const char *buff, size_t len) {
+    char ckey[CACHE_KEY_SIZE];
+    char manifest[CHUNK_MANIFEST_MAX];
+    size_t step = chunk_bytes(), off;
+    memcached_return rc;
+    int i, count = (int)((len + step - 1) / step);
+    int ttl = key_ttl(key);
+
+    if (memc == NULL)
+        return -1;
+    for (i = 0, off = 0; i < count; i++, off += step) {
+        chunk_key(ckey, key, i);
+        rc = memcached_set(memc, ckey, strlen(ckey), buff + off, (len - off) < step ? (len - off) : step,
+                           ttl > 0 ? ttl + CHUNK_TTL_GRACE : 0, 0);
+        if (rc != MEMCACHED_SUCCESS) {
+            LOG_PRINT(LOG_DEBUG, "Beansdb Set Chunk [%s] Failed: %s", ckey, memcached_strerror(memc, rc));
+            return -1;
+        }
+    }
+    snprintf(manifest, sizeof(manifest), "%s%lu %d %lu", CHUNK_MAGIC, (unsigned long)len, count, (unsigned long)step);
+    rc = memcached_set(memc, key, strlen(key), manifest, strlen(manifest), ttl, 0);
+    if (rc != MEMCACHED_SUCCESS)
+        return -1;
+    LOG_PRINT(LOG_DEBUG, "Save [%s] to beansdb as %d chunks. length = [%d].", key, count, len);
+    return 1;
+}
+
+/**
+ * @brief chunk_get_beansdb fetch all chunks of a value by one multi-get into one buffer
+ *
+ * @param memc the connection to beansdb
+ * @param key the key
+ * @param total the total length from the manifest
+ * @param count count of chunks from the manifest
+ * @param step the chunk size from the manifest
+ * @param buff the value, alloced
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int chunk_get_beansdb(memcached_st *memc, const char *key, size_t total, int count, size_t step, char **buff) {
+    char (*ckeys)[CACHE_KEY_SIZE] = NULL;
+    const char **keys = NULL;
+    size_t *lens = NULL;
+    size_t got = 0, klen, vlen;
+    char rkey[MEMCACHED_MAX_KEY];
+    char *value;
+    uint32_t flags;
+    memcached_return rc;
+    int i, idx, ret = -1;
+
+    if (memc == NULL || count <= 0)
+        return -1;
+    ckeys = malloc(sizeof(*ckeys) * count);
+    keys = (const char **)malloc(sizeof(char *) * count);
+    lens = (size_t *)malloc(sizeof(size_t) * count);
+    *buff = (char *)malloc(total > 0 ? total : 1);
+    if (ckeys == NULL || keys == NULL || lens == NULL || *buff == NULL)
+        goto done;
+    for (i = 0; i < count; i++) {
+        chunk_key(ckeys[i], key, i);
+        keys[i] = ckeys[i];
+        lens[i] = strlen(ckeys[i]);
+    }
+    /* chunks may come back in any order, the index gives the offset */
+    if (memcached_mget(memc, keys, lens, count) != MEMCACHED_SUCCESS)
+        goto done;
+    while ((value = memcached_fetch(memc, rkey, &klen, &vlen, &flags, &rc)) != NULL) {
+        rkey[klen < MEMCACHED_MAX_KEY ? klen : MEMCACHED_MAX_KEY - 1] = '\0';
+        char *tag = strstr(rkey, CHUNK_TAG);
+        idx = tag != NULL ? atoi(tag + strlen(CHUNK_TAG)) : -1;
+        if (idx >= 0 && idx < count && (size_t)idx * step + vlen <= total) {
+            memcpy(*buff + (size_t)idx * step, value, vlen);
+            got += vlen;
+        }
+        free(value);
+    }
+    if (got == total)
+        ret = 1;
+
+done:
+    if (ret == -1) {
+        LOG_PRINT(LOG_DEBUG, "Failed to get chunks of [%s] from beansdb.", key);
+        free(*buff);
+        *buff = NULL;
+    }
+    free(ckeys);
+    free(keys);
+    free(lens);
+    return ret;
+}
+
+/**
+ * @brief chunk_del_beansdb delete the chunks of a key if it is chunked
+ *
+ * @param memc the connection to beansdb
+ * @param key the key
+ *
+ * @return count of chunks deleted, 0 for a plain value
+ */
+int chunk_del_beansdb(memcached_st *memc, const char *key) {
+    char ckey[CACHE_KEY_SIZE];
+    size_t vlen, total, step;
+    uint32_t flags;
+    memcached_return rc;
+    int i, count = 0;
+
+    if (memc == NULL)
+        return 0;
+    char *value = memcached_get(memc, key, strlen(key), &vlen, &flags, &rc);
+    if (value == NULL)
+        return 0;
+    if (chunk_manifest(value, vlen, &total, &count, &step) != 1)
+        count = 0;
+    free(value);
+    for (i = 0; i < count; i++) {
+        chunk_key(ckey, key, i);
+        memcached_delete(memc, ckey, strlen(ckey), 0);
+    }
+    return count;
+}
@@ -0,0 +1,36 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zchunk.h
+ * @brief chunked storage of large values in kv backends header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZCHUNK_H
+#define ZCHUNK_H
+
+#include "zcommon.h"
+
+int chunk_need(size_t len);
+int is_chunk_key(const char *key);
+int chunk_manifest(const char *value, size_t len, size_t *total, int *count, size_t *step);
+int chunk_save_ssdb(redisContext *c, const char *key, const char *buff, size_t len);
+int chunk_get_ssdb(redisContext *c, const char *key, size_t total, int count, char **buff);
+int chunk_del_ssdb(redisContext *c, const char *key);
+int chunk_save_beansdb(memcached_st *memc, const char *key, const char *buff, size_t len);
+int chunk_get_beansdb(memcached_st *memc, const char *key, size_t total, int count, size_t step, char **buff);
+int chunk_del_beansdb(memcached_st *memc, const char *key);
+
+#endif
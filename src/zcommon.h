@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/time.h>
 #include <libmemcached/memcached.h>
 #include <hiredis/hiredis.h>
@@ -42,12 +43,23 @@
 #define RETRY_TIME_WAIT     1000
 #define CACHE_KEY_SIZE      128
 #define PATH_MAX_SIZE       512
+#define DISK_MAX            32
+#define SSDB_MAX            16
+#define PREGEN_MAX          16
+
+typedef struct ssdb_slot_s {
+    redisContext *conn;
+    int counted;
+    int backoff;
+    uint64_t retry_at;
+    uint64_t used;
+} ssdb_slot_t;
 
 typedef struct thr_arg_s {
     evthr_t *thread;
     memcached_st *cache_conn;
     memcached_st *beansdb_conn;
-    redisContext *ssdb_conn;
+    ssdb_slot_t ssdb[SSDB_MAX];
     lua_State* L;
 } thr_arg_t;
 
@@ -67,6 +79,19 @@ typedef struct zimg_req_s {
     thr_arg_t *thr_arg;
 } zimg_req_t;
 
+typedef struct pregen_s {
+    char type[64];
+    int width;
+    int height;
+    int proportion;
+    int gray;
+    int x;
+    int y;
+    int rotate;
+    int quality;
+    char fmt[16];
+} pregen_t;
+
 struct setting {
     lua_State *L;
     int is_daemon;
@@ -93,6 +118,14 @@ struct setting {
     int disable_args;
     int disable_type;
     int disable_zoom_up;
+    int shrink_on_load;
+    int native;
+    int lossless;
+    int resize_tier;
+    int derive;
+    int derive_quality;
+    int magick_memory;
+    int magick_map;
     int script_on;
     char script_name[512];
     char format[16];
@@ -101,14 +134,63 @@ struct setting {
     int save_new;
     int max_size;
     char img_path[512];
+    char img_paths[DISK_MAX][512];
+    int img_path_num;
+    int disk_threads;
+    int disk_queue;
+    int disk_timeout;
+    int disk_max_errors;
+    int disk_retry;
+    int tier;
+    char tier_path[512];
+    int tier_promote_hits;
+    int tier_demote_age;
+    int tier_interval;
+    int tier_min_free;
     char beansdb_ip[128];
     int beansdb_port;
     char ssdb_ip[128];
     int ssdb_port;
+    char ssdb_node_ip[SSDB_MAX][128];
+    int ssdb_node_port[SSDB_MAX];
+    int ssdb_node_num;
+    int ssdb_replicas;
+    int ssdb_quorum;
+    int hedge;
+    int hedge_percentile;
+    int hedge_delay_min;
+    int hedge_budget;
+    int chunk_size;
+    int derivative_ttl;
+    int connect_timeout;
+    int read_timeout;
+    int reconnect_max;
+    int ping_interval;
+    int replica[3];
+    int replica_num;
+    int replica_queue;
+    char replica_log[512];
+    int scrub;
+    int scrub_rate;
+    int scrub_interval;
+    char scrub_quarantine[512];
+    int journal;
+    char journal_path[512];
+    int journal_max;
+    int journal_batch;
+    int journal_sync;
+    int dcache;
+    char dcache_path[512];
+    int dcache_size;
+    pregen_t pregen[PREGEN_MAX];
+    int pregen_num;
+    int pregen_threads;
+    int pregen_queue;
     multipart_parser_settings *mp_set;
     int (*get_img)(zimg_req_t *, evhtp_request_t *);
     int (*info_img)(evhtp_request_t *, thr_arg_t *, char *);
     int (*admin_img)(evhtp_request_t *, thr_arg_t *, char *, int);
+    int (*batch_img)(thr_arg_t *, zimg_req_t *, int, int *);
 } settings;
 
 #define LOG_FATAL       0           /* System is unusable */
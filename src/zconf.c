@@ -0,0 +1,817 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zconf.c
+ * @brief load settings and init connections, shared by zimg and its tools.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#include "zconf.h"
+#include "zhttpd.h"
+#include "zimg.h"
+#include "zdb.h"
+#include "zpool.h"
+#include "zutil.h"
+#include "zlog.h"
+#include "zresample.h"
+
+#define _STR(s) #s
+#define STR(s) _STR(s)
+
+pthread_key_t gLuaStateKey = 0;
+
+void settings_init(void);
+static void set_callback(int mode);
+static int conf_int(lua_State *L, const char *name, int def);
+static void conf_pregen(lua_State *L);
+int load_conf(const char *conf);
+int backend_on(int mode);
+void init_conns(thr_arg_t *thr_args);
+void free_conns(thr_arg_t *thr_args);
+
+/**
+ * @brief settings_init Init the setting with default values.
+ */
+void settings_init(void) {
+    settings.L = NULL;
+    settings.is_daemon = 0;
+    str_lcpy(settings.ip, "0.0.0.0", sizeof(settings.ip));
+    settings.port = 4869;
+    settings.num_threads = get_cpu_cores();         /* N workers */
+    settings.backlog = 1024;
+    settings.max_keepalives = 1;
+    settings.retry = 3;
+    str_lcpy(settings.version, STR(PROJECT_VERSION), sizeof(settings.version));
+    snprintf(settings.server_name, 128, "zimg/%s", settings.version);
+    settings.headers = NULL;
+    settings.etag = 0;
+    settings.up_access = NULL;
+    settings.down_access = NULL;
+    settings.admin_access = NULL;
+    settings.cache_on = 0;
+    str_lcpy(settings.cache_ip, "127.0.0.1", sizeof(settings.cache_ip));
+    settings.cache_port = 11211;
+    settings.log_level = 6;
+    str_lcpy(settings.log_name, "./log/zimg.log", sizeof(settings.log_name));
+    str_lcpy(settings.root_path, "./www/index.html", sizeof(settings.root_path));
+    str_lcpy(settings.admin_path, "./www/admin.html", sizeof(settings.admin_path));
+    settings.disable_args = 0;
+    settings.disable_type = 0;
+    settings.disable_zoom_up = 0;
+    settings.shrink_on_load = 1;
+    settings.native = 1;
+    settings.lossless = 1;
+    settings.resize_tier = RS_TIER_BALANCED;
+    settings.derive = 1;
+    settings.derive_quality = 75;
+    settings.magick_memory = 0;
+    settings.magick_map = 0;
+    settings.script_on = 0;
+    settings.script_name[0] = '\0';
+    str_lcpy(settings.format, "none", sizeof(settings.format));
+    settings.quality = 75;
+    settings.mode = 1;
+    settings.save_new = 1;
+    settings.max_size = 10485760;
+    str_lcpy(settings.img_path, "./img", sizeof(settings.img_path));
+    settings.img_path_num = 0;
+    settings.disk_threads = 2;
+    settings.disk_queue = 64;
+    settings.disk_timeout = 3000;
+    settings.disk_max_errors = 5;
+    settings.disk_retry = 30;
+    settings.tier = 0;
+    str_lcpy(settings.tier_path, "./img_cold", sizeof(settings.tier_path));
+    settings.tier_promote_hits = 3;
+    settings.tier_demote_age = 604800;
+    settings.tier_interval = 600;
+    settings.tier_min_free = 10;
+    str_lcpy(settings.beansdb_ip, "127.0.0.1", sizeof(settings.beansdb_ip));
+    settings.beansdb_port = 7905;
+    str_lcpy(settings.ssdb_ip, "127.0.0.1", sizeof(settings.ssdb_ip));
+    settings.ssdb_port = 6379;
+    settings.ssdb_node_num = 0;
+    settings.ssdb_replicas = 2;
+    settings.ssdb_quorum = 0;
+    settings.hedge = 0;
+    settings.hedge_percentile = 95;
+    settings.hedge_delay_min = 5;
+    settings.hedge_budget = 2;
+    settings.chunk_size = 512;
+    settings.derivative_ttl = 0;
+    settings.connect_timeout = 500;
+    settings.read_timeout = 2000;
+    settings.reconnect_max = 30000;
+    settings.ping_interval = 30;
+    settings.replica_num = 0;
+    settings.replica_queue = 256;
+    str_lcpy(settings.replica_log, "./replica.log", sizeof(settings.replica_log));
+    settings.scrub = 0;
+    settings.scrub_rate = 10240;
+    settings.scrub_interval = 86400;
+    settings.scrub_quarantine[0] = '\0';
+    settings.journal = 0;
+    str_lcpy(settings.journal_path, "./journal", sizeof(settings.journal_path));
+    settings.journal_max = 1024;
+    settings.journal_batch = 64;
+    settings.journal_sync = 1;
+    settings.dcache = 0;
+    str_lcpy(settings.dcache_path, "./dcache", sizeof(settings.dcache_path));
+    settings.dcache_size = 10240;
+    settings.pregen_num = 0;
+    settings.pregen_threads = 1;
+    settings.pregen_queue = 1024;
+    multipart_parser_settings *callbacks = (multipart_parser_settings *)malloc(sizeof(multipart_parser_settings));
+    memset(callbacks, 0, sizeof(multipart_parser_settings));
+    //callbacks->on_header_field = on_header_field;
+    callbacks->on_header_value = on_header_value;
+    callbacks->on_chunk_data = on_chunk_data;
+    settings.mp_set = callbacks;
+    settings.get_img = NULL;
+    settings.info_img = NULL;
+    settings.admin_img = NULL;
+    settings.batch_img = NULL;
+}
+
+/**
+ * @brief set_callback set the storage callbacks by mode
+ *
+ * @param mode storage mode
+ */
+static void set_callback(int mode) {
+    if (mode == 1) {
+        settings.get_img = get_img;
+        settings.info_img = info_img;
+        settings.admin_img = admin_img;
+        settings.batch_img = batch_img;
+    } else {
+        settings.get_img = get_img_mode_db;
+        settings.info_img = info_img_mode_db;
+        settings.admin_img = admin_img_mode_db;
+        settings.batch_img = batch_img_mode_db;
+    }
+}
+
+/**
+ * @brief load_conf load the conf of zimg
+ *
+ * @param conf conf name
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int load_conf(const char *conf) {
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    if (luaL_loadfile(L, conf) || lua_pcall(L, 0, 0, 0)) {
+        lua_close(L);
+        return -1;
+    }
+
+    lua_getglobal(L, "is_daemon"); //stack index: -12
+    if (lua_isnumber(L, -1))
+        settings.is_daemon = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "ip");
+    if (lua_isstring(L, -1))
+        str_lcpy(settings.ip, lua_tostring(L, -1), sizeof(settings.ip));
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "port");
+    if (lua_isnumber(L, -1))
+        settings.port = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "thread_num");
+    if (lua_isnumber(L, -1))
+        settings.num_threads = (int)lua_tonumber(L, -1);         /* N workers */
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "backlog_num");
+    if (lua_isnumber(L, -1))
+        settings.backlog = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "max_keepalives");
+    if (lua_isnumber(L, -1))
+        settings.max_keepalives = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "retry");
+    if (lua_isnumber(L, -1))
+        settings.retry = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "system");
+    if (lua_isstring(L, -1)) {
+        char tmp[128];
+        snprintf(tmp, 128, "%s %s", settings.server_name, lua_tostring(L, -1));
+        snprintf(settings.server_name, 128, "%s", tmp);
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "headers");
+    if (lua_isstring(L, -1)) {
+        settings.headers = conf_get_headers(lua_tostring(L, -1));
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "etag");
+    if (lua_isnumber(L, -1))
+        settings.etag = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "upload_rule");
+    if (lua_isstring(L, -1)) {
+        settings.up_access = conf_get_rules(lua_tostring(L, -1));
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "download_rule");
+    if (lua_isstring(L, -1)) {
+        settings.down_access = conf_get_rules(lua_tostring(L, -1));
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "admin_rule");
+    if (lua_isstring(L, -1)) {
+        settings.admin_access = conf_get_rules(lua_tostring(L, -1));
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "cache");
+    if (lua_isnumber(L, -1))
+        settings.cache_on = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "mc_ip");
+    if (lua_isstring(L, -1))
+        str_lcpy(settings.cache_ip, lua_tostring(L, -1), sizeof(settings.cache_ip));
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "mc_port");
+    if (lua_isnumber(L, -1))
+        settings.cache_port = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "log_level");
+    if (lua_isnumber(L, -1))
+        settings.log_level = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "log_name"); //stack index: -1
+    if (lua_isstring(L, -1))
+        str_lcpy(settings.log_name, lua_tostring(L, -1), sizeof(settings.log_name));
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "root_path");
+    if (lua_isstring(L, -1))
+        str_lcpy(settings.root_path, lua_tostring(L, -1), sizeof(settings.root_path));
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "admin_path");
+    if (lua_isstring(L, -1))
+        str_lcpy(settings.admin_path, lua_tostring(L, -1), sizeof(settings.admin_path));
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "disable_args");
+    if (lua_isnumber(L, -1))
+        settings.disable_args = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "disable_type");
+    if (lua_isnumber(L, -1))
+        settings.disable_type = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "disable_zoom_up");
+    if (lua_isnumber(L, -1))
+        settings.disable_zoom_up = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "shrink_on_load");
+    if (lua_isnumber(L, -1))
+        settings.shrink_on_load = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "native");
+    if (lua_isnumber(L, -1))
+        settings.native = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "lossless");
+    if (lua_isnumber(L, -1))
+        settings.lossless = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "resize_tier");
+    if (lua_isstring(L, -1)) {
+        int tier = resample_tier(lua_tostring(L, -1));
+        if (tier != -1)
+            settings.resize_tier = tier;
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "derive");
+    if (lua_isnumber(L, -1))
+        settings.derive = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "derive_quality");
+    if (lua_isnumber(L, -1))
+        settings.derive_quality = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "magick_memory");
+    if (lua_isnumber(L, -1))
+        settings.magick_memory = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "magick_map");
+    if (lua_isnumber(L, -1))
+        settings.magick_map = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "script_name"); //stack index: -1
+    if (lua_isstring(L, -1))
+        str_lcpy(settings.script_name, lua_tostring(L, -1), sizeof(settings.script_name));
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "format");
+    if (lua_isstring(L, -1))
+        str_lcpy(settings.format, lua_tostring(L, -1), sizeof(settings.format));
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "quality");
+    if (lua_isnumber(L, -1))
+        settings.quality = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "mode");
+    if (lua_isnumber(L, -1))
+        settings.mode = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    set_callback(settings.mode);
+
+    lua_getglobal(L, "save_new");
+    if (lua_isnumber(L, -1))
+        settings.save_new = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "max_size");
+    if (lua_isnumber(L, -1))
+        settings.max_size = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "img_path");
+    if (lua_isstring(L, -1))
+        str_lcpy(settings.img_path, lua_tostring(L, -1), sizeof(settings.img_path));
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "img_paths");
+    if (lua_istable(L, -1)) {
+        int i, n = lua_objlen(L, -1);
+        for (i = 1; i <= n && settings.img_path_num < DISK_MAX; i++) {
+            lua_rawgeti(L, -1, i);
+            if (lua_isstring(L, -1))
+                str_lcpy(settings.img_paths[settings.img_path_num++], lua_tostring(L, -1), sizeof(settings.img_paths[0]));
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "disk_threads");
+    if (lua_isnumber(L, -1))
+        settings.disk_threads = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "disk_queue");
+    if (lua_isnumber(L, -1))
+        settings.disk_queue = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "disk_timeout");
+    if (lua_isnumber(L, -1))
+        settings.disk_timeout = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "disk_max_errors");
+    if (lua_isnumber(L, -1))
+        settings.disk_max_errors = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "disk_retry");
+    if (lua_isnumber(L, -1))
+        settings.disk_retry = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "tier");
+    if (lua_isnumber(L, -1))
+        settings.tier = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "tier_path");
+    if (lua_isstring(L, -1))
+        str_lcpy(settings.tier_path, lua_tostring(L, -1), sizeof(settings.tier_path));
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "tier_promote_hits");
+    if (lua_isnumber(L, -1))
+        settings.tier_promote_hits = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "tier_demote_age");
+    if (lua_isnumber(L, -1))
+        settings.tier_demote_age = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "tier_interval");
+    if (lua_isnumber(L, -1))
+        settings.tier_interval = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "tier_min_free");
+    if (lua_isnumber(L, -1))
+        settings.tier_min_free = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "beansdb_ip");
+    if (lua_isstring(L, -1))
+        str_lcpy(settings.beansdb_ip, lua_tostring(L, -1), sizeof(settings.beansdb_ip));
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "beansdb_port");
+    if (lua_isnumber(L, -1))
+        settings.beansdb_port = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "ssdb_ip");
+    if (lua_isstring(L, -1))
+        str_lcpy(settings.ssdb_ip, lua_tostring(L, -1), sizeof(settings.ssdb_ip));
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "ssdb_port");
+    if (lua_isnumber(L, -1))
+        settings.ssdb_port = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "ssdb_servers");
+    if (lua_istable(L, -1)) {
+        int i, n = lua_objlen(L, -1);
+        for (i = 1; i <= n && settings.ssdb_node_num < SSDB_MAX; i++) {
+            lua_rawgeti(L, -1, i);
+            if (lua_isstring(L, -1)) {
+                char *node = settings.ssdb_node_ip[settings.ssdb_node_num];
+                str_lcpy(node, lua_tostring(L, -1), sizeof(settings.ssdb_node_ip[0]));
+                char *colon = strrchr(node, ':');
+                if (colon != NULL && atoi(colon + 1) > 0) {
+                    *colon = '\0';
+                    settings.ssdb_node_port[settings.ssdb_node_num++] = atoi(colon + 1);
+                }
+            }
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+    if (settings.ssdb_node_num == 0) {
+        str_lcpy(settings.ssdb_node_ip[0], settings.ssdb_ip, sizeof(settings.ssdb_node_ip[0]));
+        settings.ssdb_node_port[0] = settings.ssdb_port;
+        settings.ssdb_node_num = 1;
+    }
+
+    lua_getglobal(L, "ssdb_replicas");
+    if (lua_isnumber(L, -1))
+        settings.ssdb_replicas = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    if (settings.ssdb_replicas < 1)
+        settings.ssdb_replicas = 1;
+    if (settings.ssdb_replicas > settings.ssdb_node_num)
+        settings.ssdb_replicas = settings.ssdb_node_num;
+
+    lua_getglobal(L, "ssdb_quorum");
+    if (lua_isnumber(L, -1))
+        settings.ssdb_quorum = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    if (settings.ssdb_quorum < 1)
+        settings.ssdb_quorum = settings.ssdb_replicas / 2 + 1;
+    if (settings.ssdb_quorum > settings.ssdb_replicas)
+        settings.ssdb_quorum = settings.ssdb_replicas;
+
+    lua_getglobal(L, "hedge");
+    if (lua_isnumber(L, -1))
+        settings.hedge = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "hedge_percentile");
+    if (lua_isnumber(L, -1))
+        settings.hedge_percentile = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    if (settings.hedge_percentile < 1 || settings.hedge_percentile > 99)
+        settings.hedge_percentile = 95;
+
+    lua_getglobal(L, "hedge_delay_min");
+    if (lua_isnumber(L, -1))
+        settings.hedge_delay_min = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "hedge_budget");
+    if (lua_isnumber(L, -1))
+        settings.hedge_budget = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "chunk_size");
+    if (lua_isnumber(L, -1))
+        settings.chunk_size = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "derivative_ttl");
+    if (lua_isnumber(L, -1))
+        settings.derivative_ttl = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "connect_timeout");
+    if (lua_isnumber(L, -1))
+        settings.connect_timeout = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "read_timeout");
+    if (lua_isnumber(L, -1))
+        settings.read_timeout = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "reconnect_max");
+    if (lua_isnumber(L, -1))
+        settings.reconnect_max = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "ping_interval");
+    if (lua_isnumber(L, -1))
+        settings.ping_interval = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "replica");
+    if (lua_istable(L, -1)) {
+        int i, j, n = lua_objlen(L, -1);
+        for (i = 1; i <= n && settings.replica_num < 3; i++) {
+            lua_rawgeti(L, -1, i);
+            int m = lua_isnumber(L, -1) ? (int)lua_tonumber(L, -1) : 0;
+            lua_pop(L, 1);
+            if (m < 1 || m > 3 || m == settings.mode)
+                continue;
+            for (j = 0; j < settings.replica_num && settings.replica[j] != m; j++);
+            if (j == settings.replica_num)
+                settings.replica[settings.replica_num++] = m;
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "replica_queue");
+    if (lua_isnumber(L, -1))
+        settings.replica_queue = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "replica_log");
+    if (lua_isstring(L, -1))
+        str_lcpy(settings.replica_log, lua_tostring(L, -1), sizeof(settings.replica_log));
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "scrub");
+    if (lua_isnumber(L, -1))
+        settings.scrub = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "scrub_rate");
+    if (lua_isnumber(L, -1))
+        settings.scrub_rate = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "scrub_interval");
+    if (lua_isnumber(L, -1))
+        settings.scrub_interval = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "scrub_quarantine");
+    if (lua_isstring(L, -1))
+        str_lcpy(settings.scrub_quarantine, lua_tostring(L, -1), sizeof(settings.scrub_quarantine));
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "journal");
+    if (lua_isnumber(L, -1))
+        settings.journal = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "journal_path");
+    if (lua_isstring(L, -1))
+        str_lcpy(settings.journal_path, lua_tostring(L, -1), sizeof(settings.journal_path));
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "journal_max");
+    if (lua_isnumber(L, -1))
+        settings.journal_max = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "journal_batch");
+    if (lua_isnumber(L, -1))
+        settings.journal_batch = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    if (settings.journal_batch < 1)
+        settings.journal_batch = 1;
+
+    lua_getglobal(L, "journal_sync");
+    if (lua_isnumber(L, -1))
+        settings.journal_sync = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "dcache");
+    if (lua_isnumber(L, -1))
+        settings.dcache = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "dcache_path");
+    if (lua_isstring(L, -1))
+        str_lcpy(settings.dcache_path, lua_tostring(L, -1), sizeof(settings.dcache_path));
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "dcache_size");
+    if (lua_isnumber(L, -1))
+        settings.dcache_size = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    if (settings.dcache_size < 1)
+        settings.dcache_size = 1;
+
+    conf_pregen(L);
+
+    lua_getglobal(L, "pregen_threads");
+    if (lua_isnumber(L, -1))
+        settings.pregen_threads = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    if (settings.pregen_threads < 1)
+        settings.pregen_threads = 1;
+
+    lua_getglobal(L, "pregen_queue");
+    if (lua_isnumber(L, -1))
+        settings.pregen_queue = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    //settings.L = L;
+    lua_close(L);
+
+    return 1;
+}
+
+/**
+ * @brief conf_int read a number field of the table on the top of the lua stack
+ *
+ * @param L the lua state
+ * @param name the field name
+ * @param def the value when the field is not a number
+ *
+ * @return the value
+ */
+static int conf_int(lua_State *L, const char *name, int def) {
+    int ret = def;
+
+    lua_getfield(L, -1, name);
+    if (lua_isnumber(L, -1))
+        ret = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    return ret;
+}
+
+/**
+ * @brief conf_pregen read the derivatives made right after an upload
+ *
+ * A string item is a lua type, a table item is a parameter set with the
+ * keys of a GET request: w, h, p, g, x, y, r, q and f.
+ *
+ * @param L the lua state of the conf
+ */
+static void conf_pregen(lua_State *L) {
+    pregen_t *pg;
+    int i, n;
+
+    lua_getglobal(L, "pregen");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    n = lua_objlen(L, -1);
+    for (i = 1; i <= n && settings.pregen_num < PREGEN_MAX; i++) {
+        pg = &settings.pregen[settings.pregen_num];
+        memset(pg, 0, sizeof(pregen_t));
+        lua_rawgeti(L, -1, i);
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            str_lcpy(pg->type, lua_tostring(L, -1), sizeof(pg->type));
+            settings.pregen_num++;
+        } else if (lua_istable(L, -1)) {
+            pg->width = conf_int(L, "w", 0);
+            pg->height = conf_int(L, "h", 0);
+            pg->proportion = conf_int(L, "p", 1);
+            pg->gray = conf_int(L, "g", 0);
+            pg->x = conf_int(L, "x", -1);
+            pg->y = conf_int(L, "y", -1);
+            pg->rotate = conf_int(L, "r", 0);
+            pg->quality = conf_int(L, "q", 0);
+            if (pg->x != -1 || pg->y != -1)
+                pg->proportion = 1;
+            lua_getfield(L, -1, "f");
+            if (lua_isstring(L, -1))
+                str_lcpy(pg->fmt, lua_tostring(L, -1), sizeof(pg->fmt));
+            lua_pop(L, 1);
+            settings.pregen_num++;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+/**
+ * @brief backend_on check if a storage backend is the primary or a replica
+ *
+ * @param mode the storage mode of the backend
+ *
+ * @return 1 for yes and 0 for no
+ */
+int backend_on(int mode) {
+    int i;
+    if (settings.mode == mode)
+        return 1;
+    for (i = 0; i < settings.replica_num; i++) {
+        if (settings.replica[i] == mode)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief init_conns init the cache and storage connections of a thread
+ *
+ * @param thr_args the thread arg to fill
+ */
+void init_conns(thr_arg_t *thr_args) {
+    char mserver[32];
+
+    if (settings.cache_on == true) {
+        memcached_st *memc = memcached_create(NULL);
+        snprintf(mserver, 32, "%s:%d", settings.cache_ip, settings.cache_port);
+        memcached_server_st *servers = memcached_servers_parse(mserver);
+        memcached_server_push(memc, servers);
+        memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
+        memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_NO_BLOCK, 1);
+        memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+        memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_TCP_KEEPALIVE, 1);
+        thr_args->cache_conn = memc;
+        LOG_PRINT(LOG_DEBUG, "Memcached Connection Init Finished.");
+        memcached_server_list_free(servers);
+    } else
+        thr_args->cache_conn = NULL;
+
+    thr_args->beansdb_conn = NULL;
+    if (backend_on(2)) {
+        thr_args->beansdb_conn = beansdb_connect(settings.beansdb_ip, settings.beansdb_port);
+        LOG_PRINT(LOG_DEBUG, "beansdb Connection Init Finished.");
+    }
+    /* a failed connect is retried by ssdb_get() on the next request */
+    if (backend_on(3)) {
+        int i;
+        for (i = 0; i < settings.ssdb_node_num; i++)
+            ssdb_get(thr_args, i);
+    }
+}
+
+/**
+ * @brief free_conns release the connections of a thread
+ *
+ * @param thr_args the thread arg
+ */
+void free_conns(thr_arg_t *thr_args) {
+    int i;
+
+    if (thr_args->cache_conn != NULL)
+        memcached_free(thr_args->cache_conn);
+    if (thr_args->beansdb_conn != NULL)
+        memcached_free(thr_args->beansdb_conn);
+    for (i = 0; i < settings.ssdb_node_num; i++)
+        ssdb_close(thr_args, i);
+    thr_args->cache_conn = NULL;
+    thr_args->beansdb_conn = NULL;
+}
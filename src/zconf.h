@@ -0,0 +1,35 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zconf.h
+ * @brief load settings and init connections, shared by zimg and its tools header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZCONF_H
+#define ZCONF_H
+
+#include <pthread.h>
+#include "zcommon.h"
+
+extern pthread_key_t gLuaStateKey;
+
+void settings_init(void);
+int load_conf(const char *conf);
+int backend_on(int mode);
+void init_conns(thr_arg_t *thr_args);
+void free_conns(thr_arg_t *thr_args);
+
+#endif
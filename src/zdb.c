@@ -25,15 +25,29 @@
 #include "zlog.h"
 #include "zcache.h"
 #include "zutil.h"
+#include "zpool.h"
+#include "zring.h"
+#include "zchunk.h"
+#include "zmeta.h"
+#include "zjournal.h"
+#include "zdcache.h"
+#include "zdecode.h"
+#include "znative.h"
+#include "zbatch.h"
+#include "zderive.h"
 #include "zscale.h"
 #include "zlscale.h"
 #include "cjson/cJSON.h"
 
 int get_img_mode_db(zimg_req_t *req, evhtp_request_t *request);
+static int load_orig_db(thr_arg_t *thr_arg, const char *md5, char **buff, size_t *len);
+int batch_img_mode_db(thr_arg_t *thr_arg, zimg_req_t *reqs, int n, int *results);
 int get_img_db(thr_arg_t *thr_arg, const char *cache_key, char **buff, size_t *len);
 int get_img_beansdb(memcached_st *memc, const char *key, char **value_ptr, size_t *len);
 int get_img_ssdb(redisContext* c, const char *cache_key, char **buff, size_t *len);
+int reply_img_ssdb(redisContext* c, const char *cache_key, redisReply *r, char **buff, size_t *len);
 int save_img_db(thr_arg_t *thr_arg, const char *cache_key, const char *buff, const size_t len);
+int write_img_db(thr_arg_t *thr_arg, const char *cache_key, const char *buff, const size_t len);
 int save_img_beansdb(memcached_st *memc, const char *key, const char *value, const size_t len);
 int save_img_ssdb(redisContext* c, const char *cache_key, const char *buff, const size_t len);
 int admin_img_mode_db(evhtp_request_t *req, thr_arg_t *thr_arg, char *md5, int t);
@@ -42,8 +56,14 @@ int exist_db(thr_arg_t *thr_arg, const char *cache_key);
 int exist_beansdb(memcached_st *memc, const char *key);
 int exist_ssdb(redisContext* c, const char *cache_key);
 int del_db(thr_arg_t *thr_arg, const char *cache_key);
+int remove_img_db(thr_arg_t *thr_arg, const char *cache_key);
 int del_beansdb(memcached_st *memc, const char *key);
 int del_ssdb(redisContext* c, const char *cache_key);
+int key_ttl(const char *cache_key);
+int pipe_ssdb(redisContext* c, int n, const char **cmds, const char **keys, redisReply **replies);
+int exist_get_db(thr_arg_t *thr_arg, const char *md5, const char *cache_key, char **buff, size_t *len);
+int exist_get_ssdb(redisContext* c, const char *md5, const char *cache_key, char **buff, size_t *len);
+int reply_exist_get_ssdb(redisContext* c, const char *cache_key, redisReply **r, char **buff, size_t *len);
 
 
 /**
@@ -65,68 +85,86 @@ int get_img_mode_db(zimg_req_t *req, evhtp_request_t *request) {
 
     LOG_PRINT(LOG_DEBUG, "get_img() start processing zimg request...");
 
-    if (exist_db(req->thr_arg, req->md5) == -1) {
-        LOG_PRINT(LOG_DEBUG, "Image [%s] is not existed.", req->md5);
+    if (meta_plan(req->thr_arg, req, NULL) == -1)
         goto err;
-    }
 
-    if (settings.script_on == 1 && req->type != NULL)
-        snprintf(rsp_cache_key, CACHE_KEY_SIZE, "%s:%s", req->md5, req->type);
-    else {
-        if (req->proportion == 0 && req->width == 0 && req->height == 0)
-            str_lcpy(rsp_cache_key, req->md5, CACHE_KEY_SIZE);
-        else
-            gen_key(rsp_cache_key, req->md5, 9, req->width, req->height, req->proportion, req->gray, req->x, req->y, req->rotate, req->quality, req->fmt);
-    }
+    gen_rsp_key(rsp_cache_key, req);
 
     if (find_cache_bin(req->thr_arg, rsp_cache_key, &buff, &img_size) == 1) {
+        if (exist_db(req->thr_arg, req->md5) == -1) {
+            LOG_PRINT(LOG_DEBUG, "Image [%s] is not existed.", req->md5);
+            goto err;
+        }
         LOG_PRINT(LOG_DEBUG, "Hit Cache[Key: %s].", rsp_cache_key);
         to_save = false;
         goto done;
     }
+    if (dcache_get(rsp_cache_key, &buff, &img_size) == 1) {
+        /* meta_del drops the cached record of a deleted image, so a cached one saves the backend */
+        if (meta_cached(req->thr_arg, req->md5) != 1 && exist_db(req->thr_arg, req->md5) == -1) {
+            LOG_PRINT(LOG_DEBUG, "Image [%s] is not existed.", req->md5);
+            goto err;
+        }
+        if (img_size < CACHE_MAX_SIZE) {
+            set_cache_bin(req->thr_arg, rsp_cache_key, buff, img_size);
+        }
+        to_save = false;
+        goto done;
+    }
     LOG_PRINT(LOG_DEBUG, "Start to Find the Image...");
-    if (get_img_db(req->thr_arg, rsp_cache_key, &buff, &img_size) == 1) {
+    /* the existence check and the lookup share one round trip in ssdb mode */
+    result = exist_get_db(req->thr_arg, req->md5, rsp_cache_key, &buff, &img_size);
+    if (result == -1) {
+        LOG_PRINT(LOG_DEBUG, "Image [%s] is not existed.", req->md5);
+        goto err;
+    }
+    if (result == 1) {
         LOG_PRINT(LOG_DEBUG, "Get image [%s] from backend db succ.", rsp_cache_key);
         if (img_size < CACHE_MAX_SIZE) {
             set_cache_bin(req->thr_arg, rsp_cache_key, buff, img_size);
         }
+        dcache_set(rsp_cache_key, buff, img_size);
         to_save = false;
         goto done;
     }
 
-    im = NewMagickWand();
-    if (im == NULL) goto err;
-
-    if (find_cache_bin(req->thr_arg, req->md5, &orig_buff, &img_size) == -1) {
-        if (get_img_db(req->thr_arg, req->md5, &orig_buff, &img_size) == -1) {
-            LOG_PRINT(LOG_DEBUG, "Get image [%s] from backend db failed.", req->md5);
-            goto err;
-        } else if (img_size < CACHE_MAX_SIZE) {
-            set_cache_bin(req->thr_arg, req->md5, orig_buff, img_size);
-        }
+    if (derive_img(req, NULL, &buff, &img_size) == 1) {
+        /* only one generation is allowed, a derived result is never stored */
+        to_save = false;
+        goto cache;
     }
 
-    result = MagickReadImageBlob(im, (const unsigned char *)orig_buff, img_size);
-    if (result != MagickTrue) {
-        LOG_PRINT(LOG_DEBUG, "Webimg Read Blob Failed!");
+    if (load_orig_db(req->thr_arg, req->md5, &orig_buff, &img_size) == -1)
         goto err;
-    }
-    if (settings.script_on == 1 && req->type != NULL)
-        result = lua_convert(im, req);
-    else
-        result = convert(im, req);
-    if (result == -1) goto err;
-    if (result == 0) to_save = false;
 
-    buff = (char *)MagickGetImageBlob(im, &img_size);
-    if (buff == NULL) {
-        LOG_PRINT(LOG_DEBUG, "Webimg Get Blob Failed!");
-        goto err;
+    if (native_convert(req, orig_buff, img_size, &buff, &img_size) != 1) {
+        im = NewMagickWand();
+        if (im == NULL) goto err;
+
+        result = read_img_blob(im, req, orig_buff, img_size);
+        if (result != MagickTrue) {
+            LOG_PRINT(LOG_DEBUG, "Webimg Read Blob Failed!");
+            goto err;
+        }
+        if (settings.script_on == 1 && req->type != NULL)
+            result = lua_convert(im, req);
+        else
+            result = convert(im, req);
+        if (result == -1) goto err;
+        if (result == 0) to_save = false;
+
+        buff = (char *)MagickGetImageBlob(im, &img_size);
+        if (buff == NULL) {
+            LOG_PRINT(LOG_DEBUG, "Webimg Get Blob Failed!");
+            goto err;
+        }
     }
 
+cache:
     if (img_size < CACHE_MAX_SIZE) {
         set_cache_bin(req->thr_arg, rsp_cache_key, buff, img_size);
     }
+    dcache_set(rsp_cache_key, buff, img_size);
 
 done:
     if (settings.etag == 1) {
@@ -159,6 +197,99 @@ err:
     return result;
 }
 
+/**
+ * @brief load_orig_db get an original from the caches or the backend db
+ *
+ * @param thr_arg the thread arg
+ * @param md5 the md5 of the original
+ * @param buff the original, free by caller
+ * @param len length of the original
+ *
+ * @return 1 for OK and -1 for failed
+ */
+static int load_orig_db(thr_arg_t *thr_arg, const char *md5, char **buff, size_t *len) {
+    if (find_cache_bin(thr_arg, md5, buff, len) == 1)
+        return 1;
+    if (dcache_get(md5, buff, len) == 1) {
+        if (*len < CACHE_MAX_SIZE)
+            set_cache_bin(thr_arg, md5, *buff, *len);
+        return 1;
+    }
+    if (get_img_db(thr_arg, md5, buff, len) == -1) {
+        LOG_PRINT(LOG_DEBUG, "Get image [%s] from backend db failed.", md5);
+        return -1;
+    }
+    if (*len < CACHE_MAX_SIZE)
+        set_cache_bin(thr_arg, md5, *buff, *len);
+    dcache_set(md5, *buff, *len);
+    return 1;
+}
+
+/**
+ * @brief batch_img_mode_db make several derivatives of an image in db mode from one decoding
+ *
+ * @param thr_arg the thread arg
+ * @param reqs the zimg requests of one image
+ * @param n number of requests, at most BATCH_MAX
+ * @param results 1 for made, 0 for existed and -1 for failed of every request
+ *
+ * @return 1 for OK, 0 for image not found and -1 for failed
+ */
+int batch_img_mode_db(thr_arg_t *thr_arg, zimg_req_t *reqs, int n, int *results) {
+    char keys[BATCH_MAX][CACHE_KEY_SIZE];
+    zimg_req_t todo[BATCH_MAX];
+    int idx[BATCH_MAX], saves[BATCH_MAX];
+    char *outs[BATCH_MAX];
+    size_t lens[BATCH_MAX];
+    char *orig_buff = NULL;
+    size_t orig_len = 0;
+    int i, m = 0, made;
+
+    if (n <= 0 || n > BATCH_MAX)
+        return -1;
+    if (exist_db(thr_arg, reqs[0].md5) == -1) {
+        LOG_PRINT(LOG_DEBUG, "Image [%s] is not existed.", reqs[0].md5);
+        return 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        results[i] = -1;
+        if (meta_plan(thr_arg, &reqs[i], NULL) == -1)
+            continue;
+        gen_rsp_key(keys[i], &reqs[i]);
+        if (strcmp(keys[i], reqs[i].md5) == 0 || exist_db(thr_arg, keys[i]) == 1) {
+            results[i] = 0;
+            continue;
+        }
+        todo[m] = reqs[i];
+        idx[m++] = i;
+    }
+    if (m == 0)
+        return 1;
+
+    if (load_orig_db(thr_arg, reqs[0].md5, &orig_buff, &orig_len) == -1)
+        return -1;
+    made = batch_convert(todo, m, orig_buff, orig_len, outs, lens, saves);
+    free(orig_buff);
+    if (made == -1)
+        return -1;
+
+    /* the results are stored together once every transform is done */
+    for (i = 0; i < m; i++) {
+        int k = idx[i];
+        if (outs[i] == NULL)
+            continue;
+        if (lens[i] < CACHE_MAX_SIZE)
+            set_cache_bin(thr_arg, keys[k], outs[i], lens[i]);
+        dcache_set(keys[k], outs[i], lens[i]);
+        if (saves[i] == 1)
+            save_img_db(thr_arg, keys[k], outs[i], lens[i]);
+        results[k] = 1;
+        free(outs[i]);
+    }
+    return 1;
+}
+
 /**
  * @brief get_img_db Choose db to get image by setting.
  *
@@ -172,34 +303,45 @@ err:
 int get_img_db(thr_arg_t *thr_arg, const char *cache_key, char **buff, size_t *len) {
     int ret = -1;
 
-    if (settings.mode == 2 && thr_arg->beansdb_conn != NULL)
-        ret = get_img_beansdb(thr_arg->beansdb_conn, cache_key, buff, len);
-    else if (settings.mode == 3 && thr_arg->ssdb_conn != NULL)
-        ret = get_img_ssdb(thr_arg->ssdb_conn, cache_key, buff, len);
-
-    /*
-    if(ret == -1 && settings.mode == 3)
-    {
-        if(thr_arg->ssdb_conn != NULL)
-            redisFree(thr_arg->ssdb_conn);
-        redisContext* c = redisConnect(settings.ssdb_ip, settings.ssdb_port);
-        if(c->err)
-        {
-            redisFree(c);
-            LOG_PRINT(LOG_DEBUG, "Connect to ssdb server faile");
-            return ret;
-        }
-        else
-        {
-            thr_arg->ssdb_conn = c;
-            LOG_PRINT(LOG_DEBUG, "SSDB Server Reconnected.");
-            ret = get_img_ssdb(thr_arg->ssdb_conn, cache_key, buff, len);
-        }
-    }
-    */
+    if (journal_get(cache_key, buff, len) == 1)
+        return 1;
+    if (settings.mode == 2)
+        ret = get_img_beansdb(beansdb_get(thr_arg), cache_key, buff, len);
+    else if (settings.mode == 3)
+        ret = ring_get(thr_arg, cache_key, buff, len);
     return ret;
 }
 
+/**
+ * @brief exist_get_db check an original and get a key of it in one step
+ *
+ * @param thr_arg Thread arg struct.
+ * @param md5 The md5 of the original.
+ * @param cache_key The key to get, the original or a derivative.
+ * @param buff Image buffer.
+ * @param len Image size.
+ *
+ * @return 1 for got, 0 for original existed but key not found and -1 for original not existed.
+ */
+int exist_get_db(thr_arg_t *thr_arg, const char *md5, const char *cache_key, char **buff, size_t *len) {
+    int ret;
+
+    if (journal_exist(md5) == 1)
+        return (get_img_db(thr_arg, cache_key, buff, len) == 1) ? 1 : 0;
+    if (settings.mode == 3) {
+        ret = ring_exist_get(thr_arg, md5, cache_key, buff, len);
+        if (ret == 0 && journal_get(cache_key, buff, len) == 1)
+            ret = 1;
+        return ret;
+    }
+
+    if (exist_db(thr_arg, md5) == -1)
+        return -1;
+    if (get_img_db(thr_arg, cache_key, buff, len) == 1)
+        return 1;
+    return 0;
+}
+
 /**
 * @brief get_img_beansdb Find a key's BINARY value from beansdb backend.
 *
@@ -223,6 +365,15 @@ int get_img_beansdb(memcached_st *memc, const char *key, char **value_ptr, size_
     if (rc == MEMCACHED_SUCCESS) {
         LOG_PRINT(LOG_DEBUG, "Binary Beansdb Find Key[%s], Len: %d.", key, *len);
         rst = 1;
+        size_t total, step;
+        int count;
+        if (chunk_manifest(*value_ptr, *len, &total, &count, &step) == 1) {
+            free(*value_ptr);
+            *value_ptr = NULL;
+            rst = chunk_get_beansdb(memc, key, total, count, step, value_ptr);
+            if (rst == 1)
+                *len = total;
+        }
     } else if (rc == MEMCACHED_NOTFOUND) {
         LOG_PRINT(LOG_DEBUG, "Binary Beansdb Key[%s] Not Find!", key);
         rst = -1;
@@ -253,16 +404,41 @@ int get_img_ssdb(redisContext* c, const char *cache_key, char **buff, size_t *le
         LOG_PRINT(LOG_DEBUG, "Execut ssdb command failure");
         return -1;
     }
+    return reply_img_ssdb(c, cache_key, r, buff, len);
+}
+
+/**
+ * @brief reply_img_ssdb take the image out of the reply of a GET, fetch the chunks if it is a manifest
+ *
+ * @param c Conntion to ssdb.
+ * @param cache_key image key
+ * @param r the reply, freed here
+ * @param buff buffer to storage image
+ * @param len image size
+ *
+ * @return 1 for success and -1 for fail
+ */
+int reply_img_ssdb(redisContext* c, const char *cache_key, redisReply *r, char **buff, size_t *len) {
     if ( r->type != REDIS_REPLY_STRING ) {
         LOG_PRINT(LOG_DEBUG, "Failed to execute get [%s] from ssdb.", cache_key);
         freeReplyObject(r);
         return -1;
     }
+    size_t total, step;
+    int count;
+    if (chunk_manifest(r->str, r->len, &total, &count, &step) == 1) {
+        freeReplyObject(r);
+        if (chunk_get_ssdb(c, cache_key, total, count, buff) == -1)
+            return -1;
+        *len = total;
+        return 1;
+    }
 
     *len = r->len;
     *buff = (char *)malloc(r->len);
-    if (buff == NULL) {
+    if (*buff == NULL) {
         LOG_PRINT(LOG_DEBUG, "buff malloc failed!");
+        freeReplyObject(r);
         return -1;
     }
     memcpy(*buff, r->str, r->len);
@@ -275,7 +451,102 @@ int get_img_ssdb(redisContext* c, const char *cache_key, char **buff, size_t *le
 
 
 /**
- * @brief save_img_db Choose db mode to save images.
+ * @brief pipe_ssdb send several one-key commands to ssdb in one write and read all replies
+ *
+ * @param c Conntion to ssdb.
+ * @param n count of commands
+ * @param cmds the command formats, like "GET %s"
+ * @param keys the key of each command
+ * @param replies the replies, must be freed by caller when succ
+ *
+ * @return 1 for all replies read and -1 for fail
+ */
+int pipe_ssdb(redisContext* c, int n, const char **cmds, const char **keys, redisReply **replies) {
+    int i;
+
+    if (c == NULL)
+        return -1;
+    for (i = 0; i < n; i++) {
+        if (redisAppendCommand(c, cmds[i], keys[i]) != REDIS_OK) {
+            LOG_PRINT(LOG_DEBUG, "Append ssdb command [%s] failed", keys[i]);
+            return -1;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (redisGetReply(c, (void **)&replies[i]) != REDIS_OK || replies[i] == NULL) {
+            LOG_PRINT(LOG_DEBUG, "Execut ssdb command failure");
+            while (--i >= 0)
+                freeReplyObject(replies[i]);
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief exist_get_ssdb pipeline EXISTS of the original and GET of a key
+ *
+ * @param c Conntion to ssdb.
+ * @param md5 the md5 of the original
+ * @param cache_key the key to get
+ * @param buff buffer to storage image
+ * @param len image size
+ *
+ * @return 1 for got, 0 for original existed but key not found and -1 for not existed or fail
+ */
+int exist_get_ssdb(redisContext* c, const char *md5, const char *cache_key, char **buff, size_t *len) {
+    const char *cmds[2] = {"EXISTS %s", "GET %s"};
+    const char *keys[2] = {md5, cache_key};
+    redisReply *r[2];
+
+    /* the original itself needs no existence check */
+    if (strcmp(md5, cache_key) == 0)
+        return get_img_ssdb(c, cache_key, buff, len);
+    if (pipe_ssdb(c, 2, cmds, keys, r) == -1)
+        return -1;
+    return reply_exist_get_ssdb(c, cache_key, r, buff, len);
+}
+
+/**
+ * @brief reply_exist_get_ssdb take the result out of the replies of EXISTS and GET
+ *
+ * @param c Conntion to ssdb.
+ * @param cache_key the key to get
+ * @param r the two replies, freed here
+ * @param buff buffer to storage image
+ * @param len image size
+ *
+ * @return 1 for got, 0 for original existed but key not found and -1 for not existed
+ */
+int reply_exist_get_ssdb(redisContext* c, const char *cache_key, redisReply **r, char **buff, size_t *len) {
+    int rst = -1;
+
+    if (r[0]->type == REDIS_REPLY_INTEGER && r[0]->integer == 1) {
+        rst = 0;
+        size_t total, step;
+        int count;
+        if (r[1]->type == REDIS_REPLY_STRING && chunk_manifest(r[1]->str, r[1]->len, &total, &count, &step) == 1) {
+            if (chunk_get_ssdb(c, cache_key, total, count, buff) == 1) {
+                *len = total;
+                rst = 1;
+            }
+        } else if (r[1]->type == REDIS_REPLY_STRING) {
+            *buff = (char *)malloc(r[1]->len);
+            if (*buff != NULL) {
+                memcpy(*buff, r[1]->str, r[1]->len);
+                *len = r[1]->len;
+                rst = 1;
+                LOG_PRINT(LOG_DEBUG, "Succeed to get [%s] from ssdb. length = [%d].", cache_key, *len);
+            }
+        }
+    }
+    freeReplyObject(r[0]);
+    freeReplyObject(r[1]);
+    return rst;
+}
+
+/**
+ * @brief save_img_db Save images to the journal, or to the db when the journal is off or full.
  *
  * @param thr_arg Thread arg struct.
  * @param cache_key The key of image.
@@ -285,32 +556,27 @@ int get_img_ssdb(redisContext* c, const char *cache_key, char **buff, size_t *le
  * @return 1 for succ or -1 for fialed.
  */
 int save_img_db(thr_arg_t *thr_arg, const char *cache_key, const char *buff, const size_t len) {
+    if (journal_save(cache_key, buff, len) == 1)
+        return 1;
+    return write_img_db(thr_arg, cache_key, buff, len);
+}
+
+/**
+ * @brief write_img_db Choose db mode to save images, bypassing the journal.
+ *
+ * @param thr_arg Thread arg struct.
+ * @param cache_key The key of image.
+ * @param buff Image buffer.
+ * @param len Image size.
+ *
+ * @return 1 for succ or -1 for fialed.
+ */
+int write_img_db(thr_arg_t *thr_arg, const char *cache_key, const char *buff, const size_t len) {
     int ret = -1;
     if (settings.mode == 2)
-        ret = save_img_beansdb(thr_arg->beansdb_conn, cache_key, buff, len);
+        ret = save_img_beansdb(beansdb_get(thr_arg), cache_key, buff, len);
     else if (settings.mode == 3)
-        ret = save_img_ssdb(thr_arg->ssdb_conn, cache_key, buff, len);
-
-    /*
-    if(ret == -1 && settings.mode == 3)
-    {
-        if(thr_arg->ssdb_conn != NULL)
-            redisFree(thr_arg->ssdb_conn);
-        redisContext* c = redisConnect(settings.ssdb_ip, settings.ssdb_port);
-        if(c->err)
-        {
-            redisFree(c);
-            LOG_PRINT(LOG_DEBUG, "Connect to ssdb server faile");
-            return ret;
-        }
-        else
-        {
-            thr_arg->ssdb_conn = c;
-            LOG_PRINT(LOG_DEBUG, "SSDB Server Reconnected.");
-            ret = save_img_ssdb(thr_arg->ssdb_conn, cache_key, buff, len);
-        }
-    }
-    */
+        ret = ring_save(thr_arg, cache_key, buff, len);
     return ret;
 }
 
@@ -331,7 +597,9 @@ int save_img_beansdb(memcached_st *memc, const char *key, const char *value, con
 
     memcached_return rc;
 
-    rc = memcached_set(memc, key, strlen(key), value, len, 0, 0);
+    if (chunk_need(len) == 1)
+        return chunk_save_beansdb(memc, key, value, len);
+    rc = memcached_set(memc, key, strlen(key), value, len, key_ttl(key), 0);
 
     if (rc == MEMCACHED_SUCCESS) {
         LOG_PRINT(LOG_DEBUG, "Binary Beansdb Set Successfully. Key[%s] Len: %d.", key, len);
@@ -359,8 +627,15 @@ int save_img_beansdb(memcached_st *memc, const char *key, const char *value, con
 int save_img_ssdb(redisContext* c, const char *cache_key, const char *buff, const size_t len) {
     if (c == NULL)
         return -1;
+    if (chunk_need(len) == 1)
+        return chunk_save_ssdb(c, cache_key, buff, len);
 
-    redisReply *r = (redisReply*)redisCommand(c, "SET %s %b", cache_key, buff, len);
+    int ttl = key_ttl(cache_key);
+    redisReply *r;
+    if (ttl > 0)
+        r = (redisReply*)redisCommand(c, "SETEX %s %d %b", cache_key, ttl, buff, len);
+    else
+        r = (redisReply*)redisCommand(c, "SET %s %b", cache_key, buff, len);
     if ( NULL == r) {
         LOG_PRINT(LOG_DEBUG, "Execut ssdb command failure");
         return -1;
@@ -376,6 +651,20 @@ int save_img_ssdb(redisContext* c, const char *cache_key, const char *buff, cons
     return 1;
 }
 
+/**
+ * @brief key_ttl the expire time of a key when saved to kv backends
+ *
+ * @param cache_key the key, md5 for originals and md5:args for derivatives
+ *
+ * @return seconds to live, 0 for never expire
+ */
+int key_ttl(const char *cache_key) {
+    /* originals are permanent, derivatives can always be regenerated */
+    if (settings.derivative_ttl <= 0 || strchr(cache_key, ':') == NULL || is_meta_key(cache_key) == 1)
+        return 0;
+    return settings.derivative_ttl;
+}
+
 /**
  * @brief admin_img_mode_db deal with admin requests for db mode
  *
@@ -401,6 +690,7 @@ int admin_img_mode_db(evhtp_request_t *req, thr_arg_t *thr_arg, char *md5, int t
 
     if (t == 1) {
         if (del_db(thr_arg, cache_key) != -1) {
+            meta_del(thr_arg, md5);
             result = 1;
             evbuffer_add_printf(req->buffer_out,
                                 "<html><body><h1>Admin Command Successful!</h1> \
@@ -432,6 +722,12 @@ int info_img_mode_db(evhtp_request_t *request, thr_arg_t *thr_arg, char *md5) {
 
     LOG_PRINT(LOG_DEBUG, "original key: %s", md5);
 
+    img_meta_t meta;
+    if (meta_get(thr_arg, md5, NULL, &meta) == 1) {
+        meta_info(&meta, request);
+        return 1;
+    }
+
     size_t size = 0;
     if (get_img_db(thr_arg, md5, &orig_buff, &size) == -1) {
         result = 0;
@@ -469,14 +765,16 @@ err:
  */
 int exist_db(thr_arg_t *thr_arg, const char *cache_key) {
     int result = -1;
+    if (journal_exist(cache_key) == 1)
+        return 1;
     if (settings.mode == 2) {
-        if (exist_beansdb(thr_arg->beansdb_conn, cache_key) == 1)
+        if (exist_beansdb(beansdb_get(thr_arg), cache_key) == 1)
             result = 1;
         else {
             LOG_PRINT(LOG_DEBUG, "key: %s is not exist!", cache_key);
         }
     } else if (settings.mode == 3) {
-        if (exist_ssdb(thr_arg->ssdb_conn, cache_key) == 1)
+        if (ring_exist(thr_arg, cache_key) == 1)
             result = 1;
         else {
             LOG_PRINT(LOG_DEBUG, "key: %s is not exist!", cache_key);
@@ -540,7 +838,7 @@ int exist_ssdb(redisContext* c, const char *cache_key) {
 }
 
 /**
- * @brief del_db delete a file from db mode
+ * @brief del_db delete a file from the journal and db mode
  *
  * @param thr_arg the arg of thread
  * @param cache_key the key of the file
@@ -548,14 +846,30 @@ int exist_ssdb(redisContext* c, const char *cache_key) {
  * @return 1 for OK and -1 for fail
  */
 int del_db(thr_arg_t *thr_arg, const char *cache_key) {
+    int dropped = journal_del(cache_key);
+    int result;
+    dcache_del(cache_key);
+    result = remove_img_db(thr_arg, cache_key);
+    return (dropped == 1) ? 1 : result;
+}
+
+/**
+ * @brief remove_img_db delete a file from db mode, bypassing the journal
+ *
+ * @param thr_arg the arg of thread
+ * @param cache_key the key of the file
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int remove_img_db(thr_arg_t *thr_arg, const char *cache_key) {
     int result = -1;
     if (settings.mode == 2) {
-        if (del_beansdb(thr_arg->beansdb_conn, cache_key) == -1) {
+        if (del_beansdb(beansdb_get(thr_arg), cache_key) == -1) {
             LOG_PRINT(LOG_DEBUG, "delete key: %s failed!", cache_key);
         } else
             result = 1;
     } else if (settings.mode == 3) {
-        if (del_ssdb(thr_arg->ssdb_conn, cache_key) == -1) {
+        if (ring_del(thr_arg, cache_key) == -1) {
             LOG_PRINT(LOG_DEBUG, "delete key: %s failed!", cache_key);
         } else
             result = 1;
@@ -578,6 +892,7 @@ int del_beansdb(memcached_st *memc, const char *key) {
 
     memcached_return rc;
 
+    chunk_del_beansdb(memc, key);
     rc = memcached_delete(memc, key, strlen(key), 0);
 
     if (rc == MEMCACHED_SUCCESS) {
@@ -606,6 +921,7 @@ int del_ssdb(redisContext* c, const char *cache_key) {
     if (c == NULL)
         return rst;
 
+    chunk_del_ssdb(c, cache_key);
     redisReply *r = (redisReply*)redisCommand(c, "DEL %s", cache_key);
     if (r && r->type != REDIS_REPLY_NIL && r->type == REDIS_REPLY_INTEGER && r->integer == 1) {
         LOG_PRINT(LOG_DEBUG, "ssdb key %s deleted %d", cache_key, r->integer);
@@ -24,10 +24,13 @@
 #include "zcommon.h"
 
 int get_img_mode_db(zimg_req_t *req, evhtp_request_t *request);
+int batch_img_mode_db(thr_arg_t *thr_arg, zimg_req_t *reqs, int n, int *results);
 int get_img_db(thr_arg_t *thr_arg, const char *cache_key, char **buff, size_t *len);
 int get_img_beansdb(memcached_st *memc, const char *key, char **value_ptr, size_t *len);
 int get_img_ssdb(redisContext* c, const char *cache_key, char **buff, size_t *len);
+int reply_img_ssdb(redisContext* c, const char *cache_key, redisReply *r, char **buff, size_t *len);
 int save_img_db(thr_arg_t *thr_arg, const char *cache_key, const char *buff, const size_t len);
+int write_img_db(thr_arg_t *thr_arg, const char *cache_key, const char *buff, const size_t len);
 int save_img_beansdb(memcached_st *memc, const char *key, const char *value, const size_t len);
 int save_img_ssdb(redisContext* c, const char *cache_key, const char *buff, const size_t len);
 int admin_img_mode_db(evhtp_request_t *req, thr_arg_t *thr_arg, char *md5, int t);
@@ -36,7 +39,13 @@ int exist_db(thr_arg_t *thr_arg, const char *cache_key);
 int exist_beansdb(memcached_st *memc, const char *key);
 int exist_ssdb(redisContext* c, const char *cache_key);
 int del_db(thr_arg_t *thr_arg, const char *cache_key);
+int remove_img_db(thr_arg_t *thr_arg, const char *cache_key);
 int del_beansdb(memcached_st *memc, const char *key);
 int del_ssdb(redisContext* c, const char *cache_key);
+int key_ttl(const char *cache_key);
+int pipe_ssdb(redisContext* c, int n, const char **cmds, const char **keys, redisReply **replies);
+int exist_get_db(thr_arg_t *thr_arg, const char *md5, const char *cache_key, char **buff, size_t *len);
+int exist_get_ssdb(redisContext* c, const char *md5, const char *cache_key, char **buff, size_t *len);
+int reply_exist_get_ssdb(redisContext* c, const char *cache_key, redisReply **r, char **buff, size_t *len);
 
 #endif
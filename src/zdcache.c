@@ -0,0 +1,541 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zdcache.c
+ * @brief local disk cache of kv backends.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * In beansdb and ssdb mode, images missed by memcached are looked up on the
+ * local disk before the backend, and whatever comes from the backend or is
+ * generated is kept there. Files use the layout of disk mode:
+ * dcache_path/<h1>/<h2>/<md5>/0*0 for the original and the arguments of the
+ * key for a derivative. The index lives in memory and is rebuilt by a
+ * background scan on start. When dcache_size MB is exceeded, files are
+ * evicted by CLOCK: each hit sets a reference bit, the hand clears set bits
+ * and evicts the first entry found without one. An entry being written is
+ * pending: readers take it for a miss and the hand passes it by.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "zdcache.h"
+#include "zdisk.h"
+#include "zutil.h"
+#include "zlog.h"
+
+#define DCACHE_BUCKETS      65536
+/* an item larger than this share of the cache would flush too much of it */
+#define DCACHE_ITEM_SHARE   16
+
+#define DC_READY            0
+#define DC_PENDING          1
+/* deleted while being written, the writer drops it */
+#define DC_DROPPED          2
+
+typedef struct dc_entry_s dc_entry_t;
+
+struct dc_entry_s {
+    char key[CACHE_KEY_SIZE];
+    size_t len;
+    int ref;
+    int state;
+    size_t slot;
+    dc_entry_t *hnext;
+};
+
+typedef struct dc_stat_s {
+    long hits;
+    long misses;
+    long stored;
+    long evicted;
+    long errors;
+} dc_stat_t;
+
+static int dc_on = 0;
+static dc_entry_t *dc_index[DCACHE_BUCKETS];
+static dc_entry_t **dc_ring = NULL;
+static size_t dc_count = 0;
+static size_t dc_cap = 0;
+static size_t dc_hand = 0;
+static uint64_t dc_bytes = 0;
+static uint64_t dc_max = 0;
+static dc_stat_t dc_stat;
+static pthread_mutex_t dc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int dcache_init(void);
+int dcache_get(const char *key, char **buff, size_t *len);
+void dcache_set(const char *key, const char *buff, size_t len);
+void dcache_del(const char *key);
+void dcache_status(cJSON *j_ret);
+static uint32_t dc_hash(const char *key);
+static int dc_path(const char *key, char *dir, char *path);
+static dc_entry_t * dc_find(const char *key);
+static dc_entry_t * dc_insert(const char *key, size_t len);
+static void dc_remove(dc_entry_t *e);
+static dc_entry_t * dc_evict(size_t need);
+static void dc_unlink(dc_entry_t *victims);
+static void dc_scan_dir(const char *md5, const char *dir);
+static void * dc_scan(void *arg);
+
+/**
+ * @brief dcache_init create the cache dir and start the scan of old files
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int dcache_init(void) {
+    pthread_t tid;
+
+    if (settings.mode != 2 && settings.mode != 3) {
+        LOG_PRINT(LOG_WARNING, "disk cache only works in beansdb and ssdb mode, disabled");
+        return 1;
+    }
+    if (is_dir(settings.dcache_path) != 1 && mk_dirs(settings.dcache_path) != 1) {
+        LOG_PRINT(LOG_DEBUG, "dcache_path[%s] Create Failed!", settings.dcache_path);
+        return -1;
+    }
+    memset(&dc_stat, 0, sizeof(dc_stat));
+    dc_max = (uint64_t)settings.dcache_size * 1024 * 1024;
+    if (pthread_create(&tid, NULL, dc_scan, NULL) != 0) {
+        LOG_PRINT(LOG_DEBUG, "disk cache scan create failed!");
+        return -1;
+    }
+    pthread_detach(tid);
+    dc_on = 1;
+    LOG_PRINT(LOG_DEBUG, "Disk Cache Init Finished. path: %s size: %dMB", settings.dcache_path, settings.dcache_size);
+    return 1;
+}
+
+/**
+ * @brief dcache_get read an image from the disk cache
+ *
+ * @param key the key of the image
+ * @param buff the buffer, free by caller
+ * @param len the length of buff
+ *
+ * @return 1 for hit and -1 for miss
+ */
+int dcache_get(const char *key, char **buff, size_t *len) {
+    char dir[PATH_MAX_SIZE];
+    char path[PATH_MAX_SIZE];
+    dc_entry_t *e;
+
+    if (dc_on == 0 || dc_path(key, dir, path) == -1)
+        return -1;
+
+    pthread_mutex_lock(&dc_lock);
+    if ((e = dc_find(key)) == NULL || e->state != DC_READY) {
+        dc_stat.misses++;
+        pthread_mutex_unlock(&dc_lock);
+        return -1;
+    }
+    e->ref = 1;
+    pthread_mutex_unlock(&dc_lock);
+
+    if (disk_read(path, buff, len) != 1) {
+        /* evicted meanwhile or lost, forget it */
+        pthread_mutex_lock(&dc_lock);
+        if ((e = dc_find(key)) != NULL && e->state == DC_READY)
+            dc_remove(e);
+        dc_stat.misses++;
+        pthread_mutex_unlock(&dc_lock);
+        return -1;
+    }
+    pthread_mutex_lock(&dc_lock);
+    dc_stat.hits++;
+    pthread_mutex_unlock(&dc_lock);
+    LOG_PRINT(LOG_DEBUG, "disk cache hit key:%s len:%zu", key, *len);
+    return 1;
+}
+
+/**
+ * @brief dcache_set keep an image in the disk cache, evicting old ones
+ *
+ * @param key the key of the image
+ * @param buff the image buffer
+ * @param len the length of buff
+ */
+void dcache_set(const char *key, const char *buff, size_t len) {
+    char dir[PATH_MAX_SIZE];
+    char path[PATH_MAX_SIZE];
+    char tmp[PATH_MAX_SIZE];
+    dc_entry_t *e, *victims;
+
+    if (dc_on == 0 || len == 0 || len > dc_max / DCACHE_ITEM_SHARE || dc_path(key, dir, path) == -1)
+        return;
+
+    pthread_mutex_lock(&dc_lock);
+    if ((e = dc_find(key)) != NULL) {
+        e->ref = 1;
+        pthread_mutex_unlock(&dc_lock);
+        return;
+    }
+    victims = dc_evict(len);
+    e = dc_insert(key, len);
+    if (e != NULL)
+        e->state = DC_PENDING;
+    pthread_mutex_unlock(&dc_lock);
+    dc_unlink(victims);
+    if (e == NULL)
+        return;
+
+    /* written aside and renamed, readers never see half a file */
+    snprintf(tmp, PATH_MAX_SIZE, "%s.%lu.tmp", path, (unsigned long)pthread_self());
+    if ((is_dir(dir) == 1 || mk_dirs(dir) == 1) && disk_write(tmp, buff, len) == 1 && rename(tmp, path) == 0) {
+        /* only this writer frees a pending entry, e is still valid */
+        pthread_mutex_lock(&dc_lock);
+        if (e->state == DC_DROPPED) {
+            dc_remove(e);
+            pthread_mutex_unlock(&dc_lock);
+            unlink(path);
+            return;
+        }
+        e->state = DC_READY;
+        dc_stat.stored++;
+        pthread_mutex_unlock(&dc_lock);
+        return;
+    }
+    LOG_PRINT(LOG_WARNING, "disk cache write key:%s failed", key);
+    unlink(tmp);
+    pthread_mutex_lock(&dc_lock);
+    dc_stat.errors++;
+    dc_remove(e);
+    pthread_mutex_unlock(&dc_lock);
+}
+
+/**
+ * @brief dcache_del drop an image from the disk cache
+ *
+ * @param key the key of the image
+ */
+void dcache_del(const char *key) {
+    char dir[PATH_MAX_SIZE];
+    char path[PATH_MAX_SIZE];
+    dc_entry_t *e;
+
+    if (dc_on == 0 || dc_path(key, dir, path) == -1)
+        return;
+    pthread_mutex_lock(&dc_lock);
+    if ((e = dc_find(key)) != NULL) {
+        if (e->state == DC_READY)
+            dc_remove(e);
+        else
+            e->state = DC_DROPPED;
+    }
+    pthread_mutex_unlock(&dc_lock);
+    unlink(path);
+}
+
+/**
+ * @brief dcache_status add the disk cache counters to a json object
+ *
+ * @param j_ret the json object
+ */
+void dcache_status(cJSON *j_ret) {
+    dc_stat_t st;
+    size_t count;
+    uint64_t bytes;
+    cJSON *j_dc;
+
+    if (dc_on == 0)
+        return;
+    pthread_mutex_lock(&dc_lock);
+    st = dc_stat;
+    count = dc_count;
+    bytes = dc_bytes;
+    pthread_mutex_unlock(&dc_lock);
+
+    j_dc = cJSON_CreateObject();
+    cJSON_AddNumberToObject(j_dc, "hits", st.hits);
+    cJSON_AddNumberToObject(j_dc, "misses", st.misses);
+    cJSON_AddNumberToObject(j_dc, "stored", st.stored);
+    cJSON_AddNumberToObject(j_dc, "evicted", st.evicted);
+    cJSON_AddNumberToObject(j_dc, "errors", st.errors);
+    cJSON_AddNumberToObject(j_dc, "items", count);
+    cJSON_AddNumberToObject(j_dc, "bytes", bytes);
+    cJSON_AddNumberToObject(j_dc, "max_bytes", dc_max);
+    cJSON_AddItemToObject(j_ret, "disk_cache", j_dc);
+}
+
+/**
+ * @brief dc_hash bucket of a key in the index
+ *
+ * @param key the key
+ *
+ * @return the bucket
+ */
+static uint32_t dc_hash(const char *key) {
+    uint32_t h = 2166136261U;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619U;
+    }
+    return h & (DCACHE_BUCKETS - 1);
+}
+
+/**
+ * @brief dc_path the dir and file of a key, md5 for originals and md5:args for derivatives
+ *
+ * @param key the key
+ * @param dir the dir of the md5
+ * @param path the file
+ *
+ * @return 1 for OK and -1 for a key not starting with a md5
+ */
+static int dc_path(const char *key, char *dir, char *path) {
+    char md5[33];
+    char name[CACHE_KEY_SIZE];
+    char *p;
+
+    if (strlen(key) < 32 || (key[32] != '\0' && key[32] != ':') || strlen(key) >= CACHE_KEY_SIZE)
+        return -1;
+    memcpy(md5, key, 32);
+    md5[32] = '\0';
+    if (is_md5(md5) != 1)
+        return -1;
+    get_img_path(settings.dcache_path, md5, dir);
+    if (key[32] == '\0') {
+        snprintf(path, PATH_MAX_SIZE, "%s/0*0", dir);
+    } else {
+        str_lcpy(name, key + 33, sizeof(name));
+        for (p = name; *p; p++) {
+            if (*p == '/')
+                *p = '_';
+        }
+        snprintf(path, PATH_MAX_SIZE, "%s/%s", dir, name);
+    }
+    return 1;
+}
+
+/**
+ * @brief dc_find find the entry of a key, dc_lock held
+ *
+ * @param key the key
+ *
+ * @return the entry or NULL
+ */
+static dc_entry_t * dc_find(const char *key) {
+    dc_entry_t *e;
+    for (e = dc_index[dc_hash(key)]; e != NULL; e = e->hnext) {
+        if (strcmp(e->key, key) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/**
+ * @brief dc_insert add an entry behind the clock hand, dc_lock held
+ *
+ * @param key the key
+ * @param len the size of the file
+ *
+ * @return the entry or NULL
+ */
+static dc_entry_t * dc_insert(const char *key, size_t len) {
+    dc_entry_t *e;
+    uint32_t h;
+
+    if (dc_count == dc_cap) {
+        size_t cap = dc_cap ? dc_cap * 2 : 1024;
+        dc_entry_t **ring = (dc_entry_t **)realloc(dc_ring, cap * sizeof(dc_entry_t *));
+        if (ring == NULL)
+            return NULL;
+        dc_ring = ring;
+        dc_cap = cap;
+    }
+    if ((e = (dc_entry_t *)calloc(1, sizeof(dc_entry_t))) == NULL)
+        return NULL;
+    str_lcpy(e->key, key, sizeof(e->key));
+    e->len = len;
+    e->slot = dc_count;
+    dc_ring[dc_count++] = e;
+    h = dc_hash(key);
+    e->hnext = dc_index[h];
+    dc_index[h] = e;
+    dc_bytes += len;
+    return e;
+}
+
+/**
+ * @brief dc_remove take an entry out of the index and the ring and free it, dc_lock held
+ *
+ * @param e the entry
+ */
+static void dc_remove(dc_entry_t *e) {
+    dc_entry_t **pp = &dc_index[dc_hash(e->key)];
+
+    while (*pp != NULL && *pp != e)
+        pp = &(*pp)->hnext;
+    if (*pp != NULL)
+        *pp = e->hnext;
+    /* the last entry fills the hole, the clock order barely changes */
+    dc_ring[e->slot] = dc_ring[--dc_count];
+    dc_ring[e->slot]->slot = e->slot;
+    if (dc_hand >= dc_count)
+        dc_hand = 0;
+    dc_bytes -= e->len;
+    free(e);
+}
+
+/**
+ * @brief dc_evict run the clock until need more bytes fit, dc_lock held
+ *
+ * @param need the bytes to make room for
+ *
+ * @return the evicted entries, out of the index, linked by hnext
+ */
+static dc_entry_t * dc_evict(size_t need) {
+    dc_entry_t *victims = NULL;
+    dc_entry_t *e;
+    size_t passed = 0;
+
+    while (dc_count > 0 && dc_bytes + need > dc_max) {
+        e = dc_ring[dc_hand];
+        if (e->ref || e->state != DC_READY) {
+            /* two rounds clear every bit, only pending entries are left */
+            if (++passed > 2 * dc_count)
+                break;
+            e->ref = 0;
+            dc_hand = (dc_hand + 1) % dc_count;
+            continue;
+        }
+        passed = 0;
+        /* unlink from the index by hand, the entry lives on as a victim */
+        {
+            dc_entry_t **pp = &dc_index[dc_hash(e->key)];
+            while (*pp != e)
+                pp = &(*pp)->hnext;
+            *pp = e->hnext;
+        }
+        dc_ring[dc_hand] = dc_ring[--dc_count];
+        dc_ring[dc_hand]->slot = dc_hand;
+        if (dc_hand >= dc_count)
+            dc_hand = 0;
+        dc_bytes -= e->len;
+        dc_stat.evicted++;
+        e->hnext = victims;
+        victims = e;
+    }
+    return victims;
+}
+
+/**
+ * @brief dc_unlink delete the files of evicted entries and free them
+ *
+ * @param victims the evicted entries
+ */
+static void dc_unlink(dc_entry_t *victims) {
+    char dir[PATH_MAX_SIZE];
+    char path[PATH_MAX_SIZE];
+    dc_entry_t *e;
+
+    while ((e = victims) != NULL) {
+        victims = e->hnext;
+        if (dc_path(e->key, dir, path) == 1)
+            unlink(path);
+        free(e);
+    }
+}
+
+/**
+ * @brief dc_scan_dir index the files of one md5 dir
+ *
+ * @param md5 the md5
+ * @param dir the dir
+ */
+static void dc_scan_dir(const char *md5, const char *dir) {
+    DIR *d;
+    struct dirent *ent;
+    struct stat st;
+    char path[PATH_MAX_SIZE];
+    char key[CACHE_KEY_SIZE];
+    dc_entry_t *victims;
+
+    if ((d = opendir(dir)) == NULL)
+        return;
+    while ((ent = readdir(d)) != NULL) {
+        size_t n = strlen(ent->d_name);
+        if (ent->d_name[0] == '.')
+            continue;
+        snprintf(path, PATH_MAX_SIZE, "%s/%s", dir, ent->d_name);
+        if (n > 4 && strcmp(ent->d_name + n - 4, ".tmp") == 0) {
+            unlink(path);
+            continue;
+        }
+        if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+            continue;
+        if (strcmp(ent->d_name, "0*0") == 0)
+            str_lcpy(key, md5, sizeof(key));
+        else
+            snprintf(key, sizeof(key), "%s:%s", md5, ent->d_name);
+
+        pthread_mutex_lock(&dc_lock);
+        victims = NULL;
+        if (dc_find(key) == NULL) {
+            victims = dc_evict(st.st_size);
+            dc_insert(key, st.st_size);
+        }
+        pthread_mutex_unlock(&dc_lock);
+        dc_unlink(victims);
+    }
+    closedir(d);
+}
+
+/**
+ * @brief dc_scan the thread indexing the files left by the last run
+ *
+ * @param arg not used
+ *
+ * @return not used
+ */
+static void * dc_scan(void *arg) {
+    DIR *d1, *d2, *d3;
+    struct dirent *e1, *e2, *e3;
+    char p1[PATH_MAX_SIZE], p2[PATH_MAX_SIZE], p3[PATH_MAX_SIZE];
+    const char *root = settings.dcache_path;
+
+    if ((d1 = opendir(root)) == NULL)
+        return NULL;
+    while ((e1 = readdir(d1)) != NULL) {
+        if (e1->d_name[0] == '.')
+            continue;
+        snprintf(p1, PATH_MAX_SIZE, "%s/%s", root, e1->d_name);
+        if ((d2 = opendir(p1)) == NULL)
+            continue;
+        while ((e2 = readdir(d2)) != NULL) {
+            if (e2->d_name[0] == '.')
+                continue;
+            snprintf(p2, PATH_MAX_SIZE, "%s/%s", p1, e2->d_name);
+            if ((d3 = opendir(p2)) == NULL)
+                continue;
+            while ((e3 = readdir(d3)) != NULL) {
+                if (is_md5(e3->d_name) != 1)
+                    continue;
+                snprintf(p3, PATH_MAX_SIZE, "%s/%s", p2, e3->d_name);
+                dc_scan_dir(e3->d_name, p3);
+            }
+            closedir(d3);
+        }
+        closedir(d2);
+    }
+    closedir(d1);
+    LOG_PRINT(LOG_INFO, "disk cache scan finished. items: %zu bytes: %llu", dc_count, (unsigned long long)dc_bytes);
+    return NULL;
+}
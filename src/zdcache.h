@@ -0,0 +1,33 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zdcache.h
+ * @brief local disk cache of kv backends header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZDCACHE_H
+#define ZDCACHE_H
+
+#include "zcommon.h"
+#include "cjson/cJSON.h"
+
+int dcache_init(void);
+int dcache_get(const char *key, char **buff, size_t *len);
+void dcache_set(const char *key, const char *buff, size_t len);
+void dcache_del(const char *key);
+void dcache_status(cJSON *j_ret);
+
+#endif
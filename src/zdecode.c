@@ -0,0 +1,414 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zdecode.c
+ * @brief decoding of originals sized to the request.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * A thumbnail of a large original only needs a fraction of its pixels, so
+ * the decoder is told the size before it starts: JPEG is scaled in the DCT
+ * domain by 1/2, 1/4 or 1/8 through the jpeg:size hint and WebP by the
+ * scaler of libwebp. The decoded image is never smaller than the request
+ * needs under either orientation, and proportion() finishes the exact
+ * size with Lanczos as before. Percent scales depend on the full size and
+ * are decoded as they are.
+ *
+ * A crop only needs its own rectangle. JPEG skips the rows above it and
+ * decodes only the MCU columns around it, WebP crops in the decoder, and
+ * the offsets of the request are moved into the decoded region so that
+ * convert() crops the same pixels. PNG and GIF have no random access to
+ * rows or tiles and are decoded as a whole.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <webp/decode.h>
+#include "zdecode.h"
+#include "znative.h"
+#include "zlog.h"
+
+static int jpeg_dims(const unsigned char *p, size_t len, unsigned long *w, unsigned long *h);
+static double shrink_ratio(zimg_req_t *req, unsigned long w, unsigned long h);
+static int read_jpeg_shrink(MagickWand *im, const char *buff, size_t len, unsigned long w, unsigned long h, double s);
+static int read_webp_shrink(MagickWand *im, const char *buff, size_t len, double s);
+static double batch_ratio(zimg_req_t *reqs, int n, unsigned long w, unsigned long h);
+static int roi_wanted(zimg_req_t *req);
+static int read_jpeg_roi(MagickWand *im, zimg_req_t *req, const char *buff, size_t len);
+static int read_webp_roi(MagickWand *im, zimg_req_t *req, const char *buff, size_t len);
+int read_img_blob(MagickWand *im, zimg_req_t *req, const char *buff, size_t len);
+int read_img_batch(MagickWand *im, zimg_req_t *reqs, int n, const char *buff, size_t len);
+void decode_limits(void);
+
+/**
+ * @brief jpeg_dims find the size of a jpeg in its frame header
+ *
+ * @param p the jpeg
+ * @param len length of the jpeg
+ * @param w the width
+ * @param h the height
+ *
+ * @return 1 for OK and -1 for not a jpeg or no frame header
+ */
+static int jpeg_dims(const unsigned char *p, size_t len, unsigned long *w, unsigned long *h) {
+    size_t i = 2, seg;
+    unsigned char m;
+
+    if (len < 4 || p[0] != 0xFF || p[1] != 0xD8)
+        return -1;
+    while (i + 4 <= len) {
+        if (p[i] != 0xFF)
+            return -1;
+        m = p[i + 1];
+        if (m == 0xFF) {
+            i++;
+            continue;
+        }
+        seg = ((size_t)p[i + 2] << 8) | p[i + 3];
+        /* SOF0-SOF15 except DHT, JPG and DAC */
+        if (m >= 0xC0 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC) {
+            if (i + 9 > len)
+                return -1;
+            *h = ((unsigned long)p[i + 5] << 8) | p[i + 6];
+            *w = ((unsigned long)p[i + 7] << 8) | p[i + 8];
+            return (*w > 0 && *h > 0) ? 1 : -1;
+        }
+        if (m == 0xDA || seg < 2)
+            return -1;
+        i += 2 + seg;
+    }
+    return -1;
+}
+
+/**
+ * @brief shrink_ratio the smallest share of the original a request needs
+ *
+ * @param req the zimg request
+ * @param w width of the original
+ * @param h height of the original
+ *
+ * @return the ratio, 1.0 if the full size is needed
+ */
+static double shrink_ratio(zimg_req_t *req, unsigned long w, unsigned long h) {
+    double s = 0, si, rc, rr;
+    unsigned long cs[2] = {w, h}, rs[2] = {h, w};
+    int cols, rows, i;
+
+    if (settings.shrink_on_load != 1 || req == NULL)
+        return 1.0;
+    if (settings.script_on == 1 && req->type != NULL)
+        return 1.0;
+    cols = req->width;
+    rows = req->height;
+    if ((cols == 0 && rows == 0) || req->x != -1 || req->y != -1)
+        return 1.0;
+    /* center crops and percent scales work on the full size */
+    if (req->proportion != 0 && req->proportion != 1 && req->proportion != 4)
+        return 1.0;
+    if (req->proportion == 0 && (cols == 0 || rows == 0))
+        return 1.0;
+
+    /* convert() auto-orients first, the orientation is not known before decoding */
+    for (i = 0; i < 2; i++) {
+        rc = (double)cols / cs[i];
+        rr = (double)rows / rs[i];
+        if (cols == 0)
+            si = rr;
+        else if (rows == 0)
+            si = rc;
+        else if (req->proportion == 4)
+            si = rc < rr ? rc : rr;
+        else
+            si = rc > rr ? rc : rr;
+        if (si > s)
+            s = si;
+    }
+    return s < 1.0 ? s : 1.0;
+}
+
+/**
+ * @brief read_jpeg_shrink read a jpeg scaled by the largest DCT factor the request allows
+ *
+ * @param im the MagickWand
+ * @param buff the jpeg
+ * @param len length of the jpeg
+ * @param w width of the jpeg
+ * @param h height of the jpeg
+ * @param s the share of the original needed
+ *
+ * @return MagickTrue for OK and MagickFalse for fail
+ */
+static int read_jpeg_shrink(MagickWand *im, const char *buff, size_t len, unsigned long w, unsigned long h, double s) {
+    unsigned long need_w = (unsigned long)ceil(w * s), need_h = (unsigned long)ceil(h * s);
+    char hint[64];
+    int d, ret;
+
+    for (d = 8; d > 1; d /= 2) {
+        if (w / d >= need_w && h / d >= need_h)
+            break;
+    }
+    if (d == 1)
+        return MagickReadImageBlob(im, (const unsigned char *)buff, len);
+
+    /* the decoder picks the smallest scale keeping both sides above the hint */
+    snprintf(hint, sizeof(hint), "%lux%lu", w / d, h / d);
+    MagickSetOption(im, "jpeg:size", hint);
+    ret = MagickReadImageBlob(im, (const unsigned char *)buff, len);
+    MagickDeleteOption(im, "jpeg:size");
+    LOG_PRINT(LOG_DEBUG, "jpeg %lux%lu decoded at 1/%d to %lux%lu", w, h, d,
+              (unsigned long)MagickGetImageWidth(im), (unsigned long)MagickGetImageHeight(im));
+    return ret;
+}
+
+/**
+ * @brief read_webp_shrink read a still webp scaled by libwebp
+ *
+ * @param im the MagickWand
+ * @param buff the webp
+ * @param len length of the webp
+ * @param s the share of the original needed
+ *
+ * @return MagickTrue for OK and -1 if it cannot be scaled here
+ */
+static int read_webp_shrink(MagickWand *im, const char *buff, size_t len, double s) {
+    WebPDecoderConfig config;
+    int ret, alpha;
+
+    if (WebPInitDecoderConfig(&config) == 0)
+        return -1;
+    if (WebPGetFeatures((const uint8_t *)buff, len, &config.input) != VP8_STATUS_OK)
+        return -1;
+    if (config.input.has_animation)
+        return -1;
+
+    alpha = config.input.has_alpha;
+    config.options.use_scaling = 1;
+    config.options.scaled_width = (int)ceil(config.input.width * s);
+    config.options.scaled_height = (int)ceil(config.input.height * s);
+    config.output.colorspace = alpha ? MODE_RGBA : MODE_RGB;
+    if (WebPDecode((const uint8_t *)buff, len, &config) != VP8_STATUS_OK) {
+        WebPFreeDecBuffer(&config.output);
+        return -1;
+    }
+    ret = MagickConstituteImage(im, config.output.width, config.output.height, alpha ? "RGBA" : "RGB",
+                                CharPixel, config.output.u.RGBA.rgba);
+    WebPFreeDecBuffer(&config.output);
+    if (ret != MagickTrue || MagickSetImageFormat(im, "WEBP") != MagickTrue) {
+        ClearMagickWand(im);
+        return -1;
+    }
+    LOG_PRINT(LOG_DEBUG, "webp %dx%d decoded to %dx%d", config.input.width, config.input.height,
+              config.options.scaled_width, config.options.scaled_height);
+    return MagickTrue;
+}
+
+/**
+ * @brief batch_ratio the smallest share of the original all requests of a batch need
+ *
+ * @param reqs the zimg requests
+ * @param n number of requests
+ * @param w width of the original
+ * @param h height of the original
+ *
+ * @return the ratio, 1.0 if the full size is needed
+ */
+static double batch_ratio(zimg_req_t *reqs, int n, unsigned long w, unsigned long h) {
+    double s = n > 0 ? 0 : 1.0, si;
+    int i;
+
+    for (i = 0; i < n && s < 1.0; i++) {
+        si = shrink_ratio(&reqs[i], w, h);
+        if (si > s)
+            s = si;
+    }
+    return s;
+}
+
+/**
+ * @brief roi_wanted whether convert() will crop the request
+ *
+ * @param req the zimg request
+ *
+ * @return 1 for a crop and -1 for not
+ */
+static int roi_wanted(zimg_req_t *req) {
+    if (settings.shrink_on_load != 1 || req == NULL)
+        return -1;
+    if (settings.script_on == 1 && req->type != NULL)
+        return -1;
+    if (req->x == -1 && req->y == -1)
+        return -1;
+    if (req->width == 0 && req->height == 0)
+        return -1;
+    return 1;
+}
+
+/**
+ * @brief read_jpeg_roi read the region of a jpeg around the crop of the request
+ *
+ * @param im the MagickWand
+ * @param req the zimg request, its offsets moved into the region
+ * @param buff the jpeg
+ * @param len length of the jpeg
+ *
+ * @return MagickTrue for OK and -1 if it is decoded as a whole
+ */
+static int read_jpeg_roi(MagickWand *im, zimg_req_t *req, const char *buff, size_t len) {
+    native_roi_t roi;
+    int ret;
+
+    if (native_roi(req, buff, len, &roi) != 1)
+        return -1;
+    ret = MagickConstituteImage(im, roi.width, roi.height, roi.ch == 1 ? "I" : "RGB", CharPixel, roi.pix);
+    free(roi.pix);
+    if (ret != MagickTrue || MagickSetImageFormat(im, "JPEG") != MagickTrue) {
+        ClearMagickWand(im);
+        return -1;
+    }
+    /* convert() keeps the quality of the original when it is lower than requested */
+    if (roi.quality > 0)
+        MagickSetImageCompressionQuality(im, roi.quality);
+    req->x = (req->x < 0 ? 0 : req->x) - roi.x;
+    req->y = (req->y < 0 ? 0 : req->y) - roi.y;
+    return MagickTrue;
+}
+
+/**
+ * @brief read_webp_roi read the region of a still webp around the crop of the request
+ *
+ * @param im the MagickWand
+ * @param req the zimg request, its offsets moved into the region
+ * @param buff the webp
+ * @param len length of the webp
+ *
+ * @return MagickTrue for OK and -1 if it is decoded as a whole
+ */
+static int read_webp_roi(MagickWand *im, zimg_req_t *req, const char *buff, size_t len) {
+    WebPDecoderConfig config;
+    int ret, alpha, x, y, cw, ch;
+
+    if (WebPInitDecoderConfig(&config) == 0)
+        return -1;
+    if (WebPGetFeatures((const uint8_t *)buff, len, &config.input) != VP8_STATUS_OK)
+        return -1;
+    if (config.input.has_animation)
+        return -1;
+
+    /* the rectangle of crop() */
+    x = req->x < 0 ? 0 : req->x;
+    y = req->y < 0 ? 0 : req->y;
+    if (x >= config.input.width || y >= config.input.height)
+        return -1;
+    cw = (req->width == 0 || config.input.width < x + req->width) ? config.input.width - x : req->width;
+    ch = (req->height == 0 || config.input.height < y + req->height) ? config.input.height - y : req->height;
+    if ((double)cw * ch > (double)config.input.width * config.input.height / 2)
+        return -1;
+
+    /* libwebp crops from even offsets because of the chroma subsampling */
+    alpha = config.input.has_alpha;
+    config.options.use_cropping = 1;
+    config.options.crop_left = x & ~1;
+    config.options.crop_top = y & ~1;
+    config.options.crop_width = cw + (x & 1);
+    config.options.crop_height = ch + (y & 1);
+    config.output.colorspace = alpha ? MODE_RGBA : MODE_RGB;
+    if (WebPDecode((const uint8_t *)buff, len, &config) != VP8_STATUS_OK) {
+        WebPFreeDecBuffer(&config.output);
+        return -1;
+    }
+    ret = MagickConstituteImage(im, config.output.width, config.output.height, alpha ? "RGBA" : "RGB",
+                                CharPixel, config.output.u.RGBA.rgba);
+    WebPFreeDecBuffer(&config.output);
+    if (ret != MagickTrue || MagickSetImageFormat(im, "WEBP") != MagickTrue) {
+        ClearMagickWand(im);
+        return -1;
+    }
+    req->x = x - config.options.crop_left;
+    req->y = y - config.options.crop_top;
+    LOG_PRINT(LOG_DEBUG, "webp %dx%d decoded region %d,%d %dx%d for crop %d,%d %dx%d",
+              config.input.width, config.input.height, config.options.crop_left, config.options.crop_top,
+              config.options.crop_width, config.options.crop_height, x, y, cw, ch);
+    return MagickTrue;
+}
+
+/**
+ * @brief read_img_blob read an original into a MagickWand, no larger than the request needs
+ *
+ * @param im the MagickWand
+ * @param req the zimg request, NULL for the full size; the offsets of a crop are moved into
+ * the decoded region
+ * @param buff the image
+ * @param len length of the image
+ *
+ * @return MagickTrue for OK and MagickFalse for fail
+ */
+int read_img_blob(MagickWand *im, zimg_req_t *req, const char *buff, size_t len) {
+    int ret;
+
+    if (roi_wanted(req) == 1) {
+        ret = read_jpeg_roi(im, req, buff, len);
+        if (ret == -1 && WebPGetInfo((const uint8_t *)buff, len, NULL, NULL) != 0)
+            ret = read_webp_roi(im, req, buff, len);
+        if (ret != -1)
+            return ret;
+    }
+    return read_img_batch(im, req, req != NULL ? 1 : 0, buff, len);
+}
+
+/**
+ * @brief read_img_batch read an original once for several requests, no larger than the largest needs
+ *
+ * @param im the MagickWand
+ * @param reqs the zimg requests
+ * @param n number of requests, 0 for the full size
+ * @param buff the image
+ * @param len length of the image
+ *
+ * @return MagickTrue for OK and MagickFalse for fail
+ */
+int read_img_batch(MagickWand *im, zimg_req_t *reqs, int n, const char *buff, size_t len) {
+    unsigned long w, h;
+    int width, height;
+    double s;
+
+    if (jpeg_dims((const unsigned char *)buff, len, &w, &h) == 1) {
+        s = batch_ratio(reqs, n, w, h);
+        if (s <= 0.5)
+            return read_jpeg_shrink(im, buff, len, w, h, s);
+    } else if (WebPGetInfo((const uint8_t *)buff, len, &width, &height) != 0) {
+        s = batch_ratio(reqs, n, width, height);
+        if (s <= 0.5) {
+            int ret = read_webp_shrink(im, buff, len, s);
+            if (ret != -1)
+                return ret;
+        }
+    }
+    return MagickReadImageBlob(im, (const unsigned char *)buff, len);
+}
+
+/**
+ * @brief decode_limits apply magick_memory and magick_map to the pixel caches, after the genesis
+ */
+void decode_limits(void) {
+    /* large images go to the disk cache instead of the heap */
+    if (settings.magick_memory > 0)
+        MagickSetResourceLimit(MemoryResource, (MagickSizeType)settings.magick_memory << 20);
+    if (settings.magick_map > 0)
+        MagickSetResourceLimit(MapResource, (MagickSizeType)settings.magick_map << 20);
+    LOG_PRINT(LOG_DEBUG, "MagickWand memory limit %llu map limit %llu",
+              (unsigned long long)MagickGetResourceLimit(MemoryResource),
+              (unsigned long long)MagickGetResourceLimit(MapResource));
+}
@@ -0,0 +1,31 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zdecode.h
+ * @brief decoding of originals sized to the request header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZDECODE_H
+#define ZDECODE_H
+
+#include <wand/magick_wand.h>
+#include "zcommon.h"
+
+int read_img_blob(MagickWand *im, zimg_req_t *req, const char *buff, size_t len);
+int read_img_batch(MagickWand *im, zimg_req_t *reqs, int n, const char *buff, size_t len);
+void decode_limits(void);
+
+#endif
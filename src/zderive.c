@@ -0,0 +1,412 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zderive.c
+ * @brief derivatives scaled from a larger stored derivative.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * A plain scaling request may be made from a stored derivative of the same
+ * image instead of the original when that derivative is a whole-frame
+ * scaling, has the same gray and format, no rotation, and is at least as
+ * large as the target needs. The smallest such one is decoded, which is far
+ * cheaper than a multi-megapixel original. The sizes are computed from the
+ * metadata record of the original like proportion() does, so the result
+ * may differ from one made of the original by a pixel of rounding.
+ *
+ * Quality is guarded in two ways. A source needs a quality of derive_quality
+ * and of the target at least. And only one generation is allowed: results
+ * made this way are cached but never stored, while sources are only taken
+ * from the storage, so every source was made from the original. In disk
+ * mode the sources are the files of the image directory, in db modes they
+ * are the parameter sets of pregen, which are always made from the original.
+ * Sets the metadata record does not mark as stored by pregen are skipped,
+ * records without a mask of the current sets try them all.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <dirent.h>
+#include <wand/magick_wand.h>
+#include "zderive.h"
+#include "zdecode.h"
+#include "zscale.h"
+#include "znative.h"
+#include "zmeta.h"
+#include "zpregen.h"
+#include "zcache.h"
+#include "zdcache.h"
+#include "zdisk.h"
+#include "zdb.h"
+#include "zutil.h"
+#include "zlog.h"
+
+#define DERIVE_MAX          64
+
+typedef struct derive_src_s {
+    int width;
+    int height;
+    int cols;
+    int rows;
+    char name[256];
+} derive_src_t;
+
+int derive_img(zimg_req_t *req, const char *path, char **buff, size_t *len);
+static int same_fmt(const char *a, const char *b);
+static int full_size(int p, int w, int h, unsigned long cols, unsigned long rows, int *dw, int *dh);
+static int need_size(zimg_req_t *req, unsigned long cols, unsigned long rows, int *dw, int *dh);
+static int src_ok(zimg_req_t *req, int g, int x, int y, int r, int q, const char *fmt);
+static int src_cmp(const void *a, const void *b);
+static int list_disk(zimg_req_t *req, const char *path, unsigned long cols, unsigned long rows, derive_src_t *srcs);
+static int pregen_req(zimg_req_t *req, int i, zimg_req_t *src);
+static int list_db(zimg_req_t *req, const img_meta_t *meta, unsigned long cols, unsigned long rows, derive_src_t *srcs);
+static int load_src(zimg_req_t *req, const char *path, const derive_src_t *src, char **buff, size_t *len);
+
+/**
+ * @brief same_fmt check if two format names give the same encoding
+ *
+ * @param a a format name
+ * @param b another format name
+ *
+ * @return 1 for the same and 0 for not
+ */
+static int same_fmt(const char *a, const char *b) {
+    if (strcasecmp(a, "jpg") == 0)
+        a = "jpeg";
+    if (strcasecmp(b, "jpg") == 0)
+        b = "jpeg";
+    return strcasecmp(a, b) == 0 ? 1 : 0;
+}
+
+/**
+ * @brief full_size the size of a whole-frame scaling of the original
+ *
+ * @param p the proportion type
+ * @param w the width of the request
+ * @param h the height of the request
+ * @param cols width of the original
+ * @param rows height of the original
+ * @param dw the width made
+ * @param dh the height made
+ *
+ * @return 1 for OK and -1 for a request that is not a whole-frame scaling
+ */
+static int full_size(int p, int w, int h, unsigned long cols, unsigned long rows, int *dw, int *dh) {
+    double rate;
+
+    if (settings.disable_zoom_up == 1) {
+        if (p == 3) {
+            w = w > 100 ? 100 : w;
+            h = h > 100 ? 100 : h;
+        } else {
+            w = (unsigned long)w > cols ? (int)cols : w;
+            h = (unsigned long)h > rows ? (int)rows : h;
+        }
+    }
+
+    if (p == 1 && (w == 0 || h == 0)) {
+        rate = w > 0 ? (double)w / cols : (double)h / rows;
+    } else if (p == 4) {
+        if (w == 0 || h == 0)
+            rate = w > 0 ? (double)w / cols : (double)h / rows;
+        else
+            rate = fmin((double)w / cols, (double)h / rows);
+    } else if (p == 3 && (w == 0 || h == 0 || w == h)) {
+        rate = (w > 0 ? w : h) / 100.0;
+    } else
+        return -1;
+
+    *dw = (int)round(cols * rate);
+    *dh = (int)round(rows * rate);
+    return (*dw > 0 && *dh > 0) ? 1 : -1;
+}
+
+/**
+ * @brief need_size the least whole-frame size a request can be made from
+ *
+ * @param req the zimg request
+ * @param cols width of the original
+ * @param rows height of the original
+ * @param dw the width needed
+ * @param dh the height needed
+ *
+ * @return 1 for OK and -1 for a request that needs the original
+ */
+static int need_size(zimg_req_t *req, unsigned long cols, unsigned long rows, int *dw, int *dh) {
+    int w = req->width, h = req->height;
+
+    if (req->proportion == 0) {
+        if (w <= 0 || h <= 0)
+            return -1;
+        if (settings.disable_zoom_up == 1) {
+            w = (unsigned long)w > cols ? (int)cols : w;
+            h = (unsigned long)h > rows ? (int)rows : h;
+        }
+        *dw = w;
+        *dh = h;
+        return 1;
+    }
+    if (req->proportion == 1 && w > 0 && h > 0) {
+        /* proportion() scales to cover the box before cropping the center */
+        double rate = fmax((double)w / cols, (double)h / rows);
+        *dw = (int)round(cols * rate);
+        *dh = (int)round(rows * rate);
+        return 1;
+    }
+    if (req->proportion == 1 || req->proportion == 4)
+        return full_size(req->proportion, w, h, cols, rows, dw, dh);
+    return -1;
+}
+
+/**
+ * @brief src_ok check if the options of a derivative let it be the source of a request
+ *
+ * @param req the zimg request
+ * @param g gray of the derivative
+ * @param x crop x of the derivative
+ * @param y crop y of the derivative
+ * @param r rotation of the derivative
+ * @param q quality of the derivative
+ * @param fmt format of the derivative
+ *
+ * @return 1 for yes and 0 for no
+ */
+static int src_ok(zimg_req_t *req, int g, int x, int y, int r, int q, const char *fmt) {
+    if (x != -1 || y != -1 || r != 0 || g != req->gray)
+        return 0;
+    if (q < settings.derive_quality || q < req->quality)
+        return 0;
+    if (same_fmt(fmt, req->fmt) == 0 || same_fmt(fmt, "gif") == 1)
+        return 0;
+    return 1;
+}
+
+/**
+ * @brief src_cmp order sources from the smallest
+ *
+ * @param a a source
+ * @param b another source
+ *
+ * @return the qsort order
+ */
+static int src_cmp(const void *a, const void *b) {
+    const derive_src_t *sa = (const derive_src_t *)a, *sb = (const derive_src_t *)b;
+    long la = (long)sa->cols * sa->rows, lb = (long)sb->cols * sb->rows;
+    return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+/**
+ * @brief list_disk find the sources of a request in the image directory
+ *
+ * @param req the zimg request
+ * @param path the directory of the image
+ * @param cols width of the original
+ * @param rows height of the original
+ * @param srcs the sources, DERIVE_MAX
+ *
+ * @return number of sources
+ */
+static int list_disk(zimg_req_t *req, const char *path, unsigned long cols, unsigned long rows, derive_src_t *srcs) {
+    DIR *dir;
+    struct dirent *ent;
+    int w, h, p, g, x, y, r, q, dw, dh, n = 0;
+    char fmt[16];
+
+    if ((dir = opendir(path)) == NULL)
+        return 0;
+    while ((ent = readdir(dir)) != NULL && n < DERIVE_MAX) {
+        if (sscanf(ent->d_name, "%d*%d_p%d_g%d_%d*%d_r%d_q%d.%15s", &w, &h, &p, &g, &x, &y, &r, &q, fmt) != 9)
+            continue;
+        if (src_ok(req, g, x, y, r, q, fmt) == 0)
+            continue;
+        if (full_size(p, w, h, cols, rows, &dw, &dh) != 1)
+            continue;
+        srcs[n].width = w;
+        srcs[n].height = h;
+        srcs[n].cols = dw;
+        srcs[n].rows = dh;
+        str_lcpy(srcs[n].name, ent->d_name, sizeof(srcs[n].name));
+        n++;
+    }
+    closedir(dir);
+    return n;
+}
+
+/**
+ * @brief pregen_req the request of a pregen parameter set, planned like it was made
+ *
+ * @param req the zimg request of the same image
+ * @param i index of the parameter set
+ * @param src the request
+ *
+ * @return 1 for OK and -1 for a lua type or a set that can not be made
+ */
+static int pregen_req(zimg_req_t *req, int i, zimg_req_t *src) {
+    pregen_t *pg = &settings.pregen[i];
+
+    if (pg->type[0] != '\0')
+        return -1;
+    memset(src, 0, sizeof(zimg_req_t));
+    src->md5 = req->md5;
+    src->width = pg->width;
+    src->height = pg->height;
+    src->proportion = pg->proportion;
+    src->gray = pg->gray;
+    src->x = pg->x;
+    src->y = pg->y;
+    src->rotate = pg->rotate;
+    src->quality = pg->quality != 0 ? pg->quality : settings.quality;
+    src->fmt = pg->fmt[0] != '\0' ? pg->fmt : settings.format;
+    src->thr_arg = req->thr_arg;
+    return meta_plan(req->thr_arg, src, NULL) == -1 ? -1 : 1;
+}
+
+/**
+ * @brief list_db find the sources of a request among the pregen parameter sets
+ *
+ * @param req the zimg request
+ * @param meta the metadata record of the original
+ * @param cols width of the original
+ * @param rows height of the original
+ * @param srcs the sources, DERIVE_MAX
+ *
+ * @return number of sources
+ */
+static int list_db(zimg_req_t *req, const img_meta_t *meta, unsigned long cols, unsigned long rows, derive_src_t *srcs) {
+    zimg_req_t src;
+    int known = (meta->pregen_sig == pregen_sig());
+    int i, dw, dh, n = 0;
+
+    for (i = 0; i < settings.pregen_num && n < DERIVE_MAX; i++) {
+        /* a set never stored would cost a lookup of the caches and the db */
+        if (known && (meta->pregen & (1U << i)) == 0)
+            continue;
+        if (pregen_req(req, i, &src) != 1)
+            continue;
+        if (src_ok(req, src.gray, src.x, src.y, src.rotate, src.quality, src.fmt) == 0)
+            continue;
+        if (full_size(src.proportion, src.width, src.height, cols, rows, &dw, &dh) != 1)
+            continue;
+        srcs[n].width = src.width;
+        srcs[n].height = src.height;
+        srcs[n].cols = dw;
+        srcs[n].rows = dh;
+        gen_rsp_key(srcs[n].name, &src);
+        n++;
+    }
+    return n;
+}
+
+/**
+ * @brief load_src read a source from the disk or the caches and the db
+ *
+ * @param req the zimg request
+ * @param path the directory of the image, NULL for db modes
+ * @param src the source
+ * @param buff the source image, free by caller
+ * @param len length of buff
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int load_src(zimg_req_t *req, const char *path, const derive_src_t *src, char **buff, size_t *len) {
+    char src_path[512];
+
+    if (path != NULL) {
+        snprintf(src_path, sizeof(src_path), "%s/%s", path, src->name);
+        return disk_read(src_path, buff, len) == 1 ? 1 : -1;
+    }
+    if (find_cache_bin(req->thr_arg, src->name, buff, len) == 1)
+        return 1;
+    if (dcache_get(src->name, buff, len) == 1)
+        return 1;
+    return get_img_db(req->thr_arg, src->name, buff, len) == 1 ? 1 : -1;
+}
+
+/**
+ * @brief derive_img make a request from the smallest stored derivative large enough
+ *
+ * @param req the zimg request, after meta_plan()
+ * @param path the directory of the image in disk mode, NULL for db modes
+ * @param buff the result, free by caller
+ * @param len length of the result
+ *
+ * @return 1 for made, the result must not be stored, and -1 for none to make it from
+ */
+int derive_img(zimg_req_t *req, const char *path, char **buff, size_t *len) {
+    derive_src_t srcs[DERIVE_MAX];
+    char key[CACHE_KEY_SIZE], src_key[CACHE_KEY_SIZE];
+    zimg_req_t src;
+    img_meta_t meta;
+    MagickWand *im;
+    unsigned long cols, rows;
+    char *src_buff = NULL;
+    size_t src_len = 0;
+    int i, n, need_w, need_h, ret = -1;
+
+    if (settings.derive != 1 || (settings.script_on == 1 && req->type != NULL))
+        return -1;
+    if (req->x != -1 || req->y != -1 || req->rotate != 0)
+        return -1;
+    /* animations keep their frames only when made from the original */
+    if (meta_get(req->thr_arg, req->md5, path, &meta) != 1 || strcasecmp(meta.format, "gif") == 0)
+        return -1;
+    cols = meta.orientation >= 5 ? meta.height : meta.width;
+    rows = meta.orientation >= 5 ? meta.width : meta.height;
+    if (cols == 0 || rows == 0 || need_size(req, cols, rows, &need_w, &need_h) != 1)
+        return -1;
+
+    if (path == NULL) {
+        /* the sources of db modes are always made from the original */
+        gen_rsp_key(key, req);
+        for (i = 0; i < settings.pregen_num; i++) {
+            if (pregen_req(req, i, &src) != 1)
+                continue;
+            gen_rsp_key(src_key, &src);
+            if (strcmp(key, src_key) == 0)
+                return -1;
+        }
+    }
+
+    n = path != NULL ? list_disk(req, path, cols, rows, srcs) : list_db(req, &meta, cols, rows, srcs);
+    qsort(srcs, n, sizeof(derive_src_t), src_cmp);
+    for (i = 0; i < n; i++) {
+        if (srcs[i].cols < need_w || srcs[i].rows < need_h)
+            continue;
+        if (load_src(req, path, &srcs[i], &src_buff, &src_len) == 1)
+            break;
+    }
+    if (i == n)
+        return -1;
+    LOG_PRINT(LOG_DEBUG, "derive [%s] %dx%d from %s %dx%d", req->md5, need_w, need_h,
+              srcs[i].name, srcs[i].cols, srcs[i].rows);
+
+    if (native_convert(req, src_buff, src_len, buff, len) == 1) {
+        free(src_buff);
+        return 1;
+    }
+    if ((im = NewMagickWand()) == NULL) {
+        free(src_buff);
+        return -1;
+    }
+    if (read_img_blob(im, req, src_buff, src_len) == MagickTrue && convert(im, req) != -1) {
+        *buff = (char *)MagickGetImageBlob(im, len);
+        ret = *buff != NULL ? 1 : -1;
+    }
+    DestroyMagickWand(im);
+    free(src_buff);
+    return ret;
+}
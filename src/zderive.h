@@ -0,0 +1,28 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zderive.h
+ * @brief derivatives scaled from a larger stored derivative header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZDERIVE_H
+#define ZDERIVE_H
+
+#include "zcommon.h"
+
+int derive_img(zimg_req_t *req, const char *path, char **buff, size_t *len);
+
+#endif
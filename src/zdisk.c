@@ -0,0 +1,641 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zdisk.c
+ * @brief multiple image roots with per-disk I/O queues.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * With img_paths set, every image lives under exactly one root chosen by
+ * its md5, so a JBOD box can run one zimg without RAID. Each root has its
+ * own small pool of I/O threads and a bounded queue. A request waits at
+ * most disk_timeout ms for its job, and a full queue fails at once, so a
+ * slow disk only fails the requests for its own images. After
+ * disk_max_errors errors in a row a disk is marked down and skipped, one
+ * probe is let through every disk_retry seconds to bring it back.
+ *
+ * Paths outside the roots (the cold tier) and a single img_path are read
+ * and written directly by the calling thread as before.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "zdisk.h"
+#include "zutil.h"
+#include "zlog.h"
+
+#define DISK_READ           1
+#define DISK_WRITE          2
+#define DISK_STAT           3
+#define DISK_FILE           4
+#define DISK_MKDIR          5
+
+typedef struct disk_job_s disk_job_t;
+
+struct disk_job_s {
+    int op;
+    char path[PATH_MAX_SIZE];
+    char *buff;
+    size_t len;
+    int result;
+    int done;
+    int abandoned;
+    struct timeval enqueue;
+    pthread_cond_t cond;
+    disk_job_t *next;
+};
+
+typedef struct disk_s {
+    char path[PATH_MAX_SIZE];
+    size_t path_len;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    disk_job_t *head;
+    disk_job_t *tail;
+    int depth;
+    int max_depth;
+    int down;
+    time_t down_at;
+    int err_run;
+    long ops;
+    long errors;
+    long timeouts;
+    long rejected;
+    double wait_us;
+    double service_us;
+    double max_us;
+} disk_t;
+
+static disk_t disks[DISK_MAX];
+static int disk_started = 0;
+
+int disk_init(void);
+int disk_count(void);
+const char * disk_path(int i);
+const char * disk_root(const char *md5);
+int disk_read(const char *path, char **buff, size_t *len);
+int disk_write(const char *path, const char *buff, size_t len);
+int disk_is_dir(const char *path);
+int disk_is_file(const char *path);
+int disk_mk_dirs(const char *path);
+void disk_status(cJSON *j_ret);
+static double tv_us(const struct timeval *from, const struct timeval *to);
+static disk_t * disk_of(const char *path);
+static int do_read(const char *path, char **buff, size_t *len);
+static int do_write(const char *path, const char *buff, size_t len);
+static int do_stat(const char *path, int op);
+static int do_job(disk_job_t *job);
+static void disk_error(disk_t *d, int failed);
+static int disk_submit(disk_t *d, disk_job_t *job, char **buff, size_t *len);
+static void * disk_worker(void *arg);
+
+/**
+ * @brief disk_init create the roots and start the I/O threads of every disk
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int disk_init(void) {
+    int i, j;
+    pthread_t tid;
+
+    for (i = 0; i < settings.img_path_num; i++) {
+        disk_t *d = &disks[i];
+        if (is_dir(settings.img_paths[i]) != 1 && mk_dirs(settings.img_paths[i]) != 1) {
+            LOG_PRINT(LOG_DEBUG, "img_paths[%s] Create Failed!", settings.img_paths[i]);
+            return -1;
+        }
+        memset(d, 0, sizeof(disk_t));
+        str_lcpy(d->path, settings.img_paths[i], sizeof(d->path));
+        d->path_len = strlen(d->path);
+        pthread_mutex_init(&d->lock, NULL);
+        pthread_cond_init(&d->cond, NULL);
+        for (j = 0; j < settings.disk_threads; j++) {
+            if (pthread_create(&tid, NULL, disk_worker, d) != 0) {
+                LOG_PRINT(LOG_DEBUG, "disk worker create failed!");
+                return -1;
+            }
+            pthread_detach(tid);
+        }
+    }
+    disk_started = 1;
+    LOG_PRINT(LOG_DEBUG, "Disk Init Finished. disks: %d threads: %d", settings.img_path_num, settings.disk_threads);
+    return 1;
+}
+
+/**
+ * @brief disk_count the count of image roots
+ *
+ * @return the count
+ */
+int disk_count(void) {
+    return (settings.img_path_num > 0) ? settings.img_path_num : 1;
+}
+
+/**
+ * @brief disk_path the path of an image root
+ *
+ * @param i the index of the root
+ *
+ * @return the path
+ */
+const char * disk_path(int i) {
+    return (settings.img_path_num > 0) ? settings.img_paths[i] : settings.img_path;
+}
+
+/**
+ * @brief disk_root the image root which an image is placed in
+ *
+ * @param md5 the md5 of the image
+ *
+ * @return the path of the root
+ */
+const char * disk_root(const char *md5) {
+    char c[9];
+    if (settings.img_path_num <= 0)
+        return settings.img_path;
+    /* the first 6 hex digits pick the 2-level dirs, use digits 8-15 here */
+    str_lcpy(c, md5 + 8, sizeof(c));
+    return settings.img_paths[strtoul(c, NULL, 16) % settings.img_path_num];
+}
+
+/**
+ * @brief tv_us microseconds between two times
+ *
+ * @param from the start time
+ * @param to the end time
+ *
+ * @return the microseconds
+ */
+static double tv_us(const struct timeval *from, const struct timeval *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000.0 + (to->tv_usec - from->tv_usec);
+}
+
+/**
+ * @brief disk_of find the disk which a path is on
+ *
+ * @param path the path
+ *
+ * @return the disk or NULL for paths out of all roots
+ */
+static disk_t * disk_of(const char *path) {
+    int i;
+    if (disk_started == 0)
+        return NULL;
+    for (i = 0; i < settings.img_path_num; i++) {
+        if (strncmp(path, disks[i].path, disks[i].path_len) == 0 && path[disks[i].path_len] == '/')
+            return &disks[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief do_read read a whole file
+ *
+ * @param path the file path
+ * @param buff the buffer, free by caller
+ * @param len the length of buff
+ *
+ * @return 1 for OK, 0 for not found and -1 for fail
+ */
+static int do_read(const char *path, char **buff, size_t *len) {
+    int fd;
+    struct stat st;
+    size_t off = 0;
+    ssize_t rlen;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return (errno == ENOENT || errno == ENOTDIR) ? 0 : -1;
+    if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+        LOG_PRINT(LOG_DEBUG, "File[%s] is Empty.", path);
+        close(fd);
+        return -1;
+    }
+    if ((*buff = (char *)malloc(st.st_size)) == NULL) {
+        LOG_PRINT(LOG_DEBUG, "buff Malloc Failed!");
+        close(fd);
+        return -1;
+    }
+    while (off < (size_t)st.st_size) {
+        rlen = read(fd, *buff + off, st.st_size - off);
+        if (rlen == -1 && errno == EINTR)
+            continue;
+        if (rlen <= 0)
+            break;
+        off += rlen;
+    }
+    close(fd);
+    if (off < (size_t)st.st_size) {
+        LOG_PRINT(LOG_DEBUG, "File[%s] Read Not Compeletly.", path);
+        free(*buff);
+        *buff = NULL;
+        return -1;
+    }
+    *len = off;
+    return 1;
+}
+
+/**
+ * @brief do_write write a whole file
+ *
+ * @param path the file path
+ * @param buff the buffer
+ * @param len the length of buff
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int do_write(const char *path, const char *buff, size_t len) {
+    int result = -1;
+    int fd = -1;
+    size_t off = 0;
+    ssize_t wlen;
+
+    if ((fd = open(path, O_WRONLY | O_TRUNC | O_CREAT, 00644)) < 0) {
+        LOG_PRINT(LOG_DEBUG, "fd(%s) open failed!", path);
+        goto done;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        LOG_PRINT(LOG_DEBUG, "This fd is Locked by Other thread.");
+        goto done;
+    }
+    while (off < len) {
+        wlen = write(fd, buff + off, len - off);
+        if (wlen == -1 && errno == EINTR)
+            continue;
+        if (wlen <= 0) {
+            LOG_PRINT(LOG_DEBUG, "write(%s) failed!", path);
+            goto done;
+        }
+        off += wlen;
+    }
+    flock(fd, LOCK_UN | LOCK_NB);
+    result = 1;
+
+done:
+    if (fd != -1)
+        close(fd);
+    return result;
+}
+
+/**
+ * @brief do_stat check a directory or a regular file
+ *
+ * @param path the path
+ * @param op DISK_STAT for a directory and DISK_FILE for a file
+ *
+ * @return 1 for the wanted type, 0 for not and -1 for fail
+ */
+static int do_stat(const char *path, int op) {
+    struct stat st;
+    if (stat(path, &st) == -1)
+        return (errno == ENOENT || errno == ENOTDIR) ? 0 : -1;
+    if (op == DISK_FILE)
+        return S_ISREG(st.st_mode) ? 1 : 0;
+    return S_ISDIR(st.st_mode) ? 1 : 0;
+}
+
+/**
+ * @brief do_job run a job in the current thread
+ *
+ * @param job the job
+ *
+ * @return the result of the job
+ */
+static int do_job(disk_job_t *job) {
+    if (job->op == DISK_READ)
+        return do_read(job->path, &job->buff, &job->len);
+    else if (job->op == DISK_WRITE)
+        return do_write(job->path, job->buff, job->len);
+    else if (job->op == DISK_MKDIR)
+        return mk_dirs(job->path);
+    return do_stat(job->path, job->op);
+}
+
+/**
+ * @brief disk_error count a result of a disk and mark it down or up, called with lock held
+ *
+ * @param d the disk
+ * @param failed 1 for an I/O error or timeout and 0 for OK
+ */
+static void disk_error(disk_t *d, int failed) {
+    if (failed == 0) {
+        d->err_run = 0;
+        if (d->down == 1) {
+            d->down = 0;
+            LOG_PRINT(LOG_WARNING, "disk %s is back", d->path);
+        }
+        return;
+    }
+    d->errors++;
+    d->err_run++;
+    if (d->down == 0 && d->err_run >= settings.disk_max_errors) {
+        d->down = 1;
+        d->down_at = time(NULL);
+        LOG_PRINT(LOG_ERROR, "disk %s marked down after %d errors", d->path, d->err_run);
+    }
+}
+
+/**
+ * @brief disk_submit queue a job on a disk and wait for it
+ *
+ * @param d the disk
+ * @param job the job, freed here or by the worker in every case
+ * @param buff the buffer read, free by caller, NULL for writes and stats
+ * @param len the length of buff
+ *
+ * @return the result of the job, -1 for rejected or timeout
+ */
+static int disk_submit(disk_t *d, disk_job_t *job, char **buff, size_t *len) {
+    struct timespec ts;
+    struct timeval now;
+    int result;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->down == 1) {
+        if (time(NULL) - d->down_at < settings.disk_retry) {
+            d->rejected++;
+            pthread_mutex_unlock(&d->lock);
+            goto fail;
+        }
+        /* let this one through as a probe */
+        d->down_at = time(NULL);
+    }
+    if (d->depth >= settings.disk_queue) {
+        d->rejected++;
+        pthread_mutex_unlock(&d->lock);
+        LOG_PRINT(LOG_WARNING, "disk %s queue full", d->path);
+        goto fail;
+    }
+
+    pthread_cond_init(&job->cond, NULL);
+    gettimeofday(&job->enqueue, NULL);
+    if (d->tail == NULL)
+        d->head = job;
+    else
+        d->tail->next = job;
+    d->tail = job;
+    d->depth++;
+    if (d->depth > d->max_depth)
+        d->max_depth = d->depth;
+    pthread_cond_signal(&d->cond);
+
+    now = job->enqueue;
+    ts.tv_sec = now.tv_sec + settings.disk_timeout / 1000;
+    ts.tv_nsec = now.tv_usec * 1000 + (settings.disk_timeout % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    while (job->done == 0) {
+        if (pthread_cond_timedwait(&job->cond, &d->lock, &ts) == ETIMEDOUT)
+            break;
+    }
+    if (job->done == 0) {
+        /* the worker frees the job when it is finished */
+        job->abandoned = 1;
+        d->timeouts++;
+        disk_error(d, 1);
+        pthread_mutex_unlock(&d->lock);
+        LOG_PRINT(LOG_WARNING, "disk %s timeout on %s", d->path, job->path);
+        return -1;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    result = job->result;
+    pthread_cond_destroy(&job->cond);
+    if (job->op == DISK_READ && buff != NULL) {
+        *buff = job->buff;
+        *len = job->len;
+    } else {
+        free(job->buff);
+    }
+    free(job);
+    return result;
+
+fail:
+    if (job->op == DISK_WRITE)
+        free(job->buff);
+    free(job);
+    return -1;
+}
+
+/**
+ * @brief disk_worker the I/O thread of a disk
+ *
+ * @param arg the disk
+ *
+ * @return not used
+ */
+static void * disk_worker(void *arg) {
+    disk_t *d = (disk_t *)arg;
+    disk_job_t *job;
+    struct timeval start, end;
+    double wait_us, service_us;
+    int err;
+
+    for (;;) {
+        pthread_mutex_lock(&d->lock);
+        while (d->head == NULL)
+            pthread_cond_wait(&d->cond, &d->lock);
+        job = d->head;
+        d->head = job->next;
+        if (d->head == NULL)
+            d->tail = NULL;
+        pthread_mutex_unlock(&d->lock);
+
+        gettimeofday(&start, NULL);
+        errno = 0;
+        job->result = do_job(job);
+        err = errno;
+        gettimeofday(&end, NULL);
+        wait_us = tv_us(&job->enqueue, &start);
+        service_us = tv_us(&start, &end);
+
+        pthread_mutex_lock(&d->lock);
+        d->depth--;
+        d->ops++;
+        d->wait_us = d->wait_us * 0.9 + wait_us * 0.1;
+        d->service_us = d->service_us * 0.9 + service_us * 0.1;
+        if (wait_us + service_us > d->max_us)
+            d->max_us = wait_us + service_us;
+        /* only errors of the device count, not a busy lock or a full disk */
+        disk_error(d, job->result == -1 && (err == EIO || err == EROFS || err == ENXIO || err == ENODEV));
+        if (job->abandoned == 1) {
+            pthread_mutex_unlock(&d->lock);
+            pthread_cond_destroy(&job->cond);
+            free(job->buff);
+            free(job);
+            continue;
+        }
+        job->done = 1;
+        pthread_cond_signal(&job->cond);
+        pthread_mutex_unlock(&d->lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief disk_read read a whole file through the queue of its disk
+ *
+ * @param path the file path
+ * @param buff the buffer, free by caller
+ * @param len the length of buff
+ *
+ * @return 1 for OK, 0 for not found and -1 for fail
+ */
+int disk_read(const char *path, char **buff, size_t *len) {
+    disk_t *d = disk_of(path);
+    disk_job_t *job;
+
+    *buff = NULL;
+    if (d == NULL)
+        return do_read(path, buff, len);
+    if ((job = (disk_job_t *)calloc(1, sizeof(disk_job_t))) == NULL)
+        return -1;
+    job->op = DISK_READ;
+    str_lcpy(job->path, path, sizeof(job->path));
+    return disk_submit(d, job, buff, len);
+}
+
+/**
+ * @brief disk_write write a whole file through the queue of its disk
+ *
+ * @param path the file path
+ * @param buff the buffer
+ * @param len the length of buff
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int disk_write(const char *path, const char *buff, size_t len) {
+    disk_t *d = disk_of(path);
+    disk_job_t *job;
+
+    if (d == NULL)
+        return do_write(path, buff, len);
+    if ((job = (disk_job_t *)calloc(1, sizeof(disk_job_t))) == NULL)
+        return -1;
+    /* the job keeps its own copy in case the caller gives up waiting */
+    if ((job->buff = (char *)malloc(len)) == NULL) {
+        free(job);
+        return -1;
+    }
+    memcpy(job->buff, buff, len);
+    job->len = len;
+    job->op = DISK_WRITE;
+    str_lcpy(job->path, path, sizeof(job->path));
+    return disk_submit(d, job, NULL, NULL);
+}
+
+/**
+ * @brief disk_is_dir check a directory through the queue of its disk
+ *
+ * @param path the path
+ *
+ * @return 1 for a directory and -1 for not or fail
+ */
+int disk_is_dir(const char *path) {
+    disk_t *d = disk_of(path);
+    disk_job_t *job;
+    int result;
+
+    if (d == NULL)
+        return is_dir(path);
+    if ((job = (disk_job_t *)calloc(1, sizeof(disk_job_t))) == NULL)
+        return -1;
+    job->op = DISK_STAT;
+    str_lcpy(job->path, path, sizeof(job->path));
+    result = disk_submit(d, job, NULL, NULL);
+    return (result == 1) ? 1 : -1;
+}
+
+/**
+ * @brief disk_is_file check a regular file through the queue of its disk
+ *
+ * @param path the path
+ *
+ * @return 1 for a file, 0 for not and -1 for fail or a disk down
+ */
+int disk_is_file(const char *path) {
+    disk_t *d = disk_of(path);
+    disk_job_t *job;
+
+    if (d == NULL)
+        return do_stat(path, DISK_FILE);
+    if ((job = (disk_job_t *)calloc(1, sizeof(disk_job_t))) == NULL)
+        return -1;
+    job->op = DISK_FILE;
+    str_lcpy(job->path, path, sizeof(job->path));
+    return disk_submit(d, job, NULL, NULL);
+}
+
+/**
+ * @brief disk_mk_dirs create a multi-level directory through the queue of its disk
+ *
+ * @param path the path
+ *
+ * @return 1 for OK and -1 for fail or a disk down
+ */
+int disk_mk_dirs(const char *path) {
+    disk_t *d = disk_of(path);
+    disk_job_t *job;
+
+    if (d == NULL)
+        return mk_dirs(path);
+    if ((job = (disk_job_t *)calloc(1, sizeof(disk_job_t))) == NULL)
+        return -1;
+    job->op = DISK_MKDIR;
+    str_lcpy(job->path, path, sizeof(job->path));
+    return disk_submit(d, job, NULL, NULL);
+}
+
+/**
+ * @brief disk_status add the per-disk counters to a json object
+ *
+ * @param j_ret the json object
+ */
+void disk_status(cJSON *j_ret) {
+    int i;
+    cJSON *j_disks, *j_disk;
+
+    if (disk_started == 0 || settings.img_path_num <= 0)
+        return;
+    j_disks = cJSON_CreateArray();
+    for (i = 0; i < settings.img_path_num; i++) {
+        disk_t *d = &disks[i];
+        j_disk = cJSON_CreateObject();
+        pthread_mutex_lock(&d->lock);
+        cJSON_AddStringToObject(j_disk, "path", d->path);
+        cJSON_AddBoolToObject(j_disk, "down", d->down);
+        cJSON_AddNumberToObject(j_disk, "depth", d->depth);
+        cJSON_AddNumberToObject(j_disk, "max_depth", d->max_depth);
+        cJSON_AddNumberToObject(j_disk, "ops", d->ops);
+        cJSON_AddNumberToObject(j_disk, "errors", d->errors);
+        cJSON_AddNumberToObject(j_disk, "timeouts", d->timeouts);
+        cJSON_AddNumberToObject(j_disk, "rejected", d->rejected);
+        cJSON_AddNumberToObject(j_disk, "wait_us", (int)d->wait_us);
+        cJSON_AddNumberToObject(j_disk, "service_us", (int)d->service_us);
+        cJSON_AddNumberToObject(j_disk, "max_us", (int)d->max_us);
+        pthread_mutex_unlock(&d->lock);
+        cJSON_AddItemToArray(j_disks, j_disk);
+    }
+    cJSON_AddItemToObject(j_ret, "disks", j_disks);
+}
@@ -0,0 +1,38 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zdisk.h
+ * @brief multiple image roots with per-disk I/O queues header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZDISK_H
+#define ZDISK_H
+
+#include "zcommon.h"
+#include "cjson/cJSON.h"
+
+int disk_init(void);
+int disk_count(void);
+const char * disk_path(int i);
+const char * disk_root(const char *md5);
+int disk_read(const char *path, char **buff, size_t *len);
+int disk_write(const char *path, const char *buff, size_t len);
+int disk_is_dir(const char *path);
+int disk_is_file(const char *path);
+int disk_mk_dirs(const char *path);
+void disk_status(cJSON *j_ret);
+
+#endif
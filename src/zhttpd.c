@@ -30,6 +30,15 @@
 #include "zlog.h"
 #include "zdb.h"
 #include "zaccess.h"
+#include "zscrub.h"
+#include "zrepl.h"
+#include "zdisk.h"
+#include "zpool.h"
+#include "zring.h"
+#include "zjournal.h"
+#include "zdcache.h"
+#include "zbatch.h"
+#include "zpregen.h"
 #include "cjson/cJSON.h"
 
 typedef struct {
@@ -54,6 +63,9 @@ void post_request_cb(evhtp_request_t *req, void *arg);
 void get_request_cb(evhtp_request_t *req, void *arg);
 void admin_request_cb(evhtp_request_t *req, void *arg);
 void info_request_cb(evhtp_request_t *req, void *arg);
+void status_request_cb(evhtp_request_t *req, void *arg);
+static int list_item(const char *list, int i, char *item, size_t size);
+void batch_request_cb(evhtp_request_t *req, void *arg);
 
 static const char * post_error_list[] = {
     "Internal error.",
@@ -1287,3 +1299,264 @@ err:
 done:
     return;
 }
+
+/**
+ * @brief list_item copy an item of a comma separated list
+ *
+ * @param list the list, NULL for none
+ * @param i index of the item, the last item is used past the end
+ * @param item the item, NULL to count only
+ * @param size size of item
+ *
+ * @return number of items in the list
+ */
+static int list_item(const char *list, int i, char *item, size_t size) {
+    const char *p, *start;
+    int n = 0;
+
+    if (list == NULL || list[0] == '\0')
+        return 0;
+    for (p = list, start = list; ; p++) {
+        if (*p != ',' && *p != '\0')
+            continue;
+        if (item != NULL && n <= i) {
+            size_t len = (size_t)(p - start);
+            if (len > size - 1)
+                len = size - 1;
+            memcpy(item, start, len);
+            item[len] = '\0';
+        }
+        n++;
+        if (*p == '\0')
+            break;
+        start = p + 1;
+    }
+    return n;
+}
+
+/**
+ * @brief batch_request_cb the callback function of making several derivatives from one decoding
+ *
+ * /batch?md5=<md5>&t=a,b makes the lua types a and b, and the lists of w, h,
+ * p, g, x, y, r, q and f make one derivative per position, a shorter list
+ * repeating its last item. The results go to the cache and the storage.
+ *
+ * @param req the evhtp request
+ * @param arg the callback args
+ */
+void batch_request_cb(evhtp_request_t *req, void *arg) {
+    static const char *names[9] = {"w", "h", "p", "g", "x", "y", "r", "q", "f"};
+    zimg_req_t reqs[BATCH_MAX];
+    char types[BATCH_MAX][64], fmts[BATCH_MAX][16];
+    int results[BATCH_MAX];
+    const char *lists[9];
+    char md5[33], item[64];
+    int err_no = 0, n = 0, items = 0, i, j, ret;
+
+    evhtp_connection_t *ev_conn = evhtp_request_get_connection(req);
+    struct sockaddr *saddr = ev_conn->saddr;
+    struct sockaddr_in *ss = (struct sockaddr_in *)saddr;
+    char address[16];
+
+    const char *xff_address = evhtp_header_find(req->headers_in, "X-Forwarded-For");
+    if (xff_address) {
+        inet_aton(xff_address, &ss->sin_addr);
+    }
+    strncpy(address, inet_ntoa(ss->sin_addr), 16);
+
+    int req_method = evhtp_request_get_method(req);
+    if (req_method >= 16)
+        req_method = 16;
+    if (strcmp(method_strmap[req_method], "GET") != 0) {
+        err_no = 2;
+        LOG_PRINT(LOG_DEBUG, "Request Method Not Support.");
+        LOG_PRINT(LOG_INFO, "%s refuse batch method", address);
+        goto err;
+    }
+
+    /* a batch writes to the storage, guard it like admin */
+    if (settings.admin_access != NULL) {
+        int acs = zimg_access_inet(settings.admin_access, ss->sin_addr.s_addr);
+        if (acs != ZIMG_OK) {
+            err_no = 3;
+            LOG_PRINT(LOG_INFO, "%s refuse batch forbidden", address);
+            goto err;
+        }
+    }
+
+    evhtp_kvs_t *params = req->uri->query;
+    const char *str_md5 = params != NULL ? evhtp_kv_find(params, "md5") : NULL;
+    if (str_md5 == NULL) {
+        err_no = 8;
+        LOG_PRINT(LOG_DEBUG, "md5() = NULL return");
+        LOG_PRINT(LOG_INFO, "%s refuse batch params", address);
+        goto err;
+    }
+    str_lcpy(md5, str_md5, sizeof(md5));
+    if (is_md5(md5) == -1) {
+        err_no = 8;
+        LOG_PRINT(LOG_INFO, "%s refuse batch md5", address);
+        goto err;
+    }
+
+    evthr_t *thread = get_request_thr(req);
+    thr_arg_t *thr_arg = (thr_arg_t *)evthr_get_aux(thread);
+
+    const char *str_t = (settings.disable_type != 1 && settings.script_on == 1) ? evhtp_kv_find(params, "t") : NULL;
+    for (i = 0; i < list_item(str_t, 0, NULL, 0) && n < BATCH_MAX; i++, n++) {
+        list_item(str_t, i, types[n], sizeof(types[n]));
+        memset(&reqs[n], 0, sizeof(zimg_req_t));
+        reqs[n].type = types[n];
+        reqs[n].proportion = 1;
+        reqs[n].x = -1;
+        reqs[n].y = -1;
+        reqs[n].quality = settings.quality;
+        reqs[n].fmt = settings.format;
+    }
+    if (settings.disable_args != 1) {
+        for (j = 0; j < 9; j++) {
+            lists[j] = evhtp_kv_find(params, names[j]);
+            ret = list_item(lists[j], 0, NULL, 0);
+            items = ret > items ? ret : items;
+        }
+    }
+    for (i = 0; i < items && n < BATCH_MAX; i++, n++) {
+        int v[8] = {0, 0, 1, 0, -1, -1, 0, 0};
+        for (j = 0; j < 8; j++) {
+            if (list_item(lists[j], i, item, sizeof(item)) > 0)
+                v[j] = atoi(item);
+        }
+        memset(&reqs[n], 0, sizeof(zimg_req_t));
+        reqs[n].width = v[0];
+        reqs[n].height = v[1];
+        reqs[n].proportion = (v[4] != -1 || v[5] != -1) ? 1 : v[2];
+        reqs[n].gray = v[3];
+        reqs[n].x = v[4];
+        reqs[n].y = v[5];
+        reqs[n].rotate = v[6];
+        reqs[n].quality = v[7] != 0 ? v[7] : settings.quality;
+        if (list_item(lists[8], i, fmts[n], sizeof(fmts[n])) > 0)
+            reqs[n].fmt = fmts[n];
+        else
+            reqs[n].fmt = settings.format;
+    }
+    if (n == 0) {
+        err_no = 8;
+        LOG_PRINT(LOG_INFO, "%s refuse batch params", address);
+        goto err;
+    }
+    for (i = 0; i < n; i++) {
+        reqs[i].md5 = md5;
+        reqs[i].sv = 1;
+        reqs[i].thr_arg = thr_arg;
+    }
+
+    ret = settings.batch_img(thr_arg, reqs, n, results);
+    if (ret == 0) {
+        err_no = 9;
+        LOG_PRINT(LOG_ERROR, "%s refuse batch 404", address);
+        goto err;
+    } else if (ret == -1) {
+        err_no = 0;
+        LOG_PRINT(LOG_ERROR, "%s fail batch pic:%s", address, md5);
+        goto err;
+    }
+
+    //{"ret":true,"info":{"md5":"...","items":[{"key":"...:thumb","ret":1}]}}
+    cJSON *j_ret = cJSON_CreateObject();
+    cJSON *j_ret_info = cJSON_CreateObject();
+    cJSON *j_items = cJSON_CreateArray();
+    for (i = 0; i < n; i++) {
+        char key[CACHE_KEY_SIZE];
+        cJSON *j_item = cJSON_CreateObject();
+        gen_rsp_key(key, &reqs[i]);
+        cJSON_AddStringToObject(j_item, "key", key);
+        cJSON_AddNumberToObject(j_item, "ret", results[i]);
+        cJSON_AddItemToArray(j_items, j_item);
+    }
+    cJSON_AddBoolToObject(j_ret, "ret", 1);
+    cJSON_AddStringToObject(j_ret_info, "md5", md5);
+    cJSON_AddItemToObject(j_ret_info, "items", j_items);
+    cJSON_AddItemToObject(j_ret, "info", j_ret_info);
+    char *ret_str_unformat = cJSON_PrintUnformatted(j_ret);
+    evbuffer_add_printf(req->buffer_out, "%s", ret_str_unformat);
+    cJSON_Delete(j_ret);
+    free(ret_str_unformat);
+
+    LOG_PRINT(LOG_INFO, "%s succ batch pic:%s n:%d", address, md5, n);
+    evhtp_headers_add_header(req->headers_out, evhtp_header_new("Server", settings.server_name, 0, 1));
+    evhtp_headers_add_header(req->headers_out, evhtp_header_new("Content-Type", "application/json", 0, 0));
+    evhtp_send_reply(req, EVHTP_RES_OK);
+    return;
+
+err:
+    json_return(req, err_no, NULL, 0);
+    evhtp_headers_add_header(req->headers_out, evhtp_header_new("Server", settings.server_name, 0, 1));
+    evhtp_send_reply(req, EVHTP_RES_OK);
+}
+
+/**
+ * @brief status_request_cb the callback function of the status json of background workers
+ *
+ * @param req the evhtp request
+ * @param arg the callback args
+ */
+void status_request_cb(evhtp_request_t *req, void *arg) {
+    evhtp_connection_t *ev_conn = evhtp_request_get_connection(req);
+    struct sockaddr *saddr = ev_conn->saddr;
+    struct sockaddr_in *ss = (struct sockaddr_in *)saddr;
+    char address[16];
+
+    const char *xff_address = evhtp_header_find(req->headers_in, "X-Forwarded-For");
+    if (xff_address) {
+        inet_aton(xff_address, &ss->sin_addr);
+    }
+    strncpy(address, inet_ntoa(ss->sin_addr), 16);
+
+    int req_method = evhtp_request_get_method(req);
+    if (req_method >= 16)
+        req_method = 16;
+    if (strcmp(method_strmap[req_method], "GET") != 0) {
+        LOG_PRINT(LOG_DEBUG, "Request Method Not Support.");
+        LOG_PRINT(LOG_INFO, "%s refuse status method", address);
+        json_return(req, 2, NULL, 0);
+        evhtp_headers_add_header(req->headers_out, evhtp_header_new("Server", settings.server_name, 0, 1));
+        evhtp_send_reply(req, EVHTP_RES_OK);
+        return;
+    }
+
+    /* the status shows the layout of the store, guard it like admin */
+    if (settings.admin_access != NULL) {
+        int acs = zimg_access_inet(settings.admin_access, ss->sin_addr.s_addr);
+        if (acs != ZIMG_OK) {
+            LOG_PRINT(LOG_INFO, "%s refuse status forbidden", address);
+            evbuffer_add_printf(req->buffer_out, "<html><body><h1>403 Forbidden!</h1></body></html>");
+            evhtp_headers_add_header(req->headers_out, evhtp_header_new("Server", settings.server_name, 0, 1));
+            evhtp_headers_add_header(req->headers_out, evhtp_header_new("Content-Type", "text/html", 0, 0));
+            evhtp_send_reply(req, EVHTP_RES_FORBIDDEN);
+            return;
+        }
+    }
+
+    cJSON *j_ret = cJSON_CreateObject();
+    cJSON_AddBoolToObject(j_ret, "ret", 1);
+    cJSON_AddStringToObject(j_ret, "version", settings.version);
+    cJSON_AddNumberToObject(j_ret, "mode", settings.mode);
+    disk_status(j_ret);
+    repl_status(j_ret);
+    journal_status(j_ret);
+    dcache_status(j_ret);
+    pool_status(j_ret);
+    ring_status(j_ret);
+    scrub_status(j_ret);
+    pregen_status(j_ret);
+    char *ret_str_unformat = cJSON_PrintUnformatted(j_ret);
+    evbuffer_add_printf(req->buffer_out, "%s", ret_str_unformat);
+    cJSON_Delete(j_ret);
+    free(ret_str_unformat);
+
+    LOG_PRINT(LOG_INFO, "%s succ status", address);
+    evhtp_headers_add_header(req->headers_out, evhtp_header_new("Server", settings.server_name, 0, 1));
+    evhtp_headers_add_header(req->headers_out, evhtp_header_new("Content-Type", "application/json", 0, 0));
+    evhtp_send_reply(req, EVHTP_RES_OK);
+}
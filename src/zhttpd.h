@@ -55,5 +55,7 @@ void post_request_cb(evhtp_request_t *req, void *arg);
 void get_request_cb(evhtp_request_t *req, void *arg);
 void admin_request_cb(evhtp_request_t *req, void *arg);
 void info_request_cb(evhtp_request_t *req, void *arg);
+void status_request_cb(evhtp_request_t *req, void *arg);
+void batch_request_cb(evhtp_request_t *req, void *arg);
 
 #endif
@@ -34,11 +34,24 @@
 #include "zscale.h"
 #include "zhttpd.h"
 #include "zlscale.h"
+#include "ztier.h"
+#include "zrepl.h"
+#include "zpregen.h"
+#include "zderive.h"
+#include "zdisk.h"
+#include "zmeta.h"
+#include "zdecode.h"
+#include "znative.h"
+#include "zbatch.h"
 #include "cjson/cJSON.h"
 
 int save_img(thr_arg_t *thr_arg, const char *buff, const int len, char *md5);
 int new_img(const char *buff, const size_t len, const char *save_name);
+static int read_img_file(MagickWand *im, const char *path);
+static int load_orig_file(zimg_req_t *req, const char *path, char **buff, size_t *len);
+static void gen_rsp_path(char *path, zimg_req_t *req, const char *whole_path);
 int get_img(zimg_req_t *req, evhtp_request_t *request);
+int batch_img(thr_arg_t *thr_arg, zimg_req_t *reqs, int n, int *results);
 int admin_img(evhtp_request_t *req, thr_arg_t *thr_arg, char *md5, int t);
 int info_img(evhtp_request_t *request, thr_arg_t *thr_arg, char *md5);
 
@@ -79,6 +92,7 @@ int save_img(thr_arg_t *thr_arg, const char *buff, const int len, char *md5) {
 
     char save_path[512];
     char save_name[512];
+    img_meta_t meta;
 
     if (settings.mode != 1) {
         if (exist_db(thr_arg, md5sum) == 1) {
@@ -94,20 +108,21 @@ int save_img(thr_arg_t *thr_arg, const char *buff, const int len, char *md5) {
             goto done;
         } else {
             LOG_PRINT(LOG_DEBUG, "save_img_db succ.");
+            repl_save(md5sum, buff, len);
+            if (meta_from_blob(buff, len, &meta) == 1)
+                meta_save(thr_arg, md5sum, NULL, &meta);
+            pregen_save(md5sum);
             result = 1;
             goto done;
         }
     }
 
-    //caculate 2-level path
-    int lvl1 = str_hash(md5sum);
-    int lvl2 = str_hash(md5sum + 3);
-
-    snprintf(save_path, 512, "%s/%d/%d/%s", settings.img_path, lvl1, lvl2, md5sum);
+    //find 2-level path in all tiers, new images go to the hot tier
+    int found = tier_find(md5sum, save_path);
     LOG_PRINT(LOG_DEBUG, "save_path: %s", save_path);
 
-    if (is_dir(save_path) != 1) {
-        if (mk_dirs(save_path) == -1) {
+    if (found != 1) {
+        if (disk_mk_dirs(save_path) == -1) {
             LOG_PRINT(LOG_DEBUG, "save_path[%s] Create Failed!", save_path);
             goto done;
         }
@@ -117,15 +132,24 @@ int save_img(thr_arg_t *thr_arg, const char *buff, const int len, char *md5) {
     snprintf(save_name, 512, "%s/0*0", save_path);
     LOG_PRINT(LOG_DEBUG, "save_name-->: %s", save_name);
 
-    if (is_file(save_name) == 1) {
+    found = disk_is_file(save_name);
+    if (found == 1) {
         LOG_PRINT(LOG_DEBUG, "Check File Exist. Needn't Save.");
         goto cache;
     }
+    if (found == -1) {
+        LOG_PRINT(LOG_DEBUG, "Check File[%s] Failed!", save_name);
+        goto done;
+    }
 
     if (new_img(buff, len, save_name) == -1) {
         LOG_PRINT(LOG_DEBUG, "Save Image[%s] Failed!", save_name);
         goto done;
     }
+    repl_save(md5sum, buff, len);
+    if (meta_from_blob(buff, len, &meta) == 1)
+        meta_save(thr_arg, md5sum, save_path, &meta);
+    pregen_save(md5sum);
 
 cache:
     if (len < CACHE_MAX_SIZE) {
@@ -147,37 +171,76 @@ done:
  * @return 1 for success and -1 for fail.
  */
 int new_img(const char *buff, const size_t len, const char *save_name) {
-    int result = -1;
     LOG_PRINT(LOG_DEBUG, "Start to Storage the New Image...");
-    int fd = -1;
-    int wlen = 0;
-
-    if ((fd = open(save_name, O_WRONLY | O_TRUNC | O_CREAT, 00644)) < 0) {
-        LOG_PRINT(LOG_DEBUG, "fd(%s) open failed!", save_name);
-        goto done;
-    }
-
-    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
-        LOG_PRINT(LOG_DEBUG, "This fd is Locked by Other thread.");
-        goto done;
-    }
-
-    wlen = write(fd, buff, len);
-    if (wlen == -1) {
+    if (disk_write(save_name, buff, len) == -1) {
         LOG_PRINT(LOG_DEBUG, "write(%s) failed!", save_name);
-        goto done;
-    } else if (wlen < len) {
-        LOG_PRINT(LOG_DEBUG, "Only part of [%s] is been writed.", save_name);
-        goto done;
+        return -1;
     }
-    flock(fd, LOCK_UN | LOCK_NB);
     LOG_PRINT(LOG_DEBUG, "Image [%s] Write Successfully!", save_name);
-    result = 1;
+    return 1;
+}
 
-done:
-    if (fd != -1)
-        close(fd);
-    return result;
+/**
+ * @brief read_img_file read an image file into a MagickWand through the disk queue
+ *
+ * @param im the MagickWand
+ * @param path the file path
+ *
+ * @return MagickTrue for OK and MagickFalse for fail
+ */
+static int read_img_file(MagickWand *im, const char *path) {
+    char *buff = NULL;
+    size_t len = 0;
+    int ret;
+
+    if (disk_read(path, &buff, &len) != 1)
+        return MagickFalse;
+    ret = MagickReadImageBlob(im, (const unsigned char *)buff, len);
+    free(buff);
+    return ret;
+}
+
+/**
+ * @brief load_orig_file read an original file through the disk queue and cache it
+ *
+ * @param req the zimg request
+ * @param path the file path
+ * @param buff the file, free by caller
+ * @param len length of the file
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int load_orig_file(zimg_req_t *req, const char *path, char **buff, size_t *len) {
+    if (disk_read(path, buff, len) != 1)
+        return -1;
+    /* the file itself is cached, the wand may hold a shrunk decoding of it */
+    if (*len < CACHE_MAX_SIZE)
+        set_cache_bin(req->thr_arg, req->md5, *buff, *len);
+    return 1;
+}
+
+/**
+ * @brief gen_rsp_path the file path of the result of a request
+ *
+ * @param path the path, 512 bytes
+ * @param req the zimg request
+ * @param whole_path the directory of the image
+ */
+static void gen_rsp_path(char *path, zimg_req_t *req, const char *whole_path) {
+    if (settings.script_on == 1 && req->type != NULL)
+        snprintf(path, 512, "%s/t_%s", whole_path, req->type);
+    else if (req->width == 0 && req->height == 0 && req->proportion == 0) {
+        LOG_PRINT(LOG_DEBUG, "Return original image.");
+        snprintf(path, 512, "%s/0*0", whole_path);
+    } else {
+        snprintf(path, 512, "%s/%d*%d_p%d_g%d_%d*%d_r%d_q%d.%s", whole_path, req->width, req->height,
+                 req->proportion,
+                 req->gray,
+                 req->x, req->y,
+                 req->rotate,
+                 req->quality,
+                 req->fmt);
+    }
 }
 
 /**
@@ -191,8 +254,6 @@ done:
 int get_img(zimg_req_t *req, evhtp_request_t *request) {
     int result = -1;
     char rsp_cache_key[CACHE_KEY_SIZE];
-    int fd = -1;
-    struct stat f_stat;
     char *buff = NULL;
     char *orig_buff = NULL;
     MagickWand *im = NULL;
@@ -201,26 +262,18 @@ int get_img(zimg_req_t *req, evhtp_request_t *request) {
 
     LOG_PRINT(LOG_DEBUG, "get_img() start processing zimg request...");
 
-    int lvl1 = str_hash(req->md5);
-    int lvl2 = str_hash(req->md5 + 3);
-
     char whole_path[512];
-    snprintf(whole_path, 512, "%s/%d/%d/%s", settings.img_path, lvl1, lvl2, req->md5);
+    int found = tier_find(req->md5, whole_path);
     LOG_PRINT(LOG_DEBUG, "whole_path: %s", whole_path);
 
-    if (is_dir(whole_path) == -1) {
+    if (found == -1) {
         LOG_PRINT(LOG_DEBUG, "Image %s is not existed!", req->md5);
         goto err;
     }
+    if (meta_plan(req->thr_arg, req, whole_path) == -1)
+        goto err;
 
-    if (settings.script_on == 1 && req->type != NULL)
-        snprintf(rsp_cache_key, CACHE_KEY_SIZE, "%s:%s", req->md5, req->type);
-    else {
-        if (req->proportion == 0 && req->width == 0 && req->height == 0)
-            str_lcpy(rsp_cache_key, req->md5, CACHE_KEY_SIZE);
-        else
-            gen_key(rsp_cache_key, req->md5, 9, req->width, req->height, req->proportion, req->gray, req->x, req->y, req->rotate, req->quality, req->fmt);
-    }
+    gen_rsp_key(rsp_cache_key, req);
 
     if (find_cache_bin(req->thr_arg, rsp_cache_key, &buff, &len) == 1) {
         LOG_PRINT(LOG_DEBUG, "Hit Cache[Key: %s].", rsp_cache_key);
@@ -234,116 +287,65 @@ int get_img(zimg_req_t *req, evhtp_request_t *request) {
     LOG_PRINT(LOG_DEBUG, "0rig File Path: %s", orig_path);
 
     char rsp_path[512];
-    if (settings.script_on == 1 && req->type != NULL)
-        snprintf(rsp_path, 512, "%s/t_%s", whole_path, req->type);
-    else {
-        char name[128];
-        snprintf(name, 128, "%d*%d_p%d_g%d_%d*%d_r%d_q%d.%s", req->width, req->height,
-                 req->proportion,
-                 req->gray,
-                 req->x, req->y,
-                 req->rotate,
-                 req->quality,
-                 req->fmt);
+    gen_rsp_path(rsp_path, req, whole_path);
+    LOG_PRINT(LOG_DEBUG, "Got the rsp_path: %s", rsp_path);
 
-        if (req->width == 0 && req->height == 0 && req->proportion == 0) {
-            LOG_PRINT(LOG_DEBUG, "Return original image.");
-            strncpy(rsp_path, orig_path, 512);
+    int rsp_found = disk_read(rsp_path, &buff, &len);
+    if (rsp_found == -1) {
+        LOG_PRINT(LOG_DEBUG, "File[%s] Read Failed.", rsp_path);
+        goto err;
+    } else if (rsp_found == 0 && derive_img(req, whole_path, &buff, &len) == 1) {
+        /* only one generation is allowed, a derived result is never stored */
+        to_save = false;
+    } else if (rsp_found == 0) {
+        int ret, cached = 0;
+        size_t orig_len = 0;
+        if (find_cache_bin(req->thr_arg, req->md5, &orig_buff, &orig_len) == 1) {
+            LOG_PRINT(LOG_DEBUG, "Hit Orignal Image Cache[Key: %s].", req->md5);
+            cached = 1;
         } else {
-            snprintf(rsp_path, 512, "%s/%s", whole_path, name);
+            LOG_PRINT(LOG_DEBUG, "Not Hit Original Image Cache. Begin to Open it.");
+            if (load_orig_file(req, orig_path, &orig_buff, &orig_len) != 1) {
+                LOG_PRINT(LOG_DEBUG, "Open Original Image From Disk Failed!");
+                goto err;
+            }
         }
-    }
-    LOG_PRINT(LOG_DEBUG, "Got the rsp_path: %s", rsp_path);
 
-    if ((fd = open(rsp_path, O_RDONLY)) == -1) {
-        im = NewMagickWand();
-        if (im == NULL) goto err;
+        if (native_convert(req, orig_buff, orig_len, &buff, &len) != 1) {
+            im = NewMagickWand();
+            if (im == NULL) goto err;
 
-        int ret;
-        if (find_cache_bin(req->thr_arg, req->md5, &orig_buff, &len) == 1) {
-            LOG_PRINT(LOG_DEBUG, "Hit Orignal Image Cache[Key: %s].", req->md5);
-
-            ret = MagickReadImageBlob(im, (const unsigned char *)orig_buff, len);
-            if (ret != MagickTrue) {
+            ret = read_img_blob(im, req, orig_buff, orig_len);
+            if (ret != MagickTrue && cached == 1) {
                 LOG_PRINT(LOG_DEBUG, "Open Original Image From Blob Failed! Begin to Open it From Disk.");
                 del_cache(req->thr_arg, req->md5);
-                ret = MagickReadImage(im, orig_path);
-                if (ret != MagickTrue) {
-                    LOG_PRINT(LOG_DEBUG, "Open Original Image From Disk Failed!");
-                    goto err;
-                } else {
-                    MagickSizeType size;
-                    MagickGetImageLength(im, &size);
-                    LOG_PRINT(LOG_DEBUG, "image size = %d", size);
-                    if (size < CACHE_MAX_SIZE) {
-                        MagickResetIterator(im);
-                        char *new_buff = (char *)MagickGetImageBlob(im, &len);
-                        if (new_buff == NULL) {
-                            LOG_PRINT(LOG_DEBUG, "Webimg Get Original Blob Failed!");
-                            goto err;
-                        }
-                        set_cache_bin(req->thr_arg, req->md5, new_buff, len);
-                        free(new_buff);
-                    }
-                }
+                ClearMagickWand(im);
+                free(orig_buff);
+                orig_buff = NULL;
+                if (load_orig_file(req, orig_path, &orig_buff, &orig_len) == 1)
+                    ret = read_img_blob(im, req, orig_buff, orig_len);
             }
-        } else {
-            LOG_PRINT(LOG_DEBUG, "Not Hit Original Image Cache. Begin to Open it.");
-            ret = MagickReadImage(im, orig_path);
             if (ret != MagickTrue) {
-                LOG_PRINT(LOG_DEBUG, "Open Original Image From Disk Failed! %d != %d", ret, MagickTrue);
                 LOG_PRINT(LOG_DEBUG, "Open Original Image From Disk Failed!");
                 goto err;
-            } else {
-                MagickSizeType size;
-                MagickGetImageLength(im, &size);
-                LOG_PRINT(LOG_DEBUG, "image size = %d", size);
-                if (size < CACHE_MAX_SIZE) {
-                    MagickResetIterator(im);
-                    char *new_buff = (char *)MagickGetImageBlob(im, &len);
-                    if (new_buff == NULL) {
-                        LOG_PRINT(LOG_DEBUG, "Webimg Get Original Blob Failed!");
-                        goto err;
-                    }
-                    set_cache_bin(req->thr_arg, req->md5, new_buff, len);
-                    free(new_buff);
-                }
             }
-        }
 
-        if (settings.script_on == 1 && req->type != NULL)
-            ret = lua_convert(im, req);
-        else
-            ret = convert(im, req);
-        if (ret == -1) goto err;
-        if (ret == 0) to_save = false;
+            if (settings.script_on == 1 && req->type != NULL)
+                ret = lua_convert(im, req);
+            else
+                ret = convert(im, req);
+            if (ret == -1) goto err;
+            if (ret == 0) to_save = false;
 
-        buff = (char *)MagickGetImageBlob(im, &len);
-        if (buff == NULL) {
-            LOG_PRINT(LOG_DEBUG, "Webimg Get Blob Failed!");
-            goto err;
+            buff = (char *)MagickGetImageBlob(im, &len);
+            if (buff == NULL) {
+                LOG_PRINT(LOG_DEBUG, "Webimg Get Blob Failed!");
+                goto err;
+            }
         }
     } else {
         to_save = false;
-        fstat(fd, &f_stat);
-        size_t rlen = 0;
-        len = f_stat.st_size;
-        if (len <= 0) {
-            LOG_PRINT(LOG_DEBUG, "File[%s] is Empty.", rsp_path);
-            goto err;
-        }
-        if ((buff = (char *)malloc(len)) == NULL) {
-            LOG_PRINT(LOG_DEBUG, "buff Malloc Failed!");
-            goto err;
-        }
         LOG_PRINT(LOG_DEBUG, "img_size = %d", len);
-        if ((rlen = read(fd, buff, len)) == -1) {
-            LOG_PRINT(LOG_DEBUG, "File[%s] Read Failed: %s", rsp_path, strerror(errno));
-            goto err;
-        } else if (rlen < len) {
-            LOG_PRINT(LOG_DEBUG, "File[%s] Read Not Compeletly.", rsp_path);
-            goto err;
-        }
     }
 
     //LOG_PRINT(LOG_INFO, "New Image[%s]", rsp_path);
@@ -379,8 +381,6 @@ done:
     }
 
 err:
-    if (fd != -1)
-        close(fd);
     if (im != NULL)
         DestroyMagickWand(im);
     free(buff);
@@ -388,6 +388,91 @@ err:
     return result;
 }
 
+/**
+ * @brief batch_img make several derivatives of an image in disk mode from one decoding
+ *
+ * @param thr_arg the thread arg
+ * @param reqs the zimg requests of one image
+ * @param n number of requests, at most BATCH_MAX
+ * @param results 1 for made, 0 for existed and -1 for failed of every request
+ *
+ * @return 1 for OK, 0 for image not found and -1 for failed
+ */
+int batch_img(thr_arg_t *thr_arg, zimg_req_t *reqs, int n, int *results) {
+    char whole_path[512], orig_path[512];
+    char paths[BATCH_MAX][512], keys[BATCH_MAX][CACHE_KEY_SIZE];
+    zimg_req_t todo[BATCH_MAX];
+    int idx[BATCH_MAX], saves[BATCH_MAX];
+    char *outs[BATCH_MAX];
+    size_t lens[BATCH_MAX];
+    char *orig_buff = NULL;
+    size_t orig_len = 0;
+    int i, m = 0, cached = 0, made;
+
+    if (n <= 0 || n > BATCH_MAX)
+        return -1;
+    if (tier_find(reqs[0].md5, whole_path) == -1) {
+        LOG_PRINT(LOG_DEBUG, "Image %s is not existed!", reqs[0].md5);
+        return 0;
+    }
+    snprintf(orig_path, sizeof(orig_path), "%s/0*0", whole_path);
+
+    for (i = 0; i < n; i++) {
+        results[i] = -1;
+        if (meta_plan(thr_arg, &reqs[i], whole_path) == -1)
+            continue;
+        gen_rsp_key(keys[i], &reqs[i]);
+        gen_rsp_path(paths[i], &reqs[i], whole_path);
+        if (strcmp(paths[i], orig_path) == 0) {
+            results[i] = 0;
+            continue;
+        }
+        /* a disk down or a full queue fails the request instead of a decoding */
+        made = disk_is_file(paths[i]);
+        if (made != 0) {
+            results[i] = (made == 1) ? 0 : -1;
+            continue;
+        }
+        todo[m] = reqs[i];
+        idx[m++] = i;
+    }
+    if (m == 0)
+        return 1;
+
+    if (find_cache_bin(thr_arg, reqs[0].md5, &orig_buff, &orig_len) == 1)
+        cached = 1;
+    else if (load_orig_file(&reqs[0], orig_path, &orig_buff, &orig_len) != 1) {
+        LOG_PRINT(LOG_DEBUG, "Open Original Image From Disk Failed!");
+        return -1;
+    }
+    made = batch_convert(todo, m, orig_buff, orig_len, outs, lens, saves);
+    if (made == -1 && cached == 1) {
+        LOG_PRINT(LOG_DEBUG, "Open Original Image From Blob Failed! Begin to Open it From Disk.");
+        del_cache(thr_arg, reqs[0].md5);
+        free(orig_buff);
+        orig_buff = NULL;
+        if (load_orig_file(&reqs[0], orig_path, &orig_buff, &orig_len) == 1)
+            made = batch_convert(todo, m, orig_buff, orig_len, outs, lens, saves);
+    }
+    free(orig_buff);
+    if (made == -1)
+        return -1;
+
+    /* the results are stored together once every transform is done */
+    for (i = 0; i < m; i++) {
+        int k = idx[i];
+        if (outs[i] == NULL)
+            continue;
+        if (saves[i] == 1 && new_img(outs[i], lens[i], paths[k]) == -1)
+            LOG_PRINT(LOG_WARNING, "fail save %s", paths[k]);
+        if (lens[i] < CACHE_MAX_SIZE)
+            set_cache_bin(thr_arg, keys[k], outs[i], lens[i]);
+        results[k] = 1;
+        free(outs[i]);
+    }
+    return 1;
+}
+
 /**
  * @brief admin_img the function to deal with admin reqeust for disk mode
  *
@@ -402,18 +487,16 @@ int admin_img(evhtp_request_t *req, thr_arg_t *thr_arg, char *md5, int t) {
 
     LOG_PRINT(LOG_DEBUG, "amdin_img() start processing admin request...");
     char whole_path[512];
-    int lvl1 = str_hash(md5);
-    int lvl2 = str_hash(md5 + 3);
-    snprintf(whole_path, 512, "%s/%d/%d/%s", settings.img_path, lvl1, lvl2, md5);
+    int found = tier_find(md5, whole_path);
     LOG_PRINT(LOG_DEBUG, "whole_path: %s", whole_path);
 
-    if (is_dir(whole_path) == -1) {
+    if (found == -1) {
         LOG_PRINT(LOG_DEBUG, "path: %s is not exist!", whole_path);
         return 2;
     }
 
     if (t == 1) {
-        if (delete_file(whole_path) != -1) {
+        if (tier_delete(md5) != -1) {
             result = 1;
             evbuffer_add_printf(req->buffer_out,
                                 "<html><body><h1>Admin Command Successful!</h1> \
@@ -441,17 +524,21 @@ int info_img(evhtp_request_t *request, thr_arg_t *thr_arg, char *md5) {
     LOG_PRINT(LOG_DEBUG, "info_img() start processing info request...");
     MagickWand *im = NULL;
     char whole_path[512];
-    int lvl1 = str_hash(md5);
-    int lvl2 = str_hash(md5 + 3);
-    snprintf(whole_path, 512, "%s/%d/%d/%s", settings.img_path, lvl1, lvl2, md5);
+    int found = tier_find(md5, whole_path);
     LOG_PRINT(LOG_DEBUG, "whole_path: %s", whole_path);
 
-    if (is_dir(whole_path) == -1) {
+    if (found == -1) {
         result = 0;
         LOG_PRINT(LOG_DEBUG, "Image %s is not existed!", md5);
         goto err;
     }
 
+    img_meta_t meta;
+    if (meta_get(thr_arg, md5, whole_path, &meta) == 1) {
+        meta_info(&meta, request);
+        return 1;
+    }
+
     char orig_path[512];
     snprintf(orig_path, 512, "%s/0*0", whole_path);
     LOG_PRINT(LOG_DEBUG, "0rig File Path: %s", orig_path);
@@ -460,7 +547,7 @@ int info_img(evhtp_request_t *request, thr_arg_t *thr_arg, char *md5) {
     if (im == NULL) goto err;
     int ret = -1;
 
-    ret = MagickReadImage(im, orig_path);
+    ret = read_img_file(im, orig_path);
     if (ret != MagickTrue) {
         LOG_PRINT(LOG_DEBUG, "Open Original Image From Disk Failed!");
         goto err;
@@ -0,0 +1,829 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zjournal.c
+ * @brief write-back journal in front of the kv backends.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * With journal on, save_img_db() appends the image to a local log and
+ * returns as soon as the record is on disk. A background thread writes the
+ * records to beansdb or ssdb in batches and retries with backoff while the
+ * backend is down. Keys waiting in the journal are found through an in
+ * memory index, so reads and existence checks see them at once.
+ *
+ * The log is split into segments of JOURNAL_SEGMENT_SIZE. A segment is
+ * removed when every record in it and in all older segments has reached
+ * the backend, so delete records always outlive the writes they cancel.
+ * On start every segment is replayed, a torn record at the end is cut off
+ * and the surviving records are queued again.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "zjournal.h"
+#include "zconf.h"
+#include "zdb.h"
+#include "zutil.h"
+#include "zlog.h"
+
+#define JOURNAL_MAGIC           0x4c4e4a5a  /* "ZJNL" */
+#define JOURNAL_SEGMENT_SIZE    (64 * 1024 * 1024)
+#define JOURNAL_BUCKETS         65536
+#define JOURNAL_RETRY_MIN       100
+#define JOURNAL_RETRY_MAX       10000
+
+#define JOURNAL_SET             'S'
+#define JOURNAL_DEL             'D'
+
+typedef struct jnl_rec_s {
+    uint32_t magic;
+    uint8_t type;
+    uint8_t klen;
+    uint16_t pad;
+    uint32_t vlen;
+    uint32_t sum;
+} jnl_rec_t;
+
+typedef struct jnl_seg_s jnl_seg_t;
+
+struct jnl_seg_s {
+    uint32_t seq;
+    int fd;
+    off_t size;
+    int pending;
+    int readers;
+    jnl_seg_t *next;
+};
+
+typedef struct jnl_entry_s jnl_entry_t;
+
+struct jnl_entry_s {
+    char key[CACHE_KEY_SIZE];
+    jnl_seg_t *seg;
+    off_t off;
+    size_t len;
+    uint64_t gen;
+    int busy;
+    int deleted;
+    jnl_entry_t *hnext;
+    jnl_entry_t *prev;
+    jnl_entry_t *next;
+};
+
+typedef struct jnl_job_s {
+    jnl_entry_t *e;
+    jnl_seg_t *seg;
+    off_t off;
+    size_t len;
+    uint64_t gen;
+    int ret;
+} jnl_job_t;
+
+typedef struct jnl_stat_s {
+    long queued;
+    long written;
+    long retries;
+    long full;
+    long replayed;
+    long pending;
+    uint64_t pending_bytes;
+} jnl_stat_t;
+
+static int jnl_on = 0;
+static jnl_entry_t *jnl_index[JOURNAL_BUCKETS];
+static jnl_entry_t *jnl_head = NULL;
+static jnl_entry_t *jnl_tail = NULL;
+static jnl_seg_t *jnl_segs = NULL;
+static jnl_seg_t *jnl_cur = NULL;
+static jnl_stat_t jnl_stat;
+static pthread_mutex_t jnl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t jnl_write_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jnl_cond = PTHREAD_COND_INITIALIZER;
+
+int journal_init(void);
+int journal_save(const char *key, const char *buff, size_t len);
+int journal_get(const char *key, char **buff, size_t *len);
+int journal_exist(const char *key);
+int journal_del(const char *key);
+void journal_status(cJSON *j_ret);
+static uint32_t jnl_hash(const char *key);
+static uint32_t jnl_sum(const char *key, size_t klen, const char *buff, size_t len);
+static jnl_entry_t * jnl_find(const char *key);
+static void jnl_unlink(jnl_entry_t *e);
+static int jnl_index_set(const char *key, jnl_seg_t *seg, off_t off, size_t len);
+static void jnl_index_del(const char *key);
+static void jnl_release(void);
+static jnl_seg_t * jnl_seg_open(uint32_t seq);
+static int jnl_write_full(int fd, const char *buff, size_t len);
+static int jnl_append(int type, const char *key, const char *buff, size_t len, jnl_seg_t **seg, off_t *off);
+static int jnl_seq_cmp(const void *a, const void *b);
+static void jnl_replay_seg(jnl_seg_t *seg);
+static int jnl_replay(void);
+static void * jnl_worker(void *arg);
+
+/**
+ * @brief journal_init replay the journal and start the flusher
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int journal_init(void) {
+    pthread_t tid;
+
+    if (settings.mode != 2 && settings.mode != 3) {
+        LOG_PRINT(LOG_WARNING, "journal only works in beansdb and ssdb mode, disabled");
+        return 1;
+    }
+    if (is_dir(settings.journal_path) != 1 && mk_dirs(settings.journal_path) != 1) {
+        LOG_PRINT(LOG_DEBUG, "journal_path[%s] Create Failed!", settings.journal_path);
+        return -1;
+    }
+
+    memset(&jnl_stat, 0, sizeof(jnl_stat));
+    if (jnl_replay() == -1)
+        return -1;
+    if (pthread_create(&tid, NULL, jnl_worker, NULL) != 0) {
+        LOG_PRINT(LOG_DEBUG, "journal flusher create failed!");
+        return -1;
+    }
+    pthread_detach(tid);
+    jnl_on = 1;
+    LOG_PRINT(LOG_DEBUG, "Journal Init Finished. replayed: %ld pending: %ld", jnl_stat.replayed, jnl_stat.pending);
+    return 1;
+}
+
+/**
+ * @brief journal_save append an image to the journal for a later write
+ *
+ * @param key the key of the image
+ * @param buff the image buffer
+ * @param len the length of buff
+ *
+ * @return 1 for journaled and -1 for the caller to write through
+ */
+int journal_save(const char *key, const char *buff, size_t len) {
+    uint64_t max_bytes = (uint64_t)settings.journal_max * 1024 * 1024;
+    jnl_seg_t *seg = NULL;
+    off_t off = 0;
+
+    if (jnl_on == 0 || strlen(key) >= CACHE_KEY_SIZE)
+        return -1;
+
+    pthread_mutex_lock(&jnl_lock);
+    if (jnl_stat.pending_bytes + len > max_bytes) {
+        jnl_stat.full++;
+        pthread_mutex_unlock(&jnl_lock);
+        LOG_PRINT(LOG_WARNING, "journal full, key:%s written through", key);
+        return -1;
+    }
+    pthread_mutex_unlock(&jnl_lock);
+
+    pthread_mutex_lock(&jnl_write_lock);
+    if (jnl_append(JOURNAL_SET, key, buff, len, &seg, &off) == -1) {
+        pthread_mutex_unlock(&jnl_write_lock);
+        return -1;
+    }
+    /* index before the segment can be rotated away and released */
+    pthread_mutex_lock(&jnl_lock);
+    pthread_mutex_unlock(&jnl_write_lock);
+    if (jnl_index_set(key, seg, off, len) == -1) {
+        pthread_mutex_unlock(&jnl_lock);
+        return -1;
+    }
+    jnl_stat.queued++;
+    pthread_cond_signal(&jnl_cond);
+    pthread_mutex_unlock(&jnl_lock);
+    LOG_PRINT(LOG_DEBUG, "journal key:%s len:%zu seg:%u", key, len, seg->seq);
+    return 1;
+}
+
+/**
+ * @brief journal_get read an image still waiting in the journal
+ *
+ * @param key the key of the image
+ * @param buff the buffer, free by caller
+ * @param len the length of buff
+ *
+ * @return 1 for OK and -1 for not in the journal
+ */
+int journal_get(const char *key, char **buff, size_t *len) {
+    jnl_entry_t *e;
+    jnl_seg_t *seg;
+    off_t off;
+    size_t n, done = 0;
+    ssize_t rlen;
+    char *p;
+
+    if (jnl_on == 0)
+        return -1;
+
+    pthread_mutex_lock(&jnl_lock);
+    if ((e = jnl_find(key)) == NULL) {
+        pthread_mutex_unlock(&jnl_lock);
+        return -1;
+    }
+    seg = e->seg;
+    off = e->off;
+    n = e->len;
+    seg->readers++;
+    pthread_mutex_unlock(&jnl_lock);
+
+    p = (char *)malloc(n > 0 ? n : 1);
+    while (p != NULL && done < n) {
+        rlen = pread(seg->fd, p + done, n - done, off + done);
+        if (rlen <= 0)
+            break;
+        done += rlen;
+    }
+
+    pthread_mutex_lock(&jnl_lock);
+    seg->readers--;
+    jnl_release();
+    pthread_mutex_unlock(&jnl_lock);
+
+    if (p == NULL || done < n) {
+        LOG_PRINT(LOG_ERROR, "journal read key:%s failed", key);
+        free(p);
+        return -1;
+    }
+    *buff = p;
+    *len = n;
+    return 1;
+}
+
+/**
+ * @brief journal_exist check if a key is waiting in the journal
+ *
+ * @param key the key
+ *
+ * @return 1 for found and -1 for not
+ */
+int journal_exist(const char *key) {
+    int ret;
+    if (jnl_on == 0)
+        return -1;
+    pthread_mutex_lock(&jnl_lock);
+    ret = (jnl_find(key) != NULL) ? 1 : -1;
+    pthread_mutex_unlock(&jnl_lock);
+    return ret;
+}
+
+/**
+ * @brief journal_del drop a key from the journal so it never reaches the backend
+ *
+ * @param key the key
+ *
+ * @return 1 for dropped and -1 for not in the journal
+ */
+int journal_del(const char *key) {
+    int found;
+    jnl_seg_t *seg = NULL;
+    off_t off = 0;
+
+    if (jnl_on == 0)
+        return -1;
+
+    pthread_mutex_lock(&jnl_lock);
+    found = (jnl_find(key) != NULL);
+    if (found)
+        jnl_index_del(key);
+    pthread_mutex_unlock(&jnl_lock);
+    if (!found)
+        return -1;
+
+    /* keep the write from coming back when the journal is replayed */
+    pthread_mutex_lock(&jnl_write_lock);
+    if (jnl_append(JOURNAL_DEL, key, NULL, 0, &seg, &off) == -1)
+        LOG_PRINT(LOG_WARNING, "journal delete record of key:%s failed", key);
+    pthread_mutex_unlock(&jnl_write_lock);
+    return 1;
+}
+
+/**
+ * @brief journal_status add the journal counters to a json object
+ *
+ * @param j_ret the json object
+ */
+void journal_status(cJSON *j_ret) {
+    jnl_stat_t st;
+    int segments = 0;
+    jnl_seg_t *seg;
+    cJSON *j_jnl;
+
+    if (jnl_on == 0)
+        return;
+    pthread_mutex_lock(&jnl_lock);
+    st = jnl_stat;
+    for (seg = jnl_segs; seg != NULL; seg = seg->next)
+        segments++;
+    pthread_mutex_unlock(&jnl_lock);
+
+    j_jnl = cJSON_CreateObject();
+    cJSON_AddNumberToObject(j_jnl, "queued", st.queued);
+    cJSON_AddNumberToObject(j_jnl, "written", st.written);
+    cJSON_AddNumberToObject(j_jnl, "retries", st.retries);
+    cJSON_AddNumberToObject(j_jnl, "full", st.full);
+    cJSON_AddNumberToObject(j_jnl, "replayed", st.replayed);
+    cJSON_AddNumberToObject(j_jnl, "pending", st.pending);
+    cJSON_AddNumberToObject(j_jnl, "pending_bytes", st.pending_bytes);
+    cJSON_AddNumberToObject(j_jnl, "segments", segments);
+    cJSON_AddItemToObject(j_ret, "journal", j_jnl);
+}
+
+/**
+ * @brief jnl_hash bucket of a key in the index
+ *
+ * @param key the key
+ *
+ * @return the bucket
+ */
+static uint32_t jnl_hash(const char *key) {
+    uint32_t h = 2166136261U;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619U;
+    }
+    return h & (JOURNAL_BUCKETS - 1);
+}
+
+/**
+ * @brief jnl_sum checksum of a record, to find torn writes on replay
+ *
+ * @param key the key
+ * @param klen the length of key
+ * @param buff the value
+ * @param len the length of buff
+ *
+ * @return the checksum
+ */
+static uint32_t jnl_sum(const char *key, size_t klen, const char *buff, size_t len) {
+    uint32_t a = 1, b = 0;
+    size_t i;
+    for (i = 0; i < klen; i++) {
+        a = (a + (unsigned char)key[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    for (i = 0; i < len; i++) {
+        a = (a + (unsigned char)buff[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
+/**
+ * @brief jnl_find find the live entry of a key, jnl_lock held
+ *
+ * @param key the key
+ *
+ * @return the entry or NULL
+ */
+static jnl_entry_t * jnl_find(const char *key) {
+    jnl_entry_t *e;
+    for (e = jnl_index[jnl_hash(key)]; e != NULL; e = e->hnext) {
+        if (strcmp(e->key, key) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/**
+ * @brief jnl_unlink take an entry out of the flush queue and free it, jnl_lock held
+ *
+ * @param e the entry, already out of the index
+ */
+static void jnl_unlink(jnl_entry_t *e) {
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        jnl_head = e->next;
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        jnl_tail = e->prev;
+    free(e);
+}
+
+/**
+ * @brief jnl_index_set point a key at its newest record, jnl_lock held
+ *
+ * @param key the key
+ * @param seg the segment of the record
+ * @param off the offset of the value
+ * @param len the length of the value
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int jnl_index_set(const char *key, jnl_seg_t *seg, off_t off, size_t len) {
+    jnl_entry_t *e = jnl_find(key);
+    uint32_t h;
+
+    if (e != NULL) {
+        e->seg->pending--;
+        jnl_stat.pending_bytes -= e->len;
+    } else {
+        if ((e = (jnl_entry_t *)calloc(1, sizeof(jnl_entry_t))) == NULL)
+            return -1;
+        str_lcpy(e->key, key, sizeof(e->key));
+        h = jnl_hash(key);
+        e->hnext = jnl_index[h];
+        jnl_index[h] = e;
+        e->prev = jnl_tail;
+        if (jnl_tail != NULL)
+            jnl_tail->next = e;
+        else
+            jnl_head = e;
+        jnl_tail = e;
+        jnl_stat.pending++;
+    }
+    e->seg = seg;
+    e->off = off;
+    e->len = len;
+    e->gen++;
+    seg->pending++;
+    jnl_stat.pending_bytes += len;
+    return 1;
+}
+
+/**
+ * @brief jnl_index_del drop a key from the index, jnl_lock held
+ *
+ * An entry the flusher is writing stays in the queue marked deleted, the
+ * flusher frees it and removes what it wrote from the backend.
+ *
+ * @param key the key
+ */
+static void jnl_index_del(const char *key) {
+    jnl_entry_t **pp = &jnl_index[jnl_hash(key)];
+    jnl_entry_t *e;
+
+    while ((e = *pp) != NULL && strcmp(e->key, key) != 0)
+        pp = &e->hnext;
+    if (e == NULL)
+        return;
+    *pp = e->hnext;
+    e->seg->pending--;
+    jnl_stat.pending--;
+    jnl_stat.pending_bytes -= e->len;
+    if (e->busy)
+        e->deleted = 1;
+    else
+        jnl_unlink(e);
+    jnl_release();
+}
+
+/**
+ * @brief jnl_release remove the oldest segments once nothing refers to them, jnl_lock held
+ */
+static void jnl_release(void) {
+    jnl_seg_t *seg;
+    char path[PATH_MAX_SIZE];
+
+    while ((seg = jnl_segs) != NULL && seg != jnl_cur && seg->pending == 0 && seg->readers == 0) {
+        jnl_segs = seg->next;
+        snprintf(path, PATH_MAX_SIZE, "%s/%08u.jnl", settings.journal_path, seg->seq);
+        if (unlink(path) == -1)
+            LOG_PRINT(LOG_WARNING, "journal segment %s unlink failed: %s", path, strerror(errno));
+        close(seg->fd);
+        free(seg);
+    }
+}
+
+/**
+ * @brief jnl_seg_open open or create a segment
+ *
+ * @param seq the sequence number of the segment
+ *
+ * @return the segment or NULL
+ */
+static jnl_seg_t * jnl_seg_open(uint32_t seq) {
+    char path[PATH_MAX_SIZE];
+    struct stat st;
+    jnl_seg_t *seg;
+    int fd;
+
+    snprintf(path, PATH_MAX_SIZE, "%s/%08u.jnl", settings.journal_path, seq);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) == -1) {
+        LOG_PRINT(LOG_ERROR, "journal segment %s open failed: %s", path, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || (seg = (jnl_seg_t *)calloc(1, sizeof(jnl_seg_t))) == NULL) {
+        close(fd);
+        return NULL;
+    }
+    seg->seq = seq;
+    seg->fd = fd;
+    seg->size = st.st_size;
+    return seg;
+}
+
+/**
+ * @brief jnl_write_full write exactly len bytes
+ *
+ * @param fd the fd
+ * @param buff the buffer
+ * @param len the length to write
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int jnl_write_full(int fd, const char *buff, size_t len) {
+    size_t off = 0;
+    ssize_t wlen;
+    while (off < len) {
+        wlen = write(fd, buff + off, len - off);
+        if (wlen == -1 && errno == EINTR)
+            continue;
+        if (wlen <= 0)
+            return -1;
+        off += wlen;
+    }
+    return 1;
+}
+
+/**
+ * @brief jnl_append append a record to the current segment, jnl_write_lock held
+ *
+ * @param type JOURNAL_SET or JOURNAL_DEL
+ * @param key the key
+ * @param buff the value
+ * @param len the length of buff
+ * @param seg the segment written
+ * @param off the offset of the value in seg
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int jnl_append(int type, const char *key, const char *buff, size_t len, jnl_seg_t **seg, off_t *off) {
+    jnl_rec_t rec;
+    jnl_seg_t *cur = jnl_cur;
+    size_t klen = strlen(key);
+
+    if (cur->size > 0 && cur->size + sizeof(rec) + klen + len > JOURNAL_SEGMENT_SIZE) {
+        jnl_seg_t *next = jnl_seg_open(cur->seq + 1);
+        if (next == NULL)
+            return -1;
+        pthread_mutex_lock(&jnl_lock);
+        cur->next = next;
+        jnl_cur = next;
+        jnl_release();
+        pthread_mutex_unlock(&jnl_lock);
+        cur = next;
+    }
+
+    rec.magic = JOURNAL_MAGIC;
+    rec.type = (uint8_t)type;
+    rec.klen = (uint8_t)klen;
+    rec.pad = 0;
+    rec.vlen = (uint32_t)len;
+    rec.sum = jnl_sum(key, klen, buff, len);
+    if (jnl_write_full(cur->fd, (const char *)&rec, sizeof(rec)) == -1 ||
+            jnl_write_full(cur->fd, key, klen) == -1 ||
+            jnl_write_full(cur->fd, buff, len) == -1 ||
+            (settings.journal_sync == 1 && fdatasync(cur->fd) == -1)) {
+        LOG_PRINT(LOG_ERROR, "journal append key:%s failed: %s", key, strerror(errno));
+        if (ftruncate(cur->fd, cur->size) == -1)
+            LOG_PRINT(LOG_ERROR, "journal truncate failed: %s", strerror(errno));
+        return -1;
+    }
+    *seg = cur;
+    *off = cur->size + sizeof(rec) + klen;
+    cur->size += sizeof(rec) + klen + len;
+    return 1;
+}
+
+/**
+ * @brief jnl_seq_cmp qsort compare of segment numbers
+ */
+static int jnl_seq_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief jnl_replay_seg index the records of a segment, cutting a torn tail
+ *
+ * @param seg the segment
+ */
+static void jnl_replay_seg(jnl_seg_t *seg) {
+    jnl_rec_t rec;
+    char key[CACHE_KEY_SIZE];
+    char *buff = NULL;
+    off_t off = 0;
+
+    while (off + (off_t)sizeof(rec) <= seg->size) {
+        if (pread(seg->fd, &rec, sizeof(rec), off) != sizeof(rec) || rec.magic != JOURNAL_MAGIC ||
+                rec.klen == 0 || rec.klen >= CACHE_KEY_SIZE ||
+                off + (off_t)(sizeof(rec) + rec.klen + rec.vlen) > seg->size)
+            break;
+        if ((buff = (char *)malloc(rec.vlen > 0 ? rec.vlen : 1)) == NULL)
+            break;
+        if (pread(seg->fd, key, rec.klen, off + sizeof(rec)) != rec.klen ||
+                pread(seg->fd, buff, rec.vlen, off + sizeof(rec) + rec.klen) != (ssize_t)rec.vlen ||
+                jnl_sum(key, rec.klen, buff, rec.vlen) != rec.sum) {
+            free(buff);
+            break;
+        }
+        free(buff);
+        key[rec.klen] = '\0';
+        if (rec.type == JOURNAL_SET) {
+            jnl_index_set(key, seg, off + sizeof(rec) + rec.klen, rec.vlen);
+            jnl_stat.replayed++;
+        } else {
+            jnl_index_del(key);
+        }
+        off += sizeof(rec) + rec.klen + rec.vlen;
+    }
+    if (off < seg->size) {
+        LOG_PRINT(LOG_WARNING, "journal segment %u cut at %lld of %lld", seg->seq, (long long)off, (long long)seg->size);
+        if (ftruncate(seg->fd, off) == 0)
+            seg->size = off;
+    }
+}
+
+/**
+ * @brief jnl_replay load the segments left by the last run and open a new one
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int jnl_replay(void) {
+    DIR *dir;
+    struct dirent *ent;
+    uint32_t *seqs = NULL, *tmp, next = 1;
+    size_t n = 0, cap = 0, i;
+    jnl_seg_t *seg, *last = NULL;
+    char *end;
+
+    if ((dir = opendir(settings.journal_path)) == NULL)
+        return -1;
+    while ((ent = readdir(dir)) != NULL) {
+        unsigned long seq = strtoul(ent->d_name, &end, 10);
+        if (end == ent->d_name || strcmp(end, ".jnl") != 0)
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            if ((tmp = (uint32_t *)realloc(seqs, cap * sizeof(uint32_t))) == NULL)
+                break;
+            seqs = tmp;
+        }
+        seqs[n++] = (uint32_t)seq;
+    }
+    closedir(dir);
+    if (n > 0)
+        qsort(seqs, n, sizeof(uint32_t), jnl_seq_cmp);
+
+    /* replay runs before any worker thread, the locks only keep the helpers honest */
+    pthread_mutex_lock(&jnl_lock);
+    for (i = 0; i < n; i++) {
+        if ((seg = jnl_seg_open(seqs[i])) == NULL)
+            continue;
+        if (last != NULL)
+            last->next = seg;
+        else
+            jnl_segs = seg;
+        last = seg;
+        jnl_cur = seg;
+        jnl_replay_seg(seg);
+        next = seqs[i] + 1;
+    }
+    free(seqs);
+
+    if ((seg = jnl_seg_open(next)) == NULL) {
+        pthread_mutex_unlock(&jnl_lock);
+        return -1;
+    }
+    if (last != NULL)
+        last->next = seg;
+    else
+        jnl_segs = seg;
+    jnl_cur = seg;
+    jnl_release();
+    pthread_mutex_unlock(&jnl_lock);
+    return 1;
+}
+
+/**
+ * @brief jnl_worker the flusher thread
+ *
+ * @param arg not used
+ *
+ * @return not used
+ */
+static void * jnl_worker(void *arg) {
+    thr_arg_t *thr_arg = (thr_arg_t *)calloc(1, sizeof(thr_arg_t));
+    jnl_job_t *jobs = (jnl_job_t *)calloc(settings.journal_batch, sizeof(jnl_job_t));
+    jnl_job_t *job;
+    jnl_entry_t *e;
+    int i, n, failed, backoff = 0;
+
+    if (thr_arg == NULL || jobs == NULL)
+        return NULL;
+    init_conns(thr_arg);
+
+    for (;;) {
+        /* copy what to write, a new save of the same key may move the entry meanwhile */
+        pthread_mutex_lock(&jnl_lock);
+        while (jnl_head == NULL)
+            pthread_cond_wait(&jnl_cond, &jnl_lock);
+        for (n = 0, e = jnl_head; e != NULL && n < settings.journal_batch; e = e->next) {
+            if (e->deleted)
+                continue;
+            e->busy = 1;
+            e->seg->readers++;
+            jobs[n].e = e;
+            jobs[n].seg = e->seg;
+            jobs[n].off = e->off;
+            jobs[n].len = e->len;
+            jobs[n].gen = e->gen;
+            n++;
+        }
+        pthread_mutex_unlock(&jnl_lock);
+
+        for (i = 0; i < n; i++) {
+            size_t done = 0;
+            ssize_t rlen;
+            char *buff;
+
+            job = &jobs[i];
+            job->ret = -1;
+            if ((buff = (char *)malloc(job->len > 0 ? job->len : 1)) == NULL)
+                continue;
+            while (done < job->len) {
+                rlen = pread(job->seg->fd, buff + done, job->len - done, job->off + done);
+                if (rlen <= 0)
+                    break;
+                done += rlen;
+            }
+            if (done == job->len)
+                job->ret = write_img_db(thr_arg, job->e->key, buff, job->len);
+            free(buff);
+        }
+
+        failed = 0;
+        pthread_mutex_lock(&jnl_lock);
+        for (i = 0; i < n; i++) {
+            job = &jobs[i];
+            e = job->e;
+            e->busy = 0;
+            job->seg->readers--;
+            if (job->ret != 1) {
+                failed++;
+                jnl_stat.retries++;
+            } else {
+                jnl_stat.written++;
+            }
+            if (e->deleted) {
+                /* deleted while being written, the copy just made goes too */
+                if (job->ret == 1) {
+                    pthread_mutex_unlock(&jnl_lock);
+                    remove_img_db(thr_arg, e->key);
+                    pthread_mutex_lock(&jnl_lock);
+                }
+                jnl_unlink(e);
+            } else if (job->ret == 1 && e->gen == job->gen) {
+                jnl_index_del(e->key);
+            }
+        }
+        jnl_release();
+        pthread_mutex_unlock(&jnl_lock);
+
+        /* all written, start the only segment left over instead of replaying it on restart */
+        pthread_mutex_lock(&jnl_write_lock);
+        pthread_mutex_lock(&jnl_lock);
+        if (jnl_head == NULL && jnl_segs == jnl_cur && jnl_cur->readers == 0 && jnl_cur->size > 0) {
+            if (ftruncate(jnl_cur->fd, 0) == 0)
+                jnl_cur->size = 0;
+        }
+        pthread_mutex_unlock(&jnl_lock);
+        pthread_mutex_unlock(&jnl_write_lock);
+
+        if (failed > 0) {
+            backoff = backoff == 0 ? JOURNAL_RETRY_MIN : backoff * 2;
+            if (backoff > JOURNAL_RETRY_MAX)
+                backoff = JOURNAL_RETRY_MAX;
+            LOG_PRINT(LOG_WARNING, "journal flush: %d of %d failed, retry in %dms", failed, n, backoff);
+            usleep(backoff * 1000);
+        } else {
+            backoff = 0;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,34 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zjournal.h
+ * @brief write-back journal in front of the kv backends header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZJOURNAL_H
+#define ZJOURNAL_H
+
+#include "zcommon.h"
+#include "cjson/cJSON.h"
+
+int journal_init(void);
+int journal_save(const char *key, const char *buff, size_t len);
+int journal_get(const char *key, char **buff, size_t *len);
+int journal_exist(const char *key);
+int journal_del(const char *key);
+void journal_status(cJSON *j_ret);
+
+#endif
@@ -25,6 +25,8 @@
 #include "zcommon.h"
 #include "zlog.h"
 #include "zlscale.h"
+#include "zscale.h"
+#include "zresample.h"
 
 int lua_convert(MagickWand *im, zimg_req_t *req);
 
@@ -65,7 +67,7 @@ static int scale_wi(lua_State *L) {
 
     LOG_PRINT(LOG_DEBUG, "cols = %f rows = %f", cols, rows);
     lua_arg *larg = pthread_getspecific(thread_key);
-    int ret = MagickResizeImage(larg->img, cols, rows, LanczosFilter, 1.0);
+    int ret = resize_img(larg->img, cols, rows, larg->tier);
     //int ret = MagickScaleImage(larg->img, cols, rows);
     lua_pushnumber(L, ret);
     return 1;
@@ -135,6 +137,20 @@ static int set_wi_format(lua_State *L) {
     return 1;
 }
 
+static int set_wi_tier(lua_State *L) {
+    const char *name = lua_tostring(L, 1);
+    int ret = -1, tier = resample_tier(name);
+
+    lua_arg *larg = pthread_getspecific(thread_key);
+    if (tier != -1) {
+        larg->tier = tier;
+        ret = 1;
+    }
+    LOG_PRINT(LOG_DEBUG, "set_wi_tier: %s ret = %d", name, ret);
+    lua_pushnumber(L, ret);
+    return 1;
+}
+
 static int zimg_type(lua_State *L) {
     lua_arg *larg = pthread_getspecific(thread_key);
     lua_pushstring(L, larg->trans_type);
@@ -160,6 +176,7 @@ const struct luaL_reg zimg_lib[] = {
     {"gray",                gray_wi             },
     {"set_quality",         set_wi_quality      },
     {"set_format",          set_wi_format       },
+    {"set_tier",            set_wi_tier         },
     {"type",                zimg_type           },
     {"ret",                 zimg_ret            },
     {NULL,                  NULL                }
@@ -198,6 +215,7 @@ int lua_convert(MagickWand *im, zimg_req_t *req) {
         larg->lua_ret = ret;
         larg->trans_type = req->type;
         larg->img = im;
+        larg->tier = settings.resize_tier;
         pthread_setspecific(thread_key, larg);
         //luaL_dofile(req->thr_arg->L, settings.script_name);
         lua_getglobal(req->thr_arg->L, "f");
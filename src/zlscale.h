@@ -27,6 +27,7 @@ typedef struct lua_arg_s {
     MagickWand *img;
     char *trans_type;
     int lua_ret;
+    int tier;
 } lua_arg;
 
 int lua_convert(MagickWand *im, zimg_req_t *req);
@@ -0,0 +1,405 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zmeta.c
+ * @brief stored metadata records of originals.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * A small json record with the size, format, quality and orientation of
+ * an original is kept beside it: the file "meta" in its directory for
+ * disk mode and the key md5:meta in kv modes. It is written at upload
+ * from a ping of the header and backfilled on first access for images
+ * stored before, so /info and request planning never decode pixels. In kv
+ * modes pregen adds a mask of the parameter sets it stored, with a
+ * signature of the sets configured then.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wand/magick_wand.h>
+#include "zmeta.h"
+#include "zcache.h"
+#include "zdb.h"
+#include "zdisk.h"
+#include "zutil.h"
+#include "zlog.h"
+#include "cjson/cJSON.h"
+
+#define META_MAX_SIZE       512
+
+static void meta_key(char *key, const char *md5);
+static int meta_encode(const img_meta_t *meta, char *out, size_t size);
+static int meta_decode(const char *buff, size_t len, img_meta_t *meta);
+static int meta_load(thr_arg_t *thr_arg, const char *md5, const char *path, img_meta_t *meta);
+int is_meta_key(const char *key);
+int meta_from_blob(const char *buff, size_t len, img_meta_t *meta);
+int meta_save(thr_arg_t *thr_arg, const char *md5, const char *path, const img_meta_t *meta);
+int meta_get(thr_arg_t *thr_arg, const char *md5, const char *path, img_meta_t *meta);
+int meta_del(thr_arg_t *thr_arg, const char *md5);
+int meta_cached(thr_arg_t *thr_arg, const char *md5);
+int meta_plan(thr_arg_t *thr_arg, zimg_req_t *req, const char *path);
+void meta_info(const img_meta_t *meta, evhtp_request_t *req);
+
+/**
+ * @brief meta_key gen the key of a metadata record
+ *
+ * @param key the key, CACHE_KEY_SIZE
+ * @param md5 the md5 of the original
+ */
+static void meta_key(char *key, const char *md5) {
+    snprintf(key, CACHE_KEY_SIZE, "%s%s", md5, META_KEY_SUFFIX);
+}
+
+/**
+ * @brief is_meta_key check if a key is a metadata record
+ *
+ * @param key the key
+ *
+ * @return 1 for yes and 0 for no
+ */
+int is_meta_key(const char *key) {
+    size_t len = strlen(key), slen = strlen(META_KEY_SUFFIX);
+    return (len > slen && strcmp(key + len - slen, META_KEY_SUFFIX) == 0) ? 1 : 0;
+}
+
+/**
+ * @brief meta_encode serialize a record to json
+ *
+ * @param meta the record
+ * @param out the output buffer
+ * @param size size of out
+ *
+ * @return length of json or -1 for fail
+ */
+static int meta_encode(const img_meta_t *meta, char *out, size_t size) {
+    cJSON *j_meta = cJSON_CreateObject();
+    char *str;
+    int len = -1;
+
+    cJSON_AddNumberToObject(j_meta, "width", meta->width);
+    cJSON_AddNumberToObject(j_meta, "height", meta->height);
+    cJSON_AddNumberToObject(j_meta, "quality", meta->quality);
+    cJSON_AddStringToObject(j_meta, "format", meta->format);
+    cJSON_AddNumberToObject(j_meta, "orientation", meta->orientation);
+    cJSON_AddNumberToObject(j_meta, "size", meta->size);
+    cJSON_AddNumberToObject(j_meta, "time", meta->created);
+    if (meta->pregen_sig != 0) {
+        cJSON_AddNumberToObject(j_meta, "pregen", meta->pregen);
+        cJSON_AddNumberToObject(j_meta, "pregen_sig", meta->pregen_sig);
+    }
+    str = cJSON_PrintUnformatted(j_meta);
+    if (str != NULL && strlen(str) < size) {
+        str_lcpy(out, str, size);
+        len = strlen(out);
+    }
+    free(str);
+    cJSON_Delete(j_meta);
+    return len;
+}
+
+/**
+ * @brief meta_decode parse a json record
+ *
+ * @param buff the json
+ * @param len length of buff
+ * @param meta the record
+ *
+ * @return 1 for OK and -1 for a bad record
+ */
+static int meta_decode(const char *buff, size_t len, img_meta_t *meta) {
+    char tmp[META_MAX_SIZE];
+    cJSON *j_meta, *j_item;
+
+    if (len == 0 || len >= META_MAX_SIZE)
+        return -1;
+    memcpy(tmp, buff, len);
+    tmp[len] = '\0';
+    if ((j_meta = cJSON_Parse(tmp)) == NULL)
+        return -1;
+    memset(meta, 0, sizeof(img_meta_t));
+    if ((j_item = cJSON_GetObjectItem(j_meta, "width")) != NULL)
+        meta->width = (unsigned long)j_item->valuedouble;
+    if ((j_item = cJSON_GetObjectItem(j_meta, "height")) != NULL)
+        meta->height = (unsigned long)j_item->valuedouble;
+    if ((j_item = cJSON_GetObjectItem(j_meta, "quality")) != NULL)
+        meta->quality = (size_t)j_item->valuedouble;
+    if ((j_item = cJSON_GetObjectItem(j_meta, "format")) != NULL && j_item->valuestring != NULL)
+        str_lcpy(meta->format, j_item->valuestring, sizeof(meta->format));
+    if ((j_item = cJSON_GetObjectItem(j_meta, "orientation")) != NULL)
+        meta->orientation = j_item->valueint;
+    if ((j_item = cJSON_GetObjectItem(j_meta, "size")) != NULL)
+        meta->size = (size_t)j_item->valuedouble;
+    if ((j_item = cJSON_GetObjectItem(j_meta, "time")) != NULL)
+        meta->created = (time_t)j_item->valuedouble;
+    if ((j_item = cJSON_GetObjectItem(j_meta, "pregen")) != NULL)
+        meta->pregen = (unsigned int)j_item->valuedouble;
+    if ((j_item = cJSON_GetObjectItem(j_meta, "pregen_sig")) != NULL)
+        meta->pregen_sig = (unsigned int)j_item->valuedouble;
+    cJSON_Delete(j_meta);
+    return (meta->width > 0 && meta->height > 0) ? 1 : -1;
+}
+
+/**
+ * @brief meta_from_blob read the record of an image from its header only
+ *
+ * @param buff the image
+ * @param len length of image
+ * @param meta the record
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int meta_from_blob(const char *buff, size_t len, img_meta_t *meta) {
+    MagickWand *im = NewMagickWand();
+    char *format;
+    int ret = -1;
+
+    if (im == NULL)
+        return -1;
+    /* ping reads the header and skips the pixels */
+    if (MagickPingImageBlob(im, (const unsigned char *)buff, len) == MagickTrue) {
+        memset(meta, 0, sizeof(img_meta_t));
+        meta->width = MagickGetImageWidth(im);
+        meta->height = MagickGetImageHeight(im);
+        meta->quality = MagickGetImageCompressionQuality(im);
+        meta->quality = (meta->quality == 0 ? 100 : meta->quality);
+        meta->orientation = MagickGetImageOrientation(im);
+        meta->size = len;
+        meta->created = time(NULL);
+        format = MagickGetImageFormat(im);
+        if (format != NULL) {
+            str_lcpy(meta->format, format, sizeof(meta->format));
+            MagickRelinquishMemory(format);
+        }
+        ret = 1;
+    }
+    DestroyMagickWand(im);
+    return ret;
+}
+
+/**
+ * @brief meta_save store the record of an original
+ *
+ * @param thr_arg the thread arg
+ * @param md5 the md5 of the original
+ * @param path the directory of the original in disk mode, NULL for kv modes
+ * @param meta the record
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int meta_save(thr_arg_t *thr_arg, const char *md5, const char *path, const img_meta_t *meta) {
+    char buff[META_MAX_SIZE];
+    char key[CACHE_KEY_SIZE];
+    char file[PATH_MAX_SIZE];
+    int len, ret;
+
+    if ((len = meta_encode(meta, buff, sizeof(buff))) == -1)
+        return -1;
+    meta_key(key, md5);
+    if (settings.mode == 1) {
+        if (path == NULL)
+            return -1;
+        snprintf(file, PATH_MAX_SIZE, "%s/%s", path, META_FILE);
+        ret = disk_write(file, buff, len);
+    } else {
+        ret = save_img_db(thr_arg, key, buff, len);
+    }
+    if (ret != -1)
+        set_cache_bin(thr_arg, key, buff, len);
+    return ret == -1 ? -1 : 1;
+}
+
+/**
+ * @brief meta_load read a stored record
+ *
+ * @param thr_arg the thread arg
+ * @param md5 the md5 of the original
+ * @param path the directory of the original in disk mode
+ * @param meta the record
+ *
+ * @return 1 for OK and -1 for not found
+ */
+static int meta_load(thr_arg_t *thr_arg, const char *md5, const char *path, img_meta_t *meta) {
+    char key[CACHE_KEY_SIZE];
+    char file[PATH_MAX_SIZE];
+    char *buff = NULL;
+    size_t len = 0;
+    int ret = -1;
+
+    meta_key(key, md5);
+    if (find_cache_bin(thr_arg, key, &buff, &len) == 1) {
+        ret = meta_decode(buff, len, meta);
+        free(buff);
+        if (ret == 1)
+            return 1;
+        buff = NULL;
+    }
+    if (settings.mode == 1) {
+        snprintf(file, PATH_MAX_SIZE, "%s/%s", path, META_FILE);
+        if (disk_read(file, &buff, &len) != 1)
+            return -1;
+    } else if (get_img_db(thr_arg, key, &buff, &len) != 1) {
+        return -1;
+    }
+    ret = meta_decode(buff, len, meta);
+    if (ret == 1)
+        set_cache_bin(thr_arg, key, buff, len);
+    free(buff);
+    return ret;
+}
+
+/**
+ * @brief meta_get get the record of an original, build and store it if missing
+ *
+ * @param thr_arg the thread arg
+ * @param md5 the md5 of the original
+ * @param path the directory of the original in disk mode, NULL for kv modes
+ * @param meta the record
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int meta_get(thr_arg_t *thr_arg, const char *md5, const char *path, img_meta_t *meta) {
+    char file[PATH_MAX_SIZE];
+    char *buff = NULL;
+    size_t len = 0;
+    int ret;
+
+    if (settings.mode == 1 && path == NULL)
+        return -1;
+    if (meta_load(thr_arg, md5, path, meta) == 1)
+        return 1;
+
+    /* backfill images stored before records existed */
+    if (settings.mode == 1) {
+        snprintf(file, PATH_MAX_SIZE, "%s/0*0", path);
+        ret = disk_read(file, &buff, &len);
+    } else if ((ret = find_cache_bin(thr_arg, md5, &buff, &len)) != 1) {
+        ret = get_img_db(thr_arg, md5, &buff, &len);
+    }
+    if (ret != 1)
+        return -1;
+    ret = meta_from_blob(buff, len, meta);
+    free(buff);
+    if (ret != 1)
+        return -1;
+    LOG_PRINT(LOG_DEBUG, "Backfill metadata of image [%s].", md5);
+    meta_save(thr_arg, md5, path, meta);
+    return 1;
+}
+
+/**
+ * @brief meta_del delete the record of an original from kv modes and the cache
+ *
+ * @param thr_arg the thread arg
+ * @param md5 the md5 of the original
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int meta_del(thr_arg_t *thr_arg, const char *md5) {
+    char key[CACHE_KEY_SIZE];
+
+    meta_key(key, md5);
+    del_cache(thr_arg, key);
+    if (settings.mode == 1)
+        return 1;
+    return del_db(thr_arg, key);
+}
+
+/**
+ * @brief meta_cached check the record of an original in the cache, without the backend
+ *
+ * @param thr_arg the thread arg
+ * @param md5 the md5 of the original
+ *
+ * @return 1 for cached and -1 for not
+ */
+int meta_cached(thr_arg_t *thr_arg, const char *md5) {
+    char key[CACHE_KEY_SIZE];
+
+    meta_key(key, md5);
+    return exist_cache(thr_arg, key);
+}
+
+/**
+ * @brief meta_plan check and normalize a request by the record before decoding
+ *
+ * @param thr_arg the thread arg
+ * @param req the zimg request
+ * @param path the directory of the original in disk mode, NULL for kv modes
+ *
+ * @return 1 for planned, 0 for nothing to plan and -1 for a request that must fail
+ */
+int meta_plan(thr_arg_t *thr_arg, zimg_req_t *req, const char *path) {
+    img_meta_t meta;
+    unsigned long cols, rows;
+    int x = req->x, y = req->y;
+
+    if (settings.script_on == 1 && req->type != NULL)
+        return 0;
+    if (req->width == 0 && req->height == 0)
+        return 0;
+    /* only crops and capped zoom depend on the size of the original */
+    if (x == -1 && y == -1 && (settings.disable_zoom_up != 1 || req->proportion == 3))
+        return 0;
+    if (meta_get(thr_arg, req->md5, path, &meta) != 1)
+        return 0;
+
+    /* convert() auto-orients first, the transposed orientations swap the sides */
+    cols = meta.orientation >= 5 ? meta.height : meta.width;
+    rows = meta.orientation >= 5 ? meta.width : meta.height;
+
+    if (x != -1 || y != -1) {
+        if (x < 0) x = 0;
+        if (y < 0) y = 0;
+        if ((unsigned long)x >= cols || (unsigned long)y >= rows) {
+            LOG_PRINT(LOG_DEBUG, "Crop (%d, %d) out of image [%s] %lux%lu.", x, y, req->md5, cols, rows);
+            return -1;
+        }
+        return 1;
+    }
+
+    /* the same clamp proportion() applies, so oversized requests share one derivative */
+    if ((unsigned long)req->width > cols)
+        req->width = cols;
+    if ((unsigned long)req->height > rows)
+        req->height = rows;
+    return 1;
+}
+
+/**
+ * @brief meta_info add the record to the response of /info
+ *
+ * @param meta the record
+ * @param req the evhtp request
+ */
+void meta_info(const img_meta_t *meta, evhtp_request_t *req) {
+    //{"ret":true,"info":{"size":195135,"width":720,"height":480,"quality":75,"format":"JPEG"}}
+    cJSON *j_ret = cJSON_CreateObject();
+    cJSON *j_ret_info = cJSON_CreateObject();
+    cJSON_AddBoolToObject(j_ret, "ret", 1);
+    cJSON_AddNumberToObject(j_ret_info, "size", meta->size);
+    cJSON_AddNumberToObject(j_ret_info, "width", meta->width);
+    cJSON_AddNumberToObject(j_ret_info, "height", meta->height);
+    cJSON_AddNumberToObject(j_ret_info, "quality", meta->quality);
+    cJSON_AddStringToObject(j_ret_info, "format", meta->format);
+    cJSON_AddNumberToObject(j_ret_info, "orientation", meta->orientation);
+    cJSON_AddNumberToObject(j_ret_info, "time", meta->created);
+    cJSON_AddItemToObject(j_ret, "info", j_ret_info);
+    char *ret_str_unformat = cJSON_PrintUnformatted(j_ret);
+    LOG_PRINT(LOG_DEBUG, "ret_str_unformat: %s", ret_str_unformat);
+    evbuffer_add_printf(req->buffer_out, "%s", ret_str_unformat);
+    cJSON_Delete(j_ret);
+    free(ret_str_unformat);
+}
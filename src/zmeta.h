@@ -0,0 +1,51 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zmeta.h
+ * @brief stored metadata records of originals header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZMETA_H
+#define ZMETA_H
+
+#include <time.h>
+#include "zcommon.h"
+
+#define META_FILE           "meta"
+#define META_KEY_SUFFIX     ":meta"
+
+typedef struct img_meta_s {
+    unsigned long width;
+    unsigned long height;
+    size_t quality;
+    char format[16];
+    int orientation;
+    size_t size;
+    time_t created;
+    unsigned int pregen;
+    unsigned int pregen_sig;
+} img_meta_t;
+
+int is_meta_key(const char *key);
+int meta_from_blob(const char *buff, size_t len, img_meta_t *meta);
+int meta_save(thr_arg_t *thr_arg, const char *md5, const char *path, const img_meta_t *meta);
+int meta_get(thr_arg_t *thr_arg, const char *md5, const char *path, img_meta_t *meta);
+int meta_del(thr_arg_t *thr_arg, const char *md5);
+int meta_cached(thr_arg_t *thr_arg, const char *md5);
+int meta_plan(thr_arg_t *thr_arg, zimg_req_t *req, const char *path);
+void meta_info(const img_meta_t *meta, evhtp_request_t *req);
+
+#endif
@@ -0,0 +1,739 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file znative.c
+ * @brief native jpeg to jpeg/webp scaling without MagickWand.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * The common request, a JPEG original scaled and written as JPEG or WebP,
+ * is done on plain 8-bit rows: libjpeg-turbo decodes with DCT scaling,
+ * zresample finishes the size with lanczos and libjpeg-turbo or libwebp
+ * encodes. The rows stream from the decoder through the resampler into
+ * the jpeg encoder, so a huge original takes memory for a few rows and
+ * not for its pixels; only webp, whose encoder wants the whole picture,
+ * keeps the result. The sizes, crop offsets and quality follow convert() and
+ * proportion(). Anything else returns -1 and goes through MagickWand:
+ * scripts, crops, rotation, percent scales, other formats, CMYK, EXIF
+ * orientations and damaged files.
+ *
+ * Rotations by right angles, crops and gray of a JPEG original without
+ * scaling are done losslessly on the DCT coefficients by tjTransform(), as
+ * jpegtran does, when the rotated edges and the crop offset fall on MCU
+ * boundaries. Otherwise they go through MagickWand as well.
+ *
+ * native_roi() decodes only the rows and MCU columns around a crop for
+ * read_img_blob(), so other crops cost what the region costs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <setjmp.h>
+#include <math.h>
+#include <jpeglib.h>
+#include <turbojpeg.h>
+#include <webp/encode.h>
+#include "znative.h"
+#include "zresample.h"
+#include "zlog.h"
+
+#define NATIVE_JPEG         1
+#define NATIVE_WEBP         2
+
+typedef struct native_err_s {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+} native_err_t;
+
+typedef struct native_plan_s {
+    int scaled_w;
+    int scaled_h;
+    int x;
+    int y;
+    int out_w;
+    int out_h;
+} native_plan_t;
+
+typedef struct native_sink_s {
+    struct jpeg_compress_struct *cinfo;
+    unsigned char *pix;
+    int x;
+    int y;
+    int out_w;
+    int out_h;
+    int ch;
+} native_sink_t;
+
+/* the luminance table of the jpeg spec, what libjpeg scales by quality */
+static const int std_luminance[64] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+};
+
+static void native_error_exit(j_common_ptr cinfo);
+static void native_output_message(j_common_ptr cinfo);
+static int native_format(const char *fmt);
+static int exif_orientation(jpeg_saved_marker_ptr marker);
+static int jpeg_quality(struct jpeg_decompress_struct *cinfo);
+static int native_plan(zimg_req_t *req, int w, int h, native_plan_t *plan);
+static void start_jpeg(struct jpeg_compress_struct *cinfo, int w, int h, int ch, int quality);
+static int sink_row(void *arg, const unsigned char *row, int y);
+static int encode_webp(const unsigned char *pix, int w, int h, size_t stride, int ch, int quality, char **out, size_t *out_len);
+static size_t strip_markers(unsigned char *buff, size_t len);
+static int native_transform(zimg_req_t *req, const char *in, size_t in_len, char **out, size_t *out_len);
+int native_convert(zimg_req_t *req, const char *in, size_t in_len, char **out, size_t *out_len);
+int native_roi(zimg_req_t *req, const char *in, size_t in_len, native_roi_t *roi);
+
+/**
+ * @brief native_error_exit jump back instead of exiting on a libjpeg error
+ *
+ * @param cinfo the libjpeg object
+ */
+static void native_error_exit(j_common_ptr cinfo) {
+    native_err_t *err = (native_err_t *)cinfo->err;
+    native_output_message(cinfo);
+    longjmp(err->jmp, 1);
+}
+
+/**
+ * @brief native_output_message send libjpeg warnings to the log instead of stderr
+ *
+ * @param cinfo the libjpeg object
+ */
+static void native_output_message(j_common_ptr cinfo) {
+    char msg[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, msg);
+    LOG_PRINT(LOG_DEBUG, "libjpeg: %s", msg);
+}
+
+/**
+ * @brief native_format the output format of a request
+ *
+ * @param fmt the fmt of the request
+ *
+ * @return NATIVE_JPEG, NATIVE_WEBP or -1 for formats left to MagickWand
+ */
+static int native_format(const char *fmt) {
+    if (fmt == NULL || strncmp(fmt, "none", 4) == 0)
+        return NATIVE_JPEG;
+    if (strcasecmp(fmt, "jpeg") == 0 || strcasecmp(fmt, "jpg") == 0)
+        return NATIVE_JPEG;
+    if (strcasecmp(fmt, "webp") == 0)
+        return NATIVE_WEBP;
+    return -1;
+}
+
+/**
+ * @brief exif_orientation find the orientation tag in the exif of a jpeg
+ *
+ * @param marker the saved APP1 markers
+ *
+ * @return the orientation, 0 if there is none
+ */
+static int exif_orientation(jpeg_saved_marker_ptr marker) {
+    for (; marker != NULL; marker = marker->next) {
+        const unsigned char *d = marker->data + 6;
+        size_t n, ifd, i, cnt;
+        int le;
+
+        if (marker->marker != JPEG_APP0 + 1 || marker->data_length < 14 || memcmp(marker->data, "Exif\0\0", 6) != 0)
+            continue;
+        n = marker->data_length - 6;
+        le = (d[0] == 'I');
+#define EXIF16(p) (le ? ((p)[0] | ((p)[1] << 8)) : (((p)[0] << 8) | (p)[1]))
+#define EXIF32(p) (le ? ((size_t)(p)[0] | ((size_t)(p)[1] << 8) | ((size_t)(p)[2] << 16) | ((size_t)(p)[3] << 24)) \
+                      : (((size_t)(p)[0] << 24) | ((size_t)(p)[1] << 16) | ((size_t)(p)[2] << 8) | (size_t)(p)[3]))
+        ifd = EXIF32(d + 4);
+        if (ifd + 2 > n)
+            return 0;
+        cnt = EXIF16(d + ifd);
+        for (i = 0; i < cnt && ifd + 2 + 12 * (i + 1) <= n; i++) {
+            const unsigned char *e = d + ifd + 2 + 12 * i;
+            if (EXIF16(e) == 0x0112)
+                return EXIF16(e + 8);
+        }
+#undef EXIF16
+#undef EXIF32
+        return 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief jpeg_quality estimate the quality a jpeg was written with from its luminance table
+ *
+ * @param cinfo the libjpeg object after jpeg_read_header
+ *
+ * @return the quality, 0 if unknown
+ */
+static int jpeg_quality(struct jpeg_decompress_struct *cinfo) {
+    JQUANT_TBL *tbl = cinfo->quant_tbl_ptrs[0];
+    double sum = 0, std = 0, s;
+    int i, q;
+
+    if (tbl == NULL)
+        return 0;
+    for (i = 0; i < DCTSIZE2; i++) {
+        sum += tbl->quantval[i];
+        std += std_luminance[i];
+    }
+    s = sum * 100.0 / std;
+    q = (int)lrint(s <= 100.0 ? (200.0 - s) / 2.0 : 5000.0 / s);
+    return q < 1 ? 1 : (q > 100 ? 100 : q);
+}
+
+/**
+ * @brief native_plan the sizes proportion() would produce for a request
+ *
+ * @param req the zimg request
+ * @param w width of the original
+ * @param h height of the original
+ * @param plan the scaled size, the crop offset and the final size
+ *
+ * @return 1 for OK and -1 for requests left to MagickWand
+ */
+static int native_plan(zimg_req_t *req, int w, int h, native_plan_t *plan) {
+    int cols = req->width, rows = req->height;
+
+    if (cols == 0 && rows == 0)
+        return -1;
+    if (settings.disable_zoom_up == 1) {
+        cols = cols > w ? w : cols;
+        rows = rows > h ? h : rows;
+    }
+    plan->x = 0;
+    plan->y = 0;
+
+    if (req->proportion == 1) {
+        if (cols == 0 || rows == 0) {
+            if (cols > 0)
+                rows = (int)round(((double)cols / w) * h);
+            else
+                cols = (int)round(((double)rows / h) * w);
+            plan->scaled_w = cols;
+            plan->scaled_h = rows;
+        } else {
+            double cols_rate = (double)cols / w;
+            double rows_rate = (double)rows / h;
+            if (cols_rate > rows_rate) {
+                plan->scaled_w = cols;
+                plan->scaled_h = (int)round(cols_rate * h);
+                plan->y = (int)floor((plan->scaled_h - rows) / 2.0);
+            } else {
+                plan->scaled_w = (int)round(rows_rate * w);
+                plan->scaled_h = rows;
+                plan->x = (int)floor((plan->scaled_w - cols) / 2.0);
+            }
+        }
+    } else if (req->proportion == 0) {
+        if (cols == 0 || rows == 0)
+            return -1;
+        plan->scaled_w = cols;
+        plan->scaled_h = rows;
+    } else if (req->proportion == 4) {
+        double rate;
+        if (cols == 0 || rows == 0) {
+            rate = cols > 0 ? (double)cols / w : (double)rows / h;
+        } else {
+            double rate_col = (double)cols / w;
+            double rate_row = (double)rows / h;
+            rate = rate_col < rate_row ? rate_col : rate_row;
+        }
+        plan->scaled_w = cols = (int)round(w * rate);
+        plan->scaled_h = rows = (int)round(h * rate);
+    } else {
+        return -1;
+    }
+
+    plan->out_w = cols;
+    plan->out_h = rows;
+    if (plan->out_w < 1 || plan->out_h < 1 || plan->x < 0 || plan->y < 0 ||
+            plan->x + plan->out_w > plan->scaled_w || plan->y + plan->out_h > plan->scaled_h)
+        return -1;
+    return 1;
+}
+
+/**
+ * @brief start_jpeg start a baseline jpeg written row by row
+ *
+ * @param cinfo the compressor, created with a destination
+ * @param w width
+ * @param h height
+ * @param ch 1 for gray and 3 for rgb
+ * @param quality the quality
+ */
+static void start_jpeg(struct jpeg_compress_struct *cinfo, int w, int h, int ch, int quality) {
+    cinfo->image_width = w;
+    cinfo->image_height = h;
+    cinfo->input_components = ch;
+    cinfo->in_color_space = ch == 1 ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, quality, TRUE);
+    cinfo->optimize_coding = TRUE;
+    /* full chroma at high quality, as ImageMagick does */
+    if (ch == 3 && quality >= 90) {
+        cinfo->comp_info[0].h_samp_factor = 1;
+        cinfo->comp_info[0].v_samp_factor = 1;
+    }
+    jpeg_start_compress(cinfo, TRUE);
+}
+
+/**
+ * @brief sink_row take a scaled row, crop it and write it to the jpeg or keep it for webp
+ *
+ * @param arg the sink
+ * @param row the scaled row
+ * @param y index of the row
+ *
+ * @return 1 for OK
+ */
+static int sink_row(void *arg, const unsigned char *row, int y) {
+    native_sink_t *sink = (native_sink_t *)arg;
+    JSAMPROW p;
+
+    if (y < sink->y || y >= sink->y + sink->out_h)
+        return 1;
+    p = (JSAMPROW)(row + (size_t)sink->x * sink->ch);
+    if (sink->cinfo != NULL)
+        jpeg_write_scanlines(sink->cinfo, &p, 1);
+    else
+        memcpy(sink->pix + (size_t)(y - sink->y) * sink->out_w * sink->ch, p, (size_t)sink->out_w * sink->ch);
+    return 1;
+}
+
+/**
+ * @brief encode_webp encode pixels as a lossy webp
+ *
+ * @param pix the first pixel
+ * @param w width
+ * @param h height
+ * @param stride bytes per row
+ * @param ch 1 for gray and 3 for rgb
+ * @param quality the quality
+ * @param out the webp, free by caller
+ * @param out_len length of the webp
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int encode_webp(const unsigned char *pix, int w, int h, size_t stride, int ch, int quality, char **out, size_t *out_len) {
+    unsigned char *rgb = NULL;
+    uint8_t *webp = NULL;
+    size_t len;
+    int x, y;
+
+    if (ch == 1) {
+        if ((rgb = (unsigned char *)malloc((size_t)w * h * 3)) == NULL)
+            return -1;
+        for (y = 0; y < h; y++) {
+            for (x = 0; x < w; x++)
+                memset(rgb + ((size_t)y * w + x) * 3, pix[y * stride + x], 3);
+        }
+        pix = rgb;
+        stride = (size_t)w * 3;
+    }
+    len = WebPEncodeRGB(pix, w, h, (int)stride, quality, &webp);
+    free(rgb);
+    if (len == 0)
+        return -1;
+    /* the buffer of libwebp goes back to libwebp, callers free with free() */
+    if ((*out = (char *)malloc(len)) == NULL) {
+        WebPFree(webp);
+        return -1;
+    }
+    memcpy(*out, webp, len);
+    WebPFree(webp);
+    *out_len = len;
+    return 1;
+}
+
+/**
+ * @brief strip_markers drop the metadata segments of a jpeg like MagickStripImage()
+ *
+ * @param buff the jpeg, changed in place
+ * @param len length of the jpeg
+ *
+ * @return the new length
+ */
+static size_t strip_markers(unsigned char *buff, size_t len) {
+    size_t pos = 2, seg;
+    int m;
+
+    while (pos + 4 <= len && buff[pos] == 0xFF) {
+        m = buff[pos + 1];
+        if (m == 0xDA)
+            break;
+        seg = 2 + ((size_t)buff[pos + 2] << 8 | buff[pos + 3]);
+        if (pos + seg > len)
+            break;
+        /* APP1-APP15 hold exif, xmp and profiles, COM the comments; APP0 is JFIF */
+        if ((m >= 0xE1 && m <= 0xEF) || m == 0xFE) {
+            memmove(buff + pos, buff + pos + seg, len - pos - seg);
+            len -= seg;
+        } else
+            pos += seg;
+    }
+    return len;
+}
+
+/**
+ * @brief native_transform rotate, crop or gray a jpeg losslessly
+ *
+ * @param req the zimg request
+ * @param in the original
+ * @param in_len length of the original
+ * @param out the result, free by caller
+ * @param out_len length of the result
+ *
+ * @return 1 for OK and -1 for requests left to the other paths
+ */
+static int native_transform(zimg_req_t *req, const char *in, size_t in_len, char **out, size_t *out_len) {
+    struct jpeg_decompress_struct cinfo;
+    native_err_t jerr;
+    tjtransform xf;
+    tjhandle tj;
+    unsigned char *dst = NULL;
+    unsigned long dst_len = 0;
+    /* convert() crops only when a size is given too */
+    int crop = (req->x != -1 || req->y != -1) && (req->width != 0 || req->height != 0);
+    int rotate = ((req->rotate % 360) + 360) % 360;
+    int w, h, x, y, cw, ch, quality, ret;
+
+    if (settings.lossless == 0 || native_format(req->fmt) != NATIVE_JPEG)
+        return -1;
+    /* scaling needs the pixels, and plain requests are just encoded again */
+    if (!crop && req->x == -1 && req->y == -1 && (req->width != 0 || req->height != 0))
+        return -1;
+    if (rotate % 90 != 0 || (rotate == 0 && !crop && req->gray != 1))
+        return -1;
+    if ((unsigned char)in[0] != 0xFF || (unsigned char)in[1] != 0xD8)
+        return -1;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = native_error_exit;
+    jerr.pub.output_message = native_output_message;
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)in, in_len);
+    jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xFFFF);
+    jpeg_read_header(&cinfo, TRUE);
+    w = cinfo.image_width;
+    h = cinfo.image_height;
+    quality = jpeg_quality(&cinfo);
+    ret = ((cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_GRAYSCALE) ||
+           exif_orientation(cinfo.marker_list) > 1) ? -1 : 1;
+    jpeg_destroy_decompress(&cinfo);
+    if (ret == -1)
+        return -1;
+    /* convert() would write a lower quality, the coefficients keep the original one */
+    if (settings.lossless == 1 && (quality == 0 || quality > req->quality))
+        return -1;
+
+    /* the rectangle crop() cuts before the rotation */
+    x = req->x < 0 ? 0 : req->x;
+    y = req->y < 0 ? 0 : req->y;
+    if (x >= w || y >= h)
+        return -1;
+    cw = (req->width == 0 || w < x + req->width) ? w - x : req->width;
+    ch = (req->height == 0 || h < y + req->height) ? h - y : req->height;
+    if (!crop) {
+        cw = w;
+        ch = h;
+    }
+
+    /* tjTransform() crops the rotated image, so turn the rectangle with it */
+    memset(&xf, 0, sizeof(xf));
+    if (rotate == 90) {
+        xf.op = TJXOP_ROT90;
+        xf.r.x = h - (y + ch);
+        xf.r.y = x;
+    } else if (rotate == 180) {
+        xf.op = TJXOP_ROT180;
+        xf.r.x = w - (x + cw);
+        xf.r.y = h - (y + ch);
+    } else if (rotate == 270) {
+        xf.op = TJXOP_ROT270;
+        xf.r.x = y;
+        xf.r.y = w - (x + cw);
+    } else {
+        xf.op = TJXOP_NONE;
+        xf.r.x = x;
+        xf.r.y = y;
+    }
+    xf.r.w = rotate % 180 == 0 ? cw : ch;
+    xf.r.h = rotate % 180 == 0 ? ch : cw;
+    /* partial MCUs on the moved edges make tjTransform() fail instead of trimming */
+    xf.options = TJXOPT_PERFECT;
+    if (cw != w || ch != h)
+        xf.options |= TJXOPT_CROP;
+    if (req->gray == 1)
+        xf.options |= TJXOPT_GRAY;
+
+    if ((tj = tjInitTransform()) == NULL)
+        return -1;
+    ret = tjTransform(tj, (unsigned char *)in, in_len, 1, &dst, &dst_len, &xf, 0);
+    tjDestroy(tj);
+    if (ret != 0) {
+        LOG_PRINT(LOG_DEBUG, "lossless transform of [%s] failed: %s", req->md5, tjGetErrorStr());
+        tjFree(dst);
+        return -1;
+    }
+    /* the buffer of turbojpeg goes back to turbojpeg, callers free with free() */
+    if ((*out = (char *)malloc(dst_len)) == NULL) {
+        tjFree(dst);
+        return -1;
+    }
+    memcpy(*out, dst, dst_len);
+    tjFree(dst);
+    *out_len = strip_markers((unsigned char *)*out, dst_len);
+    LOG_PRINT(LOG_DEBUG, "lossless transform [%s] %dx%d r%d crop %d,%d %dx%d", req->md5,
+              w, h, rotate, x, y, cw, ch);
+    return 1;
+}
+
+/**
+ * @brief native_convert scale or losslessly transform a jpeg original for a request without MagickWand
+ *
+ * @param req the zimg request
+ * @param in the original
+ * @param in_len length of the original
+ * @param out the result, free by caller
+ * @param out_len length of the result
+ *
+ * @return 1 for OK and -1 for requests left to MagickWand
+ */
+int native_convert(zimg_req_t *req, const char *in, size_t in_len, char **out, size_t *out_len) {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_compress_struct cout;
+    native_err_t jerr;
+    native_plan_t plan;
+    native_sink_t sink;
+    rs_stream_t *volatile rs = NULL;
+    unsigned char *volatile row = NULL;
+    unsigned char *volatile pix = NULL;
+    unsigned char *volatile mem = NULL;
+    unsigned long mem_len = 0;
+    volatile int started = 0;
+    int fmt, quality, d, ch, ret;
+
+    if (in == NULL || in_len < 4)
+        return -1;
+    if (settings.script_on == 1 && req->type != NULL)
+        return -1;
+    if (native_transform(req, in, in_len, out, out_len) == 1)
+        return 1;
+    if (settings.native != 1)
+        return -1;
+    if (req->x != -1 || req->y != -1 || req->rotate != 0)
+        return -1;
+    if ((fmt = native_format(req->fmt)) == -1)
+        return -1;
+    if ((unsigned char)in[0] != 0xFF || (unsigned char)in[1] != 0xD8)
+        return -1;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = native_error_exit;
+    jerr.pub.output_message = native_output_message;
+    /* the decoder and the encoder share the error handler */
+    if (setjmp(jerr.jmp)) {
+        LOG_PRINT(LOG_DEBUG, "native decoding of [%s] failed, fall back to MagickWand", req->md5);
+        jpeg_destroy_decompress(&cinfo);
+        if (started == 1) {
+            /* the buffer moves when it grows, term_destination tells where it is */
+            if (cout.dest != NULL)
+                cout.dest->term_destination(&cout);
+            jpeg_destroy_compress(&cout);
+        }
+        resample_stream_free(rs);
+        free(row);
+        free(mem);
+        free(pix);
+        return -1;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)in, in_len);
+    jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xFFFF);
+    jpeg_read_header(&cinfo, TRUE);
+
+    if ((cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_GRAYSCALE) ||
+            exif_orientation(cinfo.marker_list) > 1 ||
+            native_plan(req, cinfo.image_width, cinfo.image_height, &plan) == -1) {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+    /* convert() keeps the quality of the original when it is lower */
+    quality = jpeg_quality(&cinfo);
+    if (quality == 0 || quality > req->quality)
+        quality = req->quality;
+
+    for (d = 8; d > 1; d /= 2) {
+        if ((int)((cinfo.image_width + d - 1) / d) >= plan.scaled_w && (int)((cinfo.image_height + d - 1) / d) >= plan.scaled_h)
+            break;
+    }
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = d;
+    cinfo.out_color_space = (req->gray == 1 || cinfo.jpeg_color_space == JCS_GRAYSCALE) ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    ch = cinfo.output_components;
+
+    sink.cinfo = NULL;
+    sink.x = plan.x;
+    sink.y = plan.y;
+    sink.out_w = plan.out_w;
+    sink.out_h = plan.out_h;
+    sink.ch = ch;
+    if (fmt == NATIVE_WEBP) {
+        sink.pix = pix = (unsigned char *)malloc((size_t)plan.out_w * plan.out_h * ch);
+    } else {
+        sink.pix = NULL;
+        cout.err = &jerr.pub;
+        jpeg_create_compress(&cout);
+        started = 1;
+        jpeg_mem_dest(&cout, (unsigned char **)&mem, &mem_len);
+        start_jpeg(&cout, plan.out_w, plan.out_h, ch, quality);
+        sink.cinfo = &cout;
+    }
+    rs = resample_stream_new(cinfo.output_width, cinfo.output_height, ch, plan.scaled_w, plan.scaled_h,
+                             settings.resize_tier, sink_row, &sink);
+    row = (unsigned char *)malloc((size_t)cinfo.output_width * ch);
+    if (rs == NULL || row == NULL || (fmt == NATIVE_WEBP && pix == NULL))
+        longjmp(jerr.jmp, 1);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW r = row;
+        jpeg_read_scanlines(&cinfo, &r, 1);
+        resample_stream_push(rs, row);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    /* finish_compress still may jump back, nothing may be freed twice */
+    resample_stream_free(rs);
+    rs = NULL;
+    free(row);
+    row = NULL;
+
+    if (fmt == NATIVE_WEBP) {
+        ret = encode_webp(pix, plan.out_w, plan.out_h, (size_t)plan.out_w * ch, ch, quality, out, out_len);
+        free(pix);
+    } else {
+        jpeg_finish_compress(&cout);
+        jpeg_destroy_compress(&cout);
+        *out = (char *)mem;
+        *out_len = mem_len;
+        ret = 1;
+    }
+    if (ret == 1)
+        LOG_PRINT(LOG_DEBUG, "native convert [%s] %ux%u at 1/%d to %dx%d q%d", req->md5,
+                  cinfo.image_width, cinfo.image_height, d, plan.out_w, plan.out_h, quality);
+    return ret;
+}
+
+/**
+ * @brief native_roi decode the region of a jpeg a crop request needs
+ *
+ * @param req the zimg request with a crop
+ * @param in the original
+ * @param in_len length of the original
+ * @param roi the region, covering the crop at least, its pix free by caller
+ *
+ * @return 1 for OK and -1 for requests decoded as a whole
+ */
+int native_roi(zimg_req_t *req, const char *in, size_t in_len, native_roi_t *roi) {
+    struct jpeg_decompress_struct cinfo;
+    native_err_t jerr;
+    unsigned char *volatile pix = NULL;
+    JDIMENSION xoff, width;
+    JSAMPROW row;
+    size_t stride;
+    int w, h, x, y, cw, ch;
+
+    if (in == NULL || in_len < 4 || (unsigned char)in[0] != 0xFF || (unsigned char)in[1] != 0xD8)
+        return -1;
+    if (req->x == -1 && req->y == -1)
+        return -1;
+    /* convert() crops only when a size is given too */
+    if (req->width == 0 && req->height == 0)
+        return -1;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = native_error_exit;
+    jerr.pub.output_message = native_output_message;
+    if (setjmp(jerr.jmp)) {
+        LOG_PRINT(LOG_DEBUG, "region decoding of [%s] failed, decode it as a whole", req->md5);
+        jpeg_destroy_decompress(&cinfo);
+        free(pix);
+        return -1;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)in, in_len);
+    jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xFFFF);
+    jpeg_read_header(&cinfo, TRUE);
+    w = cinfo.image_width;
+    h = cinfo.image_height;
+
+    /* the rectangle of crop(), which works after the auto-orient of convert() */
+    x = req->x < 0 ? 0 : req->x;
+    y = req->y < 0 ? 0 : req->y;
+    if ((cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_GRAYSCALE) ||
+            exif_orientation(cinfo.marker_list) > 1 || x >= w || y >= h) {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+    cw = (req->width == 0 || w < x + req->width) ? w - x : req->width;
+    ch = (req->height == 0 || h < y + req->height) ? h - y : req->height;
+    if ((double)cw * ch > (double)w * h / 2) {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+
+    roi->quality = jpeg_quality(&cinfo);
+    cinfo.out_color_space = cinfo.jpeg_color_space == JCS_GRAYSCALE ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    /* the columns widen to whole MCUs, the rows above are only entropy decoded */
+    xoff = x;
+    width = cw;
+    jpeg_crop_scanline(&cinfo, &xoff, &width);
+    if (y > 0)
+        jpeg_skip_scanlines(&cinfo, y);
+
+    stride = (size_t)cinfo.output_width * cinfo.output_components;
+    if ((pix = (unsigned char *)malloc(stride * ch)) == NULL) {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+    while ((int)cinfo.output_scanline < y + ch) {
+        row = pix + (cinfo.output_scanline - y) * stride;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    roi->pix = pix;
+    roi->x = xoff;
+    roi->y = y;
+    roi->width = cinfo.output_width;
+    roi->height = ch;
+    roi->ch = cinfo.output_components;
+    /* the rows below the crop are never decoded */
+    jpeg_destroy_decompress(&cinfo);
+    LOG_PRINT(LOG_DEBUG, "jpeg %dx%d decoded region %d,%d %dx%d for crop %d,%d %dx%d", w, h,
+              roi->x, roi->y, roi->width, roi->height, x, y, cw, ch);
+    return 1;
+}
@@ -0,0 +1,39 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file znative.h
+ * @brief native jpeg to jpeg/webp scaling without MagickWand header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZNATIVE_H
+#define ZNATIVE_H
+
+#include "zcommon.h"
+
+typedef struct native_roi_s {
+    unsigned char *pix;
+    int x;
+    int y;
+    int width;
+    int height;
+    int ch;
+    int quality;
+} native_roi_t;
+
+int native_convert(zimg_req_t *req, const char *in, size_t in_len, char **out, size_t *out_len);
+int native_roi(zimg_req_t *req, const char *in, size_t in_len, native_roi_t *roi);
+
+#endif
@@ -0,0 +1,461 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zpool.c
+ * @brief managed backend connections of worker threads.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * A hiredis context must not be shared between threads, so the pool is
+ * made of one slot per worker thread and ssdb node, kept in its thr_arg. Every access
+ * goes through ssdb_get(), which checks the slot before handing it out:
+ * a broken connection is dropped and reconnected at once, a failed
+ * reconnect is retried with exponential backoff up to reconnect_max, and
+ * a connection idle longer than ping_interval is checked by PING first.
+ * libmemcached reconnects its servers by itself, beansdb connections only
+ * get the timeouts and retry behaviors here. The health and average latency
+ * of every node are shared by all threads to choose the replica to read.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <hiredis/hiredis.h>
+#include "zpool.h"
+#include "zconf.h"
+#include "zlog.h"
+
+#define POOL_BACKOFF_MIN    100
+#define POOL_HIST_BUCKETS   108
+/* old samples are halved away so the percentiles follow the recent load */
+#define POOL_HIST_DECAY     4096
+
+typedef struct pool_stat_s {
+    long slots;
+    long healthy;
+    long connects;
+    long failures;
+    long drops;
+    int up;
+    long latency;
+} pool_stat_t;
+
+typedef struct pool_hist_s {
+    long count;
+    long buckets[POOL_HIST_BUCKETS];
+} pool_hist_t;
+
+static pool_stat_t ssdb_stat[SSDB_MAX];
+static pool_hist_t ssdb_hist[SSDB_MAX];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t pool_now(void);
+static void pool_count(long *counter, long n);
+static int ssdb_ping(redisContext *c);
+redisContext * ssdb_connect(const char *ip, int port);
+memcached_st * beansdb_connect(const char *ip, int port);
+redisContext * ssdb_get(thr_arg_t *thr_arg, int node);
+memcached_st * beansdb_get(thr_arg_t *thr_arg);
+int ssdb_broken(thr_arg_t *thr_arg, int node);
+void ssdb_close(thr_arg_t *thr_arg, int node);
+void ssdb_record(int node, uint64_t start, int ok);
+void ssdb_slow(int node, uint64_t start);
+static int hist_bucket(long us);
+static long hist_bound(int idx);
+void ssdb_sample(int node, uint64_t start);
+long ssdb_percentile(int node, int pct);
+int ssdb_score(int node);
+void pool_status(cJSON *j_ret);
+
+/**
+ * @brief pool_now the current time in microseconds
+ *
+ * @return the time
+ */
+uint64_t pool_now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * @brief pool_count add n to a counter of the pool
+ *
+ * @param counter the counter
+ * @param n the value to add
+ */
+static void pool_count(long *counter, long n) {
+    pthread_mutex_lock(&pool_lock);
+    *counter += n;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief ssdb_ping check a connection by PING
+ *
+ * @param c the connection
+ *
+ * @return 1 for alive and -1 for broken
+ */
+static int ssdb_ping(redisContext *c) {
+    int ret = -1;
+    redisReply *r = (redisReply *)redisCommand(c, "PING");
+    if (r != NULL) {
+        if (r->type != REDIS_REPLY_ERROR)
+            ret = 1;
+        freeReplyObject(r);
+    }
+    return ret;
+}
+
+/**
+ * @brief ssdb_connect connect to ssdb with the connect and read timeouts of conf
+ *
+ * @param ip the ip of ssdb
+ * @param port the port of ssdb
+ *
+ * @return the connection or NULL for fail
+ */
+redisContext * ssdb_connect(const char *ip, int port) {
+    struct timeval tv;
+    redisContext *c;
+
+    tv.tv_sec = settings.connect_timeout / 1000;
+    tv.tv_usec = (settings.connect_timeout % 1000) * 1000;
+    c = redisConnectWithTimeout(ip, port, tv);
+    if (c == NULL)
+        return NULL;
+    if (c->err) {
+        LOG_PRINT(LOG_DEBUG, "Connect to ssdb[%s:%d] failed: %s", ip, port, c->errstr);
+        redisFree(c);
+        return NULL;
+    }
+    if (settings.read_timeout > 0) {
+        tv.tv_sec = settings.read_timeout / 1000;
+        tv.tv_usec = (settings.read_timeout % 1000) * 1000;
+        if (redisSetTimeout(c, tv) != REDIS_OK) {
+            LOG_PRINT(LOG_DEBUG, "Set timeout of ssdb[%s:%d] failed", ip, port);
+            redisFree(c);
+            return NULL;
+        }
+    }
+    return c;
+}
+
+/**
+ * @brief beansdb_connect create a beansdb connection with the timeouts of conf
+ *
+ * @param ip the ip of beansdb
+ * @param port the port of beansdb
+ *
+ * @return the connection or NULL for fail
+ */
+memcached_st * beansdb_connect(const char *ip, int port) {
+    char mserver[32];
+    memcached_st *beans = memcached_create(NULL);
+    if (beans == NULL)
+        return NULL;
+    snprintf(mserver, 32, "%s:%d", ip, port);
+    memcached_server_st *servers = memcached_servers_parse(mserver);
+    memcached_server_push(beans, servers);
+    memcached_server_list_free(servers);
+    memcached_behavior_set(beans, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 0);
+    memcached_behavior_set(beans, MEMCACHED_BEHAVIOR_NO_BLOCK, 1);
+    memcached_behavior_set(beans, MEMCACHED_BEHAVIOR_TCP_KEEPALIVE, 1);
+    memcached_behavior_set(beans, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, settings.connect_timeout);
+    memcached_behavior_set(beans, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, settings.read_timeout);
+    memcached_behavior_set(beans, MEMCACHED_BEHAVIOR_RCV_TIMEOUT, (uint64_t)settings.read_timeout * 1000);
+    memcached_behavior_set(beans, MEMCACHED_BEHAVIOR_SND_TIMEOUT, (uint64_t)settings.read_timeout * 1000);
+    /* libmemcached counts the retry timeout in seconds */
+    memcached_behavior_set(beans, MEMCACHED_BEHAVIOR_RETRY_TIMEOUT,
+                           settings.reconnect_max >= 1000 ? settings.reconnect_max / 1000 : 1);
+    return beans;
+}
+
+/**
+ * @brief ssdb_get get a healthy connection to a ssdb node of a thread, reconnect if needed
+ *
+ * @param thr_arg the thread arg
+ * @param node the index of the node in ssdb_servers
+ *
+ * @return the connection or NULL if the node is unreachable for now
+ */
+redisContext * ssdb_get(thr_arg_t *thr_arg, int node) {
+    ssdb_slot_t *slot = &thr_arg->ssdb[node];
+    uint64_t now = pool_now() / 1000;
+    redisContext *c = slot->conn;
+
+    if (slot->counted == 0) {
+        slot->counted = 1;
+        pool_count(&ssdb_stat[node].slots, 1);
+    }
+    if (c != NULL && c->err == 0 && settings.ping_interval > 0 &&
+            now - slot->used > (uint64_t)settings.ping_interval * 1000 &&
+            ssdb_ping(c) == -1) {
+        LOG_PRINT(LOG_DEBUG, "ssdb[%d] connection idle for %llu ms is broken",
+                  node, (unsigned long long)(now - slot->used));
+        c->err = REDIS_ERR_EOF;
+    }
+    if (c != NULL && c->err == 0) {
+        slot->used = now;
+        return c;
+    }
+    if (c != NULL)
+        ssdb_close(thr_arg, node);
+
+    if (now < slot->retry_at)
+        return NULL;
+    c = ssdb_connect(settings.ssdb_node_ip[node], settings.ssdb_node_port[node]);
+    if (c == NULL) {
+        if (slot->backoff < POOL_BACKOFF_MIN)
+            slot->backoff = POOL_BACKOFF_MIN;
+        else if (slot->backoff < settings.reconnect_max)
+            slot->backoff *= 2;
+        if (slot->backoff > settings.reconnect_max)
+            slot->backoff = settings.reconnect_max;
+        slot->retry_at = now + slot->backoff;
+        pthread_mutex_lock(&pool_lock);
+        ssdb_stat[node].failures++;
+        ssdb_stat[node].up = 0;
+        pthread_mutex_unlock(&pool_lock);
+        LOG_PRINT(LOG_DEBUG, "Connect to ssdb[%s:%d] failed, retry in %d ms",
+                  settings.ssdb_node_ip[node], settings.ssdb_node_port[node], slot->backoff);
+        return NULL;
+    }
+    slot->conn = c;
+    slot->backoff = 0;
+    slot->retry_at = 0;
+    slot->used = now;
+    pthread_mutex_lock(&pool_lock);
+    ssdb_stat[node].healthy++;
+    ssdb_stat[node].connects++;
+    ssdb_stat[node].up = 1;
+    pthread_mutex_unlock(&pool_lock);
+    LOG_PRINT(LOG_DEBUG, "Connect to ssdb[%s:%d] Success", settings.ssdb_node_ip[node], settings.ssdb_node_port[node]);
+    return c;
+}
+
+/**
+ * @brief beansdb_get get the beansdb connection of a thread, create it if needed
+ *
+ * @param thr_arg the thread arg
+ *
+ * @return the connection or NULL for fail
+ */
+memcached_st * beansdb_get(thr_arg_t *thr_arg) {
+    if (thr_arg->beansdb_conn == NULL)
+        thr_arg->beansdb_conn = beansdb_connect(settings.beansdb_ip, settings.beansdb_port);
+    return thr_arg->beansdb_conn;
+}
+
+/**
+ * @brief ssdb_broken check if the last command broke the connection to a ssdb node
+ *
+ * @param thr_arg the thread arg
+ * @param node the index of the node
+ *
+ * @return 1 for broken and 0 for not
+ */
+int ssdb_broken(thr_arg_t *thr_arg, int node) {
+    redisContext *c = thr_arg->ssdb[node].conn;
+    return (c != NULL && c->err != 0) ? 1 : 0;
+}
+
+/**
+ * @brief ssdb_close drop the connection to a ssdb node of a thread
+ *
+ * @param thr_arg the thread arg
+ * @param node the index of the node
+ */
+void ssdb_close(thr_arg_t *thr_arg, int node) {
+    if (thr_arg->ssdb[node].conn == NULL)
+        return;
+    redisFree(thr_arg->ssdb[node].conn);
+    thr_arg->ssdb[node].conn = NULL;
+    pthread_mutex_lock(&pool_lock);
+    ssdb_stat[node].healthy--;
+    ssdb_stat[node].drops++;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief ssdb_record record the result and latency of a command on a ssdb node
+ *
+ * @param node the index of the node
+ * @param start the time the command started, from pool_now()
+ * @param ok 1 if the node answered and 0 if not
+ */
+void ssdb_record(int node, uint64_t start, int ok) {
+    long cost = (long)(pool_now() - start);
+    pthread_mutex_lock(&pool_lock);
+    ssdb_stat[node].up = ok;
+    if (ok == 1) {
+        /* EWMA with a weight of 1/8 for the new sample */
+        if (ssdb_stat[node].latency == 0)
+            ssdb_stat[node].latency = cost;
+        else
+            ssdb_stat[node].latency += (cost - ssdb_stat[node].latency) / 8;
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief ssdb_slow record a read a ssdb node lost to a hedge, it is still up
+ *
+ * @param node the index of the node
+ * @param start the time the read started, from pool_now()
+ */
+void ssdb_slow(int node, uint64_t start) {
+    /* it has not answered yet, the time so far is the least its latency can be */
+    long cost = (long)(pool_now() - start);
+    pthread_mutex_lock(&pool_lock);
+    if (ssdb_stat[node].latency < cost)
+        ssdb_stat[node].latency += (cost - ssdb_stat[node].latency) / 8;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief hist_bucket the histogram bucket of a latency, four buckets per power of two
+ *
+ * @param us the latency in microseconds
+ *
+ * @return the index of the bucket
+ */
+static int hist_bucket(long us) {
+    int b = 0;
+    if (us < 4)
+        return us < 0 ? 0 : (int)us;
+    while ((us >> (b + 1)) != 0)
+        b++;
+    b = 4 * (b - 1) + (int)((us >> (b - 2)) & 3);
+    return b < POOL_HIST_BUCKETS ? b : POOL_HIST_BUCKETS - 1;
+}
+
+/**
+ * @brief hist_bound the upper bound of a histogram bucket
+ *
+ * @param idx the index of the bucket
+ *
+ * @return the latency in microseconds
+ */
+static long hist_bound(int idx) {
+    int b = idx / 4 + 1;
+    if (idx < 4)
+        return idx + 1;
+    return (1L << b) + ((long)(idx % 4 + 1) << (b - 2));
+}
+
+/**
+ * @brief ssdb_sample add the latency of a read to the histogram of a ssdb node
+ *
+ * @param node the index of the node
+ * @param start the time the read started, from pool_now()
+ */
+void ssdb_sample(int node, uint64_t start) {
+    pool_hist_t *h = &ssdb_hist[node];
+    int i, idx = hist_bucket((long)(pool_now() - start));
+
+    pthread_mutex_lock(&pool_lock);
+    if (h->count >= POOL_HIST_DECAY) {
+        h->count = 0;
+        for (i = 0; i < POOL_HIST_BUCKETS; i++) {
+            h->buckets[i] /= 2;
+            h->count += h->buckets[i];
+        }
+    }
+    h->buckets[idx]++;
+    h->count++;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief ssdb_percentile a percentile of the recent read latency of a ssdb node
+ *
+ * @param node the index of the node
+ * @param pct the percentile, 1 to 99
+ *
+ * @return the latency in microseconds, 0 before enough reads are seen
+ */
+long ssdb_percentile(int node, int pct) {
+    pool_hist_t *h = &ssdb_hist[node];
+    long rank, seen = 0, bound = 0;
+    int i;
+
+    pthread_mutex_lock(&pool_lock);
+    if (h->count >= 100) {
+        rank = (h->count * pct + 99) / 100;
+        for (i = 0; i < POOL_HIST_BUCKETS; i++) {
+            seen += h->buckets[i];
+            if (seen >= rank) {
+                bound = hist_bound(i);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return bound;
+}
+
+/**
+ * @brief ssdb_score the read preference of a ssdb node, lower is better
+ *
+ * @param node the index of the node
+ *
+ * @return the average latency in microseconds, a node known down gets a large penalty
+ */
+int ssdb_score(int node) {
+    int score;
+    pthread_mutex_lock(&pool_lock);
+    score = (int)ssdb_stat[node].latency;
+    if (ssdb_stat[node].up == 0 && ssdb_stat[node].connects + ssdb_stat[node].failures > 0)
+        score += 1000000000;
+    pthread_mutex_unlock(&pool_lock);
+    return score;
+}
+
+/**
+ * @brief pool_status add the counters of the ssdb connections to a json
+ *
+ * @param j_ret the json object of /status
+ */
+void pool_status(cJSON *j_ret) {
+    pool_stat_t st[SSDB_MAX];
+    cJSON *j_pool, *j_node;
+    char name[160];
+    int i;
+
+    if (backend_on(3) == 0)
+        return;
+    pthread_mutex_lock(&pool_lock);
+    memcpy(st, ssdb_stat, sizeof(st));
+    pthread_mutex_unlock(&pool_lock);
+
+    j_pool = cJSON_CreateArray();
+    for (i = 0; i < settings.ssdb_node_num; i++) {
+        j_node = cJSON_CreateObject();
+        snprintf(name, sizeof(name), "%s:%d", settings.ssdb_node_ip[i], settings.ssdb_node_port[i]);
+        cJSON_AddStringToObject(j_node, "node", name);
+        cJSON_AddBoolToObject(j_node, "up", st[i].up);
+        cJSON_AddNumberToObject(j_node, "latency_us", st[i].latency);
+        cJSON_AddNumberToObject(j_node, "slots", st[i].slots);
+        cJSON_AddNumberToObject(j_node, "healthy", st[i].healthy);
+        cJSON_AddNumberToObject(j_node, "connects", st[i].connects);
+        cJSON_AddNumberToObject(j_node, "failures", st[i].failures);
+        cJSON_AddNumberToObject(j_node, "drops", st[i].drops);
+        cJSON_AddItemToArray(j_pool, j_node);
+    }
+    cJSON_AddItemToObject(j_ret, "ssdb_pool", j_pool);
+}
@@ -0,0 +1,41 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zpool.h
+ * @brief managed backend connections of worker threads header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZPOOL_H
+#define ZPOOL_H
+
+#include "zcommon.h"
+#include "cjson/cJSON.h"
+
+redisContext * ssdb_connect(const char *ip, int port);
+memcached_st * beansdb_connect(const char *ip, int port);
+redisContext * ssdb_get(thr_arg_t *thr_arg, int node);
+memcached_st * beansdb_get(thr_arg_t *thr_arg);
+int ssdb_broken(thr_arg_t *thr_arg, int node);
+void ssdb_close(thr_arg_t *thr_arg, int node);
+uint64_t pool_now(void);
+void ssdb_record(int node, uint64_t start, int ok);
+void ssdb_slow(int node, uint64_t start);
+void ssdb_sample(int node, uint64_t start);
+long ssdb_percentile(int node, int pct);
+int ssdb_score(int node);
+void pool_status(cJSON *j_ret);
+
+#endif
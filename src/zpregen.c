@@ -0,0 +1,335 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zpregen.c
+ * @brief background derivatives of new uploads.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * save_img() queues the md5 of every newly stored original here and returns.
+ * pregen_threads workers at the lowest cpu priority make the derivatives
+ * listed in settings.pregen with settings.batch_img(), which decodes the
+ * original once and writes the results to the cache and the storage. When
+ * the queue is full the upload is skipped and its derivatives are made on
+ * the first request as before. In kv modes the sets stored are marked in the
+ * metadata record, so derive_img() never looks up a set that was not made.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#include "zpregen.h"
+#include "zconf.h"
+#include "zbatch.h"
+#include "zmeta.h"
+#include "zutil.h"
+#include "zlog.h"
+
+extern const struct luaL_reg zimg_lib[];
+extern const struct luaL_Reg loglib[];
+
+typedef struct pregen_item_s pregen_item_t;
+
+struct pregen_item_s {
+    char md5[33];
+    pregen_item_t *next;
+};
+
+typedef struct pregen_stat_s {
+    long queued;
+    long made;
+    long failed;
+    long dropped;
+    long pending;
+} pregen_stat_t;
+
+static int pregen_on = 0;
+static pregen_item_t *pregen_head = NULL;
+static pregen_item_t *pregen_tail = NULL;
+static pregen_stat_t pregen_stat;
+static pthread_mutex_t pregen_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pregen_cond = PTHREAD_COND_INITIALIZER;
+
+int pregen_init(void);
+void pregen_save(const char *md5);
+void pregen_status(cJSON *j_ret);
+unsigned int pregen_sig(void);
+static uint32_t sig_mix(uint32_t h, const void *p, size_t n);
+static int pregen_reqs(thr_arg_t *thr_arg, char *md5, zimg_req_t *reqs, int *sets);
+static void pregen_mark(thr_arg_t *thr_arg, const char *md5, const int *sets, const int *results, int n);
+static void * pregen_worker(void *arg);
+
+/**
+ * @brief pregen_init start the workers making derivatives of new uploads
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int pregen_init(void) {
+    pthread_t tid;
+    int i, started = 0;
+
+    if (settings.batch_img == NULL)
+        return -1;
+    memset(&pregen_stat, 0, sizeof(pregen_stat));
+    for (i = 0; i < settings.pregen_threads; i++) {
+        if (pthread_create(&tid, NULL, pregen_worker, NULL) != 0) {
+            LOG_PRINT(LOG_DEBUG, "pregen worker create failed!");
+            continue;
+        }
+        pthread_detach(tid);
+        started++;
+    }
+    if (started == 0)
+        return -1;
+    pregen_on = 1;
+    LOG_PRINT(LOG_DEBUG, "Pregen Init Finished. items: %d threads: %d", settings.pregen_num, started);
+    return 1;
+}
+
+/**
+ * @brief pregen_save queue a new original for its derivatives
+ *
+ * @param md5 the md5 of the image
+ */
+void pregen_save(const char *md5) {
+    pregen_item_t *item;
+
+    if (pregen_on == 0)
+        return;
+
+    pthread_mutex_lock(&pregen_lock);
+    if (pregen_stat.pending >= settings.pregen_queue) {
+        pregen_stat.dropped++;
+        pthread_mutex_unlock(&pregen_lock);
+        LOG_PRINT(LOG_WARNING, "pregen queue full, pic:%s skipped", md5);
+        return;
+    }
+    pthread_mutex_unlock(&pregen_lock);
+
+    item = (pregen_item_t *)malloc(sizeof(pregen_item_t));
+    if (item == NULL)
+        return;
+    str_lcpy(item->md5, md5, sizeof(item->md5));
+    item->next = NULL;
+
+    pthread_mutex_lock(&pregen_lock);
+    if (pregen_tail == NULL)
+        pregen_head = item;
+    else
+        pregen_tail->next = item;
+    pregen_tail = item;
+    pregen_stat.queued++;
+    pregen_stat.pending++;
+    pthread_cond_signal(&pregen_cond);
+    pthread_mutex_unlock(&pregen_lock);
+}
+
+/**
+ * @brief pregen_status add the pregen counters to a json object
+ *
+ * @param j_ret the json object
+ */
+void pregen_status(cJSON *j_ret) {
+    pregen_stat_t st;
+    cJSON *j_pregen;
+
+    if (pregen_on == 0)
+        return;
+    pthread_mutex_lock(&pregen_lock);
+    st = pregen_stat;
+    pthread_mutex_unlock(&pregen_lock);
+
+    j_pregen = cJSON_CreateObject();
+    cJSON_AddNumberToObject(j_pregen, "queued", st.queued);
+    cJSON_AddNumberToObject(j_pregen, "made", st.made);
+    cJSON_AddNumberToObject(j_pregen, "failed", st.failed);
+    cJSON_AddNumberToObject(j_pregen, "dropped", st.dropped);
+    cJSON_AddNumberToObject(j_pregen, "pending", st.pending);
+    cJSON_AddItemToObject(j_ret, "pregen", j_pregen);
+}
+
+/**
+ * @brief sig_mix add some bytes to a FNV-1a hash
+ *
+ * @param h the hash
+ * @param p the bytes
+ * @param n number of bytes
+ *
+ * @return the new hash
+ */
+static uint32_t sig_mix(uint32_t h, const void *p, size_t n) {
+    const unsigned char *c = (const unsigned char *)p;
+    while (n-- > 0) {
+        h ^= *c++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/**
+ * @brief pregen_sig the signature of the configured parameter sets, a mask of stored sets is only valid with it
+ *
+ * @return the signature, never 0
+ */
+unsigned int pregen_sig(void) {
+    uint32_t h = 2166136261U;
+    int i;
+
+    for (i = 0; i < settings.pregen_num; i++) {
+        pregen_t *pg = &settings.pregen[i];
+        int v[8] = {pg->width, pg->height, pg->proportion, pg->gray, pg->x, pg->y, pg->rotate, pg->quality};
+        h = sig_mix(h, pg->type, strlen(pg->type) + 1);
+        h = sig_mix(h, v, sizeof(v));
+        h = sig_mix(h, pg->fmt, strlen(pg->fmt) + 1);
+    }
+    return h != 0 ? h : 1;
+}
+
+/**
+ * @brief pregen_reqs build the requests of the configured derivatives
+ *
+ * @param thr_arg the connections of the worker
+ * @param md5 the md5 of the image
+ * @param reqs the requests, PREGEN_MAX at least
+ * @param sets the index of the parameter set of every request
+ *
+ * @return number of requests
+ */
+static int pregen_reqs(thr_arg_t *thr_arg, char *md5, zimg_req_t *reqs, int *sets) {
+    pregen_t *pg;
+    int i, n = 0;
+
+    for (i = 0; i < settings.pregen_num && n < BATCH_MAX; i++) {
+        pg = &settings.pregen[i];
+        /* lua types need the script, like the type requests of get_request_cb */
+        if (pg->type[0] != '\0' && settings.script_on != 1)
+            continue;
+        memset(&reqs[n], 0, sizeof(zimg_req_t));
+        reqs[n].md5 = md5;
+        reqs[n].type = pg->type[0] != '\0' ? pg->type : NULL;
+        reqs[n].width = pg->width;
+        reqs[n].height = pg->height;
+        reqs[n].proportion = pg->proportion;
+        reqs[n].gray = pg->gray;
+        reqs[n].x = pg->x;
+        reqs[n].y = pg->y;
+        reqs[n].rotate = pg->rotate;
+        reqs[n].quality = pg->quality != 0 ? pg->quality : settings.quality;
+        reqs[n].fmt = pg->fmt[0] != '\0' ? pg->fmt : settings.format;
+        reqs[n].sv = 1;
+        reqs[n].thr_arg = thr_arg;
+        sets[n] = i;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * @brief pregen_mark add the sets made or found to the metadata record of a kv mode image
+ *
+ * @param thr_arg the connections of the worker
+ * @param md5 the md5 of the image
+ * @param sets the index of the parameter set of every request
+ * @param results the results of settings.batch_img()
+ * @param n number of requests
+ */
+static void pregen_mark(thr_arg_t *thr_arg, const char *md5, const int *sets, const int *results, int n) {
+    img_meta_t meta;
+    unsigned int sig = pregen_sig();
+    unsigned int mask;
+    int i;
+
+    if (meta_get(thr_arg, md5, NULL, &meta) != 1)
+        return;
+    /* a mask of other sets says nothing about these */
+    mask = (meta.pregen_sig == sig) ? meta.pregen : 0;
+    for (i = 0; i < n; i++) {
+        if (results[i] == 1 || results[i] == 0)
+            mask |= 1U << sets[i];
+    }
+    if (meta.pregen_sig == sig && meta.pregen == mask)
+        return;
+    meta.pregen = mask;
+    meta.pregen_sig = sig;
+    meta_save(thr_arg, md5, NULL, &meta);
+}
+
+/**
+ * @brief pregen_worker the thread making derivatives of new uploads
+ *
+ * @param arg not used
+ *
+ * @return not used
+ */
+static void * pregen_worker(void *arg) {
+    thr_arg_t *thr_arg = (thr_arg_t *)calloc(1, sizeof(thr_arg_t));
+    zimg_req_t reqs[PREGEN_MAX];
+    int results[PREGEN_MAX], sets[PREGEN_MAX];
+    pregen_item_t *item;
+    int i, n, ret;
+
+    if (thr_arg == NULL)
+        return NULL;
+    /* the nice value of a linux thread is its own, uploads and GETs keep the cpu */
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+    init_conns(thr_arg);
+    if (settings.script_on == 1) {
+        thr_arg->L = luaL_newstate();
+        if (thr_arg->L != NULL) {
+            luaL_openlibs(thr_arg->L);
+            luaL_openlib(thr_arg->L, "zimg", zimg_lib, 0);
+            luaL_openlib(thr_arg->L, "log", loglib, 0);
+            luaL_loadfile(thr_arg->L, settings.script_name);
+            lua_pcall(thr_arg->L, 0, 0, 0);
+        }
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&pregen_lock);
+        while (pregen_head == NULL)
+            pthread_cond_wait(&pregen_cond, &pregen_lock);
+        item = pregen_head;
+        pregen_head = item->next;
+        if (pregen_head == NULL)
+            pregen_tail = NULL;
+        pthread_mutex_unlock(&pregen_lock);
+
+        n = pregen_reqs(thr_arg, item->md5, reqs, sets);
+        ret = n > 0 ? settings.batch_img(thr_arg, reqs, n, results) : 0;
+        if (ret != 1)
+            LOG_PRINT(LOG_WARNING, "pregen pic:%s failed", item->md5);
+        else if (settings.mode != 1)
+            pregen_mark(thr_arg, item->md5, sets, results, n);
+
+        pthread_mutex_lock(&pregen_lock);
+        for (i = 0; i < n; i++) {
+            if (ret == 1 && results[i] == 1)
+                pregen_stat.made++;
+            else if (ret != 1 || results[i] == -1)
+                pregen_stat.failed++;
+        }
+        pregen_stat.pending--;
+        pthread_mutex_unlock(&pregen_lock);
+        LOG_PRINT(LOG_DEBUG, "pregen pic:%s done", item->md5);
+        free(item);
+    }
+    return NULL;
+}
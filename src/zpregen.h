@@ -0,0 +1,32 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zpregen.h
+ * @brief background derivatives of new uploads header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZPREGEN_H
+#define ZPREGEN_H
+
+#include "zcommon.h"
+#include "cjson/cJSON.h"
+
+int pregen_init(void);
+void pregen_save(const char *md5);
+void pregen_status(cJSON *j_ret);
+unsigned int pregen_sig(void);
+
+#endif
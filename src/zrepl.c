@@ -0,0 +1,680 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zrepl.c
+ * @brief replication of originals to secondary backends.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * settings.mode is the primary backend and settings.replica lists the
+ * secondary ones. Uploads are stored in the primary by save_img() and then
+ * queued here for a background thread which copies them to every replica.
+ * When the primary misses an original, reads walk the replicas in order,
+ * write the first good copy back to the primary and retry there. Only the
+ * originals are replicated, derivatives are generated again from them.
+ *
+ * A copy that fails on any replica goes back to the end of the queue and
+ * the thread backs off like the journal does. The queue keeps the bytes
+ * of new uploads up to replica_queue MB, beyond that and for retries only
+ * the md5 is kept and the original is read back from the primary. Every
+ * md5 queued is appended to replica_log, which is cut when the queue runs
+ * empty and replayed on start, so a restart loses no pending copy.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <hiredis/hiredis.h>
+#include "zrepl.h"
+#include "zconf.h"
+#include "zimg.h"
+#include "zdb.h"
+#include "zmd5.h"
+#include "ztier.h"
+#include "zdisk.h"
+#include "zpool.h"
+#include "zring.h"
+#include "zutil.h"
+#include "zlog.h"
+
+#define REPL_RETRY_MIN      100
+#define REPL_RETRY_MAX      10000
+
+typedef struct repl_item_s repl_item_t;
+
+struct repl_item_s {
+    char md5[33];
+    char *buff;
+    size_t len;
+    int tries;
+    repl_item_t *next;
+};
+
+typedef struct repl_stat_s {
+    long queued;
+    long written;
+    long failed;
+    long retries;
+    long deferred;
+    long dropped;
+    long replayed;
+    long repaired;
+    long pending;
+    long waiting;
+    uint64_t pending_bytes;
+} repl_stat_t;
+
+static int repl_on = 0;
+static int repl_fd = -1;
+static off_t repl_log_own = 0;
+static repl_item_t *repl_head = NULL;
+static repl_item_t *repl_tail = NULL;
+static repl_stat_t repl_stat;
+static pthread_mutex_t repl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t repl_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t repl_empty = PTHREAD_COND_INITIALIZER;
+static int (*primary_get_img)(zimg_req_t *, evhtp_request_t *) = NULL;
+static int (*primary_info_img)(evhtp_request_t *, thr_arg_t *, char *) = NULL;
+static int (*primary_admin_img)(evhtp_request_t *, thr_arg_t *, char *, int) = NULL;
+
+int repl_init(void);
+void repl_save(const char *md5, const char *buff, size_t len);
+void repl_drain(void);
+void repl_status(cJSON *j_ret);
+static void repl_push(repl_item_t *item);
+static int repl_log_line(const char *md5);
+static void repl_log(const char *md5);
+static void repl_log_reset(void);
+static int repl_replay(void);
+static int backend_exist(thr_arg_t *thr_arg, int mode, const char *md5);
+static int backend_get(thr_arg_t *thr_arg, int mode, const char *md5, char **buff, size_t *len);
+static int backend_save(thr_arg_t *thr_arg, int mode, const char *md5, const char *buff, size_t len);
+static int backend_del(thr_arg_t *thr_arg, int mode, const char *md5);
+static int repl_check(const char *md5, const char *buff, size_t len);
+static int repl_repair(thr_arg_t *thr_arg, const char *md5);
+static int repl_get_img(zimg_req_t *req, evhtp_request_t *request);
+static int repl_info_img(evhtp_request_t *request, thr_arg_t *thr_arg, char *md5);
+static int repl_admin_img(evhtp_request_t *req, thr_arg_t *thr_arg, char *md5, int t);
+static int repl_copy(thr_arg_t *thr_arg, repl_item_t *item);
+static void * repl_worker(void *arg);
+
+/**
+ * @brief repl_init start the replication thread and wrap the storage callbacks
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int repl_init(void) {
+    pthread_t tid;
+
+    memset(&repl_stat, 0, sizeof(repl_stat));
+    if (repl_replay() == -1)
+        return -1;
+    if (pthread_create(&tid, NULL, repl_worker, NULL) != 0) {
+        LOG_PRINT(LOG_DEBUG, "replication worker create failed!");
+        return -1;
+    }
+    pthread_detach(tid);
+
+    primary_get_img = settings.get_img;
+    primary_info_img = settings.info_img;
+    primary_admin_img = settings.admin_img;
+    settings.get_img = repl_get_img;
+    settings.info_img = repl_info_img;
+    settings.admin_img = repl_admin_img;
+    repl_on = 1;
+    LOG_PRINT(LOG_DEBUG, "Replication Init Finished. replicas: %d replayed: %ld", settings.replica_num, repl_stat.replayed);
+    return 1;
+}
+
+/**
+ * @brief repl_save queue a new original for the replicas
+ *
+ * @param md5 the md5 of the image
+ * @param buff the image buffer
+ * @param len the length of buff
+ */
+void repl_save(const char *md5, const char *buff, size_t len) {
+    repl_item_t *item;
+    uint64_t max_bytes = (uint64_t)settings.replica_queue * 1024 * 1024;
+    int keep;
+
+    if (repl_on == 0)
+        return;
+
+    pthread_mutex_lock(&repl_lock);
+    keep = (repl_stat.pending_bytes + len <= max_bytes);
+    pthread_mutex_unlock(&repl_lock);
+
+    item = (repl_item_t *)calloc(1, sizeof(repl_item_t));
+    if (item == NULL)
+        return;
+    /* over the limit only the md5 waits, the worker reads the original back from the primary */
+    if (keep && (item->buff = (char *)malloc(len)) != NULL) {
+        memcpy(item->buff, buff, len);
+        item->len = len;
+    }
+    str_lcpy(item->md5, md5, sizeof(item->md5));
+
+    pthread_mutex_lock(&repl_lock);
+    if (item->buff == NULL)
+        repl_stat.deferred++;
+    repl_stat.queued++;
+    repl_log(md5);
+    repl_push(item);
+    pthread_mutex_unlock(&repl_lock);
+}
+
+/**
+ * @brief repl_drain wait until every queued image is tried once, the failed ones stay in replica_log
+ */
+void repl_drain(void) {
+    if (repl_on == 0)
+        return;
+    pthread_mutex_lock(&repl_lock);
+    while (repl_stat.pending > repl_stat.waiting)
+        pthread_cond_wait(&repl_empty, &repl_lock);
+    pthread_mutex_unlock(&repl_lock);
+}
+
+/**
+ * @brief repl_status add the replication counters to a json object
+ *
+ * @param j_ret the json object
+ */
+void repl_status(cJSON *j_ret) {
+    repl_stat_t st;
+    cJSON *j_repl;
+
+    if (repl_on == 0)
+        return;
+    pthread_mutex_lock(&repl_lock);
+    st = repl_stat;
+    pthread_mutex_unlock(&repl_lock);
+
+    j_repl = cJSON_CreateObject();
+    cJSON_AddNumberToObject(j_repl, "queued", st.queued);
+    cJSON_AddNumberToObject(j_repl, "written", st.written);
+    cJSON_AddNumberToObject(j_repl, "failed", st.failed);
+    cJSON_AddNumberToObject(j_repl, "retries", st.retries);
+    cJSON_AddNumberToObject(j_repl, "deferred", st.deferred);
+    cJSON_AddNumberToObject(j_repl, "dropped", st.dropped);
+    cJSON_AddNumberToObject(j_repl, "replayed", st.replayed);
+    cJSON_AddNumberToObject(j_repl, "repaired", st.repaired);
+    cJSON_AddNumberToObject(j_repl, "pending", st.pending);
+    cJSON_AddNumberToObject(j_repl, "waiting", st.waiting);
+    cJSON_AddNumberToObject(j_repl, "pending_bytes", st.pending_bytes);
+    cJSON_AddItemToObject(j_ret, "replication", j_repl);
+}
+
+/**
+ * @brief repl_push add an item to the end of the queue, repl_lock held
+ *
+ * @param item the item
+ */
+static void repl_push(repl_item_t *item) {
+    item->next = NULL;
+    if (repl_tail == NULL)
+        repl_head = item;
+    else
+        repl_tail->next = item;
+    repl_tail = item;
+    repl_stat.pending++;
+    repl_stat.pending_bytes += item->len;
+    if (item->tries > 0)
+        repl_stat.waiting++;
+    pthread_cond_signal(&repl_cond);
+}
+
+/**
+ * @brief repl_log_line append a md5 to replica_log, the file locked by caller
+ *
+ * @param md5 the md5 of the image
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int repl_log_line(const char *md5) {
+    char line[34];
+
+    snprintf(line, sizeof(line), "%s\n", md5);
+    if (write(repl_fd, line, 33) != 33) {
+        LOG_PRINT(LOG_WARNING, "replica_log write pic:%s failed", md5);
+        return -1;
+    }
+    repl_log_own += 33;
+    return 1;
+}
+
+/**
+ * @brief repl_log append a md5 to replica_log, repl_lock held
+ *
+ * @param md5 the md5 of the image
+ */
+static void repl_log(const char *md5) {
+    if (repl_fd == -1)
+        return;
+    /* zimg-import may append to the same file */
+    flock(repl_fd, LOCK_EX);
+    repl_log_line(md5);
+    flock(repl_fd, LOCK_UN);
+}
+
+/**
+ * @brief repl_log_reset cut replica_log once the queue is empty, repl_lock held
+ */
+static void repl_log_reset(void) {
+    struct stat st;
+
+    if (repl_fd == -1 || repl_log_own == 0)
+        return;
+    flock(repl_fd, LOCK_EX);
+    /* lines of another process stay until the next start replays them */
+    if (fstat(repl_fd, &st) == 0 && st.st_size == repl_log_own && ftruncate(repl_fd, 0) == 0)
+        repl_log_own = 0;
+    flock(repl_fd, LOCK_UN);
+}
+
+/**
+ * @brief repl_replay queue the md5s left in replica_log by the last run
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int repl_replay(void) {
+    FILE *fp;
+    char line[64];
+    struct stat st;
+    repl_item_t *item;
+
+    if (settings.replica_log[0] == '\0')
+        return 1;
+    if ((repl_fd = open(settings.replica_log, O_WRONLY | O_APPEND | O_CREAT, 00644)) == -1) {
+        LOG_PRINT(LOG_DEBUG, "replica_log[%s] open failed!", settings.replica_log);
+        return -1;
+    }
+    flock(repl_fd, LOCK_EX);
+    pthread_mutex_lock(&repl_lock);
+    if ((fp = fopen(settings.replica_log, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (is_md5(line) != 1)
+                continue;
+            if ((item = (repl_item_t *)calloc(1, sizeof(repl_item_t))) == NULL)
+                break;
+            str_lcpy(item->md5, line, sizeof(item->md5));
+            repl_push(item);
+            repl_stat.replayed++;
+        }
+        fclose(fp);
+    }
+    /* written again from the queue, a torn last line is gone */
+    if (ftruncate(repl_fd, 0) == 0) {
+        repl_log_own = 0;
+        for (item = repl_head; item != NULL; item = item->next)
+            repl_log_line(item->md5);
+    } else if (fstat(repl_fd, &st) == 0) {
+        repl_log_own = st.st_size;
+    }
+    pthread_mutex_unlock(&repl_lock);
+    flock(repl_fd, LOCK_UN);
+    return 1;
+}
+
+/**
+ * @brief backend_exist check if an original is in a backend
+ *
+ * @param thr_arg the connections
+ * @param mode the backend
+ * @param md5 the md5 of the image
+ *
+ * @return 1 for found and -1 for not
+ */
+static int backend_exist(thr_arg_t *thr_arg, int mode, const char *md5) {
+    char path[PATH_MAX_SIZE];
+    char orig_path[PATH_MAX_SIZE];
+
+    if (mode == 1) {
+        if (tier_find(md5, path) == -1)
+            return -1;
+        snprintf(orig_path, PATH_MAX_SIZE, "%s/0*0", path);
+        return is_file(orig_path);
+    } else if (mode == 2) {
+        return exist_beansdb(beansdb_get(thr_arg), md5);
+    } else if (mode == 3) {
+        return ring_exist(thr_arg, md5);
+    }
+    return -1;
+}
+
+/**
+ * @brief backend_get read an original from a backend
+ *
+ * @param thr_arg the connections
+ * @param mode the backend
+ * @param md5 the md5 of the image
+ * @param buff the buffer, free by caller
+ * @param len the length of buff
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int backend_get(thr_arg_t *thr_arg, int mode, const char *md5, char **buff, size_t *len) {
+    char path[PATH_MAX_SIZE];
+    char orig_path[PATH_MAX_SIZE];
+
+    if (mode == 2)
+        return get_img_beansdb(beansdb_get(thr_arg), md5, buff, len);
+    else if (mode == 3)
+        return ring_get(thr_arg, md5, buff, len);
+    else if (mode != 1)
+        return -1;
+
+    if (tier_find(md5, path) == -1)
+        return -1;
+    snprintf(orig_path, PATH_MAX_SIZE, "%s/0*0", path);
+    return (disk_read(orig_path, buff, len) == 1) ? 1 : -1;
+}
+
+/**
+ * @brief backend_save write an original into a backend
+ *
+ * @param thr_arg the connections
+ * @param mode the backend
+ * @param md5 the md5 of the image
+ * @param buff the image buffer
+ * @param len the length of buff
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int backend_save(thr_arg_t *thr_arg, int mode, const char *md5, const char *buff, size_t len) {
+    char path[PATH_MAX_SIZE];
+    char orig_path[PATH_MAX_SIZE];
+
+    if (mode == 2)
+        return save_img_beansdb(beansdb_get(thr_arg), md5, buff, len);
+    else if (mode == 3)
+        return ring_save(thr_arg, md5, buff, len);
+    else if (mode != 1)
+        return -1;
+
+    if (tier_find(md5, path) == -1 && mk_dirs(path) == -1)
+        return -1;
+    snprintf(orig_path, PATH_MAX_SIZE, "%s/0*0", path);
+    return new_img(buff, len, orig_path);
+}
+
+/**
+ * @brief backend_del delete an image from a backend
+ *
+ * @param thr_arg the connections
+ * @param mode the backend
+ * @param md5 the md5 of the image
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int backend_del(thr_arg_t *thr_arg, int mode, const char *md5) {
+    if (mode == 1)
+        return tier_delete(md5);
+    else if (mode == 2)
+        return del_beansdb(beansdb_get(thr_arg), md5);
+    else if (mode == 3)
+        return ring_del(thr_arg, md5);
+    return -1;
+}
+
+/**
+ * @brief repl_check check a copy from a replica against its md5
+ *
+ * @param md5 the md5 of the image
+ * @param buff the image buffer
+ * @param len the length of buff
+ *
+ * @return 1 for OK and -1 for a bad copy
+ */
+static int repl_check(const char *md5, const char *buff, size_t len) {
+    md5_state_t mdctx;
+    md5_byte_t md_value[16];
+    char md5sum[33];
+    int i, h, l;
+
+    md5_init(&mdctx);
+    md5_append(&mdctx, (const unsigned char*)(buff), len);
+    md5_finish(&mdctx, md_value);
+    for (i = 0; i < 16; ++i) {
+        h = md_value[i] & 0xf0;
+        h >>= 4;
+        l = md_value[i] & 0x0f;
+        md5sum[i * 2] = (char)((h >= 0x0 && h <= 0x9) ? (h + 0x30) : (h + 0x57));
+        md5sum[i * 2 + 1] = (char)((l >= 0x0 && l <= 0x9) ? (l + 0x30) : (l + 0x57));
+    }
+    md5sum[32] = '\0';
+    return (strcmp(md5sum, md5) == 0) ? 1 : -1;
+}
+
+/**
+ * @brief repl_repair copy an original missing in the primary back from the replicas
+ *
+ * @param thr_arg the connections
+ * @param md5 the md5 of the image
+ *
+ * @return 1 for repaired and -1 for not
+ */
+static int repl_repair(thr_arg_t *thr_arg, const char *md5) {
+    char *buff = NULL;
+    size_t len = 0;
+    int i, mode;
+
+    if (backend_exist(thr_arg, settings.mode, md5) == 1)
+        return -1;
+
+    for (i = 0; i < settings.replica_num; i++) {
+        mode = settings.replica[i];
+        if (backend_get(thr_arg, mode, md5, &buff, &len) != 1)
+            continue;
+        if (repl_check(md5, buff, len) != 1) {
+            LOG_PRINT(LOG_WARNING, "replica[%d] pic:%s md5 mismatch", mode, md5);
+            free(buff);
+            buff = NULL;
+            continue;
+        }
+        if (backend_save(thr_arg, settings.mode, md5, buff, len) == -1) {
+            LOG_PRINT(LOG_ERROR, "repair pic:%s from replica[%d] failed", md5, mode);
+            free(buff);
+            return -1;
+        }
+        free(buff);
+        pthread_mutex_lock(&repl_lock);
+        repl_stat.repaired++;
+        pthread_mutex_unlock(&repl_lock);
+        LOG_PRINT(LOG_INFO, "repair pic:%s from replica[%d]", md5, mode);
+        return 1;
+    }
+    return -1;
+}
+
+/**
+ * @brief repl_get_img get image from the primary, repair it from replicas on a miss
+ *
+ * @param req the zimg request
+ * @param request the evhtp request
+ *
+ * @return 1 for OK, 2 for 304 not modify and -1 for failed
+ */
+static int repl_get_img(zimg_req_t *req, evhtp_request_t *request) {
+    int ret = primary_get_img(req, request);
+    if (ret != -1 || repl_repair(req->thr_arg, req->md5) != 1)
+        return ret;
+    return primary_get_img(req, request);
+}
+
+/**
+ * @brief repl_info_img get image info from the primary, repair it from replicas on a miss
+ *
+ * @param request the evhtp request
+ * @param thr_arg the thread arg
+ * @param md5 the md5 of image
+ *
+ * @return 1 for OK, 0 for not found and -1 for fail
+ */
+static int repl_info_img(evhtp_request_t *request, thr_arg_t *thr_arg, char *md5) {
+    int ret = primary_info_img(request, thr_arg, md5);
+    if (ret == 1 || repl_repair(thr_arg, md5) != 1)
+        return ret;
+    return primary_info_img(request, thr_arg, md5);
+}
+
+/**
+ * @brief repl_admin_img run an admin command on the primary, deletes go to every replica too
+ *
+ * @param req the evhtp request
+ * @param thr_arg the thread arg
+ * @param md5 the md5 of image
+ * @param t the command type
+ *
+ * @return 1 for OK, 2 for not found and -1 for fail
+ */
+static int repl_admin_img(evhtp_request_t *req, thr_arg_t *thr_arg, char *md5, int t) {
+    int i, deleted = 0;
+    int ret;
+
+    if (t == 1) {
+        for (i = 0; i < settings.replica_num; i++) {
+            if (backend_exist(thr_arg, settings.replica[i], md5) == 1 &&
+                    backend_del(thr_arg, settings.replica[i], md5) == 1)
+                deleted++;
+        }
+    }
+    ret = primary_admin_img(req, thr_arg, md5, t);
+    if (ret == 2 && deleted > 0) {
+        evbuffer_add_printf(req->buffer_out,
+                            "<html><body><h1>Admin Command Successful!</h1> \
+            <p>MD5: %s</p> \
+            <p>Command Type: %d</p> \
+            </body></html>",
+                            md5, t);
+        evhtp_headers_add_header(req->headers_out, evhtp_header_new("Content-Type", "text/html", 0, 0));
+        ret = 1;
+    }
+    return ret;
+}
+
+/**
+ * @brief repl_copy copy an original to every replica missing it
+ *
+ * @param thr_arg the connections
+ * @param item the item, the original is read from the primary if it has no bytes
+ *
+ * @return number of replicas failed, -1 for the original gone from the primary
+ */
+static int repl_copy(thr_arg_t *thr_arg, repl_item_t *item) {
+    int i, mode, ret, failed = 0;
+
+    for (i = 0; i < settings.replica_num; i++) {
+        mode = settings.replica[i];
+        if (backend_exist(thr_arg, mode, item->md5) == 1)
+            continue;
+        if (item->buff == NULL && backend_get(thr_arg, settings.mode, item->md5, &item->buff, &item->len) != 1) {
+            item->buff = NULL;
+            item->len = 0;
+            /* deleted meanwhile, or the primary failed and it is tried again */
+            return backend_exist(thr_arg, settings.mode, item->md5) == 1 ? failed + 1 : -1;
+        }
+        ret = backend_save(thr_arg, mode, item->md5, item->buff, item->len);
+        pthread_mutex_lock(&repl_lock);
+        if (ret == -1)
+            repl_stat.failed++;
+        else
+            repl_stat.written++;
+        pthread_mutex_unlock(&repl_lock);
+        if (ret == -1) {
+            LOG_PRINT(LOG_ERROR, "replicate pic:%s to replica[%d] failed", item->md5, mode);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+/**
+ * @brief repl_worker the replication thread
+ *
+ * @param arg not used
+ *
+ * @return not used
+ */
+static void * repl_worker(void *arg) {
+    thr_arg_t *thr_arg = (thr_arg_t *)calloc(1, sizeof(thr_arg_t));
+    repl_item_t *item;
+    char md5[33];
+    int failed, tries, backoff = 0;
+
+    if (thr_arg == NULL)
+        return NULL;
+    init_conns(thr_arg);
+
+    for (;;) {
+        pthread_mutex_lock(&repl_lock);
+        while (repl_head == NULL)
+            pthread_cond_wait(&repl_cond, &repl_lock);
+        item = repl_head;
+        repl_head = item->next;
+        if (repl_head == NULL)
+            repl_tail = NULL;
+        repl_stat.pending_bytes -= item->len;
+        if (item->tries > 0)
+            repl_stat.waiting--;
+        pthread_mutex_unlock(&repl_lock);
+
+        failed = repl_copy(thr_arg, item);
+        str_lcpy(md5, item->md5, sizeof(md5));
+        tries = ++item->tries;
+        if (failed == -1)
+            LOG_PRINT(LOG_WARNING, "replicate pic:%s not in primary, dropped", md5);
+
+        pthread_mutex_lock(&repl_lock);
+        repl_stat.pending--;
+        if (failed > 0) {
+            /* only the md5 waits for the retry */
+            free(item->buff);
+            item->buff = NULL;
+            item->len = 0;
+            repl_stat.retries++;
+            repl_push(item);
+            item = NULL;
+        } else if (failed == -1) {
+            repl_stat.dropped++;
+        }
+        if (repl_stat.pending == repl_stat.waiting)
+            pthread_cond_broadcast(&repl_empty);
+        if (repl_stat.pending == 0)
+            repl_log_reset();
+        pthread_mutex_unlock(&repl_lock);
+        if (item != NULL) {
+            free(item->buff);
+            free(item);
+        }
+
+        if (failed > 0) {
+            backoff = backoff == 0 ? REPL_RETRY_MIN : backoff * 2;
+            if (backoff > REPL_RETRY_MAX)
+                backoff = REPL_RETRY_MAX;
+            LOG_PRINT(LOG_WARNING, "replicate pic:%s failed %d times, retry in %dms", md5, tries, backoff);
+            usleep(backoff * 1000);
+        } else {
+            backoff = 0;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,32 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zrepl.h
+ * @brief replication of originals to secondary backends header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZREPL_H
+#define ZREPL_H
+
+#include "zcommon.h"
+#include "cjson/cJSON.h"
+
+int repl_init(void);
+void repl_save(const char *md5, const char *buff, size_t len);
+void repl_drain(void);
+void repl_status(cJSON *j_ret);
+
+#endif
@@ -0,0 +1,927 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zresample.c
+ * @brief lanczos resampling of 8-bit pixel buffers.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * A separable Lanczos-3 filter, widened by the scale when shrinking like
+ * the LanczosFilter of MagickResizeImage. The weights of every output
+ * column and row are computed once in 14-bit fixed point, rows are
+ * filtered horizontally into an 8-bit buffer and then vertically.
+ * Planar data is resampled plane by plane with one channel.
+ *
+ * The filter follows the scale and a tier. best is Lanczos at any scale.
+ * balanced first averages large reductions down to twice the target with
+ * a box filter, which costs a fraction of Lanczos taps, and finishes with
+ * Lanczos. fast averages every reduction of 2x or more straight to the
+ * target and uses a triangle filter below that.
+ *
+ * Thumbnails come in a few sizes, so the weights are kept in a small LRU
+ * cache keyed by the source and target size of the axis and the filter. On x86 the
+ * horizontal pass uses SSE4.1 and the vertical pass AVX2 or SSE4.1, picked
+ * at runtime. All of them sum the same integer products, so every CPU
+ * gives the same bytes.
+ *
+ * The stream functions take the source row by row. Every row is filtered
+ * horizontally into a ring of as many rows as the vertical kernel has
+ * taps, and a result row is filtered and handed to a callback as soon as
+ * its last source row arrives, so memory grows with the width and the
+ * filter support but not with the height. The ring keeps each row twice,
+ * at its slot and one ring further, so the taps of any result row are
+ * contiguous and the vertical filters run on it unchanged. The bytes are
+ * the same as resample().
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "zresample.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RS_X86              1
+#include <immintrin.h>
+#endif
+
+#define RS_LOBES            3.0
+#define RS_BITS             14
+#define RS_PRESHRINK        3
+#define RS_PI               3.14159265358979323846
+#define RS_CACHE_SIZE       64
+
+#define RS_SCALAR           0
+#define RS_SSE41            1
+#define RS_AVX2             2
+
+typedef struct rs_kernel_s {
+    int in;
+    int out;
+    int filter;
+    int *start;
+    int *count;
+    int16_t *weights;
+    int taps;
+    int refs;
+    int cached;
+    unsigned long used;
+} rs_kernel_t;
+
+typedef struct rs_pass_s {
+    rs_kernel_t *kx;
+    rs_kernel_t *ky;
+    int sw;
+    int ch;
+    int dw;
+    int dh;
+    int in_y;
+    int out_y;
+    size_t tstride;
+    unsigned char *ring;
+    unsigned char *row;
+    int32_t *acc;
+} rs_pass_t;
+
+struct rs_stream_s {
+    rs_pass_t pass[2];
+    int n;
+    int out_y;
+    resample_row_cb cb;
+    void *arg;
+};
+
+static rs_kernel_t *rs_cache[RS_CACHE_SIZE];
+static unsigned long rs_tick = 0;
+static pthread_mutex_t rs_lock = PTHREAD_MUTEX_INITIALIZER;
+static int rs_level = -1;
+
+static double lanczos(double x);
+static double filter_weight(int filter, double x);
+static rs_kernel_t * kernel_build(int in, int out, int filter);
+static void kernel_free(rs_kernel_t *k);
+static rs_kernel_t * kernel_get(int in, int out, int filter);
+static void kernel_put(rs_kernel_t *k);
+static int simd_level(void);
+static unsigned char clamp8(int32_t v);
+static void resample_h(const unsigned char *src, int sw, int sh, size_t sstride, int ch,
+                       unsigned char *dst, int dw, size_t dstride, const rs_kernel_t *k);
+static void row_v(const unsigned char *src, size_t sstride, int n, unsigned char *out,
+                  const int16_t *w, int start, int count, int32_t *acc);
+static int resample_v(const unsigned char *src, size_t sstride, int ch,
+                      unsigned char *dst, int dw, int dh, size_t dstride, const rs_kernel_t *k);
+#ifdef RS_X86
+static void resample_h_sse41(const unsigned char *src, int sw, int sh, size_t sstride, int ch,
+                             unsigned char *dst, int dw, size_t dstride, const rs_kernel_t *k);
+static int row_v_sse41(const unsigned char *src, size_t sstride, int n, unsigned char *out,
+                       const int16_t *w, int start, int count);
+static int row_v_avx2(const unsigned char *src, size_t sstride, int n, unsigned char *out,
+                      const int16_t *w, int start, int count);
+#endif
+static int resample_pass(const unsigned char *src, int sw, int sh, size_t sstride, int ch,
+                         unsigned char *dst, int dw, int dh, size_t dstride, int filter);
+int resample_tier(const char *name);
+int resample_plan(int sw, int sh, int dw, int dh, int tier, int *mw, int *mh);
+int resample(const unsigned char *src, int sw, int sh, size_t sstride, int ch,
+             unsigned char *dst, int dw, int dh, size_t dstride, int tier);
+static int pass_init(rs_pass_t *p, int sw, int sh, int ch, int dw, int dh, int filter);
+static void pass_free(rs_pass_t *p);
+static int stream_push(rs_stream_t *s, int i, const unsigned char *row);
+rs_stream_t * resample_stream_new(int sw, int sh, int ch, int dw, int dh, int tier, resample_row_cb cb, void *arg);
+int resample_stream_push(rs_stream_t *s, const unsigned char *row);
+void resample_stream_free(rs_stream_t *s);
+
+/**
+ * @brief lanczos the lanczos-3 window
+ *
+ * @param x the distance
+ *
+ * @return the weight
+ */
+static double lanczos(double x) {
+    if (x < 0)
+        x = -x;
+    if (x < 1e-8)
+        return 1.0;
+    if (x >= RS_LOBES)
+        return 0.0;
+    x *= RS_PI;
+    return RS_LOBES * sin(x) * sin(x / RS_LOBES) / (x * x);
+}
+
+/**
+ * @brief filter_weight the weight of a filter
+ *
+ * @param filter RS_BOX, RS_TRIANGLE or RS_LANCZOS
+ * @param x the distance in filter units
+ *
+ * @return the weight
+ */
+static double filter_weight(int filter, double x) {
+    if (x < 0)
+        x = -x;
+    if (filter == RS_BOX)
+        return x < 0.5 ? 1.0 : (x == 0.5 ? 0.5 : 0.0);
+    if (filter == RS_TRIANGLE)
+        return x < 1.0 ? 1.0 - x : 0.0;
+    return lanczos(x);
+}
+
+/**
+ * @brief kernel_build compute the fixed point weights of every output pixel of one axis
+ *
+ * @param in size of the axis in the source
+ * @param out size of the axis in the result
+ * @param filter RS_BOX, RS_TRIANGLE or RS_LANCZOS
+ *
+ * @return the kernel, NULL for fail
+ */
+static rs_kernel_t * kernel_build(int in, int out, int filter) {
+    double scale = (double)in / out;
+    double fscale = scale > 1.0 ? scale : 1.0;
+    double support = (filter == RS_BOX ? 0.5 : (filter == RS_TRIANGLE ? 1.0 : RS_LOBES)) * fscale;
+    rs_kernel_t *k;
+    double *w;
+    int i, j;
+
+    if ((k = (rs_kernel_t *)calloc(1, sizeof(rs_kernel_t))) == NULL)
+        return NULL;
+    k->in = in;
+    k->out = out;
+    k->filter = filter;
+    k->taps = (int)ceil(support) * 2 + 1;
+    k->start = (int *)malloc(out * sizeof(int));
+    k->count = (int *)malloc(out * sizeof(int));
+    k->weights = (int16_t *)malloc((size_t)out * k->taps * sizeof(int16_t));
+    w = (double *)malloc(k->taps * sizeof(double));
+    if (k->start == NULL || k->count == NULL || k->weights == NULL || w == NULL) {
+        free(w);
+        kernel_free(k);
+        return NULL;
+    }
+
+    for (i = 0; i < out; i++) {
+        double center = (i + 0.5) * scale;
+        double sum = 0;
+        int lo = (int)(center - support + 0.5);
+        int hi = (int)(center + support + 0.5);
+        int acc = 0, top = 0;
+        if (lo < 0)
+            lo = 0;
+        if (hi > in)
+            hi = in;
+        if (hi - lo > k->taps)
+            hi = lo + k->taps;
+        for (j = lo; j < hi; j++) {
+            w[j - lo] = filter_weight(filter, (j - center + 0.5) / fscale);
+            sum += w[j - lo];
+        }
+        for (j = 0; j < hi - lo; j++) {
+            int16_t q = (int16_t)lrint(w[j] / sum * (1 << RS_BITS));
+            k->weights[(size_t)i * k->taps + j] = q;
+            acc += q;
+            if (q > k->weights[(size_t)i * k->taps + top])
+                top = j;
+        }
+        /* the rounding error goes to the largest weight so flat areas stay flat */
+        k->weights[(size_t)i * k->taps + top] += (1 << RS_BITS) - acc;
+        k->start[i] = lo;
+        k->count[i] = hi - lo;
+    }
+    free(w);
+    return k;
+}
+
+/**
+ * @brief kernel_free free a kernel
+ *
+ * @param k the kernel
+ */
+static void kernel_free(rs_kernel_t *k) {
+    if (k == NULL)
+        return;
+    free(k->start);
+    free(k->count);
+    free(k->weights);
+    free(k);
+}
+
+/**
+ * @brief kernel_get find the kernel of an axis in the cache or build it
+ *
+ * @param in size of the axis in the source
+ * @param out size of the axis in the result
+ * @param filter RS_BOX, RS_TRIANGLE or RS_LANCZOS
+ *
+ * @return the kernel, give it back by kernel_put, NULL for fail
+ */
+static rs_kernel_t * kernel_get(int in, int out, int filter) {
+    rs_kernel_t *k, *old = NULL;
+    int i, slot = -1;
+
+    pthread_mutex_lock(&rs_lock);
+    for (i = 0; i < RS_CACHE_SIZE; i++) {
+        k = rs_cache[i];
+        if (k != NULL && k->in == in && k->out == out && k->filter == filter) {
+            k->refs++;
+            k->used = ++rs_tick;
+            pthread_mutex_unlock(&rs_lock);
+            return k;
+        }
+    }
+    pthread_mutex_unlock(&rs_lock);
+
+    if ((k = kernel_build(in, out, filter)) == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&rs_lock);
+    for (i = 0; i < RS_CACHE_SIZE; i++) {
+        rs_kernel_t *c = rs_cache[i];
+        if (c != NULL && c->in == in && c->out == out && c->filter == filter) {
+            /* built by another thread meanwhile */
+            c->refs++;
+            c->used = ++rs_tick;
+            pthread_mutex_unlock(&rs_lock);
+            kernel_free(k);
+            return c;
+        }
+        if (c == NULL) {
+            if (slot == -1 || rs_cache[slot] != NULL)
+                slot = i;
+        } else if (c->refs == 0 && (slot == -1 || (rs_cache[slot] != NULL && c->used < rs_cache[slot]->used))) {
+            slot = i;
+        }
+    }
+    k->refs = 1;
+    k->used = ++rs_tick;
+    /* every entry in use, the kernel lives only for this call */
+    if (slot != -1) {
+        old = rs_cache[slot];
+        rs_cache[slot] = k;
+        k->cached = 1;
+    }
+    pthread_mutex_unlock(&rs_lock);
+    kernel_free(old);
+    return k;
+}
+
+/**
+ * @brief kernel_put give back a kernel from kernel_get
+ *
+ * @param k the kernel
+ */
+static void kernel_put(rs_kernel_t *k) {
+    if (k == NULL)
+        return;
+    if (k->cached == 0) {
+        kernel_free(k);
+        return;
+    }
+    pthread_mutex_lock(&rs_lock);
+    k->refs--;
+    pthread_mutex_unlock(&rs_lock);
+}
+
+/**
+ * @brief simd_level the widest instruction set this CPU runs
+ *
+ * @return RS_AVX2, RS_SSE41 or RS_SCALAR
+ */
+static int simd_level(void) {
+    int level = rs_level;
+
+    if (level != -1)
+        return level;
+    level = RS_SCALAR;
+#ifdef RS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        level = RS_AVX2;
+    else if (__builtin_cpu_supports("sse4.1"))
+        level = RS_SSE41;
+#endif
+    rs_level = level;
+    return level;
+}
+
+/**
+ * @brief clamp8 round a fixed point sum to a pixel
+ *
+ * @param v the sum
+ *
+ * @return the pixel
+ */
+static unsigned char clamp8(int32_t v) {
+    v = (v + (1 << (RS_BITS - 1))) >> RS_BITS;
+    return v < 0 ? 0 : (v > 255 ? 255 : (unsigned char)v);
+}
+
+/**
+ * @brief resample_h filter all rows horizontally
+ *
+ * @param src the source
+ * @param sw width of the source
+ * @param sh rows of the source
+ * @param sstride bytes per row of the source
+ * @param ch channels per pixel
+ * @param dst the result
+ * @param dw width of the result
+ * @param dstride bytes per row of the result
+ * @param k the kernel of the x axis
+ */
+static void resample_h(const unsigned char *src, int sw, int sh, size_t sstride, int ch,
+                       unsigned char *dst, int dw, size_t dstride, const rs_kernel_t *k) {
+    int y, x, j, c;
+
+#ifdef RS_X86
+    if (ch != 2 && simd_level() >= RS_SSE41) {
+        resample_h_sse41(src, sw, sh, sstride, ch, dst, dw, dstride, k);
+        return;
+    }
+#endif
+    for (y = 0; y < sh; y++) {
+        const unsigned char *row = src + (size_t)y * sstride;
+        unsigned char *out = dst + (size_t)y * dstride;
+        for (x = 0; x < dw; x++) {
+            const int16_t *w = k->weights + (size_t)x * k->taps;
+            const unsigned char *p = row + (size_t)k->start[x] * ch;
+            int32_t acc[4] = {0, 0, 0, 0};
+            for (j = 0; j < k->count[x]; j++) {
+                for (c = 0; c < ch; c++)
+                    acc[c] += p[j * ch + c] * w[j];
+            }
+            for (c = 0; c < ch; c++)
+                out[x * ch + c] = clamp8(acc[c]);
+        }
+    }
+}
+
+/**
+ * @brief row_v filter one result row vertically
+ *
+ * @param src the source, already filtered horizontally
+ * @param sstride bytes per row of the source
+ * @param n bytes of the row
+ * @param out the result row
+ * @param w the weights of the row
+ * @param start the first source row
+ * @param count number of source rows
+ * @param acc n sums of scratch
+ */
+static void row_v(const unsigned char *src, size_t sstride, int n, unsigned char *out,
+                  const int16_t *w, int start, int count, int32_t *acc) {
+    int i, j, done = 0;
+
+#ifdef RS_X86
+    /* the simd rows leave the tail of a row narrower than a register */
+    int level = simd_level();
+    if (level == RS_AVX2)
+        done = row_v_avx2(src, sstride, n, out, w, start, count);
+    else if (level == RS_SSE41)
+        done = row_v_sse41(src, sstride, n, out, w, start, count);
+#endif
+    if (done == n)
+        return;
+    for (i = done; i < n; i++)
+        acc[i] = 0;
+    /* row by row keeps the reads sequential */
+    for (j = 0; j < count; j++) {
+        const unsigned char *row = src + (size_t)(start + j) * sstride;
+        int32_t wj = w[j];
+        for (i = done; i < n; i++)
+            acc[i] += row[i] * wj;
+    }
+    for (i = done; i < n; i++)
+        out[i] = clamp8(acc[i]);
+}
+
+/**
+ * @brief resample_v filter all columns vertically
+ *
+ * @param src the source, already filtered horizontally
+ * @param sstride bytes per row of the source
+ * @param ch channels per pixel
+ * @param dst the result
+ * @param dw width of the result
+ * @param dh height of the result
+ * @param dstride bytes per row of the result
+ * @param k the kernel of the y axis
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int resample_v(const unsigned char *src, size_t sstride, int ch,
+                      unsigned char *dst, int dw, int dh, size_t dstride, const rs_kernel_t *k) {
+    int y, n = dw * ch;
+    int32_t *acc = (int32_t *)malloc(n * sizeof(int32_t));
+
+    if (acc == NULL)
+        return -1;
+    for (y = 0; y < dh; y++)
+        row_v(src, sstride, n, dst + (size_t)y * dstride, k->weights + (size_t)y * k->taps,
+              k->start[y], k->count[y], acc);
+    free(acc);
+    return 1;
+}
+
+#ifdef RS_X86
+/**
+ * @brief resample_h_sse41 filter all rows horizontally with sse4.1
+ *
+ * @param src the source
+ * @param sw width of the source
+ * @param sh rows of the source
+ * @param sstride bytes per row of the source
+ * @param ch channels per pixel, 1, 3 or 4
+ * @param dst the result
+ * @param dw width of the result
+ * @param dstride bytes per row of the result
+ * @param k the kernel of the x axis
+ */
+__attribute__((target("sse4.1")))
+static void resample_h_sse41(const unsigned char *src, int sw, int sh, size_t sstride, int ch,
+                             unsigned char *dst, int dw, size_t dstride, const rs_kernel_t *k) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi32(1 << (RS_BITS - 1));
+    /* two pixels side by side per channel: r0 r1 g0 g1 b0 b1 a0 a1 */
+    const __m128i pairs = ch == 3 ? _mm_setr_epi8(0, 3, 1, 4, 2, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)
+                                  : _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+    size_t row_len = (size_t)sw * ch;
+    int y, x, j;
+
+    for (y = 0; y < sh; y++) {
+        const unsigned char *row = src + (size_t)y * sstride;
+        unsigned char *out = dst + (size_t)y * dstride;
+        for (x = 0; x < dw; x++) {
+            const int16_t *w = k->weights + (size_t)x * k->taps;
+            size_t off = (size_t)k->start[x] * ch;
+            const unsigned char *p = row + off;
+            int count = k->count[x];
+            __m128i acc = zero;
+            int32_t sum;
+
+            if (ch == 1) {
+                for (j = 0; j + 8 <= count; j += 8) {
+                    __m128i px = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(p + j)));
+                    acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_loadu_si128((const __m128i *)(w + j))));
+                }
+                acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4E));
+                acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xB1));
+                sum = _mm_cvtsi128_si32(acc);
+                for (; j < count; j++)
+                    sum += p[j] * w[j];
+                out[x] = clamp8(sum);
+                continue;
+            }
+
+            for (j = 0; j < count; j += 2) {
+                __m128i px, wp;
+                if (off + (size_t)j * ch + 8 <= row_len) {
+                    px = _mm_loadl_epi64((const __m128i *)(p + j * ch));
+                } else {
+                    /* the last pixels of a row, do not read past it */
+                    unsigned char tail[8] = {0};
+                    memcpy(tail, p + j * ch, j + 1 < count ? 2 * ch : ch);
+                    px = _mm_loadl_epi64((const __m128i *)tail);
+                }
+                if (j + 1 < count)
+                    wp = _mm_set1_epi32((int32_t)(((uint32_t)(uint16_t)w[j + 1] << 16) | (uint16_t)w[j]));
+                else
+                    wp = _mm_set1_epi32((uint16_t)w[j]);
+                px = _mm_cvtepu8_epi16(_mm_shuffle_epi8(px, pairs));
+                acc = _mm_add_epi32(acc, _mm_madd_epi16(px, wp));
+            }
+            acc = _mm_srai_epi32(_mm_add_epi32(acc, half), RS_BITS);
+            acc = _mm_packus_epi16(_mm_packs_epi32(acc, acc), acc);
+            sum = _mm_cvtsi128_si32(acc);
+            memcpy(out + (size_t)x * ch, &sum, ch);
+        }
+    }
+}
+
+/**
+ * @brief row_v_sse41 filter one row vertically with sse4.1, 16 bytes at a time
+ *
+ * @param src the source, already filtered horizontally
+ * @param sstride bytes per row of the source
+ * @param n bytes of the row
+ * @param out the row of the result
+ * @param w the weights of the row
+ * @param start the first source row
+ * @param count number of source rows
+ *
+ * @return bytes done, the rest is left to the caller
+ */
+__attribute__((target("sse4.1")))
+static int row_v_sse41(const unsigned char *src, size_t sstride, int n, unsigned char *out,
+                       const int16_t *w, int start, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi32(1 << (RS_BITS - 1));
+    int i, j;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i s0 = zero, s1 = zero, s2 = zero, s3 = zero;
+        for (j = 0; j < count; j += 2) {
+            const unsigned char *r = src + (size_t)(start + j) * sstride + i;
+            __m128i a = _mm_loadu_si128((const __m128i *)r), b, wp, lo, hi;
+            /* two source rows interleaved so one madd weights both */
+            if (j + 1 < count) {
+                b = _mm_loadu_si128((const __m128i *)(r + sstride));
+                wp = _mm_set1_epi32((int32_t)(((uint32_t)(uint16_t)w[j + 1] << 16) | (uint16_t)w[j]));
+            } else {
+                b = zero;
+                wp = _mm_set1_epi32((uint16_t)w[j]);
+            }
+            lo = _mm_unpacklo_epi8(a, b);
+            hi = _mm_unpackhi_epi8(a, b);
+            s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), wp));
+            s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), wp));
+            s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), wp));
+            s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), wp));
+        }
+        s0 = _mm_srai_epi32(_mm_add_epi32(s0, half), RS_BITS);
+        s1 = _mm_srai_epi32(_mm_add_epi32(s1, half), RS_BITS);
+        s2 = _mm_srai_epi32(_mm_add_epi32(s2, half), RS_BITS);
+        s3 = _mm_srai_epi32(_mm_add_epi32(s3, half), RS_BITS);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(_mm_packs_epi32(s0, s1), _mm_packs_epi32(s2, s3)));
+    }
+    return i;
+}
+
+/**
+ * @brief row_v_avx2 filter one row vertically with avx2, 32 bytes at a time
+ *
+ * @param src the source, already filtered horizontally
+ * @param sstride bytes per row of the source
+ * @param n bytes of the row
+ * @param out the row of the result
+ * @param w the weights of the row
+ * @param start the first source row
+ * @param count number of source rows
+ *
+ * @return bytes done, the rest is left to the caller
+ */
+__attribute__((target("avx2")))
+static int row_v_avx2(const unsigned char *src, size_t sstride, int n, unsigned char *out,
+                      const int16_t *w, int start, int count) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i half = _mm256_set1_epi32(1 << (RS_BITS - 1));
+    int i, j;
+
+    /* unpack and pack both work within 128-bit lanes, so the order comes back */
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m256i s0 = zero, s1 = zero, s2 = zero, s3 = zero;
+        for (j = 0; j < count; j += 2) {
+            const unsigned char *r = src + (size_t)(start + j) * sstride + i;
+            __m256i a = _mm256_loadu_si256((const __m256i *)r), b, wp, lo, hi;
+            if (j + 1 < count) {
+                b = _mm256_loadu_si256((const __m256i *)(r + sstride));
+                wp = _mm256_set1_epi32((int32_t)(((uint32_t)(uint16_t)w[j + 1] << 16) | (uint16_t)w[j]));
+            } else {
+                b = zero;
+                wp = _mm256_set1_epi32((uint16_t)w[j]);
+            }
+            lo = _mm256_unpacklo_epi8(a, b);
+            hi = _mm256_unpackhi_epi8(a, b);
+            s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), wp));
+            s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), wp));
+            s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), wp));
+            s3 = _mm256_add_epi32(s3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), wp));
+        }
+        s0 = _mm256_srai_epi32(_mm256_add_epi32(s0, half), RS_BITS);
+        s1 = _mm256_srai_epi32(_mm256_add_epi32(s1, half), RS_BITS);
+        s2 = _mm256_srai_epi32(_mm256_add_epi32(s2, half), RS_BITS);
+        s3 = _mm256_srai_epi32(_mm256_add_epi32(s3, half), RS_BITS);
+        _mm256_storeu_si256((__m256i *)(out + i),
+                            _mm256_packus_epi16(_mm256_packs_epi32(s0, s1), _mm256_packs_epi32(s2, s3)));
+    }
+    /* a 16 byte tail still fits sse4.1 */
+    if (i + 16 <= n)
+        i += row_v_sse41(src + i, sstride, n - i, out + i, w, start, count);
+    return i;
+}
+#endif
+
+/**
+ * @brief resample_pass scale an interleaved 8-bit image with one filter
+ *
+ * @param src the source pixels
+ * @param sw width of the source
+ * @param sh height of the source
+ * @param sstride bytes per row of the source
+ * @param ch channels per pixel
+ * @param dst the result pixels
+ * @param dw width of the result
+ * @param dh height of the result
+ * @param dstride bytes per row of the result
+ * @param filter RS_BOX, RS_TRIANGLE or RS_LANCZOS
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int resample_pass(const unsigned char *src, int sw, int sh, size_t sstride, int ch,
+                         unsigned char *dst, int dw, int dh, size_t dstride, int filter) {
+    rs_kernel_t *kx, *ky;
+    unsigned char *tmp;
+    size_t tstride = (size_t)dw * ch;
+    int ret = -1;
+
+    if ((tmp = (unsigned char *)malloc(tstride * sh)) == NULL)
+        return -1;
+    kx = kernel_get(sw, dw, filter);
+    ky = kernel_get(sh, dh, filter);
+    if (kx != NULL && ky != NULL) {
+        resample_h(src, sw, sh, sstride, ch, tmp, dw, tstride, kx);
+        ret = resample_v(tmp, tstride, ch, dst, dw, dh, dstride, ky);
+    }
+    kernel_put(kx);
+    kernel_put(ky);
+    free(tmp);
+    return ret;
+}
+
+/**
+ * @brief resample_tier the tier of a name
+ *
+ * @param name fast, balanced or best
+ *
+ * @return the tier, -1 for an unknown name
+ */
+int resample_tier(const char *name) {
+    if (name == NULL)
+        return -1;
+    if (strcmp(name, "fast") == 0)
+        return RS_TIER_FAST;
+    if (strcmp(name, "balanced") == 0)
+        return RS_TIER_BALANCED;
+    if (strcmp(name, "best") == 0)
+        return RS_TIER_BEST;
+    return -1;
+}
+
+/**
+ * @brief resample_plan the filter and the box pre-shrink for a resize
+ *
+ * @param sw width of the source
+ * @param sh height of the source
+ * @param dw width of the result
+ * @param dh height of the result
+ * @param tier RS_TIER_FAST, RS_TIER_BALANCED or RS_TIER_BEST
+ * @param mw width to box average to first, 0 for none
+ * @param mh height to box average to first, 0 for none
+ *
+ * @return the filter of the final pass
+ */
+int resample_plan(int sw, int sh, int dw, int dh, int tier, int *mw, int *mh) {
+    double rw = (double)sw / dw, rh = (double)sh / dh;
+    double r = rw > rh ? rw : rh;
+
+    *mw = 0;
+    *mh = 0;
+    if (tier == RS_TIER_FAST)
+        return r >= 2.0 ? RS_BOX : RS_TRIANGLE;
+    if (tier == RS_TIER_BALANCED && r >= RS_PRESHRINK) {
+        *mw = rw > 2.0 ? dw * 2 : sw;
+        *mh = rh > 2.0 ? dh * 2 : sh;
+    }
+    return RS_LANCZOS;
+}
+
+/**
+ * @brief resample scale an interleaved 8-bit image by the filter policy of a tier
+ *
+ * @param src the source pixels
+ * @param sw width of the source
+ * @param sh height of the source
+ * @param sstride bytes per row of the source
+ * @param ch channels per pixel, 1 to 4
+ * @param dst the result pixels, dh rows of dstride bytes
+ * @param dw width of the result
+ * @param dh height of the result
+ * @param dstride bytes per row of the result
+ * @param tier RS_TIER_FAST, RS_TIER_BALANCED or RS_TIER_BEST
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int resample(const unsigned char *src, int sw, int sh, size_t sstride, int ch,
+             unsigned char *dst, int dw, int dh, size_t dstride, int tier) {
+    unsigned char *mid;
+    int filter, mw, mh, ret;
+
+    if (sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0 || ch < 1 || ch > 4)
+        return -1;
+    filter = resample_plan(sw, sh, dw, dh, tier, &mw, &mh);
+    if (mw == 0)
+        return resample_pass(src, sw, sh, sstride, ch, dst, dw, dh, dstride, filter);
+
+    if ((mid = (unsigned char *)malloc((size_t)mw * mh * ch)) == NULL)
+        return -1;
+    ret = resample_pass(src, sw, sh, sstride, ch, mid, mw, mh, (size_t)mw * ch, RS_BOX);
+    if (ret == 1)
+        ret = resample_pass(mid, mw, mh, (size_t)mw * ch, ch, dst, dw, dh, dstride, filter);
+    free(mid);
+    return ret;
+}
+
+/**
+ * @brief pass_init prepare one filter of a stream
+ *
+ * @param p the pass
+ * @param sw width of the source
+ * @param sh height of the source
+ * @param ch channels per pixel
+ * @param dw width of the result
+ * @param dh height of the result
+ * @param filter RS_BOX, RS_TRIANGLE or RS_LANCZOS
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int pass_init(rs_pass_t *p, int sw, int sh, int ch, int dw, int dh, int filter) {
+    memset(p, 0, sizeof(rs_pass_t));
+    p->sw = sw;
+    p->ch = ch;
+    p->dw = dw;
+    p->dh = dh;
+    p->tstride = (size_t)dw * ch;
+    p->kx = kernel_get(sw, dw, filter);
+    p->ky = kernel_get(sh, dh, filter);
+    if (p->kx == NULL || p->ky == NULL)
+        return -1;
+    p->ring = (unsigned char *)malloc(p->tstride * p->ky->taps * 2);
+    p->row = (unsigned char *)malloc(p->tstride);
+    p->acc = (int32_t *)malloc(p->tstride * sizeof(int32_t));
+    if (p->ring == NULL || p->row == NULL || p->acc == NULL)
+        return -1;
+    return 1;
+}
+
+/**
+ * @brief pass_free free one filter of a stream
+ *
+ * @param p the pass
+ */
+static void pass_free(rs_pass_t *p) {
+    kernel_put(p->kx);
+    kernel_put(p->ky);
+    free(p->ring);
+    free(p->row);
+    free(p->acc);
+}
+
+/**
+ * @brief stream_push feed a source row to a pass and its results onwards
+ *
+ * @param s the stream
+ * @param i the pass
+ * @param row the source row
+ *
+ * @return 1 for OK and -1 for stopped by the callback
+ */
+static int stream_push(rs_stream_t *s, int i, const unsigned char *row) {
+    rs_pass_t *p;
+    rs_kernel_t *ky;
+    unsigned char *slot;
+    int taps;
+
+    if (i == s->n)
+        return s->cb(s->arg, row, s->out_y++);
+    p = &s->pass[i];
+    ky = p->ky;
+    taps = ky->taps;
+    slot = p->ring + (p->in_y % taps) * p->tstride;
+    resample_h(row, p->sw, 1, 0, p->ch, slot, p->dw, p->tstride, p->kx);
+    memcpy(slot + taps * p->tstride, slot, p->tstride);
+    p->in_y++;
+
+    /* the sources of a row are at most taps apart, all of them are still in the ring */
+    while (p->out_y < p->dh && ky->start[p->out_y] + ky->count[p->out_y] <= p->in_y) {
+        row_v(p->ring + (ky->start[p->out_y] % taps) * p->tstride, p->tstride, (int)p->tstride, p->row,
+              ky->weights + (size_t)p->out_y * taps, 0, ky->count[p->out_y], p->acc);
+        p->out_y++;
+        if (stream_push(s, i + 1, p->row) == -1)
+            return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief resample_stream_new start scaling an image fed row by row, with the filters of resample()
+ *
+ * @param sw width of the source
+ * @param sh height of the source
+ * @param ch channels per pixel, 1 to 4
+ * @param dw width of the result
+ * @param dh height of the result
+ * @param tier RS_TIER_FAST, RS_TIER_BALANCED or RS_TIER_BEST
+ * @param cb called with every result row in order, returns -1 to stop
+ * @param arg the argument of cb
+ *
+ * @return the stream, free by resample_stream_free, NULL for fail
+ */
+rs_stream_t * resample_stream_new(int sw, int sh, int ch, int dw, int dh, int tier, resample_row_cb cb, void *arg) {
+    rs_stream_t *s;
+    int filter, mw, mh, ret = 1;
+
+    if (sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0 || ch < 1 || ch > 4 || cb == NULL)
+        return NULL;
+    if ((s = (rs_stream_t *)calloc(1, sizeof(rs_stream_t))) == NULL)
+        return NULL;
+    s->cb = cb;
+    s->arg = arg;
+    /* the same size is passed through */
+    if (sw == dw && sh == dh)
+        return s;
+
+    filter = resample_plan(sw, sh, dw, dh, tier, &mw, &mh);
+    if (mw != 0) {
+        s->n = 2;
+        ret = pass_init(&s->pass[0], sw, sh, ch, mw, mh, RS_BOX);
+        if (ret == 1)
+            ret = pass_init(&s->pass[1], mw, mh, ch, dw, dh, filter);
+    } else {
+        s->n = 1;
+        ret = pass_init(&s->pass[0], sw, sh, ch, dw, dh, filter);
+    }
+    if (ret != 1) {
+        resample_stream_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+/**
+ * @brief resample_stream_push feed the next source row
+ *
+ * @param s the stream
+ * @param row the row, sw pixels of ch bytes
+ *
+ * @return 1 for OK and -1 for stopped by the callback
+ */
+int resample_stream_push(rs_stream_t *s, const unsigned char *row) {
+    return stream_push(s, 0, row);
+}
+
+/**
+ * @brief resample_stream_free free a stream
+ *
+ * @param s the stream
+ */
+void resample_stream_free(rs_stream_t *s) {
+    int i;
+
+    if (s == NULL)
+        return;
+    for (i = 0; i < 2; i++)
+        pass_free(&s->pass[i]);
+    free(s);
+}
@@ -0,0 +1,45 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zresample.h
+ * @brief lanczos resampling of 8-bit pixel buffers header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZRESAMPLE_H
+#define ZRESAMPLE_H
+
+#include <stddef.h>
+
+#define RS_BOX              0
+#define RS_TRIANGLE         1
+#define RS_LANCZOS          2
+
+#define RS_TIER_FAST        0
+#define RS_TIER_BALANCED    1
+#define RS_TIER_BEST        2
+
+typedef struct rs_stream_s rs_stream_t;
+typedef int (*resample_row_cb)(void *arg, const unsigned char *row, int y);
+
+int resample_tier(const char *name);
+int resample_plan(int sw, int sh, int dw, int dh, int tier, int *mw, int *mh);
+int resample(const unsigned char *src, int sw, int sh, size_t sstride, int ch,
+             unsigned char *dst, int dw, int dh, size_t dstride, int tier);
+rs_stream_t * resample_stream_new(int sw, int sh, int ch, int dw, int dh, int tier, resample_row_cb cb, void *arg);
+int resample_stream_push(rs_stream_t *s, const unsigned char *row);
+void resample_stream_free(rs_stream_t *s);
+
+#endif
@@ -0,0 +1,622 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zring.c
+ * @brief sharded and replicated ssdb cluster.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * The nodes of ssdb_servers are placed on a ketama style hash ring and a
+ * key is stored on the first ssdb_replicas distinct nodes found clockwise
+ * from its hash. Only the md5 part of a key is hashed, so an original and
+ * all of its derivatives live on the same nodes. Reads try the replicas in
+ * order of health and average latency; writes are sent to all replicas at
+ * once and succeed when ssdb_quorum of them acknowledge.
+ *
+ * With hedge on, a read not answered within hedge_percentile of the recent
+ * read latency of its replica is sent again to the next replica, and the
+ * first answer wins. The connection of the loser still has a reply on the
+ * way, so it is closed. A first replica that loses has its latency raised
+ * by the time it took so far, and stays up. Hedges are paid from a budget
+ * of hedge_budget percent of the reads.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <hiredis/hiredis.h>
+#include "zring.h"
+#include "zpool.h"
+#include "zconf.h"
+#include "zdb.h"
+#include "zchunk.h"
+#include "zmd5.h"
+#include "zlog.h"
+
+#define RING_POINTS         160
+#define RING_NODE_FAIL      -2
+
+#define RING_GET            0
+#define RING_EXIST          1
+#define RING_EXIST_GET      2
+#define RING_SAVE           3
+#define RING_DEL            4
+
+/* hedges saved up while reads are fast, spent in a burst of slow ones */
+#define HEDGE_BURST         20
+
+typedef struct ring_point_s {
+    uint32_t hash;
+    int node;
+} ring_point_t;
+
+typedef struct ring_op_s {
+    int type;
+    const char *md5;
+    const char *key;
+    const char *value;
+    size_t vlen;
+    char **buff;
+    size_t *len;
+} ring_op_t;
+
+static ring_point_t ring[SSDB_MAX * RING_POINTS];
+static int ring_num = 0;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static double hedge_tokens = 0;
+static long hedge_sent = 0;
+static long hedge_won = 0;
+static long hedge_denied = 0;
+static pthread_mutex_t hedge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int ring_point_cmp(const void *a, const void *b);
+static void ring_build(void);
+static uint32_t ring_hash(const char *key);
+static int ring_read_order(const char *key, int *nodes);
+static int ring_exec(redisContext *c, ring_op_t *op);
+static int ring_call(thr_arg_t *thr_arg, int node, ring_op_t *op);
+static int hedge_take(void);
+static int ring_send(redisContext *c, ring_op_t *op);
+static int ring_recv(redisContext *c, ring_op_t *op, int n);
+static int ring_hedged(thr_arg_t *thr_arg, int *nodes, ring_op_t *op, int *node);
+int ring_nodes(const char *key, int *nodes);
+int ring_get(thr_arg_t *thr_arg, const char *key, char **buff, size_t *len);
+int ring_exist(thr_arg_t *thr_arg, const char *key);
+int ring_exist_get(thr_arg_t *thr_arg, const char *md5, const char *key, char **buff, size_t *len);
+int ring_save(thr_arg_t *thr_arg, const char *key, const char *buff, size_t len);
+int ring_del(thr_arg_t *thr_arg, const char *key);
+void ring_status(cJSON *j_ret);
+
+/**
+ * @brief ring_point_cmp compare two points of the ring for qsort
+ *
+ * @param a the first point
+ * @param b the second point
+ *
+ * @return -1, 0 or 1
+ */
+static int ring_point_cmp(const void *a, const void *b) {
+    const ring_point_t *pa = (const ring_point_t *)a;
+    const ring_point_t *pb = (const ring_point_t *)b;
+    if (pa->hash != pb->hash)
+        return pa->hash < pb->hash ? -1 : 1;
+    return pa->node - pb->node;
+}
+
+/**
+ * @brief ring_build place RING_POINTS points of every node on the ring
+ */
+static void ring_build(void) {
+    char name[160];
+    md5_state_t mdctx;
+    md5_byte_t digest[16];
+    int i, j, k;
+
+    ring_num = 0;
+    for (i = 0; i < settings.ssdb_node_num; i++) {
+        for (j = 0; j < RING_POINTS / 4; j++) {
+            snprintf(name, sizeof(name), "%s:%d-%d", settings.ssdb_node_ip[i], settings.ssdb_node_port[i], j);
+            md5_init(&mdctx);
+            md5_append(&mdctx, (const md5_byte_t *)name, strlen(name));
+            md5_finish(&mdctx, digest);
+            for (k = 0; k < 4; k++) {
+                ring[ring_num].hash = ((uint32_t)digest[3 + k * 4] << 24) | ((uint32_t)digest[2 + k * 4] << 16)
+                                      | ((uint32_t)digest[1 + k * 4] << 8) | digest[k * 4];
+                ring[ring_num].node = i;
+                ring_num++;
+            }
+        }
+    }
+    qsort(ring, ring_num, sizeof(ring_point_t), ring_point_cmp);
+    LOG_PRINT(LOG_DEBUG, "ssdb ring built: %d nodes, %d replicas, quorum %d",
+              settings.ssdb_node_num, settings.ssdb_replicas, settings.ssdb_quorum);
+}
+
+/**
+ * @brief ring_hash hash the md5 part of a key
+ *
+ * @param key the key, md5 or md5:args
+ *
+ * @return the hash on the ring
+ */
+static uint32_t ring_hash(const char *key) {
+    md5_state_t mdctx;
+    md5_byte_t digest[16];
+
+    md5_init(&mdctx);
+    md5_append(&mdctx, (const md5_byte_t *)key, strcspn(key, ":"));
+    md5_finish(&mdctx, digest);
+    return ((uint32_t)digest[3] << 24) | ((uint32_t)digest[2] << 16) | ((uint32_t)digest[1] << 8) | digest[0];
+}
+
+/**
+ * @brief ring_nodes find the replica nodes of a key
+ *
+ * @param key the key
+ * @param nodes the node indexes in placement order, SSDB_MAX at most
+ *
+ * @return count of nodes
+ */
+int ring_nodes(const char *key, int *nodes) {
+    uint32_t hash;
+    int lo, hi, mid, i, j, n = 0;
+
+    pthread_once(&ring_once, ring_build);
+    if (ring_num == 0)
+        return 0;
+    hash = ring_hash(key);
+    lo = 0;
+    hi = ring_num;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (i = 0; i < ring_num && n < settings.ssdb_replicas; i++) {
+        int node = ring[(lo + i) % ring_num].node;
+        for (j = 0; j < n && nodes[j] != node; j++);
+        if (j == n)
+            nodes[n++] = node;
+    }
+    return n;
+}
+
+/**
+ * @brief ring_read_order find the replica nodes of a key, the best one to read first
+ *
+ * @param key the key
+ * @param nodes the node indexes
+ *
+ * @return count of nodes
+ */
+static int ring_read_order(const char *key, int *nodes) {
+    int score[SSDB_MAX];
+    int n = ring_nodes(key, nodes);
+    int i, j, node, s;
+
+    for (i = 0; i < n; i++)
+        score[i] = ssdb_score(nodes[i]);
+    /* insertion sort keeps the placement order of equal nodes */
+    for (i = 1; i < n; i++) {
+        node = nodes[i];
+        s = score[i];
+        for (j = i - 1; j >= 0 && score[j] > s; j--) {
+            nodes[j + 1] = nodes[j];
+            score[j + 1] = score[j];
+        }
+        nodes[j + 1] = node;
+        score[j + 1] = s;
+    }
+    return n;
+}
+
+/**
+ * @brief ring_exec run an operation on a connection
+ *
+ * @param c the connection
+ * @param op the operation
+ *
+ * @return the result of the single node function
+ */
+static int ring_exec(redisContext *c, ring_op_t *op) {
+    switch (op->type) {
+    case RING_GET:
+        return get_img_ssdb(c, op->key, op->buff, op->len);
+    case RING_EXIST:
+        return exist_ssdb(c, op->key);
+    case RING_EXIST_GET:
+        return exist_get_ssdb(c, op->md5, op->key, op->buff, op->len);
+    case RING_SAVE:
+        return save_img_ssdb(c, op->key, op->value, op->vlen);
+    case RING_DEL:
+        return del_ssdb(c, op->key);
+    }
+    return -1;
+}
+
+/**
+ * @brief ring_call run an operation on a node, reconnect once if the connection breaks
+ *
+ * @param thr_arg the thread arg
+ * @param node the index of the node
+ * @param op the operation
+ *
+ * @return the result of the operation or RING_NODE_FAIL if the node did not answer
+ */
+static int ring_call(thr_arg_t *thr_arg, int node, ring_op_t *op) {
+    redisContext *c;
+    uint64_t start;
+    int i, ret;
+
+    /* a restart of the node breaks the idle connection, try a new one */
+    for (i = 0; i < 2; i++) {
+        if ((c = ssdb_get(thr_arg, node)) == NULL)
+            return RING_NODE_FAIL;
+        start = pool_now();
+        ret = ring_exec(c, op);
+        if (ssdb_broken(thr_arg, node) == 0) {
+            ssdb_record(node, start, 1);
+            if (op->type == RING_GET || op->type == RING_EXIST_GET)
+                ssdb_sample(node, start);
+            return ret;
+        }
+        ssdb_record(node, start, 0);
+    }
+    return RING_NODE_FAIL;
+}
+
+/**
+ * @brief hedge_take credit the budget with a read and take a hedge from it
+ *
+ * @return 1 if a hedge may be sent and 0 if not
+ */
+static int hedge_take(void) {
+    int ok = 0;
+    pthread_mutex_lock(&hedge_lock);
+    if (hedge_tokens >= 1) {
+        hedge_tokens -= 1;
+        hedge_sent++;
+        ok = 1;
+    } else {
+        hedge_denied++;
+    }
+    pthread_mutex_unlock(&hedge_lock);
+    return ok;
+}
+
+/**
+ * @brief ring_send write the commands of a read to a connection without waiting
+ *
+ * @param c the connection
+ * @param op the operation, RING_GET or RING_EXIST_GET
+ *
+ * @return count of replies to read or -1 for fail
+ */
+static int ring_send(redisContext *c, ring_op_t *op) {
+    int done = 0, n = 1;
+
+    if (op->type == RING_EXIST_GET && strcmp(op->md5, op->key) != 0) {
+        if (redisAppendCommand(c, "EXISTS %s", op->md5) != REDIS_OK)
+            return -1;
+        n = 2;
+    }
+    if (redisAppendCommand(c, "GET %s", op->key) != REDIS_OK)
+        return -1;
+    while (done == 0) {
+        if (redisBufferWrite(c, &done) != REDIS_OK)
+            return -1;
+    }
+    return n;
+}
+
+/**
+ * @brief ring_recv read the replies of a read sent by ring_send
+ *
+ * @param c the connection
+ * @param op the operation
+ * @param n count of replies
+ *
+ * @return the result of the single node function
+ */
+static int ring_recv(redisContext *c, ring_op_t *op, int n) {
+    redisReply *r[2];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (redisGetReply(c, (void **)&r[i]) != REDIS_OK || r[i] == NULL) {
+            while (--i >= 0)
+                freeReplyObject(r[i]);
+            return -1;
+        }
+    }
+    if (n == 2)
+        return reply_exist_get_ssdb(c, op->key, r, op->buff, op->len);
+    return reply_img_ssdb(c, op->key, r[0], op->buff, op->len);
+}
+
+/**
+ * @brief ring_hedged read from the best replica, and also from the second one if the first is slow
+ *
+ * @param thr_arg the thread arg
+ * @param nodes the replicas in read order, two at least
+ * @param op the operation, RING_GET or RING_EXIST_GET
+ * @param node the node which answered
+ *
+ * @return the result of the operation or RING_NODE_FAIL if no node answered
+ */
+static int ring_hedged(thr_arg_t *thr_arg, int *nodes, ring_op_t *op, int *node) {
+    redisContext *cs[2] = {NULL, NULL};
+    struct pollfd pfd[2];
+    uint64_t start = pool_now();
+    long delay;
+    int i, ret, win = 0, cnt, wait = -1;
+
+    pthread_mutex_lock(&hedge_lock);
+    hedge_tokens += settings.hedge_budget / 100.0;
+    if (hedge_tokens > HEDGE_BURST)
+        hedge_tokens = HEDGE_BURST;
+    pthread_mutex_unlock(&hedge_lock);
+
+    *node = nodes[0];
+    if ((cs[0] = ssdb_get(thr_arg, nodes[0])) == NULL || (cnt = ring_send(cs[0], op)) == -1)
+        return RING_NODE_FAIL;
+    delay = ssdb_percentile(nodes[0], settings.hedge_percentile) / 1000;
+    if (delay < settings.hedge_delay_min)
+        delay = settings.hedge_delay_min;
+    pfd[0].fd = cs[0]->fd;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+
+    if (poll(pfd, 1, (int)delay) == 0 && hedge_take() == 1) {
+        if ((cs[1] = ssdb_get(thr_arg, nodes[1])) != NULL && ring_send(cs[1], op) == cnt) {
+            LOG_PRINT(LOG_DEBUG, "read [%s] hedged to ssdb[%d] after %ld ms", op->key, nodes[1], delay);
+            pfd[1].fd = cs[1]->fd;
+            pfd[1].events = POLLIN;
+            pfd[1].revents = 0;
+            if (settings.read_timeout > 0)
+                wait = settings.read_timeout;
+            if (poll(pfd, 2, wait) <= 0) {
+                for (i = 0; i < 2; i++) {
+                    ssdb_record(nodes[i], start, 0);
+                    ssdb_close(thr_arg, nodes[i]);
+                }
+                return RING_NODE_FAIL;
+            }
+            win = (pfd[0].revents == 0) ? 1 : 0;
+            /* the other reply is still on its way, the connection cannot be reused */
+            ssdb_close(thr_arg, nodes[1 - win]);
+            if (win == 1) {
+                /* a slow replica moves back in the read order by its latency, it is not down */
+                ssdb_slow(nodes[0], start);
+                pthread_mutex_lock(&hedge_lock);
+                hedge_won++;
+                pthread_mutex_unlock(&hedge_lock);
+            }
+        } else if (cs[1] != NULL) {
+            ssdb_close(thr_arg, nodes[1]);
+        }
+    }
+
+    *node = nodes[win];
+    ret = ring_recv(cs[win], op, cnt);
+    if (ssdb_broken(thr_arg, nodes[win]) == 1) {
+        ssdb_record(nodes[win], start, 0);
+        return RING_NODE_FAIL;
+    }
+    ssdb_record(nodes[win], start, 1);
+    ssdb_sample(nodes[win], start);
+    return ret;
+}
+
+/**
+ * @brief ring_get get a key from the nearest replica holding it
+ *
+ * @param thr_arg the thread arg
+ * @param key the key
+ * @param buff the value, alloced
+ * @param len the length of value
+ *
+ * @return 1 for OK and -1 for not found or fail
+ */
+int ring_get(thr_arg_t *thr_arg, const char *key, char **buff, size_t *len) {
+    ring_op_t op = {RING_GET, NULL, key, NULL, 0, buff, len};
+    int nodes[SSDB_MAX];
+    int i, ret, tried = -1, n = ring_read_order(key, nodes);
+
+    if (settings.hedge == 1 && n > 1) {
+        ret = ring_hedged(thr_arg, nodes, &op, &tried);
+        if (ret == 1)
+            return 1;
+        if (ret == -1 && strchr(key, ':') != NULL)
+            return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (nodes[i] == tried)
+            continue;
+        ret = ring_call(thr_arg, nodes[i], &op);
+        if (ret == 1)
+            return 1;
+        /* a replica may miss an original written by quorum, derivatives are just regenerated */
+        if (ret == -1 && strchr(key, ':') != NULL)
+            return -1;
+    }
+    return -1;
+}
+
+/**
+ * @brief ring_exist check if a key is on any of its replicas
+ *
+ * @param thr_arg the thread arg
+ * @param key the key
+ *
+ * @return 1 for existed and -1 for not
+ */
+int ring_exist(thr_arg_t *thr_arg, const char *key) {
+    ring_op_t op = {RING_EXIST, NULL, key, NULL, 0, NULL, NULL};
+    int nodes[SSDB_MAX];
+    int i, n = ring_read_order(key, nodes);
+
+    for (i = 0; i < n; i++) {
+        if (ring_call(thr_arg, nodes[i], &op) == 1)
+            return 1;
+    }
+    return -1;
+}
+
+/**
+ * @brief ring_exist_get check an original and get a key of it from the nearest replica
+ *
+ * @param thr_arg the thread arg
+ * @param md5 the md5 of the original
+ * @param key the key to get
+ * @param buff the value, alloced
+ * @param len the length of value
+ *
+ * @return 1 for got, 0 for original existed but key not found and -1 for original not existed
+ */
+int ring_exist_get(thr_arg_t *thr_arg, const char *md5, const char *key, char **buff, size_t *len) {
+    ring_op_t op = {RING_EXIST_GET, md5, key, NULL, 0, buff, len};
+    int nodes[SSDB_MAX];
+    int i, ret, tried = -1, n = ring_read_order(key, nodes);
+
+    if (settings.hedge == 1 && n > 1) {
+        ret = ring_hedged(thr_arg, nodes, &op, &tried);
+        if (ret == 1 || ret == 0)
+            return ret;
+    }
+    for (i = 0; i < n; i++) {
+        if (nodes[i] == tried)
+            continue;
+        ret = ring_call(thr_arg, nodes[i], &op);
+        if (ret == 1 || ret == 0)
+            return ret;
+    }
+    return -1;
+}
+
+/**
+ * @brief ring_save write a key to all of its replicas and wait for the quorum
+ *
+ * @param thr_arg the thread arg
+ * @param key the key
+ * @param buff the value
+ * @param len the length of value
+ *
+ * @return 1 for at least ssdb_quorum acks and -1 for fail
+ */
+int ring_save(thr_arg_t *thr_arg, const char *key, const char *buff, size_t len) {
+    ring_op_t op = {RING_SAVE, NULL, key, buff, len, NULL, NULL};
+    redisContext *cs[SSDB_MAX];
+    redisReply *r;
+    int nodes[SSDB_MAX];
+    int i, done, ok, ret, acks = 0, n = ring_nodes(key, nodes);
+    uint64_t start = pool_now();
+
+    /* chunked values take several commands, write them node by node */
+    if (chunk_need(len) == 1) {
+        for (i = 0; i < n; i++)
+            acks += (ring_call(thr_arg, nodes[i], &op) == 1);
+        if (acks < n)
+            LOG_PRINT(LOG_WARNING, "save [%s] acked by %d of %d ssdb replicas", key, acks, n);
+        return acks >= settings.ssdb_quorum ? 1 : -1;
+    }
+    for (i = 0; i < n; i++) {
+        cs[i] = ssdb_get(thr_arg, nodes[i]);
+        if (cs[i] == NULL)
+            continue;
+        if (key_ttl(key) > 0)
+            ret = redisAppendCommand(cs[i], "SETEX %s %d %b", key, key_ttl(key), buff, len);
+        else
+            ret = redisAppendCommand(cs[i], "SET %s %b", key, buff, len);
+        if (ret != REDIS_OK)
+            cs[i] = NULL;
+    }
+    /* flush every replica before waiting for any reply so the writes overlap */
+    for (i = 0; i < n; i++) {
+        done = 0;
+        while (cs[i] != NULL && done == 0) {
+            if (redisBufferWrite(cs[i], &done) != REDIS_OK)
+                break;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (cs[i] == NULL)
+            continue;
+        ok = 0;
+        r = NULL;
+        if (redisGetReply(cs[i], (void **)&r) == REDIS_OK && r != NULL) {
+            if (r->type == REDIS_REPLY_STATUS && strcasecmp(r->str, "OK") == 0)
+                ok = 1;
+            freeReplyObject(r);
+        }
+        if (ssdb_broken(thr_arg, nodes[i]) == 1) {
+            ssdb_record(nodes[i], start, 0);
+            ok = (ring_call(thr_arg, nodes[i], &op) == 1);
+        } else {
+            ssdb_record(nodes[i], start, 1);
+        }
+        acks += ok;
+    }
+
+    if (acks < n)
+        LOG_PRINT(LOG_WARNING, "save [%s] acked by %d of %d ssdb replicas", key, acks, n);
+    return acks >= settings.ssdb_quorum ? 1 : -1;
+}
+
+/**
+ * @brief ring_del delete a key from all of its replicas
+ *
+ * @param thr_arg the thread arg
+ * @param key the key
+ *
+ * @return 1 for deleted from any replica and -1 for fail
+ */
+int ring_del(thr_arg_t *thr_arg, const char *key) {
+    ring_op_t op = {RING_DEL, NULL, key, NULL, 0, NULL, NULL};
+    int nodes[SSDB_MAX];
+    int i, ret = -1, n = ring_nodes(key, nodes);
+
+    for (i = 0; i < n; i++) {
+        if (ring_call(thr_arg, nodes[i], &op) == 1)
+            ret = 1;
+        else
+            LOG_PRINT(LOG_DEBUG, "delete [%s] from ssdb[%s:%d] failed", key,
+                      settings.ssdb_node_ip[nodes[i]], settings.ssdb_node_port[nodes[i]]);
+    }
+    return ret;
+}
+
+/**
+ * @brief ring_status add the counters of hedged reads to a json
+ *
+ * @param j_ret the json object of /status
+ */
+void ring_status(cJSON *j_ret) {
+    cJSON *j_hedge;
+
+    if (settings.hedge == 0 || backend_on(3) == 0)
+        return;
+    j_hedge = cJSON_CreateObject();
+    pthread_mutex_lock(&hedge_lock);
+    cJSON_AddNumberToObject(j_hedge, "sent", hedge_sent);
+    cJSON_AddNumberToObject(j_hedge, "won", hedge_won);
+    cJSON_AddNumberToObject(j_hedge, "denied", hedge_denied);
+    cJSON_AddNumberToObject(j_hedge, "budget", (int)hedge_tokens);
+    pthread_mutex_unlock(&hedge_lock);
+    cJSON_AddItemToObject(j_ret, "hedge", j_hedge);
+}
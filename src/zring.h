@@ -0,0 +1,35 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zring.h
+ * @brief sharded and replicated ssdb cluster header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZRING_H
+#define ZRING_H
+
+#include "zcommon.h"
+#include "cjson/cJSON.h"
+
+int ring_nodes(const char *key, int *nodes);
+int ring_get(thr_arg_t *thr_arg, const char *key, char **buff, size_t *len);
+int ring_exist(thr_arg_t *thr_arg, const char *key);
+int ring_exist_get(thr_arg_t *thr_arg, const char *md5, const char *key, char **buff, size_t *len);
+int ring_save(thr_arg_t *thr_arg, const char *key, const char *buff, size_t len);
+int ring_del(thr_arg_t *thr_arg, const char *key);
+void ring_status(cJSON *j_ret);
+
+#endif
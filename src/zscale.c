@@ -23,15 +23,91 @@
 #include <unistd.h>
 #include <math.h>
 #include <string.h>
+#include <limits.h>
 #include <wand/magick_wand.h>
 #include "zlog.h"
 #include "zcommon.h"
 #include "zscale.h"
+#include "zresample.h"
 
+static int resize_magick(MagickWand *im, size_t cols, size_t rows, int tier);
+int resize_img(MagickWand *im, size_t cols, size_t rows, int tier);
 static int proportion(MagickWand *im, int p_type, int cols, int rows);
 static int crop(MagickWand *im, int x, int y, int cols, int rows);
 int convert(MagickWand *im, zimg_req_t *req);
 
+/**
+ * @brief resize_magick resize by MagickWand with the filter policy of zresample
+ *
+ * @param im the image
+ * @param cols target width
+ * @param rows target height
+ * @param tier RS_TIER_FAST, RS_TIER_BALANCED or RS_TIER_BEST
+ *
+ * @return MagickTrue for OK and MagickFalse for fail
+ */
+static int resize_magick(MagickWand *im, size_t cols, size_t rows, int tier) {
+    size_t im_cols = MagickGetImageWidth(im);
+    size_t im_rows = MagickGetImageHeight(im);
+    int filter, mw, mh;
+
+    if (cols == 0 || rows == 0 || cols > INT_MAX || rows > INT_MAX || im_cols > INT_MAX || im_rows > INT_MAX)
+        return MagickResizeImage(im, cols, rows, LanczosFilter, 1.0);
+    filter = resample_plan(im_cols, im_rows, cols, rows, tier, &mw, &mh);
+    /* MagickScaleImage averages the pixels it covers, the box filter of zresample */
+    if (filter == RS_BOX)
+        return MagickScaleImage(im, cols, rows);
+    if (mw != 0 && MagickScaleImage(im, mw, mh) != MagickTrue)
+        return MagickFalse;
+    return MagickResizeImage(im, cols, rows, filter == RS_TRIANGLE ? TriangleFilter : LanczosFilter, 1.0);
+}
+
+/**
+ * @brief resize_img resize the current image by the filter policy of a tier
+ *
+ * 8-bit RGB and gray images without alpha are exported, resampled by
+ * zresample and imported back at the new size, everything else is
+ * resized by MagickWand.
+ *
+ * @param im the image
+ * @param cols target width
+ * @param rows target height
+ * @param tier RS_TIER_FAST, RS_TIER_BALANCED or RS_TIER_BEST
+ *
+ * @return MagickTrue for OK and MagickFalse for fail
+ */
+int resize_img(MagickWand *im, size_t cols, size_t rows, int tier) {
+    size_t im_cols = MagickGetImageWidth(im);
+    size_t im_rows = MagickGetImageHeight(im);
+    ColorspaceType cs = MagickGetImageColorspace(im);
+    unsigned char *src = NULL, *dst = NULL;
+    const char *map;
+    int ch, ret = MagickFalse;
+
+    if (settings.native != 1 || cols == 0 || rows == 0 || cols > INT_MAX || rows > INT_MAX ||
+            im_cols > INT_MAX || im_rows > INT_MAX || MagickGetImageDepth(im) > 8 ||
+            MagickGetImageAlphaChannel(im) == MagickTrue ||
+            (cs != sRGBColorspace && cs != RGBColorspace && cs != GRAYColorspace))
+        return resize_magick(im, cols, rows, tier);
+
+    map = cs == GRAYColorspace ? "I" : "RGB";
+    ch = cs == GRAYColorspace ? 1 : 3;
+    src = (unsigned char *)malloc(im_cols * im_rows * ch);
+    dst = (unsigned char *)malloc(cols * rows * ch);
+    if (src == NULL || dst == NULL ||
+            MagickExportImagePixels(im, 0, 0, im_cols, im_rows, map, CharPixel, src) != MagickTrue ||
+            resample(src, im_cols, im_rows, im_cols * ch, ch, dst, cols, rows, cols * ch, tier) != 1) {
+        free(src);
+        free(dst);
+        return resize_magick(im, cols, rows, tier);
+    }
+    free(src);
+    if (MagickSetImageExtent(im, cols, rows) == MagickTrue)
+        ret = MagickImportImagePixels(im, 0, 0, cols, rows, map, CharPixel, dst);
+    free(dst);
+    return ret;
+}
+
 /**
  * @brief proportion proportion function
  *
@@ -64,7 +140,7 @@ static int proportion(MagickWand *im, int p_type, int cols, int rows) {
             } else {
                 cols = (uint32_t)round(((double)rows / im_rows) * im_cols);
             }
-            ret = MagickResizeImage(im, cols, rows, LanczosFilter, 1.0);
+            ret = resize_img(im, cols, rows, settings.resize_tier);
             LOG_PRINT(LOG_DEBUG, "p=1, wi_scale(im, %d, %d) ret = %d", cols, rows, ret);
             //ret = MagickScaleImage(im, cols, rows);
         } else {
@@ -81,7 +157,7 @@ static int proportion(MagickWand *im, int p_type, int cols, int rows) {
                 s_rows = rows;
                 x = (uint32_t)floor((s_cols - cols) / 2.0);
             }
-            ret = MagickResizeImage(im, s_cols, s_rows, LanczosFilter, 1.0);
+            ret = resize_img(im, s_cols, s_rows, settings.resize_tier);
             LOG_PRINT(LOG_DEBUG, "p=2, wi_scale(im, %d, %d) ret = %d", s_cols, s_rows, ret);
             //ret = MagickScaleImage(im, s_cols, s_rows);
 
@@ -99,18 +175,18 @@ static int proportion(MagickWand *im, int p_type, int cols, int rows) {
             int rate = cols > 0 ? cols : rows;
             rows = (uint32_t)round(im_rows * (double)rate / 100);
             cols = (uint32_t)round(im_cols * (double)rate / 100);
-            ret = MagickResizeImage(im, cols, rows, LanczosFilter, 1.0);
+            ret = resize_img(im, cols, rows, settings.resize_tier);
             LOG_PRINT(LOG_DEBUG, "p=3, wi_scale(im, %d, %d) ret = %d", cols, rows, ret);
             //ret = MagickScaleImage(im, cols, rows);
         } else {
             rows = (uint32_t)round(im_rows * (double)rows / 100);
             cols = (uint32_t)round(im_cols * (double)cols / 100);
-            ret = MagickResizeImage(im, cols, rows, LanczosFilter, 1.0);
+            ret = resize_img(im, cols, rows, settings.resize_tier);
             LOG_PRINT(LOG_DEBUG, "p=3, wi_scale(im, %d, %d) ret = %d", cols, rows, ret);
             //ret = MagickScaleImage(im, cols, rows);
         }
     } else if (p_type == 0) {
-        ret = MagickResizeImage(im, cols, rows, LanczosFilter, 1.0);
+        ret = resize_img(im, cols, rows, settings.resize_tier);
         LOG_PRINT(LOG_DEBUG, "p=0, wi_scale(im, %d, %d) ret = %d", cols, rows, ret);
         //ret = MagickScaleImage(im, cols, rows);
     } else if (p_type == 4) {
@@ -124,7 +200,7 @@ static int proportion(MagickWand *im, int p_type, int cols, int rows) {
         }
         cols = (uint32_t)round(im_cols * rate);
         rows = (uint32_t)round(im_rows * rate);
-        ret = MagickResizeImage(im, cols, rows, LanczosFilter, 1.0);
+        ret = resize_img(im, cols, rows, settings.resize_tier);
         LOG_PRINT(LOG_DEBUG, "p=4, wi_scale(im, %d, %d) ret = %d", cols, rows, ret);
     }
 
@@ -24,6 +24,7 @@
 #include "zcommon.h"
 #include <wand/magick_wand.h>
 
+int resize_img(MagickWand *im, size_t cols, size_t rows, int tier);
 int convert(MagickWand *im, zimg_req_t *req);
 
 #endif
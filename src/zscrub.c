@@ -0,0 +1,561 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zscrub.c
+ * @brief background storage scrubber.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * A single thread walks the whole store every scrub_interval seconds and
+ * reads at most scrub_rate KB per second. Originals are hashed again and
+ * compared with their md5, a mismatch is moved to scrub_quarantine (disk
+ * mode) or only reported. Derivatives which can not be decoded are deleted
+ * and will be generated again by the next request. beansdb can not be
+ * listed so it is not scrubbed.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <hiredis/hiredis.h>
+#include <wand/magick_wand.h>
+#include "zscrub.h"
+#include "zconf.h"
+#include "zcache.h"
+#include "zdb.h"
+#include "zdisk.h"
+#include "zpool.h"
+#include "zchunk.h"
+#include "zmeta.h"
+#include "zmd5.h"
+#include "zutil.h"
+#include "zlog.h"
+
+/* files changed in the last minute may still be written by an upload */
+#define SCRUB_MIN_AGE       60
+#define SCRUB_SCAN_LIMIT    1000
+
+typedef struct scrub_stat_s {
+    int running;
+    long passes;
+    time_t pass_start;
+    time_t pass_finish;
+    int progress;
+    uint64_t bytes;
+    long originals;
+    long derivatives;
+    long corrupt;
+    long quarantined;
+    long removed;
+    long errors;
+} scrub_stat_t;
+
+static scrub_stat_t scrub_stat;
+static pthread_mutex_t scrub_stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timeval scrub_tv_start;
+static uint64_t scrub_tv_bytes = 0;
+
+int scrub_init(void);
+void scrub_status(cJSON *j_ret);
+static void scrub_count(long *counter, long n);
+static void scrub_throttle(size_t len);
+static void scrub_md5(const char *buff, size_t len, char *md5sum);
+static int scrub_decode(const char *buff, size_t len);
+static int read_img(const char *path, char **buff, size_t *len);
+static void scrub_quarantine(thr_arg_t *thr_arg, const char *md5, const char *path);
+static void scrub_img_dir(thr_arg_t *thr_arg, const char *md5, const char *path);
+static void scrub_disk(thr_arg_t *thr_arg, const char *root);
+static void scrub_ssdb_key(thr_arg_t *thr_arg, int node, const char *key);
+static void scrub_ssdb(thr_arg_t *thr_arg, int node);
+static void * scrub_worker(void *arg);
+
+/**
+ * @brief scrub_init start the scrubber thread
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int scrub_init(void) {
+    pthread_t tid;
+
+    if (settings.mode == 2) {
+        LOG_PRINT(LOG_WARNING, "beansdb can not be listed, scrubber disabled");
+        return 1;
+    }
+    if (settings.mode == 1 && settings.scrub_quarantine[0] != '\0' && is_dir(settings.scrub_quarantine) != 1) {
+        if (mk_dirs(settings.scrub_quarantine) != 1) {
+            LOG_PRINT(LOG_DEBUG, "scrub_quarantine[%s] Create Failed!", settings.scrub_quarantine);
+            return -1;
+        }
+    }
+
+    memset(&scrub_stat, 0, sizeof(scrub_stat));
+    if (pthread_create(&tid, NULL, scrub_worker, NULL) != 0) {
+        LOG_PRINT(LOG_DEBUG, "scrub worker create failed!");
+        return -1;
+    }
+    pthread_detach(tid);
+    LOG_PRINT(LOG_DEBUG, "Scrubber Init Finished. rate: %dKB/s interval: %ds", settings.scrub_rate, settings.scrub_interval);
+    return 1;
+}
+
+/**
+ * @brief scrub_status add the scrubber counters to a json object
+ *
+ * @param j_ret the json object
+ */
+void scrub_status(cJSON *j_ret) {
+    scrub_stat_t st;
+    cJSON *j_scrub;
+
+    if (settings.scrub != 1)
+        return;
+    pthread_mutex_lock(&scrub_stat_lock);
+    st = scrub_stat;
+    pthread_mutex_unlock(&scrub_stat_lock);
+
+    j_scrub = cJSON_CreateObject();
+    cJSON_AddBoolToObject(j_scrub, "running", st.running);
+    cJSON_AddNumberToObject(j_scrub, "passes", st.passes);
+    cJSON_AddNumberToObject(j_scrub, "progress", st.progress);
+    cJSON_AddNumberToObject(j_scrub, "pass_start", st.pass_start);
+    cJSON_AddNumberToObject(j_scrub, "pass_finish", st.pass_finish);
+    cJSON_AddNumberToObject(j_scrub, "bytes", st.bytes);
+    cJSON_AddNumberToObject(j_scrub, "originals", st.originals);
+    cJSON_AddNumberToObject(j_scrub, "derivatives", st.derivatives);
+    cJSON_AddNumberToObject(j_scrub, "corrupt", st.corrupt);
+    cJSON_AddNumberToObject(j_scrub, "quarantined", st.quarantined);
+    cJSON_AddNumberToObject(j_scrub, "removed", st.removed);
+    cJSON_AddNumberToObject(j_scrub, "errors", st.errors);
+    cJSON_AddItemToObject(j_ret, "scrub", j_scrub);
+}
+
+/**
+ * @brief scrub_count add to a counter of the scrubber
+ *
+ * @param counter the counter
+ * @param n the number to add
+ */
+static void scrub_count(long *counter, long n) {
+    pthread_mutex_lock(&scrub_stat_lock);
+    *counter += n;
+    pthread_mutex_unlock(&scrub_stat_lock);
+}
+
+/**
+ * @brief scrub_throttle sleep to keep the read rate under scrub_rate
+ *
+ * @param len the bytes just read
+ */
+static void scrub_throttle(size_t len) {
+    struct timeval now;
+    double expect, elapsed;
+
+    pthread_mutex_lock(&scrub_stat_lock);
+    scrub_stat.bytes += len;
+    pthread_mutex_unlock(&scrub_stat_lock);
+    if (settings.scrub_rate <= 0)
+        return;
+
+    scrub_tv_bytes += len;
+    gettimeofday(&now, NULL);
+    expect = (double)scrub_tv_bytes / ((double)settings.scrub_rate * 1024);
+    elapsed = (now.tv_sec - scrub_tv_start.tv_sec) + (now.tv_usec - scrub_tv_start.tv_usec) / 1000000.0;
+    if (expect > elapsed)
+        usleep((useconds_t)((expect - elapsed) * 1000000));
+
+    /* restart the window now and then so an idle period is not saved up */
+    if (elapsed > 60) {
+        gettimeofday(&scrub_tv_start, NULL);
+        scrub_tv_bytes = 0;
+    }
+}
+
+/**
+ * @brief scrub_md5 the md5 string of a buffer
+ *
+ * @param buff the buffer
+ * @param len the length of buff
+ * @param md5sum the md5 string
+ */
+static void scrub_md5(const char *buff, size_t len, char *md5sum) {
+    md5_state_t mdctx;
+    md5_byte_t md_value[16];
+    int i, h, l;
+
+    md5_init(&mdctx);
+    md5_append(&mdctx, (const unsigned char*)(buff), len);
+    md5_finish(&mdctx, md_value);
+    for (i = 0; i < 16; ++i) {
+        h = md_value[i] & 0xf0;
+        h >>= 4;
+        l = md_value[i] & 0x0f;
+        md5sum[i * 2] = (char)((h >= 0x0 && h <= 0x9) ? (h + 0x30) : (h + 0x57));
+        md5sum[i * 2 + 1] = (char)((l >= 0x0 && l <= 0x9) ? (l + 0x30) : (l + 0x57));
+    }
+    md5sum[32] = '\0';
+}
+
+/**
+ * @brief scrub_decode check if an image buffer can be decoded
+ *
+ * @param buff the image buffer
+ * @param len the length of buff
+ *
+ * @return 1 for OK and -1 for corrupt
+ */
+static int scrub_decode(const char *buff, size_t len) {
+    int ret = -1;
+    MagickWand *im;
+
+    if (len == 0)
+        return -1;
+    im = NewMagickWand();
+    if (im == NULL)
+        return 1;
+    if (MagickReadImageBlob(im, (const unsigned char *)buff, len) == MagickTrue)
+        ret = 1;
+    DestroyMagickWand(im);
+    return ret;
+}
+
+/**
+ * @brief read_img read a file with throttle
+ *
+ * @param path the file path
+ * @param buff the buffer read, free by caller
+ * @param len the length of buff
+ *
+ * @return 1 for OK, 0 for too new to check and -1 for fail
+ */
+static int read_img(const char *path, char **buff, size_t *len) {
+    int fd = -1;
+    struct stat st;
+    size_t off = 0;
+    ssize_t rlen;
+
+    *buff = NULL;
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return -1;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (time(NULL) - st.st_mtime < SCRUB_MIN_AGE) {
+        close(fd);
+        return 0;
+    }
+    if ((*buff = (char *)malloc(st.st_size > 0 ? st.st_size : 1)) == NULL) {
+        close(fd);
+        return -1;
+    }
+    while (off < (size_t)st.st_size) {
+        rlen = read(fd, *buff + off, st.st_size - off);
+        if (rlen <= 0)
+            break;
+        off += rlen;
+    }
+    close(fd);
+    *len = off;
+    scrub_throttle(off);
+    return 1;
+}
+
+/**
+ * @brief scrub_quarantine move a corrupt image out of the store
+ *
+ * @param thr_arg the connections
+ * @param md5 the md5 of the image
+ * @param path the directory of the image
+ */
+static void scrub_quarantine(thr_arg_t *thr_arg, const char *md5, const char *path) {
+    char dst[PATH_MAX_SIZE];
+
+    del_cache(thr_arg, md5);
+    if (settings.scrub_quarantine[0] == '\0')
+        return;
+    get_file_path(settings.scrub_quarantine, md5, dst);
+    if (is_dir(dst) == 1)
+        delete_file(dst);
+    if (rename(path, dst) != 0) {
+        LOG_PRINT(LOG_ERROR, "scrub quarantine %s failed: %s", md5, strerror(errno));
+        scrub_count(&scrub_stat.errors, 1);
+        return;
+    }
+    scrub_count(&scrub_stat.quarantined, 1);
+    LOG_PRINT(LOG_WARNING, "scrub quarantine pic:%s -> %s", md5, dst);
+}
+
+/**
+ * @brief scrub_img_dir check the original and derivatives of an image
+ *
+ * @param thr_arg the connections
+ * @param md5 the md5 of the image
+ * @param path the directory of the image
+ */
+static void scrub_img_dir(thr_arg_t *thr_arg, const char *md5, const char *path) {
+    DIR *dir;
+    struct dirent *dir_info;
+    char file_path[PATH_MAX_SIZE];
+    char md5sum[33];
+    char *buff = NULL;
+    size_t len = 0;
+    int ret;
+
+    get_file_path(path, "0*0", file_path);
+    ret = read_img(file_path, &buff, &len);
+    if (ret == 0)
+        return;
+    if (ret == -1) {
+        /* a tier move between readdir and open is not an error */
+        if (is_dir(path) == 1) {
+            LOG_PRINT(LOG_ERROR, "scrub read %s failed", file_path);
+            scrub_count(&scrub_stat.errors, 1);
+        }
+        return;
+    }
+    scrub_count(&scrub_stat.originals, 1);
+    scrub_md5(buff, len, md5sum);
+    free(buff);
+    if (strcmp(md5sum, md5) != 0) {
+        LOG_PRINT(LOG_ERROR, "scrub corrupt pic:%s size:%d md5:%s", md5, len, md5sum);
+        scrub_count(&scrub_stat.corrupt, 1);
+        scrub_quarantine(thr_arg, md5, path);
+        return;
+    }
+
+    if ((dir = opendir(path)) == NULL)
+        return;
+    while ((dir_info = readdir(dir)) != NULL) {
+        if (dir_info->d_name[0] == '.' || strcmp(dir_info->d_name, "0*0") == 0
+                || strcmp(dir_info->d_name, META_FILE) == 0)
+            continue;
+        get_file_path(path, dir_info->d_name, file_path);
+        if (is_file(file_path) != 1 || read_img(file_path, &buff, &len) != 1)
+            continue;
+        scrub_count(&scrub_stat.derivatives, 1);
+        if (scrub_decode(buff, len) == -1) {
+            LOG_PRINT(LOG_WARNING, "scrub remove corrupt %s", file_path);
+            if (delete_file(file_path) == 1)
+                scrub_count(&scrub_stat.removed, 1);
+            else
+                scrub_count(&scrub_stat.errors, 1);
+        }
+        free(buff);
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief scrub_disk walk a storage root of disk mode
+ *
+ * @param thr_arg the connections
+ * @param root the storage root
+ */
+static void scrub_disk(thr_arg_t *thr_arg, const char *root) {
+    DIR *dir1, *dir2, *dir3;
+    struct dirent *info1, *info2, *info3;
+    char path1[PATH_MAX_SIZE], path2[PATH_MAX_SIZE], path3[PATH_MAX_SIZE];
+    int total = 0, done = 0;
+
+    if ((dir1 = opendir(root)) == NULL)
+        return;
+    while ((info1 = readdir(dir1)) != NULL) {
+        if (is_special_dir(info1->d_name) != 1)
+            total++;
+    }
+    rewinddir(dir1);
+
+    while ((info1 = readdir(dir1)) != NULL) {
+        if (is_special_dir(info1->d_name) == 1)
+            continue;
+        get_file_path(root, info1->d_name, path1);
+        if ((dir2 = opendir(path1)) != NULL) {
+            while ((info2 = readdir(dir2)) != NULL) {
+                if (is_special_dir(info2->d_name) == 1)
+                    continue;
+                get_file_path(path1, info2->d_name, path2);
+                if ((dir3 = opendir(path2)) == NULL)
+                    continue;
+                while ((info3 = readdir(dir3)) != NULL) {
+                    if (is_md5(info3->d_name) != 1)
+                        continue;
+                    get_file_path(path2, info3->d_name, path3);
+                    scrub_img_dir(thr_arg, info3->d_name, path3);
+                }
+                closedir(dir3);
+            }
+            closedir(dir2);
+        }
+        done++;
+        pthread_mutex_lock(&scrub_stat_lock);
+        scrub_stat.progress = done * 100 / total;
+        pthread_mutex_unlock(&scrub_stat_lock);
+    }
+    closedir(dir1);
+}
+
+/**
+ * @brief scrub_ssdb_key check a key on a ssdb node
+ *
+ * @param thr_arg the connections
+ * @param node the index of the ssdb node
+ * @param key the key, md5 for originals and md5:args for derivatives
+ */
+static void scrub_ssdb_key(thr_arg_t *thr_arg, int node, const char *key) {
+    char md5[33];
+    char md5sum[33];
+    char *buff = NULL;
+    size_t len = 0;
+    int is_orig;
+
+    str_lcpy(md5, key, sizeof(md5));
+    /* chunks are checked as a whole through the key of their manifest */
+    if (is_md5(md5) != 1 || is_chunk_key(key) == 1 || is_meta_key(key) == 1)
+        return;
+    is_orig = (strlen(key) == 32);
+
+    if (get_img_ssdb(ssdb_get(thr_arg, node), key, &buff, &len) == -1) {
+        scrub_count(&scrub_stat.errors, 1);
+        return;
+    }
+    scrub_throttle(len);
+
+    if (is_orig) {
+        scrub_count(&scrub_stat.originals, 1);
+        scrub_md5(buff, len, md5sum);
+        if (strcmp(md5sum, md5) != 0) {
+            LOG_PRINT(LOG_ERROR, "scrub corrupt pic:%s size:%d md5:%s", md5, len, md5sum);
+            scrub_count(&scrub_stat.corrupt, 1);
+            del_cache(thr_arg, md5);
+        }
+    } else {
+        scrub_count(&scrub_stat.derivatives, 1);
+        if (scrub_decode(buff, len) == -1) {
+            LOG_PRINT(LOG_WARNING, "scrub remove corrupt key %s", key);
+            if (del_ssdb(ssdb_get(thr_arg, node), key) == 1)
+                scrub_count(&scrub_stat.removed, 1);
+            else
+                scrub_count(&scrub_stat.errors, 1);
+            del_cache(thr_arg, key);
+        }
+    }
+    free(buff);
+}
+
+/**
+ * @brief scrub_ssdb walk all keys of a ssdb node page by page
+ *
+ * @param thr_arg the connections
+ * @param node the index of the ssdb node
+ */
+static void scrub_ssdb(thr_arg_t *thr_arg, int node) {
+    char start[CACHE_KEY_SIZE] = "";
+    static char keys[SCRUB_SCAN_LIMIT][CACHE_KEY_SIZE];
+    redisReply *r;
+    int i, n;
+
+    for (;;) {
+        if (ssdb_get(thr_arg, node) == NULL) {
+            scrub_count(&scrub_stat.errors, 1);
+            return;
+        }
+        r = (redisReply *)redisCommand(thr_arg->ssdb[node].conn, "KEYS %s %s %d", start, "", SCRUB_SCAN_LIMIT);
+        if (r == NULL || r->type != REDIS_REPLY_ARRAY) {
+            LOG_PRINT(LOG_ERROR, "scrub ssdb keys from [%s] failed", start);
+            if (r != NULL)
+                freeReplyObject(r);
+            scrub_count(&scrub_stat.errors, 1);
+            return;
+        }
+        /* copy the page out, the reply can not be kept across commands */
+        n = 0;
+        for (i = 0; i < (int)r->elements && n < SCRUB_SCAN_LIMIT; i++) {
+            if (r->element[i]->type == REDIS_REPLY_STRING)
+                str_lcpy(keys[n++], r->element[i]->str, CACHE_KEY_SIZE);
+        }
+        freeReplyObject(r);
+        if (n == 0)
+            return;
+
+        for (i = 0; i < n; i++)
+            scrub_ssdb_key(thr_arg, node, keys[i]);
+        str_lcpy(start, keys[n - 1], sizeof(start));
+
+        pthread_mutex_lock(&scrub_stat_lock);
+        /* keys are ordered, the first hex digit is a fair progress guess */
+        if (start[0] >= '0' && start[0] <= '9')
+            scrub_stat.progress = (node * 16 + start[0] - '0') * 100 / (16 * settings.ssdb_node_num);
+        else if (start[0] >= 'a' && start[0] <= 'f')
+            scrub_stat.progress = (node * 16 + start[0] - 'a' + 10) * 100 / (16 * settings.ssdb_node_num);
+        pthread_mutex_unlock(&scrub_stat_lock);
+    }
+}
+
+/**
+ * @brief scrub_worker the scrubber thread
+ *
+ * @param arg not used
+ *
+ * @return not used
+ */
+static void * scrub_worker(void *arg) {
+    thr_arg_t *thr_arg = (thr_arg_t *)calloc(1, sizeof(thr_arg_t));
+    if (thr_arg == NULL)
+        return NULL;
+    init_conns(thr_arg);
+
+    for (;;) {
+        pthread_mutex_lock(&scrub_stat_lock);
+        scrub_stat.running = 1;
+        scrub_stat.progress = 0;
+        scrub_stat.pass_start = time(NULL);
+        pthread_mutex_unlock(&scrub_stat_lock);
+        gettimeofday(&scrub_tv_start, NULL);
+        scrub_tv_bytes = 0;
+        LOG_PRINT(LOG_INFO, "scrub pass start");
+
+        if (settings.mode == 1) {
+            int i;
+            for (i = 0; i < disk_count(); i++)
+                scrub_disk(thr_arg, disk_path(i));
+            if (settings.tier == 1)
+                scrub_disk(thr_arg, settings.tier_path);
+        } else if (settings.mode == 3) {
+            /* every replica keeps its own copy, check all of them */
+            int i;
+            for (i = 0; i < settings.ssdb_node_num; i++)
+                scrub_ssdb(thr_arg, i);
+        }
+
+        pthread_mutex_lock(&scrub_stat_lock);
+        scrub_stat.running = 0;
+        scrub_stat.progress = 100;
+        scrub_stat.passes++;
+        scrub_stat.pass_finish = time(NULL);
+        pthread_mutex_unlock(&scrub_stat_lock);
+        LOG_PRINT(LOG_INFO, "scrub pass finish originals:%ld derivatives:%ld corrupt:%ld removed:%ld errors:%ld",
+                  scrub_stat.originals, scrub_stat.derivatives, scrub_stat.corrupt, scrub_stat.removed, scrub_stat.errors);
+
+        sleep(settings.scrub_interval > 0 ? settings.scrub_interval : 1);
+    }
+    return NULL;
+}
@@ -0,0 +1,30 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file zscrub.h
+ * @brief background storage scrubber header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZSCRUB_H
+#define ZSCRUB_H
+
+#include "zcommon.h"
+#include "cjson/cJSON.h"
+
+int scrub_init(void);
+void scrub_status(cJSON *j_ret);
+
+#endif
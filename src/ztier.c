@@ -0,0 +1,577 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file ztier.c
+ * @brief hot/cold tiered storage for disk mode.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ *
+ * The hot tier is settings.img_path (or the img_paths disks) and the cold
+ * tier is settings.tier_path, both use the same 2-level layout. An image directory (the original and all
+ * of its derivatives) always moves as a whole. Reads look at the hot tier
+ * first, cold images which are read tier_promote_hits times are promoted by a
+ * background thread, and the same thread demotes hot images which are not
+ * accessed for tier_demote_age seconds.
+ *
+ * The access table only holds recent images and is lost on restart, so an
+ * access also touches the image directory now and then and the scan falls
+ * back to its mtime. An image missing from the table is not demoted within
+ * tier_demote_age of startup. A moved directory is left in place for
+ * TIER_GRACE seconds for the readers which have resolved it, and files
+ * written into it meanwhile are merged into the new one before it goes.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#include "ztier.h"
+#include "zdisk.h"
+#include "zutil.h"
+#include "zlog.h"
+
+#define TIER_TABLE_SIZE     65536
+#define TIER_LOCKS          64
+#define TIER_QUEUE_SIZE     1024
+#define TIER_PENDING        256
+#define TIER_GRACE          30
+#define TIER_HOT            1
+#define TIER_COLD           2
+
+typedef struct tier_entry_s {
+    char md5[33];
+    uint32_t hits;
+    time_t last;
+    time_t touched;
+} tier_entry_t;
+
+typedef struct tier_pending_s {
+    char src[PATH_MAX_SIZE];
+    char dst[PATH_MAX_SIZE];
+    time_t at;
+    int rounds;
+} tier_pending_t;
+
+static tier_entry_t *tier_table = NULL;
+static pthread_mutex_t tier_locks[TIER_LOCKS];
+static char tier_queue[TIER_QUEUE_SIZE][33];
+static int tier_queue_head = 0;
+static int tier_queue_len = 0;
+static pthread_mutex_t tier_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tier_queue_cond = PTHREAD_COND_INITIALIZER;
+static tier_pending_t tier_pending[TIER_PENDING];
+static int tier_pending_num = 0;
+static time_t tier_started = 0;
+
+int tier_init(void);
+int tier_find(const char *md5, char *path);
+int tier_delete(const char *md5);
+static int tier_slot(const char *md5);
+static void tier_record(const char *md5, const char *path, int tier);
+static time_t tier_last_access(const char *md5, const char *path);
+static int tier_free_percent(const char *path);
+static int copy_file(const char *from, const char *to);
+static int tier_merge(const char *src, const char *dst);
+static void tier_retire(const char *src, const char *dst);
+static void tier_reap(int force);
+static int tier_move(const char *md5, const char *from_root, const char *to_root);
+static void tier_demote_scan(const char *root);
+static void * tier_worker(void *arg);
+
+/**
+ * @brief tier_init init the access table and start the migration thread
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int tier_init(void) {
+    int i;
+    pthread_t tid;
+
+    if (is_dir(settings.tier_path) != 1) {
+        if (mk_dirs(settings.tier_path) != 1) {
+            LOG_PRINT(LOG_DEBUG, "tier_path[%s] Create Failed!", settings.tier_path);
+            return -1;
+        }
+    }
+
+    tier_table = (tier_entry_t *)calloc(TIER_TABLE_SIZE, sizeof(tier_entry_t));
+    if (tier_table == NULL) {
+        LOG_PRINT(LOG_DEBUG, "tier_table calloc failed!");
+        return -1;
+    }
+    for (i = 0; i < TIER_LOCKS; i++)
+        pthread_mutex_init(&tier_locks[i], NULL);
+    tier_started = time(NULL);
+
+    if (pthread_create(&tid, NULL, tier_worker, NULL) != 0) {
+        LOG_PRINT(LOG_DEBUG, "tier worker create failed!");
+        return -1;
+    }
+    pthread_detach(tid);
+    LOG_PRINT(LOG_DEBUG, "Tiered Storage Init Finished. hot: %d disks cold: %s", disk_count(), settings.tier_path);
+    return 1;
+}
+
+/**
+ * @brief tier_slot the access table slot of an image
+ *
+ * @param md5 the md5 of the image
+ *
+ * @return the slot index
+ */
+static int tier_slot(const char *md5) {
+    char c[9];
+    str_lcpy(c, md5, sizeof(c));
+    return (int)(strtoul(c, NULL, 16) & (TIER_TABLE_SIZE - 1));
+}
+
+/**
+ * @brief tier_record record an access and queue the image for promotion
+ *
+ * @param md5 the md5 of the image
+ * @param path the directory of the image
+ * @param tier the tier which the image is found in
+ */
+static void tier_record(const char *md5, const char *path, int tier) {
+    int slot = tier_slot(md5);
+    int promote = 0, touch = 0;
+    pthread_mutex_t *lock = &tier_locks[slot % TIER_LOCKS];
+    tier_entry_t *entry;
+    time_t now = time(NULL);
+    /* the mtime is at most a quarter of the demote age behind */
+    time_t every = settings.tier_demote_age / 4 > 0 ? settings.tier_demote_age / 4 : 1;
+
+    /* tools like zimg-import use the tiers without the migration thread */
+    if (tier_table == NULL)
+        return;
+    entry = &tier_table[slot];
+
+    pthread_mutex_lock(lock);
+    if (strcmp(entry->md5, md5) != 0) {
+        str_lcpy(entry->md5, md5, sizeof(entry->md5));
+        entry->hits = 0;
+        entry->touched = 0;
+    }
+    entry->hits++;
+    entry->last = now;
+    if (tier == TIER_COLD && entry->hits >= settings.tier_promote_hits) {
+        entry->hits = 0;
+        promote = 1;
+    }
+    if (now - entry->touched >= every) {
+        entry->touched = now;
+        touch = 1;
+    }
+    pthread_mutex_unlock(lock);
+
+    /* the table is lost on restart, the directory keeps the access */
+    if (touch == 1 && utimes(path, NULL) == -1)
+        LOG_PRINT(LOG_DEBUG, "touch %s failed: %s", path, strerror(errno));
+
+    if (promote == 0)
+        return;
+
+    pthread_mutex_lock(&tier_queue_lock);
+    if (tier_queue_len < TIER_QUEUE_SIZE) {
+        str_lcpy(tier_queue[(tier_queue_head + tier_queue_len) % TIER_QUEUE_SIZE], md5, 33);
+        tier_queue_len++;
+        pthread_cond_signal(&tier_queue_cond);
+        LOG_PRINT(LOG_DEBUG, "Image[%s] Queued for Promotion.", md5);
+    } else {
+        LOG_PRINT(LOG_DEBUG, "Promotion Queue Full, Image[%s] Skipped.", md5);
+    }
+    pthread_mutex_unlock(&tier_queue_lock);
+}
+
+/**
+ * @brief tier_find find the directory of an image in hot and cold tier
+ *
+ * @param md5 the md5 of the image
+ * @param path the directory found, or the hot tier directory if not found
+ *
+ * @return 1 for found and -1 for not found
+ */
+int tier_find(const char *md5, char *path) {
+    char cold_path[PATH_MAX_SIZE];
+
+    get_img_path(disk_root(md5), md5, path);
+    if (disk_is_dir(path) == 1) {
+        if (settings.tier == 1)
+            tier_record(md5, path, TIER_HOT);
+        return 1;
+    }
+    if (settings.tier != 1)
+        return -1;
+
+    get_img_path(settings.tier_path, md5, cold_path);
+    if (is_dir(cold_path) == 1) {
+        LOG_PRINT(LOG_DEBUG, "Image[%s] Found in Cold Tier.", md5);
+        str_lcpy(path, cold_path, PATH_MAX_SIZE);
+        tier_record(md5, cold_path, TIER_COLD);
+        return 1;
+    }
+    return -1;
+}
+
+/**
+ * @brief tier_delete delete an image from all tiers
+ *
+ * @param md5 the md5 of the image
+ *
+ * @return 1 for OK and -1 for fail
+ */
+int tier_delete(const char *md5) {
+    int ret = -1;
+    char path[PATH_MAX_SIZE];
+
+    get_img_path(disk_root(md5), md5, path);
+    if (is_dir(path) == 1)
+        ret = delete_file(path);
+    if (settings.tier == 1) {
+        get_img_path(settings.tier_path, md5, path);
+        if (is_dir(path) == 1)
+            ret = delete_file(path);
+    }
+    return (ret == -1) ? -1 : 1;
+}
+
+/**
+ * @brief tier_last_access the last access time of an image
+ *
+ * @param md5 the md5 of the image
+ * @param path the directory of the image
+ *
+ * @return the last access time
+ */
+static time_t tier_last_access(const char *md5, const char *path) {
+    time_t last = 0;
+    int slot = tier_slot(md5);
+    pthread_mutex_t *lock = &tier_locks[slot % TIER_LOCKS];
+    struct stat st;
+    char orig_path[PATH_MAX_SIZE];
+
+    pthread_mutex_lock(lock);
+    if (strcmp(tier_table[slot].md5, md5) == 0)
+        last = tier_table[slot].last;
+    pthread_mutex_unlock(lock);
+    if (last != 0)
+        return last;
+
+    /* not in the table, fall back to the file system times, touched by tier_record() */
+    if (stat(path, &st) == 0)
+        last = st.st_mtime;
+    snprintf(orig_path, PATH_MAX_SIZE, "%s/0*0", path);
+    if (stat(orig_path, &st) == 0 && st.st_atime > last)
+        last = st.st_atime;
+    /* the times of an image read since startup may lag, count it as read at startup */
+    if (last < tier_started)
+        last = tier_started;
+    return last;
+}
+
+/**
+ * @brief tier_free_percent the free space percent of a path
+ *
+ * @param path the path
+ *
+ * @return the free space percent or -1 for fail
+ */
+static int tier_free_percent(const char *path) {
+    struct statvfs vfs;
+    if (statvfs(path, &vfs) != 0 || vfs.f_blocks == 0)
+        return -1;
+    return (int)(vfs.f_bavail * 100 / vfs.f_blocks);
+}
+
+/**
+ * @brief copy_file copy a file and sync it to disk
+ *
+ * @param from the source file
+ * @param to the destination file
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int copy_file(const char *from, const char *to) {
+    int result = -1;
+    int in = -1, out = -1;
+    char buff[65536];
+    ssize_t rlen;
+
+    if ((in = open(from, O_RDONLY)) == -1)
+        goto done;
+    if ((out = open(to, O_WRONLY | O_TRUNC | O_CREAT, 00644)) == -1)
+        goto done;
+    while ((rlen = read(in, buff, sizeof(buff))) > 0) {
+        if (write(out, buff, rlen) != rlen)
+            goto done;
+    }
+    if (rlen == -1 || fsync(out) == -1)
+        goto done;
+    result = 1;
+
+done:
+    if (in != -1)
+        close(in);
+    if (out != -1)
+        close(out);
+    return result;
+}
+
+/**
+ * @brief tier_merge copy the files of an image directory missing in another one
+ *
+ * @param src the source directory
+ * @param dst the destination directory
+ *
+ * @return the count of files copied and -1 for fail
+ */
+static int tier_merge(const char *src, const char *dst) {
+    char from[PATH_MAX_SIZE];
+    char to[PATH_MAX_SIZE];
+    char tmp[PATH_MAX_SIZE];
+    DIR *dir;
+    struct dirent *dir_info;
+    int copied = 0;
+
+    if ((dir = opendir(src)) == NULL)
+        return -1;
+    /* a file appears in dst only when it is complete */
+    get_file_path(dst, ".tier", tmp);
+    while ((dir_info = readdir(dir)) != NULL) {
+        if (is_special_dir(dir_info->d_name) == 1 || strcmp(dir_info->d_name, ".tier") == 0)
+            continue;
+        get_file_path(src, dir_info->d_name, from);
+        get_file_path(dst, dir_info->d_name, to);
+        if (is_file(from) != 1 || is_file(to) == 1)
+            continue;
+        if (copy_file(from, tmp) == -1 || rename(tmp, to) != 0) {
+            unlink(tmp);
+            copied = -1;
+            break;
+        }
+        copied++;
+    }
+    closedir(dir);
+    return copied;
+}
+
+/**
+ * @brief tier_retire delete a moved directory after the grace time
+ *
+ * @param src the moved directory
+ * @param dst the directory it is moved to
+ */
+static void tier_retire(const char *src, const char *dst) {
+    tier_pending_t *p;
+
+    if (tier_pending_num == TIER_PENDING)
+        tier_reap(1);
+    p = &tier_pending[tier_pending_num++];
+    str_lcpy(p->src, src, sizeof(p->src));
+    str_lcpy(p->dst, dst, sizeof(p->dst));
+    p->at = time(NULL);
+    p->rounds = 0;
+}
+
+/**
+ * @brief tier_reap delete the moved directories whose grace time is over, called by the migration thread
+ *
+ * @param force 1 to reap the oldest one now to make room
+ */
+static void tier_reap(int force) {
+    time_t now = time(NULL);
+    int i = 0, n;
+
+    while (i < tier_pending_num) {
+        tier_pending_t *p = &tier_pending[i];
+        if (!(force == 1 && i == 0) && now - p->at < TIER_GRACE) {
+            i++;
+            continue;
+        }
+        force = 0;
+        /* derivatives written in the grace time go along, wait again for their readers */
+        n = tier_merge(p->src, p->dst);
+        if (n > 0 && ++p->rounds < 10) {
+            LOG_PRINT(LOG_DEBUG, "%d new files merged from %s.", n, p->src);
+            p->at = now;
+            i++;
+            continue;
+        }
+        if (n == -1 && is_dir(p->src) == 1)
+            LOG_PRINT(LOG_WARNING, "tier merge %s failed, deleted anyway", p->src);
+        delete_file(p->src);
+        LOG_PRINT(LOG_DEBUG, "Moved Directory %s Deleted.", p->src);
+        memmove(p, p + 1, (tier_pending_num - i - 1) * sizeof(tier_pending_t));
+        tier_pending_num--;
+    }
+}
+
+/**
+ * @brief tier_move move the directory of an image between tiers
+ *
+ * @param md5 the md5 of the image
+ * @param from_root the root path of source tier
+ * @param to_root the root path of destination tier
+ *
+ * @return 1 for OK and -1 for fail
+ */
+static int tier_move(const char *md5, const char *from_root, const char *to_root) {
+    char src[PATH_MAX_SIZE];
+    char dst[PATH_MAX_SIZE];
+    char tmp[PATH_MAX_SIZE];
+    int i;
+
+    get_img_path(from_root, md5, src);
+    get_img_path(to_root, md5, dst);
+    if (is_dir(src) != 1)
+        return -1;
+    for (i = 0; i < tier_pending_num; i++) {
+        if (strcmp(tier_pending[i].src, src) == 0)
+            return -1;
+    }
+
+    if (is_dir(dst) != 1) {
+        if (mk_dirf(dst) != 1)
+            return -1;
+        if (rename(src, dst) == 0) {
+            LOG_PRINT(LOG_DEBUG, "Image[%s] Renamed %s -> %s.", md5, src, dst);
+            return 1;
+        }
+        if (errno != EXDEV)
+            return -1;
+
+        /* copy into a temp directory first so readers never see a partial image */
+        snprintf(tmp, PATH_MAX_SIZE, "%s.tier", dst);
+        if (is_dir(tmp) == 1)
+            delete_file(tmp);
+        if (mk_dir(tmp) != 1)
+            return -1;
+        if (tier_merge(src, tmp) == -1 || rename(tmp, dst) != 0) {
+            LOG_PRINT(LOG_WARNING, "tier move %s failed", md5);
+            delete_file(tmp);
+            return -1;
+        }
+    }
+
+    /* files written into src during the copy, or all of them if dst is left by an earlier move */
+    if (tier_merge(src, dst) == -1) {
+        LOG_PRINT(LOG_WARNING, "tier merge %s failed", md5);
+        return -1;
+    }
+    tier_retire(src, dst);
+    LOG_PRINT(LOG_DEBUG, "Image[%s] Copied %s -> %s.", md5, src, dst);
+    return 1;
+}
+
+/**
+ * @brief tier_demote_scan walk a root of the hot tier and demote cold images
+ *
+ * @param root the root path
+ */
+static void tier_demote_scan(const char *root) {
+    DIR *dir1, *dir2, *dir3;
+    struct dirent *info1, *info2, *info3;
+    char path1[PATH_MAX_SIZE], path2[PATH_MAX_SIZE], path3[PATH_MAX_SIZE];
+    time_t now = time(NULL);
+    int demoted = 0;
+
+    if ((dir1 = opendir(root)) == NULL)
+        return;
+    while ((info1 = readdir(dir1)) != NULL) {
+        if (is_special_dir(info1->d_name) == 1)
+            continue;
+        get_file_path(root, info1->d_name, path1);
+        if ((dir2 = opendir(path1)) == NULL)
+            continue;
+        while ((info2 = readdir(dir2)) != NULL) {
+            if (is_special_dir(info2->d_name) == 1)
+                continue;
+            get_file_path(path1, info2->d_name, path2);
+            if ((dir3 = opendir(path2)) == NULL)
+                continue;
+            while ((info3 = readdir(dir3)) != NULL) {
+                if (is_md5(info3->d_name) != 1)
+                    continue;
+                get_file_path(path2, info3->d_name, path3);
+                if (now - tier_last_access(info3->d_name, path3) < settings.tier_demote_age)
+                    continue;
+                if (tier_move(info3->d_name, root, settings.tier_path) == 1)
+                    demoted++;
+            }
+            closedir(dir3);
+        }
+        closedir(dir2);
+    }
+    closedir(dir1);
+    LOG_PRINT(LOG_INFO, "tier scan %s finished, %d images demoted", root, demoted);
+}
+
+/**
+ * @brief tier_worker the migration thread of tiered storage
+ *
+ * @param arg not used
+ *
+ * @return not used
+ */
+static void * tier_worker(void *arg) {
+    char md5[33];
+    time_t last_scan = time(NULL);
+    struct timespec ts;
+    int i;
+
+    for (;;) {
+        tier_reap(0);
+        pthread_mutex_lock(&tier_queue_lock);
+        while (tier_queue_len == 0) {
+            ts.tv_sec = last_scan + settings.tier_interval;
+            /* wake up for the moved directories too */
+            for (i = 0; i < tier_pending_num; i++) {
+                if (tier_pending[i].at + TIER_GRACE < ts.tv_sec)
+                    ts.tv_sec = tier_pending[i].at + TIER_GRACE;
+            }
+            ts.tv_nsec = 0;
+            if (pthread_cond_timedwait(&tier_queue_cond, &tier_queue_lock, &ts) == ETIMEDOUT)
+                break;
+        }
+        if (tier_queue_len > 0) {
+            str_lcpy(md5, tier_queue[tier_queue_head], sizeof(md5));
+            tier_queue_head = (tier_queue_head + 1) % TIER_QUEUE_SIZE;
+            tier_queue_len--;
+            pthread_mutex_unlock(&tier_queue_lock);
+
+            int free_percent = tier_free_percent(disk_root(md5));
+            if (free_percent != -1 && free_percent < settings.tier_min_free) {
+                LOG_PRINT(LOG_DEBUG, "Hot Tier Free Space %d%%, Image[%s] Not Promoted.", free_percent, md5);
+            } else if (tier_move(md5, settings.tier_path, disk_root(md5)) == 1) {
+                LOG_PRINT(LOG_DEBUG, "Image[%s] Promoted to Hot Tier.", md5);
+            }
+            continue;
+        }
+        pthread_mutex_unlock(&tier_queue_lock);
+
+        if (time(NULL) - last_scan >= settings.tier_interval) {
+            for (i = 0; i < disk_count(); i++)
+                tier_demote_scan(disk_path(i));
+            last_scan = time(NULL);
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,30 @@
+/*
+ *   zimg - high performance image storage and processing system.
+ *       http://zimg.buaa.us
+ *
+ *   Copyright (c) 2013-2014, Peter Zhao <zp@buaa.us>.
+ *   All rights reserved.
+ *
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text.
+ *
+ */
+
+/**
+ * @file ztier.h
+ * @brief hot/cold tiered storage for disk mode header.
+ * @author 招牌疯子 zp@buaa.us
+ * @version 3.2.0
+ * @date 2026-10-18
+ */
+
+#ifndef ZTIER_H
+#define ZTIER_H
+
+#include "zcommon.h"
+
+int tier_init(void);
+int tier_find(const char *md5, char *path);
+int tier_delete(const char *md5);
+
+#endif
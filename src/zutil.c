@@ -49,6 +49,7 @@ int is_img(const char *filename);
 int is_dir(const char *path);
 int is_special_dir(const char *path);
 void get_file_path(const char *path, const char *file_name, char *file_path);
+void get_img_path(const char *root, const char *md5, char *path);
 int mk_dir(const char *path);
 int mk_dirs(const char *dir);
 int mk_dirf(const char *filename);
@@ -56,6 +57,7 @@ int delete_file(const char *path);
 int is_md5(char *s);
 int str_hash(const char *str);
 int gen_key(char *key, char *md5, ...);
+void gen_rsp_key(char *key, zimg_req_t *req);
 
 /**
  * @brief strnchr find the pointer of a char in a string
@@ -353,6 +355,19 @@ void get_file_path(const char *path, const char *file_name, char *file_path) {
     str_lcat(file_path, file_name, PATH_MAX_SIZE);
 }
 
+/**
+ * @brief get_img_path get the 2-level storage path of an image
+ *
+ * @param root the root path of the storage
+ * @param md5 the md5 of the image
+ * @param path the full path of the image directory
+ */
+void get_img_path(const char *root, const char *md5, char *path) {
+    int lvl1 = str_hash(md5);
+    int lvl2 = str_hash(md5 + 3);
+    snprintf(path, PATH_MAX_SIZE, "%s/%d/%d/%s", root, lvl1, lvl2, md5);
+}
+
 /**
  * @brief mk_dir It create a new directory with the path input.
  *
@@ -565,3 +580,18 @@ int gen_key(char *key, char *md5, ...) {
     LOG_PRINT(LOG_DEBUG, "key: %s", key);
     return 1;
 }
+
+/**
+ * @brief gen_rsp_key Generate the cache and storage key of a request.
+ *
+ * @param key The key string, CACHE_KEY_SIZE.
+ * @param req The zimg request.
+ */
+void gen_rsp_key(char *key, zimg_req_t *req) {
+    if (settings.script_on == 1 && req->type != NULL)
+        snprintf(key, CACHE_KEY_SIZE, "%s:%s", req->md5, req->type);
+    else if (req->proportion == 0 && req->width == 0 && req->height == 0)
+        str_lcpy(key, req->md5, CACHE_KEY_SIZE);
+    else
+        gen_key(key, req->md5, 9, req->width, req->height, req->proportion, req->gray, req->x, req->y, req->rotate, req->quality, req->fmt);
+}
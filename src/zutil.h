@@ -36,6 +36,7 @@ int is_img(const char *filename);
 int is_dir(const char *path);
 int is_special_dir(const char *path);
 void get_file_path(const char *path, const char *file_name, char *file_path);
+void get_img_path(const char *root, const char *md5, char *path);
 int mk_dir(const char *path);
 int mk_dirs(const char *dir);
 int mk_dirf(const char *filename);
@@ -43,5 +44,6 @@ int delete_file(const char *path);
 int is_md5(char *s);
 int str_hash(const char *str);
 int gen_key(char *key, char *md5, ...);
+void gen_rsp_key(char *key, zimg_req_t *req);
 
 #endif